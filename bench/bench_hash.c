@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "hash.h"
+
+/*
+ * Measures each hash function's throughput and how evenly it spreads keys over buckets.
+ * Keys are record sized buffers whose first 8 bytes are a counter, which is the worst case for
+ * a weak hash since the records only differ in a few low bits.
+ */
+
+#define N_KEYS (1 << 20)
+#define N_BUCKETS (1 << 12)
+
+static const size_t record_sizes[] = {8, 18, 64, 128, 512};
+
+static const struct {
+    char*       name;
+    HashType    type;
+} hashes[] = {
+    {"fast", HASH_FAST},
+    {"crc32c", HASH_CRC32C},
+};
+
+static double now(void);
+static void bench_throughput(HashFn hash, size_t record_size);
+static void bench_distribution(HashFn hash, size_t record_size);
+
+int
+main(void)
+{
+    printf("crc32c: %s\n", crc32c_is_hardware() ? "hardware" : "software");
+    printf("%-8s %6s %12s %10s %10s %10s\n", "hash", "size", "MB/s", "Mhash/s", "max/mean", "stddev");
+
+    for (size_t h = 0; h < sizeof(hashes) / sizeof(hashes[0]); h++) {
+        for (size_t s = 0; s < sizeof(record_sizes) / sizeof(record_sizes[0]); s++) {
+            printf("%-8s %6zu ", hashes[h].name, record_sizes[s]);
+            bench_throughput(hash_get(hashes[h].type), record_sizes[s]);
+            bench_distribution(hash_get(hashes[h].type), record_sizes[s]);
+            printf("\n");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_throughput(HashFn hash, size_t record_size)
+{
+    char* record = calloc(1, record_size);
+    uint64_t sink = 0;
+
+    double start = now();
+    for (uint64_t i = 0; i < N_KEYS * 4; i++) {
+        memcpy(record, &i, record_size < sizeof(i) ? record_size : sizeof(i));
+        sink ^= hash(record, record_size, 0);
+    }
+    double elapsed = now() - start;
+
+    /* Printing sink keeps the loop from being optimised away. */
+    fprintf(stderr, "%llx\r", (unsigned long long)sink);
+    printf("%12.1f %10.1f ", N_KEYS * 4.0 * record_size / elapsed / 1e6, N_KEYS * 4.0 / elapsed / 1e6);
+
+    free(record);
+}
+
+static void
+bench_distribution(HashFn hash, size_t record_size)
+{
+    char* record = calloc(1, record_size);
+    int* buckets = calloc(N_BUCKETS, sizeof(*buckets));
+
+    for (uint64_t i = 0; i < N_KEYS; i++) {
+        memcpy(record, &i, record_size < sizeof(i) ? record_size : sizeof(i));
+        buckets[hash(record, record_size, 0) & (N_BUCKETS - 1)]++;
+    }
+
+    double mean = (double)N_KEYS / N_BUCKETS;
+    double variance = 0;
+    int max = 0;
+    for (int i = 0; i < N_BUCKETS; i++) {
+        variance += (buckets[i] - mean) * (buckets[i] - mean);
+        if (buckets[i] > max) {
+            max = buckets[i];
+        }
+    }
+
+    printf("%10.3f %10.2f", max / mean, sqrt(variance / N_BUCKETS));
+
+    free(buckets);
+    free(record);
+}
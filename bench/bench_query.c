@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "query.h"
+
+/*
+ * Joins a table of orders with a table of customers on the customer id, first in the engine with
+ * query_join and then the way an application would, by scanning both tables out, one malloc per
+ * record, and joining the copies in a hash table on a single thread.
+ */
+
+#define N_ORDERS (1 << 20)
+#define N_CUSTOMERS (1 << 16)
+#define RECORD_SIZE (32)
+#define N_THREADS (4)
+
+struct rows
+{
+    void**  records;
+    size_t  n_records;
+};
+
+static double now(void);
+static Table create_table(char* name, uint64_t n_records, uint64_t n_customers);
+static int count_pair(const void* left, const void* right, void* ctx);
+static int copy_record(void* record, void* ctx);
+static long join_outside(Table orders, Table customers);
+
+int
+main(void)
+{
+    Table orders = create_table("orders", N_ORDERS, N_CUSTOMERS);
+    Table customers = create_table("customers", N_CUSTOMERS, N_CUSTOMERS);
+    QueryPool pool = query_pool_create(N_THREADS);
+    if (orders == NULL || customers == NULL || pool == NULL) {
+        fprintf(stderr, "could not create tables\n");
+        return EXIT_FAILURE;
+    }
+
+    long pairs = 0;
+    double start = now();
+    query_join(pool, orders, 8, customers, 0, 8, count_pair, &pairs);
+    double in_engine = now() - start;
+
+    start = now();
+    long outside_pairs = join_outside(orders, customers);
+    double outside = now() - start;
+
+    printf("%ld pairs, %.1f Mrecords/s in the engine, %.1f Mrecords/s outside (%ld pairs), "
+        "%.1fx\n", pairs, (double)N_ORDERS / in_engine / 1e6, (double)N_ORDERS / outside / 1e6,
+        outside_pairs, outside / in_engine);
+
+    query_pool_free(&pool);
+    table_free(orders);
+    table_free(customers);
+
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Records are keyed by their id and hold a customer id at offset 8.
+ */
+static Table
+create_table(char* name, uint64_t n_records, uint64_t n_customers)
+{
+    TableConfig config = table_default_config();
+    config.record_size = RECORD_SIZE;
+    config.key_size = sizeof(uint64_t);
+
+    Table table = table_create_with_config(name, config);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    char record[RECORD_SIZE] = {0};
+    for (uint64_t id = 0; id < n_records; id++) {
+        uint64_t customer = id % n_customers;
+        memcpy(record, &id, sizeof(id));
+        memcpy(record + 8, &customer, sizeof(customer));
+        table_insert(table, record);
+    }
+
+    return table;
+}
+
+static int
+count_pair(const void* left, const void* right, void* ctx)
+{
+    (void)left;
+    (void)right;
+    __atomic_fetch_add((long*)ctx, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+copy_record(void* record, void* ctx)
+{
+    struct rows* rows = ctx;
+    void* copy = malloc(RECORD_SIZE);
+    memcpy(copy, record, RECORD_SIZE);
+    rows->records[rows->n_records++] = copy;
+    return 0;
+}
+
+static long
+join_outside(Table orders, Table customers)
+{
+    struct rows left = {.records = malloc(N_ORDERS * sizeof(void*))};
+    struct rows right = {.records = malloc(N_CUSTOMERS * sizeof(void*))};
+    table_scan(orders, copy_record, &left);
+    table_scan(customers, copy_record, &right);
+
+    /* Customer ids are dense, a bucket per id stands in for the application's hash table. */
+    size_t n_buckets = N_CUSTOMERS * 2;
+    void** buckets = calloc(n_buckets, sizeof(void*));
+    for (size_t i = 0; i < right.n_records; i++) {
+        uint64_t id;
+        memcpy(&id, right.records[i], sizeof(id));
+        size_t bucket = (id * 0x9e3779b97f4a7c15ULL) % n_buckets;
+        while (buckets[bucket] != NULL) {
+            bucket = (bucket + 1) % n_buckets;
+        }
+        buckets[bucket] = right.records[i];
+    }
+
+    long pairs = 0;
+    for (size_t i = 0; i < left.n_records; i++) {
+        uint64_t customer;
+        memcpy(&customer, (char*)left.records[i] + 8, sizeof(customer));
+        size_t bucket = (customer * 0x9e3779b97f4a7c15ULL) % n_buckets;
+        for (; buckets[bucket] != NULL; bucket = (bucket + 1) % n_buckets) {
+            if (memcmp(buckets[bucket], &customer, sizeof(customer)) == 0) {
+                pairs++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < left.n_records; i++) {
+        free(left.records[i]);
+    }
+    for (size_t i = 0; i < right.n_records; i++) {
+        free(right.records[i]);
+    }
+    free(left.records);
+    free(right.records);
+    free(buckets);
+
+    return pairs;
+}
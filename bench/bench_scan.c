@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "table.h"
+
+/*
+ * Filters a table of 20 four byte fields on one field, as an analytics query would.
+ * Run it against a packed and a pax build (-Dpage_layout=pax) to compare the two layouts.
+ */
+
+#define N_RECORDS (1 << 20)
+#define N_FIELDS (20)
+#define N_RUNS (10)
+
+static double now(void);
+static int count_record(void* record, void* ctx);
+
+int
+main(void)
+{
+    TableConfig config = table_default_config();
+    config.record_size = N_FIELDS * sizeof(uint32_t);
+    config.key_size = sizeof(uint32_t);
+    config.n_fields = N_FIELDS;
+    for (int i = 0; i < N_FIELDS; i++) {
+        config.field_sizes[i] = sizeof(uint32_t);
+    }
+
+    Table table = table_create_with_config("bench", config);
+    if (table == NULL) {
+        fprintf(stderr, "could not create table\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t record[N_FIELDS];
+    for (uint32_t key = 0; key < N_RECORDS; key++) {
+        for (int i = 0; i < N_FIELDS; i++) {
+            record[i] = key * (i + 1);
+        }
+        record[3] = key % 1000;
+        table_insert(table, record);
+    }
+
+    uint32_t value = 7;
+    long matches = 0;
+    double start = now();
+    for (int run = 0; run < N_RUNS; run++) {
+        table_filter(table, 3 * sizeof(uint32_t), sizeof(uint32_t), &value, count_record, &matches);
+    }
+    double elapsed = now() - start;
+
+    printf("%ld matches, %.1f Mrecords/s filtered\n", matches / N_RUNS,
+        (double)N_RECORDS * N_RUNS / elapsed / 1e6);
+
+    table_free(table);
+
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+count_record(void* record, void* ctx)
+{
+    (void)record;
+    (*(long*)ctx)++;
+    return 0;
+}
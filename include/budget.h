@@ -0,0 +1,118 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+
+#define BUDGET_ARG_INVALID -1
+#define BUDGET_EXCEEDED -2
+
+/*
+ * A count of bytes in use with an optional limit.
+ * Budgets form a tree under the global budget: bytes charged to a budget are also charged to every
+ * budget above it, and a charge that would take any of them over its limit is refused.
+ * Tables each get a budget under the global one, so a single table can be capped and the process
+ * as a whole can be too.
+ * A batched budget charges the budgets above it a batch at a time and draws its own charges down
+ * from that, so most charges only touch the budget itself. It holds up to two batches more than
+ * is charged to it, which the budgets above count as used.
+ * A NULL budget means the global budget everywhere below.
+ * A Budget is thread safe.
+ */
+typedef struct budget* Budget;
+
+/*
+ * Returns the process wide budget, which has no limit until one is set.
+ */
+Budget
+budget_global(void);
+
+/*
+ * Returns a budget under parent that allows limit bytes, zero meaning no limit of its own.
+ * Returns NULL if the budget could not be created.
+ */
+Budget
+budget_create(Budget parent, size_t limit);
+
+/*
+ * Returns a batched budget under parent that allows limit bytes, zero meaning no limit of its own,
+ * and charges parent batch bytes at a time.
+ * Returns NULL if batch is zero or the budget could not be created.
+ */
+Budget
+budget_create_batched(Budget parent, size_t limit, size_t batch);
+
+/*
+ * Frees the budget, sets the reference to NULL. Whatever is still charged to it is released from
+ * the budgets above it.
+ */
+void
+budget_free(Budget* budget);
+
+/*
+ * Sets the budget's limit, zero meaning no limit. Bytes already charged stay charged even if they
+ * are over the new limit.
+ */
+void
+budget_set_limit(Budget budget, size_t limit);
+
+/*
+ * Returns the budget's limit, zero if it has none.
+ */
+size_t
+budget_limit(Budget budget);
+
+/*
+ * Returns the bytes charged to the budget and the budgets under it.
+ */
+size_t
+budget_used(Budget budget);
+
+/*
+ * Charges size bytes to the budget.
+ * Returns zero if the bytes were charged.
+ * Returns BUDGET_EXCEEDED if the budget or one above it would go over its limit, nothing is
+ * charged then.
+ */
+int
+budget_reserve(Budget budget, size_t size);
+
+/*
+ * Gives back size bytes charged with budget_reserve.
+ */
+void
+budget_release(Budget budget, size_t size);
+
+/*
+ * Gives back to the budgets above a batched budget whatever it holds past the bytes charged to it.
+ */
+void
+budget_trim(Budget budget);
+
+/*
+ * Charges size bytes to the budget and allocates them.
+ * Returns NULL if the budget is exceeded or there is no memory.
+ */
+void*
+budget_alloc(Budget budget, size_t size);
+
+/*
+ * Like budget_alloc, but the memory is zeroed.
+ */
+void*
+budget_calloc(Budget budget, size_t n, size_t size);
+
+/*
+ * Resizes memory from budget_alloc from old_size to new_size bytes, charging the difference.
+ * Returns NULL if the budget is exceeded or there is no memory, ptr is left as it was then.
+ * Returns NULL if new_size is zero, ptr is freed then.
+ */
+void*
+budget_realloc(Budget budget, void* ptr, size_t old_size, size_t new_size);
+
+/*
+ * Frees size bytes from budget_alloc and gives them back to the budget.
+ */
+void
+budget_dealloc(Budget budget, void* ptr, size_t size);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_ARG_INVALID -1
+#define CACHE_MISS -2
+
+/*
+ * A size bounded cache of records keyed by their first key_size bytes.
+ * The cache is split into lock striped partitions picked by the key's hash. Each partition evicts
+ * with CLOCK and only admits a new record over its victim if the new key has been asked for more
+ * often recently (TinyLFU), so a burst of one-off keys can't flush the hot ones out.
+ * A Cache is thread safe.
+ */
+typedef struct cache* Cache;
+
+typedef struct cache_stats
+{
+    size_t  hits;
+    size_t  misses;
+    size_t  entries;
+    size_t  evictions;
+    size_t  rejections;
+    size_t  memory;
+} CacheStats;
+
+/*
+ * Returns an empty cache that holds up to capacity records.
+ * Returns NULL if the cache could not be created.
+ */
+Cache
+cache_create(size_t capacity, size_t record_size, size_t key_size);
+
+/*
+ * Frees the memory associated with the cache, sets the reference to NULL.
+ */
+void
+cache_free(Cache* cache);
+
+/*
+ * Copies the cached record with the given key into out, hash must be the hash of the key.
+ * Returns zero on a hit.
+ * Returns CACHE_MISS if the key isn't cached.
+ */
+int
+cache_get(Cache cache, uint64_t hash, const void* key, void* out);
+
+/*
+ * Caches the record, replacing any cached record with the same key.
+ * The record may not be admitted if the cache is full of more frequently used records.
+ * Returns zero if the record is now cached.
+ * Returns CACHE_MISS if it wasn't admitted.
+ */
+int
+cache_put(Cache cache, uint64_t hash, const void* record);
+
+/*
+ * Removes the record with the given key from the cache, if it is there.
+ */
+void
+cache_invalidate(Cache cache, uint64_t hash, const void* key);
+
+/*
+ * Returns the cache's counters summed over its partitions, and the bytes it allocated up front.
+ */
+CacheStats
+cache_stats(Cache cache);
+
+#endif
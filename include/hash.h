@@ -0,0 +1,61 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The hash functions a table can be created with.
+ * Linear hashing uses the low bits of the hash to pick a bucket, so every function here mixes its
+ * output so that all 64 bits are usable.
+ */
+typedef enum hash_type
+{
+    HASH_FAST,
+    HASH_CRC32C
+} HashType;
+
+typedef uint64_t (*HashFn)(const void* data, size_t len, uint64_t seed);
+
+/*
+ * Returns a 64-bit hash of data using a multiply-mix hash in the style of wyhash.
+ */
+uint64_t
+hash_fast(const void* data, size_t len, uint64_t seed);
+
+/*
+ * Returns a 64-bit hash of data built from a CRC32C of its 8 byte words, each multiplied by a key
+ * derived from seed first since a plain CRC would collide on the same keys whatever the seed.
+ * Uses the SSE4.2 or ARMv8 CRC instructions when they are available.
+ */
+uint64_t
+hash_crc32c(const void* data, size_t len, uint64_t seed);
+
+/*
+ * Returns the CRC32C of data, continuing from crc (pass 0 to start a new checksum).
+ */
+uint32_t
+crc32c(uint32_t crc, const void* data, size_t len);
+
+/*
+ * Returns non-zero if crc32c is using hardware instructions, zero otherwise.
+ */
+int
+crc32c_is_hardware(void);
+
+/*
+ * Returns the hash function for type.
+ * Returns NULL if type is not a valid HashType.
+ */
+HashFn
+hash_get(HashType type);
+
+/*
+ * Returns a random seed from the operating system.
+ * Which keys collide under either hash function depends on its seed, so tables created with a
+ * random seed can't be flooded with keys chosen to collide.
+ */
+uint64_t
+hash_random_seed(void);
+
+#endif
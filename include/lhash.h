@@ -0,0 +1,276 @@
+#ifndef LHASH_H
+#define LHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "budget.h"
+#include "hash.h"
+#include "page.h"
+
+#define LHASH_ARG_INVALID -1
+#define LHASH_KEY_EXISTS -2
+#define LHASH_KEY_NOT_FOUND -3
+#define LHASH_NO_MEMORY -4
+#define LHASH_IO_ERROR -5
+
+/*
+ * The cursor of a finished lhash_scan_from, see there.
+ */
+#define LHASH_SCAN_END UINT64_MAX
+
+/*
+ * A linear hash partition: a directory of buckets, each a chain of pages, that grows one bucket
+ * at a time by splitting the bucket under the split pointer, and shrinks one bucket at a time by
+ * merging the last bucket back when deletes leave it sparse.
+ * Records are keyed by their first key_size bytes.
+ * An LHash is not thread safe, the caller must latch it.
+ */
+typedef struct lhash* LHash;
+
+/*
+ * Called once per record by lhash_scan, returning non-zero stops the scan.
+ */
+typedef int (*LHashScanFn)(void* record, void* ctx);
+
+/*
+ * Called once per page by lhash_pages.
+ */
+typedef void (*LHashPageFn)(Page page, void* ctx);
+
+/*
+ * Called by the linear hash just before it changes, moves or gives back a page that already held
+ * records, see lhash_watch_writes.
+ */
+typedef void (*LHashWriteFn)(Page page, void* ctx);
+
+/*
+ * Called by lhash_rmw with the record for a key, which it may change in place except for the key.
+ * exists is zero if the key wasn't stored, the record is then zeroed apart from the key.
+ * Returning zero stores the record, returning non-zero leaves the table as it was.
+ */
+typedef int (*LHashRmwFn)(void* record, int exists, void* ctx);
+
+/*
+ * Where a linear hash keeps its pages when they aren't malloc'd.
+ * alloc returns page_size bytes, aligned to 8 bytes, for the position'th page of bucket's chain, or
+ * NULL if there is no room. release takes back a page the linear hash no longer needs.
+ * move, which may be NULL, is offered every page by lhash_compact and returns a copy of the page
+ * the store would rather keep, releasing the original, or NULL to leave the page where it is.
+ * Pages still in use when the linear hash is freed are not released, they belong to the store.
+ * A store that pages its pages in and out sets pin and unpin, the linear hash then only keeps what
+ * alloc returned as a handle to the page. pin returns the page's memory, or NULL if it couldn't be
+ * paged in, and the memory stays put until the page is unpinned, dirty if it was changed. move
+ * must then be NULL.
+ */
+typedef struct lhash_store
+{
+    void*   (*alloc)(void* ctx, size_t bucket, int position);
+    void    (*release)(void* ctx, void* page);
+    void*   (*move)(void* ctx, void* page);
+    void*   (*pin)(void* ctx, void* page);
+    void    (*unpin)(void* ctx, void* page, int dirty);
+    void*   ctx;
+} LHashStore;
+
+/*
+ * A page of a stored linear hash and its place in the directory, see lhash_restore.
+ */
+typedef struct lhash_page_ref
+{
+    size_t  bucket;
+    int     position;
+    Page    page;
+} LHashPageRef;
+
+/*
+ * Returns an empty linear hash with one bucket.
+ * Keys are rehashed with hash and seed when buckets are split.
+ * Returns NULL if the linear hash could not be created.
+ */
+LHash
+lhash_create(size_t page_size, size_t record_size, size_t key_size, HashFn hash, uint64_t seed);
+
+/*
+ * Returns an empty linear hash whose records are made of n_fields fields of the given sizes.
+ * Returns NULL if the linear hash could not be created.
+ */
+LHash
+lhash_create_with_fields(size_t page_size, int n_fields, const size_t* field_sizes,
+    size_t key_size, HashFn hash, uint64_t seed);
+
+/*
+ * Returns an empty linear hash that takes its pages from store, or mallocs them if store is NULL.
+ * Everything the linear hash allocates is charged to budget, pages from a store aren't.
+ * Inserts that need memory the budget doesn't allow fail with LHASH_NO_MEMORY.
+ * Returns NULL if the linear hash could not be created.
+ */
+LHash
+lhash_create_with_store(size_t page_size, int n_fields, const size_t* field_sizes,
+    size_t key_size, HashFn hash, uint64_t seed, const LHashStore* store, Budget budget);
+
+/*
+ * Puts back the directory of an empty linear hash that takes its pages from a store: n_buckets
+ * buckets holding n_records records on the given pages.
+ * Every chain must be complete, positions 0 to n - 1 of each non-empty bucket.
+ * Returns zero if the directory was restored.
+ * Returns LHASH_ARG_INVALID if the linear hash isn't empty or the pages don't make up whole chains.
+ * Returns LHASH_NO_MEMORY if the directory could not be allocated.
+ */
+int
+lhash_restore(LHash lhash, size_t n_buckets, size_t n_records, const LHashPageRef* pages,
+    size_t n_pages);
+
+/*
+ * Grows the directory of a linear hash that holds no records to the buckets n_records records
+ * would have split it into, so loading them doesn't split a bucket.
+ * Returns zero if the directory was grown, or was already large enough.
+ * Returns LHASH_ARG_INVALID if the linear hash holds records.
+ * Returns LHASH_NO_MEMORY if the directory could not be grown.
+ */
+int
+lhash_reserve(LHash lhash, size_t n_records);
+
+/*
+ * Has fn called before every write to a page that was there before it, until it is replaced by
+ * another fn or NULL. Pages the write itself adds aren't reported until they are written again.
+ * Does nothing if the store pins pages, their memory isn't theirs between writes.
+ */
+void
+lhash_watch_writes(LHash lhash, LHashWriteFn fn, void* ctx);
+
+/*
+ * Frees the memory associated with the linear hash, sets the reference to NULL.
+ */
+void
+lhash_free(LHash* lhash);
+
+/*
+ * Adds the record, hash must be the hash of the record's key.
+ * Returns zero if the record was added.
+ * Returns LHASH_KEY_EXISTS if a record with the same key is already stored.
+ * Returns LHASH_NO_MEMORY if a page could not be allocated.
+ * Returns LHASH_IO_ERROR if the store couldn't pin a page, as may every call below that reads or
+ * writes records.
+ */
+int
+lhash_insert(LHash lhash, uint64_t hash, void* record);
+
+/*
+ * Copies the record with the given key into out.
+ * Returns zero if the record was found.
+ * Returns LHASH_KEY_NOT_FOUND if no record has that key.
+ */
+int
+lhash_lookup(LHash lhash, uint64_t hash, void* key, void* out);
+
+/*
+ * Replaces the record that has the same key as record.
+ * Returns zero if the record was replaced.
+ * Returns LHASH_KEY_NOT_FOUND if no record has that key.
+ */
+int
+lhash_update(LHash lhash, uint64_t hash, void* record);
+
+/*
+ * Replaces the record that has the same key as record, or adds it if there is none, probing the
+ * bucket once.
+ * Returns zero if the record was stored.
+ * Returns LHASH_NO_MEMORY if the record was new and a page could not be allocated.
+ */
+int
+lhash_upsert(LHash lhash, uint64_t hash, void* record);
+
+/*
+ * Calls fn on a copy of the record with the given key, or on a new record if there is none, and
+ * stores the result where the record was found, probing the bucket once.
+ * fn must not use the linear hash.
+ * Returns zero if the record was stored.
+ * Returns the value fn returned if it was non-zero, nothing is stored then.
+ * Returns LHASH_ARG_INVALID if fn changed the key.
+ * Returns LHASH_NO_MEMORY if the record was new and a page could not be allocated.
+ */
+int
+lhash_rmw(LHash lhash, uint64_t hash, void* key, LHashRmwFn fn, void* ctx);
+
+/*
+ * Deletes the record with the given key.
+ * Empty overflow pages are given back, and the last bucket is merged back if the table has become
+ * sparse.
+ * Returns zero if the record was deleted.
+ * Returns LHASH_KEY_NOT_FOUND if no record has that key.
+ */
+int
+lhash_delete(LHash lhash, uint64_t hash, void* key);
+
+/*
+ * Merges buckets until the table is no longer sparse, fits the directory and chains to what they
+ * hold and offers every page to the store's move.
+ * Returns zero if the table was compacted.
+ * Returns LHASH_NO_MEMORY if a merge could not allocate a page, the table is left valid.
+ */
+int
+lhash_compact(LHash lhash);
+
+/*
+ * Calls fn on every record until it returns non-zero.
+ * Returns the value fn stopped on, or zero if every record was visited.
+ */
+int
+lhash_scan(LHash lhash, LHashScanFn fn, void* ctx);
+
+/*
+ * Calls fn on the records of at most n_buckets buckets, carrying on from *cursor, which is zero to
+ * start a scan, and moves *cursor past them. *cursor is LHASH_SCAN_END once every bucket was visited.
+ * The cursor is a position in the order of the hashes' bits reversed rather than a bucket, so the
+ * linear hash may change between calls: records that are in it for the whole scan are visited
+ * exactly once, however buckets were split or merged in between, and any others at most once.
+ * Returns the value fn stopped on, *cursor is then left on the bucket it stopped in.
+ * Returns zero if the buckets were visited.
+ * Returns LHASH_IO_ERROR if the store couldn't pin a page, *cursor is then left as for fn stopping.
+ */
+int
+lhash_scan_from(LHash lhash, uint64_t* cursor, size_t n_buckets, LHashScanFn fn, void* ctx);
+
+/*
+ * Calls fn on every record whose width bytes at offset equal value until it returns non-zero.
+ * Only the matching records are read in full.
+ * Returns the value fn stopped on, zero if every match was visited or LHASH_ARG_INVALID.
+ */
+int
+lhash_filter(LHash lhash, size_t offset, size_t width, const void* value, LHashScanFn fn,
+    void* ctx);
+
+/*
+ * Calls fn on every page of the buckets from first up to but not including last.
+ * Returns zero if every page was visited.
+ * Returns LHASH_IO_ERROR if the store couldn't pin a page, fn isn't called for the rest.
+ */
+int
+lhash_pages(LHash lhash, size_t first, size_t last, LHashPageFn fn, void* ctx);
+
+/*
+ * Returns the number of records stored.
+ */
+size_t
+lhash_count(LHash lhash);
+
+/*
+ * Returns the bucket that hash currently maps to.
+ * The answer changes as buckets are split.
+ */
+size_t
+lhash_bucket_of(LHash lhash, uint64_t hash);
+
+/*
+ * Returns the number of buckets in the directory.
+ */
+size_t
+lhash_n_buckets(LHash lhash);
+
+/*
+ * Returns the number of pages, including overflow pages.
+ */
+size_t
+lhash_n_pages(LHash lhash);
+
+#endif
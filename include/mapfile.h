@@ -0,0 +1,124 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAPFILE_META_SIZE (8192)
+
+#define MAPFILE_ARG_INVALID -1
+#define MAPFILE_IO_ERROR -2
+
+/*
+ * A file of fixed size page slots mapped into memory, pages are used in place in the mapping.
+ * Every slot records who owns it: an owner id, a bucket and the page's position in that bucket's
+ * chain. The records are kept together in a directory slot ahead of every run of page slots, so
+ * opening a file only reads the directories and never touches the pages themselves.
+ * The file grows in place, the mapping never moves, so pointers into it stay valid until the file
+ * is closed or the page is released or relocated.
+ * The file also holds MAPFILE_META_SIZE bytes for the caller's own use.
+ * A MapFile is thread safe, but the pages themselves aren't latched.
+ * Nothing is written atomically: a file is only consistent after mapfile_sync.
+ */
+typedef struct mapfile* MapFile;
+
+/*
+ * Called by mapfile_pages once for every page in use.
+ */
+typedef void (*MapFilePageFn)(void* page, int owner, size_t bucket, int position, void* ctx);
+
+/*
+ * Creates a new mapped file at path with slots of page_size bytes, page_size must be a multiple
+ * of 512 and the file must not exist.
+ * Returns NULL if the file could not be created.
+ */
+MapFile
+mapfile_create(const char* path, size_t page_size);
+
+/*
+ * Maps an existing file.
+ * Returns NULL if the file could not be opened or isn't a mapped file.
+ */
+MapFile
+mapfile_open(const char* path);
+
+/*
+ * Syncs and unmaps the file, sets the reference to NULL.
+ * Returns zero if the file was synced.
+ * Returns MAPFILE_IO_ERROR if it wasn't, the file is unmapped regardless.
+ */
+int
+mapfile_close(MapFile* file);
+
+/*
+ * Returns the caller's MAPFILE_META_SIZE bytes, part of the mapping.
+ */
+void*
+mapfile_meta(MapFile file);
+
+/*
+ * Returns the size of the file's pages.
+ */
+size_t
+mapfile_page_size(MapFile file);
+
+/*
+ * Returns a free page slot, now owned by the given owner, bucket and position, growing the file if
+ * every slot is taken. owner must be between 0 and 65534, position between 0 and 65535.
+ * Returns NULL if the file could not grow.
+ */
+void*
+mapfile_alloc(MapFile file, int owner, size_t bucket, int position);
+
+/*
+ * Gives the page's slot back to the file.
+ */
+void
+mapfile_release(MapFile file, void* page);
+
+/*
+ * Moves the page into a free slot nearer the start of the file if it is in an extent that
+ * mapfile_shrink could cut off once it is empty. The slot keeps its owner, bucket and position.
+ * The caller must make sure nothing else uses the page while it moves.
+ * Returns where the page is now, page itself if it wasn't moved.
+ */
+void*
+mapfile_relocate(MapFile file, void* page);
+
+/*
+ * Cuts the free extents at the end off the file, after pages have been moved out of them with
+ * mapfile_relocate.
+ * Returns zero if the file was shrunk or had nothing to cut off.
+ * Returns MAPFILE_IO_ERROR if the file could not be truncated.
+ */
+int
+mapfile_shrink(MapFile file);
+
+/*
+ * Returns the size of the file in bytes.
+ */
+size_t
+mapfile_size(MapFile file);
+
+/*
+ * Calls fn on every page in use, in file order.
+ */
+void
+mapfile_pages(MapFile file, MapFilePageFn fn, void* ctx);
+
+/*
+ * Returns the number of pages in use.
+ */
+size_t
+mapfile_n_pages(MapFile file);
+
+/*
+ * Writes every changed page of the mapping and the file's length back to the file and waits for
+ * them.
+ * Returns zero if the file was synced.
+ * Returns MAPFILE_IO_ERROR if it wasn't.
+ */
+int
+mapfile_sync(MapFile file);
+
+#endif
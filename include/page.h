@@ -4,6 +4,8 @@
 #include <stddef.h>
 
 #define MIN_PAGE_SIZE (128)
+#define MAX_PAGE_SIZE (1024 * 1024)
+#define PAGE_MAX_FIELDS (32)
 
 #define PAGE_ARG_INVALID -1
 #define PAGE_HAS_NO_SPACE -2
@@ -12,11 +14,27 @@
 typedef struct page* Page;
 
 /*
- * Returns a page of size, size (including the header).
+ * Returns a page of size, size (including the header), which must be from MIN_PAGE_SIZE to
+ * MAX_PAGE_SIZE.
  * Returns NULL if the page could not be created.
  */
 Page page_create(size_t size, size_t record_size);
 
+/*
+ * Returns a page of size, size whose records are made of n_fields fields of the given sizes.
+ * The packed layout only needs the record size, the pax layout stores each field separately.
+ * Returns NULL if the page could not be created.
+ */
+Page page_create_with_fields(size_t size, int n_fields, const size_t* field_sizes);
+
+/*
+ * Lays out an empty page in the size bytes at memory, which must be aligned to 8 bytes.
+ * The memory stays the caller's, the page must not be given to page_free. Pages laid out this way
+ * contain no pointers, so the bytes can be written to a file and used in place again later.
+ * Returns NULL if the page could not be laid out.
+ */
+Page page_init(void* memory, size_t size, int n_fields, const size_t* field_sizes);
+
 /*
  * Frees the memory associated with the page, sets the reference to NULL.
  */
@@ -38,6 +56,14 @@ page_add_record(Page page, void* record);
 int
 page_delete_record(Page page, void* record);
 
+/*
+ * Returns the index of the record that was deleted from the page.
+ * The last record on the page is moved into its place.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid.
+ */
+int
+page_delete_record_id(Page page, int record_id);
+
 /*
  * Returns zero on successful update.
  * Returns PAGE_ARG_INVALID if the given arguments are invalid.
@@ -46,6 +72,14 @@ page_delete_record(Page page, void* record);
 int
 page_update_record(Page page, void* old, void* new);
 
+/*
+ * Overwrites the record at record_id with new.
+ * Returns zero on successful update.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid.
+ */
+int
+page_update_record_id(Page page, int record_id, void* new);
+
 /*
  * Returns a pointer to the record.
  * Returns NULL if the record_id is invalid or the pointer could not be created.
@@ -53,4 +87,50 @@ page_update_record(Page page, void* old, void* new);
 void*
 page_read_record(Page page, int record_id);
 
+/*
+ * Copies the record into out, which must be able to hold a record.
+ * Returns zero on success.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid.
+ */
+int
+page_copy_record(Page page, int record_id, void* out);
+
+/*
+ * Copies width bytes at offset in the record into out.
+ * Returns zero on success.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid.
+ */
+int
+page_copy_field(Page page, int record_id, size_t offset, size_t width, void* out);
+
+/*
+ * Writes the ids of the records whose width bytes at offset are equal to value into record_ids,
+ * which must have room for page_n_records(page) ids.
+ * Returns the number of matching records.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid, or in the pax layout, if the bytes
+ * span more than one field.
+ */
+int
+page_match_field(Page page, size_t offset, size_t width, const void* value, int* record_ids);
+
+/*
+ * Returns the index of the first record whose first key_size bytes match key.
+ * Returns PAGE_ARG_INVALID if the given arguments are invalid.
+ * Returns PAGE_RECORD_NOT_FOUND if no record has that key.
+ */
+int
+page_find_key(Page page, void* key, size_t key_size);
+
+/*
+ * Returns the number of records on the page, or zero if the page is NULL.
+ */
+int
+page_n_records(Page page);
+
+/*
+ * Returns the number of records of record_size that fit on a page of size.
+ */
+int
+page_capacity(size_t size, size_t record_size);
+
 #endif
@@ -0,0 +1,101 @@
+#ifndef PAGEFILE_H
+#define PAGEFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGEFILE_ARG_INVALID -1
+#define PAGEFILE_IO_ERROR -2
+#define PAGEFILE_NO_MEMORY -3
+#define PAGEFILE_NO_FRAME -4
+
+/*
+ * A file of fixed size pages read and written through a fixed pool of frames.
+ * Pages are pinned into frames, changed in place and unpinned. Dirty frames are only written back
+ * when they are evicted to make room or when the file is flushed, so the engine decides when
+ * pages reach the disk.
+ * In direct mode the file is opened with O_DIRECT and frames are aligned to the file system's
+ * block size, so the kernel keeps no second copy of the pages and memory use is exactly the frame
+ * pool. Files on file systems without O_DIRECT (tmpfs, for one) or page sizes that aren't a
+ * multiple of the block size fall back to buffered I/O.
+ * A PageFile is thread safe.
+ */
+typedef struct pagefile* PageFile;
+
+typedef struct pagefile_stats
+{
+    size_t  reads;
+    size_t  writes;
+    size_t  evictions;
+} PageFileStats;
+
+/*
+ * Opens or creates the page file at path, with n_frames frames of page_size bytes.
+ * If direct is non-zero the file is read and written with O_DIRECT when the file system allows.
+ * Returns NULL if the file could not be opened or the frames could not be allocated.
+ */
+PageFile
+pagefile_open(const char* path, size_t page_size, int n_frames, int direct);
+
+/*
+ * Writes back every dirty frame, closes the file and frees the frames, sets the reference to NULL.
+ * Every page must be unpinned first.
+ * Returns zero if the pages were written back.
+ * Returns PAGEFILE_IO_ERROR if a write failed, the file is closed regardless.
+ */
+int
+pagefile_close(PageFile* file);
+
+/*
+ * Pins page page_no into a frame and points frame at its page_size bytes, reading the page from
+ * disk if it isn't already in a frame. Pages past the end of the file read as zeros.
+ * The frame stays valid until the page is unpinned.
+ * Returns zero if the page was pinned.
+ * Returns PAGEFILE_ARG_INVALID if the given arguments are invalid.
+ * Returns PAGEFILE_NO_FRAME if every frame is pinned.
+ * Returns PAGEFILE_IO_ERROR if the page or an evicted page could not be read or written.
+ */
+int
+pagefile_pin(PageFile file, uint64_t page_no, void** frame);
+
+/*
+ * Unpins the page, if dirty is non-zero the frame was changed and will be written back.
+ * Returns zero if the page was unpinned.
+ * Returns PAGEFILE_ARG_INVALID if the page isn't pinned.
+ */
+int
+pagefile_unpin(PageFile file, uint64_t page_no, int dirty);
+
+/*
+ * Writes back every dirty frame and syncs the file.
+ * Returns zero if every page reached the disk.
+ * Returns PAGEFILE_IO_ERROR if a write or the sync failed.
+ */
+int
+pagefile_flush(PageFile file);
+
+/*
+ * Returns the number of pages in the file, including pages that only exist in frames so far.
+ */
+uint64_t
+pagefile_n_pages(PageFile file);
+
+/*
+ * Returns non-zero if the file is read and written with O_DIRECT.
+ */
+int
+pagefile_is_direct(PageFile file);
+
+/*
+ * Returns the alignment of the frames.
+ */
+size_t
+pagefile_alignment(PageFile file);
+
+/*
+ * Returns the file's I/O counters.
+ */
+PageFileStats
+pagefile_stats(PageFile file);
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The binary protocol spoken by ezdbd.
+ *
+ * Every message is a 12 byte header followed by length bytes of payload. All integers are little
+ * endian.
+ *
+ *     0       4      5          8       12
+ *     | length | code | reserved | id    | payload ...
+ *
+ * In a request code is a ProtocolOp, in a response it is a ProtocolStatus. Responses carry the id of
+ * their request and are sent in the order the requests were received, so a client may pipeline as
+ * many requests as it likes before reading the responses.
+ *
+ *     op      request payload     response payload on success
+ *     INFO    none                record_size and key_size as two u32s
+ *     INSERT  a record            none
+ *     LOOKUP  a key               the record
+ *     UPDATE  a record            none
+ *     DELETE  a key               none
+ *     SCAN    none                every record, one after another, see below
+ *     UPSERT  a record            none
+ *
+ * A scan is answered with a run of messages carrying the scan's id: chunks of whole records, each
+ * at most PROTOCOL_SCAN_CHUNK_SIZE bytes (or one record, if records are larger), then an empty
+ * message whose code is the status of the scan. A scan's responses are never interleaved with
+ * other responses.
+ */
+
+#define PROTOCOL_HEADER_SIZE (12)
+#define PROTOCOL_SCAN_CHUNK_SIZE (1024 * 1024)
+
+#define PROTOCOL_INCOMPLETE -1
+
+typedef enum protocol_op
+{
+    PROTOCOL_OP_INFO,
+    PROTOCOL_OP_INSERT,
+    PROTOCOL_OP_LOOKUP,
+    PROTOCOL_OP_UPDATE,
+    PROTOCOL_OP_DELETE,
+    PROTOCOL_OP_SCAN,
+    PROTOCOL_OP_UPSERT
+} ProtocolOp;
+
+/*
+ * Response statuses, these are the negated TABLE_* error codes.
+ */
+typedef enum protocol_status
+{
+    PROTOCOL_OK = 0,
+    PROTOCOL_ARG_INVALID = 1,
+    PROTOCOL_KEY_EXISTS = 2,
+    PROTOCOL_KEY_NOT_FOUND = 3,
+    PROTOCOL_NO_MEMORY = 4
+} ProtocolStatus;
+
+typedef struct protocol_header
+{
+    uint32_t    length;
+    uint8_t     code;
+    uint32_t    id;
+} ProtocolHeader;
+
+/*
+ * Writes the header into the first PROTOCOL_HEADER_SIZE bytes of buf.
+ */
+void
+protocol_write_header(void* buf, ProtocolHeader header);
+
+/*
+ * Reads the header at the start of buf, which holds len bytes.
+ * Returns the size of the whole message (header and payload) if all of it is in buf.
+ * Returns PROTOCOL_INCOMPLETE if more bytes are needed, header is still set if the header itself was
+ * complete.
+ */
+long
+protocol_read_header(const void* buf, size_t len, ProtocolHeader* header);
+
+/*
+ * Writes v into the first 4 bytes of buf.
+ */
+void
+protocol_write_u32(void* buf, uint32_t v);
+
+/*
+ * Returns the u32 in the first 4 bytes of buf.
+ */
+uint32_t
+protocol_read_u32(const void* buf);
+
+/*
+ * Returns the status to send for a table_* return value.
+ */
+ProtocolStatus
+protocol_status(int table_result);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "table.h"
+
+#define QUERY_ARG_INVALID -1
+#define QUERY_NO_MEMORY -2
+#define QUERY_IO_ERROR -3
+
+#define QUERY_MAX_AGGREGATES (16)
+
+/*
+ * Joins and aggregates that run inside the engine, on a table's pages rather than on records
+ * copied out of it.
+ * A query runs in two phases on a pool of worker threads. First the workers take morsels of pages
+ * off a shared counter, so a worker that finishes early just takes more, and scatter what they
+ * read into radix partitions picked by the top bits of the key's hash and sized to fit in cache.
+ * Then each partition is finished by a single worker, without latching or sharing any memory with
+ * the others.
+ * The tables are latched for the whole query, writers wait until it is done.
+ */
+typedef struct query_pool* QueryPool;
+
+typedef enum query_agg_op
+{
+    QUERY_COUNT,
+    QUERY_SUM,
+    QUERY_MIN,
+    QUERY_MAX
+} QueryAggOp;
+
+/*
+ * An aggregate of a signed integer field of width 1, 2, 4 or 8 bytes at offset in the record, in
+ * the machine's byte order. QUERY_COUNT doesn't read a field.
+ */
+typedef struct query_aggregate
+{
+    QueryAggOp  op;
+    size_t      offset;
+    size_t      width;
+} QueryAggregate;
+
+/*
+ * Called by query_join once per pair of joined records, returning non-zero stops the query.
+ * It runs with every shard of both tables latched and the pool busy, so it must not use either
+ * table or the pool.
+ */
+typedef int (*QueryJoinFn)(const void* left, const void* right, void* ctx);
+
+/*
+ * Called by query_group_by once per group with its key and its aggregates in the order they were
+ * asked for, returning non-zero stops the query.
+ * It runs with every shard of the table latched and the pool busy, so it must not use the table
+ * or the pool.
+ */
+typedef int (*QueryGroupFn)(const void* group, const int64_t* values, void* ctx);
+
+/*
+ * Returns a pool of n_threads workers that queries run on.
+ * Returns NULL if the pool could not be created.
+ */
+QueryPool
+query_pool_create(int n_threads);
+
+/*
+ * Stops the workers and frees the pool, sets the reference to NULL.
+ */
+void
+query_pool_free(QueryPool* pool);
+
+/*
+ * Returns the number of workers in the pool.
+ */
+int
+query_pool_size(QueryPool pool);
+
+/*
+ * Joins every record of left with every record of right whose width bytes at right_offset equal
+ * its width bytes at left_offset, calling fn on each pair.
+ * The smaller table is the one hashed. fn is called from the pool's workers, several at a time.
+ * Returns zero if every pair was visited.
+ * Returns the value fn stopped on.
+ * Returns QUERY_ARG_INVALID if the given arguments are invalid.
+ * Returns QUERY_NO_MEMORY if the partitions could not be allocated.
+ * Returns QUERY_IO_ERROR if a table's pages could not be read.
+ */
+int
+query_join(QueryPool pool, Table left, size_t left_offset, Table right, size_t right_offset,
+    size_t width, QueryJoinFn fn, void* ctx);
+
+/*
+ * Groups the table's records by their width bytes at offset and calls fn once per group with the
+ * given aggregates of its records.
+ * fn is called from the pool's workers, several at a time.
+ * Returns zero if every group was visited.
+ * Returns the value fn stopped on.
+ * Returns QUERY_ARG_INVALID if the given arguments are invalid.
+ * Returns QUERY_NO_MEMORY if the groups could not be allocated.
+ * Returns QUERY_IO_ERROR if the table's pages could not be read.
+ */
+int
+query_group_by(QueryPool pool, Table table, size_t offset, size_t width,
+    const QueryAggregate* aggregates, int n_aggregates, QueryGroupFn fn, void* ctx);
+
+#endif
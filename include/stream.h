@@ -0,0 +1,65 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include "budget.h"
+
+#define STREAM_ARG_INVALID -1
+#define STREAM_IO_ERROR -2
+#define STREAM_END -3
+
+/*
+ * A file descriptor read or written through two fixed size buffers and a thread of its own, so
+ * the caller fills or empties one buffer while the thread writes or reads the other. However much
+ * goes through a stream, it only ever holds its two buffers.
+ * A writer only writes whole buffers, and whatever is left when it is closed. A reader reads ahead
+ * a buffer at a time, so it may have taken more from the descriptor than the caller has read.
+ * A Stream is not thread safe, only its own thread and one caller may use it.
+ */
+typedef struct stream* Stream;
+
+/*
+ * Returns a stream that writes to fd through two buffers of buffer_size bytes charged to budget.
+ * Returns NULL if the stream could not be created.
+ */
+Stream
+stream_writer(int fd, size_t buffer_size, Budget budget);
+
+/*
+ * Returns a stream that reads from fd through two buffers of buffer_size bytes charged to budget.
+ * Returns NULL if the stream could not be created.
+ */
+Stream
+stream_reader(int fd, size_t buffer_size, Budget budget);
+
+/*
+ * Copies size bytes of data into the stream, waiting for the thread to finish writing the other
+ * buffer if this one fills up.
+ * Returns zero if the data was taken.
+ * Returns STREAM_ARG_INVALID if the stream isn't a writer.
+ * Returns STREAM_IO_ERROR if an earlier write to fd failed.
+ */
+int
+stream_write(Stream stream, const void* data, size_t size);
+
+/*
+ * Copies the next size bytes of the stream into data, waiting for the thread to read more if they
+ * aren't in the buffer yet.
+ * Returns zero if the bytes were read.
+ * Returns STREAM_ARG_INVALID if the stream isn't a reader.
+ * Returns STREAM_END if fd ended first, what there was of the bytes is in data.
+ * Returns STREAM_IO_ERROR if fd could not be read.
+ */
+int
+stream_read(Stream stream, void* data, size_t size);
+
+/*
+ * Writes out what is left in a writer, stops the stream's thread and frees the stream, sets the
+ * reference to NULL. A reader's thread is stopped even if it is waiting on fd. fd is not closed.
+ * Returns zero if every byte given to a writer was written, or the stream is a reader.
+ * Returns STREAM_IO_ERROR if a write failed.
+ */
+int
+stream_close(Stream* stream);
+
+#endif
@@ -1,20 +1,473 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "budget.h"
+#include "cache.h"
+#include "hash.h"
+#include "page.h"
+
+#define TABLE_ARG_INVALID -1
+#define TABLE_KEY_EXISTS -2
+#define TABLE_KEY_NOT_FOUND -3
+#define TABLE_NO_MEMORY -4
+#define TABLE_IO_ERROR -5
+#define TABLE_CORRUPT -6
+
+#define TABLE_MAX_SHARDS (256)
+
+/*
+ * Frames of a table with direct_io set, see TableConfig. A shard pins at most a few pages at once.
+ */
+#define TABLE_DEFAULT_FRAMES (1024)
+#define TABLE_MIN_SHARD_FRAMES (4)
+
+/*
+ * Flags for table_export.
+ */
+#define TABLE_EXPORT_COMPRESS (1)
+
 typedef struct table* Table;
 
 /*
- * Returns a table with the given name.
+ * How a table lays out its records.
+ * Records are record_size bytes and keyed by their first key_size bytes, on pages of page_size
+ * bytes, at most MAX_PAGE_SIZE.
+ * Each of the n_shards shards is an independent linear hash with its own latch, the shard of a key
+ * is picked by the high bits of its hash so it doesn't affect which bucket the key lands in.
+ * If n_fields is non-zero, records are made of fields of field_sizes which must add up to
+ * record_size. Pages in the pax layout store each field separately, which makes table_filter on a
+ * field read only that field.
+ * If cache_size is non-zero, up to that many frequently read records are cached in front of the
+ * shards so lookups on hot keys don't touch the pages or the shard latch.
+ * If path is set, the pages live in that file, mapped into memory and used in place, and the kernel
+ * decides which of them stay in memory. The file is created if it doesn't exist, otherwise the
+ * table in it is opened without reading its pages. page_size must then be a multiple of 512.
+ * If direct_io is set as well, the pages live in a page file at path instead, and only n_frames
+ * of them are in memory at a time, in frames charged to the table's memory budget. The file is
+ * read and written with O_DIRECT where the file system allows, so pages aren't cached by the
+ * kernel too, and dirty pages reach it when they are evicted or the table is flushed. n_frames is
+ * TABLE_DEFAULT_FRAMES if zero and at least TABLE_MIN_SHARD_FRAMES per shard. The file must not
+ * exist, it is scratch space that is gone once the table is freed and can't be opened again.
+ * If memory_limit is non-zero, the table may use at most that many bytes of heap, see
+ * table_memory_used. Every table's memory also counts against budget_global().
+ */
+typedef struct table_config
+{
+    size_t      record_size;
+    size_t      key_size;
+    int         n_fields;
+    size_t      field_sizes[PAGE_MAX_FIELDS];
+    size_t      page_size;
+    int         n_shards;
+    HashType    hash;
+    uint64_t    seed;
+    size_t      cache_size;
+    char*       path;
+    size_t      memory_limit;
+    int         direct_io;
+    size_t      n_frames;
+} TableConfig;
+
+/*
+ * Operations that can be run with table_submit or table_execute.
+ */
+typedef enum table_op
+{
+    TABLE_OP_INSERT,
+    TABLE_OP_LOOKUP,
+    TABLE_OP_UPDATE,
+    TABLE_OP_DELETE,
+    TABLE_OP_UPSERT,
+    TABLE_OP_RMW
+} TableOp;
+
+/*
+ * Called by table_rmw with the record for a key, see lhash_rmw. It runs with the key's shard
+ * latched and must not use the table.
+ */
+typedef int (*TableRmwFn)(void* record, int exists, void* ctx);
+
+/*
+ * A request for table_submit or table_execute.
+ * For inserts, updates and upserts record is the new record, otherwise key is the key and lookups
+ * copy the record into record. Read-modify-writes call rmw with rmw_ctx.
+ * done is called once result is set, from the shard's worker thread if the request was submitted.
+ */
+typedef struct table_request
+{
+    TableOp                 op;
+    void*                   key;
+    void*                   record;
+    TableRmwFn              rmw;
+    void*                   rmw_ctx;
+    int                     result;
+    void                    (*done)(struct table_request* request, void* ctx);
+    void*                   ctx;
+    struct table_request*   next;
+} TableRequest;
+
+/*
+ * Called once per record by table_scan, returning non-zero stops the scan.
+ */
+typedef int (*TableScanFn)(void* record, void* ctx);
+
+/*
+ * How far a scan with table_scan_from has got. Zeroed, it starts a scan, done is set once the scan
+ * has visited every shard.
+ */
+typedef struct table_scan_cursor
+{
+    int         shard;
+    uint64_t    position;
+    int         done;
+} TableScanCursor;
+
+/*
+ * Called once per page by table_morsel.
+ */
+typedef void (*TablePageFn)(Page page, void* ctx);
+
+/*
+ * Returns the default config: 128 byte records keyed by their first 8 bytes, on 4096 byte pages,
+ * in a single shard hashed with HASH_FAST and a zero seed, without a cache.
+ */
+TableConfig
+table_default_config(void);
+
+/*
+ * Returns a table with the given name and the default config.
  * Returns NULL if the table couldn't be created.
  */
 Table
 table_create(char* name);
 
 /*
- * Frees the memory associated with the table.
+ * Returns a table with the given name that hashes keys with the given hash function and seed.
+ * Pass hash_random_seed() as the seed if the keys come from untrusted sources.
+ * Returns NULL if the table couldn't be created.
+ */
+Table
+table_create_with_hash(char* name, HashType type, uint64_t seed);
+
+/*
+ * Returns a table with the given name and config.
+ * Returns NULL if the table couldn't be created.
+ */
+Table
+table_create_with_config(char* name, TableConfig config);
+
+/*
+ * Opens the table stored in the file at path, with the config it was created with.
+ * Returns NULL if the file could not be opened or doesn't hold a table.
+ */
+Table
+table_open(char* name, char* path);
+
+/*
+ * Writes a table backed by a file out to it and waits for the writes to complete. A file is only
+ * consistent after a flush, which table_free also does.
+ * Returns zero if the table was flushed, or has no file.
+ * Returns TABLE_IO_ERROR if the file could not be written.
+ */
+int
+table_flush(Table table);
+
+/*
+ * Gives back the space records deleted since the table was at its largest still hold.
+ * Deletes already merge buckets as the table empties, one at a time; this catches up on the rest,
+ * fits each shard's directory to its buckets and, for a table backed by a file, moves pages
+ * towards the start of the file and truncates the free space at its end.
+ * Shards are compacted one at a time while the others keep serving requests.
+ * Returns zero if the table was compacted.
+ * Returns TABLE_NO_MEMORY if buckets could not be merged, the table is still valid.
+ * Returns TABLE_IO_ERROR if the file could not be truncated.
+ */
+int
+table_compact(Table table);
+
+/*
+ * Frees the memory associated with the table, stopping its workers if they were started.
+ * A backup still running is abandoned and its file removed.
+ * A table backed by a file is flushed and the file closed.
  * TODO: should the table commit before doing this?
  */
 void
 table_free(Table table);
 
+/*
+ * Returns the hash of key using the table's hash function and seed.
+ */
+uint64_t
+table_hash(Table table, const void* key, size_t len);
+
+/*
+ * Adds the record to the table.
+ * Returns zero if the record was added.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_KEY_EXISTS if a record with the same key is already in the table.
+ * Returns TABLE_NO_MEMORY if there was no memory for the record or the table or the process is at
+ * its memory limit.
+ */
+int
+table_insert(Table table, void* record);
+
+/*
+ * Copies the record with the given key into out.
+ * Returns zero if the record was found.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_KEY_NOT_FOUND if no record has that key.
+ */
+int
+table_lookup(Table table, void* key, void* out);
+
+/*
+ * Replaces the record that has the same key as record.
+ * Returns zero if the record was replaced.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_KEY_NOT_FOUND if no record has that key.
+ */
+int
+table_update(Table table, void* record);
+
+/*
+ * Deletes the record with the given key.
+ * Returns zero if the record was deleted.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_KEY_NOT_FOUND if no record has that key.
+ */
+int
+table_delete(Table table, void* key);
+
+/*
+ * Replaces the record that has the same key as record, or adds it if there is none, finding the
+ * key's slot once.
+ * Returns zero if the record was stored.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_NO_MEMORY if the record was new and there was no memory for it.
+ */
+int
+table_upsert(Table table, void* record);
+
+/*
+ * Calls fn on the record with the given key, or on a new zeroed record holding just the key, and
+ * stores what fn leaves in it, all under the shard latch with the key's slot found once.
+ * Returns zero if the record was stored.
+ * Returns the value fn returned if it was non-zero, the table is left as it was then.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid or fn changed the key.
+ * Returns TABLE_NO_MEMORY if the record was new and there was no memory for it.
+ */
+int
+table_rmw(Table table, void* key, TableRmwFn fn, void* ctx);
+
+/*
+ * Runs the requests on the calling thread, setting each request's result and then calling its done
+ * callback if it has one.
+ * Requests are grouped by shard and then by bucket, so each shard is latched once and each bucket's
+ * pages are probed together. Requests on the same key still run in the order given.
+ * Returns zero if the requests were run.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_NO_MEMORY if the batch could not be sorted, in which case nothing was run.
+ */
+int
+table_execute(Table table, TableRequest* requests, int n_requests);
+
+/*
+ * Calls fn on every record in every shard until it returns non-zero.
+ * Each shard is latched while it is scanned, the table as a whole is not.
+ * Returns the value fn stopped on, zero if every record was visited or TABLE_ARG_INVALID.
+ */
+int
+table_scan(Table table, TableScanFn fn, void* ctx);
+
+/*
+ * Calls fn on the records of at most n_buckets buckets of one shard, carrying on from cursor, and
+ * moves cursor past them.
+ * The shard is only latched during the call, so a long scan can be done a few buckets at a time
+ * while the table changes: records in the table for the whole scan are visited exactly once and
+ * any others at most once, see lhash_scan_from.
+ * Returns the value fn stopped on, cursor is then left on the bucket it stopped in.
+ * Returns zero if the buckets were visited, TABLE_ARG_INVALID or TABLE_IO_ERROR.
+ */
+int
+table_scan_from(Table table, TableScanCursor* cursor, size_t n_buckets, TableScanFn fn,
+    void* ctx);
+
+/*
+ * Calls fn on every record whose width bytes at offset equal value until it returns non-zero.
+ * Returns the value fn stopped on, zero if every match was visited or TABLE_ARG_INVALID.
+ */
+int
+table_filter(Table table, size_t offset, size_t width, const void* value, TableScanFn fn,
+    void* ctx);
+
+/*
+ * Returns the number of records in the table.
+ */
+size_t
+table_count(Table table);
+
+/*
+ * Returns the size of the table's records.
+ */
+size_t
+table_record_size(Table table);
+
+/*
+ * Latches every shard of the table, so its pages can be read a morsel at a time by many threads
+ * at once while writers wait. Nothing else may be called on the table until table_unlatch.
+ */
+void
+table_latch(Table table);
+
+/*
+ * Releases the latches taken by table_latch.
+ */
+void
+table_unlatch(Table table);
+
+/*
+ * Returns the number of morsels the table's pages are split into, a morsel being a run of a few
+ * buckets of one shard. The table must be latched with table_latch.
+ */
+size_t
+table_n_morsels(Table table);
+
+/*
+ * Calls fn on every page of the given morsel. The table must be latched with table_latch, morsels
+ * may be read from any number of threads at once.
+ * Returns zero if every page of the morsel was visited.
+ * Returns TABLE_IO_ERROR if a page could not be read from the table's page file.
+ */
+int
+table_morsel(Table table, size_t morsel, TablePageFn fn, void* ctx);
+
+/*
+ * Starts an online backup of the table to a new table file at path, which table_open can open.
+ * The backup holds the table as it was when this call returned: every shard is latched just long
+ * enough to list its pages. A thread then writes them out at no more than rate_limit bytes per
+ * second, or as fast as it can if rate_limit is zero, while requests keep running. A write to a
+ * page that isn't backed up yet first copies it aside, once, and the copy is written instead.
+ * The copies are charged to the table's memory budget, if one is refused the backup fails.
+ * The table's page_size must be a multiple of 512 and it can't have direct_io set. Only one backup
+ * of a table runs at a time.
+ * Returns zero if the backup was started.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid, path exists or a backup is running.
+ * Returns TABLE_NO_MEMORY if the backup could not be started.
+ * Returns TABLE_IO_ERROR if the file could not be created.
+ */
+int
+table_backup(Table table, const char* path, size_t rate_limit);
+
+/*
+ * Waits for the table's backup to finish.
+ * Returns zero if the backup is complete and synced to its file.
+ * Returns TABLE_ARG_INVALID if no backup was started.
+ * Returns TABLE_NO_MEMORY if a page could not be copied aside, the file is removed.
+ * Returns TABLE_IO_ERROR if the file could not be written, the file is removed.
+ */
+int
+table_backup_wait(Table table);
+
+/*
+ * Streams the table's records to fd a page at a time, in a binary format table_import reads on any
+ * host of the same byte order. Each page's records go out in a block with a CRC32C of its own; with
+ * TABLE_EXPORT_COMPRESS each byte is also encoded against the same byte of the record before it,
+ * which shrinks records that repeat their neighbours' fields or padding.
+ * Whatever the table's size, the export only holds a bucket's records and two fixed size buffers,
+ * charged to the table's memory budget, while a thread of its own writes one buffer as the other
+ * fills. A shard is only latched while a bucket is copied out of it, never while the export waits
+ * on fd, and goes on splitting and merging buckets meanwhile, the export keeps its place as
+ * table_scan_from does. A record that is in the table throughout is exported once, one added or
+ * deleted meanwhile may or may not be; use table_backup for a copy of the whole table as of one
+ * moment.
+ * Returns zero if the table was exported.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid.
+ * Returns TABLE_NO_MEMORY if the buffers could not be allocated.
+ * Returns TABLE_IO_ERROR if fd could not be written.
+ */
+int
+table_export(Table table, int fd, int flags);
+
+/*
+ * Reads an export written by table_export from fd into the table, which must be empty and have
+ * the same record_size, key_size and fields as the exported table. Its shards, hash, seed, page
+ * size and file may all differ.
+ * Each shard's directory is first grown to the size the exported records need, so adding the
+ * records splits no bucket, though each is still searched for the record's key. Only a page of
+ * records and two fixed size buffers are held, while a thread of its own
+ * reads ahead into one buffer as the other is emptied, so fd may have been read past the end of
+ * the export. Every shard is latched until the import is done.
+ * Returns zero if the table was imported.
+ * Returns TABLE_ARG_INVALID if the given arguments are invalid, the table isn't empty or its
+ * records aren't laid out like the exported ones.
+ * Returns TABLE_NO_MEMORY if there was no memory for the buffers or the records.
+ * Returns TABLE_IO_ERROR if fd could not be read.
+ * Returns TABLE_CORRUPT if fd doesn't hold a whole export, a checksum doesn't match, the
+ * exported pages are larger than MAX_PAGE_SIZE or a key was exported twice.
+ * The table keeps what was imported before an error.
+ */
+int
+table_import(Table table, int fd);
+
+/*
+ * Returns the number of shards in the table.
+ */
+int
+table_n_shards(Table table);
+
+/*
+ * Returns the shard that key belongs to.
+ */
+int
+table_shard_of(Table table, void* key);
+
+/*
+ * Returns the counters of the table's record cache, all zero if it has none.
+ */
+CacheStats
+table_cache_stats(Table table);
+
+/*
+ * Returns the bytes of heap the table is using: its pages, directories, cache and bookkeeping.
+ * Each shard draws its memory from the table's budget in batches, and what it has drawn but not
+ * yet used, at most 32 KB, counts too. table_compact gives that back.
+ * Pages of a table backed by a file are in the file's mapping and aren't counted, the kernel
+ * decides how much of them is in memory.
+ */
+size_t
+table_memory_used(Table table);
+
+/*
+ * Sets the table's memory limit, zero meaning no limit of its own. Memory already in use isn't
+ * given back, but inserts fail until the table is back under the limit.
+ */
+void
+table_set_memory_limit(Table table, size_t limit);
+
+/*
+ * Starts one worker thread per shard, each draining its shard's request queue.
+ * If pin is non-zero, the workers are pinned round-robin to the cpus the process may run on.
+ * Returns zero if the workers were started.
+ * Returns TABLE_ARG_INVALID if the workers are already running.
+ * Returns TABLE_NO_MEMORY if a thread could not be created.
+ */
+int
+table_start_workers(Table table, int pin);
+
+/*
+ * Stops the workers, waiting for every queued request to complete first.
+ */
+void
+table_stop_workers(Table table);
+
+/*
+ * Queues the request on its key's shard, it will be run by that shard's worker.
+ * Returns zero if the request was queued.
+ * Returns TABLE_ARG_INVALID if the workers aren't running or the request is invalid.
+ */
+int
+table_submit(Table table, TableRequest* request);
+
 #endif
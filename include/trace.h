@@ -0,0 +1,113 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_IO_ERROR -1
+#define TRACE_NO_MEMORY -2
+
+#define TRACE_RING_SIZE (1 << 14)
+
+/*
+ * Per operation latency tracing, for finding out what the slowest operations were and why.
+ * Built with -Dtracing=true, the engine records every traced operation into a ring buffer of the
+ * calling thread, which only that thread writes so recording takes no latch and no atomic
+ * read-modify-write. A ring keeps the last TRACE_RING_SIZE - 1 operations of its thread, the slot
+ * after them is the one the next operation is written to. Rings live as long as the process and
+ * aren't charged to budget_global().
+ * Built without it, TRACE_START and TRACE compile to nothing and the engine records nothing. The
+ * functions below are there either way.
+ */
+
+typedef enum trace_op
+{
+    TRACE_PAGE_ADD,
+    TRACE_PAGE_DELETE,
+    TRACE_LOOKUP,
+    TRACE_SPLIT,
+    TRACE_FAULT,
+    TRACE_FLUSH,
+    TRACE_N_OPS
+} TraceOp;
+
+/*
+ * A traced operation. Times are in nanoseconds of CLOCK_MONOTONIC.
+ * id is the page's address for page operations and lookups, the bucket being split for splits, the
+ * page number for faults and flushes of a page in a file and zero for flushes of a whole file.
+ * A fault is a page file reading a page into a frame, or a mapped file bringing in a page slot
+ * the first time it is handed out.
+ * probes is the number of records compared by a delete and of pages read by a lookup or split.
+ */
+typedef struct trace_event
+{
+    uint64_t    start;
+    uint64_t    duration;
+    uint64_t    id;
+    uint32_t    probes;
+    uint32_t    op;
+} TraceEvent;
+
+#ifdef EZDB_TRACING
+#define TRACE_START(start) uint64_t start = trace_now()
+#define TRACE(op, start, id, probes) trace_record((op), (start), (id), (probes))
+#else
+#define TRACE_START(start)
+#define TRACE(op, start, id, probes) ((void)0)
+#endif
+
+/*
+ * Returns non-zero if the engine was built to record operations.
+ */
+int
+trace_enabled(void);
+
+/*
+ * Returns the current time in nanoseconds of CLOCK_MONOTONIC.
+ */
+uint64_t
+trace_now(void);
+
+/*
+ * Records an operation that started at start and ends now into the calling thread's ring.
+ * Nothing is recorded if the ring could not be allocated.
+ */
+void
+trace_record(TraceOp op, uint64_t start, uint64_t id, uint32_t probes);
+
+/*
+ * Forgets every operation recorded so far.
+ */
+void
+trace_clear(void);
+
+/*
+ * Returns the name of op as it appears in dumps.
+ */
+const char*
+trace_op_name(TraceOp op);
+
+/*
+ * Writes the operations in the rings to fd as Chrome trace event JSON, which chrome://tracing and
+ * Perfetto open. Each ring is a thread of the process.
+ * Operations may be recorded meanwhile, those that overwrite the part of a ring being read are
+ * left out.
+ * Returns zero if the trace was written.
+ * Returns TRACE_NO_MEMORY if a ring could not be copied.
+ * Returns TRACE_IO_ERROR if fd could not be written.
+ */
+int
+trace_write_chrome(int fd);
+
+/*
+ * Writes a latency histogram of each operation in the rings to fd as text: its count, its 50th,
+ * 90th, 99th and 99.9th percentile and maximum, and how many took up to each power of two
+ * nanoseconds. Percentiles are accurate to within an eighth.
+ * Returns zero if the histograms were written.
+ * Returns TRACE_NO_MEMORY if a ring could not be copied.
+ * Returns TRACE_IO_ERROR if fd could not be written.
+ */
+int
+trace_write_histograms(int fd);
+
+#endif
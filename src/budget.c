@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include "budget.h"
+
+/*
+ * Charges are made with atomic adds up the tree, a charge that takes a budget over its limit is
+ * taken back off every budget it was added to. Two charges racing for the last bytes may both be
+ * refused, neither is ever let through over the limit.
+ *
+ * A batched budget stops the walk up the tree: held is what it has charged to its parent, and a
+ * charge it has room for in held is only added to used. When used outgrows held, a batch is
+ * charged to the parent, and when held is more than two batches past used, all but one batch is
+ * given back.
+ * Giving back lowers held before it looks at used, and a charge raises used before it looks at
+ * held, so at least one of them sees the other. The charge then tops held up again, or the
+ * give-back puts held back.
+ */
+
+#define CACHE_LINE_SIZE (64)
+
+struct budget
+{
+    struct budget*  parent;
+    size_t          limit;
+    size_t          batch;
+    size_t          used;
+    size_t          held;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct budget global = {0};
+
+static Budget create(Budget parent, size_t limit, size_t batch);
+static Budget or_global(Budget budget);
+static int charge(Budget budget, size_t size);
+static void uncharge(Budget budget, size_t size);
+static int top_up(Budget budget, size_t used);
+static void give_back(Budget budget, size_t keep);
+
+Budget
+budget_global(void)
+{
+    return &global;
+}
+
+Budget
+budget_create(Budget parent, size_t limit)
+{
+    return create(parent, limit, 0);
+}
+
+Budget
+budget_create_batched(Budget parent, size_t limit, size_t batch)
+{
+    return batch == 0 ? NULL : create(parent, limit, batch);
+}
+
+void
+budget_free(Budget* budget)
+{
+    if (budget == NULL || *budget == NULL || *budget == &global) {
+        return;
+    }
+
+    Budget b = *budget;
+    uncharge(b->parent, __atomic_load_n(b->batch != 0 ? &b->held : &b->used, __ATOMIC_SEQ_CST));
+    free(b);
+    *budget = NULL;
+}
+
+void
+budget_set_limit(Budget budget, size_t limit)
+{
+    __atomic_store_n(&or_global(budget)->limit, limit, __ATOMIC_RELAXED);
+}
+
+size_t
+budget_limit(Budget budget)
+{
+    return __atomic_load_n(&or_global(budget)->limit, __ATOMIC_RELAXED);
+}
+
+size_t
+budget_used(Budget budget)
+{
+    return __atomic_load_n(&or_global(budget)->used, __ATOMIC_RELAXED);
+}
+
+int
+budget_reserve(Budget budget, size_t size)
+{
+    return charge(or_global(budget), size);
+}
+
+void
+budget_release(Budget budget, size_t size)
+{
+    uncharge(or_global(budget), size);
+}
+
+void
+budget_trim(Budget budget)
+{
+    budget = or_global(budget);
+    if (budget->batch != 0) {
+        give_back(budget, 0);
+    }
+}
+
+void*
+budget_alloc(Budget budget, size_t size)
+{
+    if (budget_reserve(budget, size) != 0) {
+        return NULL;
+    }
+
+    void* ptr = malloc(size);
+    if (ptr == NULL) {
+        budget_release(budget, size);
+    }
+
+    return ptr;
+}
+
+void*
+budget_calloc(Budget budget, size_t n, size_t size)
+{
+    if (budget_reserve(budget, n * size) != 0) {
+        return NULL;
+    }
+
+    void* ptr = calloc(n, size);
+    if (ptr == NULL) {
+        budget_release(budget, n * size);
+    }
+
+    return ptr;
+}
+
+void*
+budget_realloc(Budget budget, void* ptr, size_t old_size, size_t new_size)
+{
+    /* realloc may free ptr and return NULL or a pointer of its own for zero bytes. */
+    if (new_size == 0) {
+        budget_dealloc(budget, ptr, old_size);
+        return NULL;
+    }
+
+    if (new_size > old_size && budget_reserve(budget, new_size - old_size) != 0) {
+        return NULL;
+    }
+
+    void* new = realloc(ptr, new_size);
+    if (new == NULL && new_size > old_size) {
+        budget_release(budget, new_size - old_size);
+    } else if (new != NULL && new_size < old_size) {
+        budget_release(budget, old_size - new_size);
+    }
+
+    return new;
+}
+
+void
+budget_dealloc(Budget budget, void* ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    free(ptr);
+    budget_release(budget, size);
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static Budget
+create(Budget parent, size_t limit, size_t batch)
+{
+    Budget budget;
+    if (posix_memalign((void**)&budget, CACHE_LINE_SIZE, sizeof(*budget)) != 0) {
+        return NULL;
+    }
+
+    budget->parent = or_global(parent);
+    budget->limit = limit;
+    budget->batch = batch;
+    budget->used = 0;
+    budget->held = 0;
+
+    return budget;
+}
+
+static Budget
+or_global(Budget budget)
+{
+    return budget == NULL ? &global : budget;
+}
+
+/*
+ * Adds size bytes to the budget and, up to the first batched one, every budget above it.
+ * Returns zero if the bytes were charged.
+ * Returns BUDGET_EXCEEDED if a budget would go over its limit, nothing is charged then.
+ */
+static int
+charge(Budget budget, size_t size)
+{
+    size_t used = __atomic_add_fetch(&budget->used, size, __ATOMIC_SEQ_CST);
+    size_t limit = __atomic_load_n(&budget->limit, __ATOMIC_RELAXED);
+    int result = limit != 0 && used > limit ? BUDGET_EXCEEDED : 0;
+
+    if (result == 0 && budget->parent != NULL) {
+        result = budget->batch != 0 ? top_up(budget, used) : charge(budget->parent, size);
+    }
+    if (result != 0) {
+        __atomic_sub_fetch(&budget->used, size, __ATOMIC_SEQ_CST);
+    }
+
+    return result;
+}
+
+/*
+ * Takes size bytes off the budget and, up to the first batched one, every budget above it.
+ */
+static void
+uncharge(Budget budget, size_t size)
+{
+    for (Budget b = budget; b != NULL; b = b->parent) {
+        __atomic_sub_fetch(&b->used, size, __ATOMIC_SEQ_CST);
+        if (b->batch != 0) {
+            give_back(b, b->batch);
+            return;
+        }
+    }
+}
+
+/*
+ * Charges a batched budget's parent until what the budget holds covers used, a batch at a time
+ * while the parent has room for it and only what is missing once it hasn't.
+ * Returns zero if used is covered.
+ * Returns BUDGET_EXCEEDED if the parent refused what was missing.
+ */
+static int
+top_up(Budget budget, size_t used)
+{
+    size_t held = __atomic_load_n(&budget->held, __ATOMIC_SEQ_CST);
+    while (used > held) {
+        size_t missing = used - held;
+        size_t size = (missing + budget->batch - 1) / budget->batch * budget->batch;
+        if (charge(budget->parent, size) != 0) {
+            size = missing;
+            if (charge(budget->parent, size) != 0) {
+                return BUDGET_EXCEEDED;
+            }
+        }
+        held = __atomic_add_fetch(&budget->held, size, __ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+/*
+ * Gives a batched budget's parent back what the budget holds past used and keep bytes, once that
+ * is more than a batch, or anything at all if keep is zero.
+ */
+static void
+give_back(Budget budget, size_t keep)
+{
+    size_t held = __atomic_load_n(&budget->held, __ATOMIC_SEQ_CST);
+    size_t used = __atomic_load_n(&budget->used, __ATOMIC_SEQ_CST);
+    if (held <= used + keep + (keep != 0 ? budget->batch : 0)) {
+        return;
+    }
+
+    /* Another give-back or a top up got in first, the next one looks again. */
+    size_t size = held - used - keep;
+    if (!__atomic_compare_exchange_n(&budget->held, &held, held - size, 0, __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    /* A charge that came in since may have counted on what was held. */
+    if (__atomic_load_n(&budget->used, __ATOMIC_SEQ_CST) > held - size) {
+        __atomic_add_fetch(&budget->held, size, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    uncharge(budget->parent, size);
+}
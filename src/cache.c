@@ -0,0 +1,408 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/*
+ * Each stripe is a chained hash table over a fixed array of entries. Free entries are kept on a
+ * list threaded through next, in use entries are chained off heads.
+ *
+ * Admission uses a count-min sketch of recent accesses: SKETCH_DEPTH rows of small saturating
+ * counters, all halved once the stripe has seen SAMPLE_FACTOR accesses per entry so that old
+ * popularity fades.
+ */
+
+#define MAX_STRIPES (64)
+#define SKETCH_DEPTH (4)
+#define MAX_COUNT (15)
+#define SAMPLE_FACTOR (10)
+#define SKETCH_WIDTH_FACTOR (8)
+#define NO_ENTRY (-1)
+#define CACHE_LINE_SIZE (64)
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0xd6e8feb86659fd93ull,
+};
+
+struct entry
+{
+    uint64_t    hash;
+    int         next;
+    char        referenced;
+};
+
+struct stripe
+{
+    pthread_mutex_t latch;
+    int             n_entries;
+    int             n_used;
+    int             n_heads;
+    int             free;
+    int             hand;
+    int*            heads;
+    struct entry*   entries;
+    char*           records;
+
+    int             sketch_width;
+    uint8_t*        sketch;
+    size_t          n_accesses;
+
+    CacheStats      stats;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct cache
+{
+    size_t          record_size;
+    size_t          key_size;
+    int             n_stripes;
+    struct stripe*  stripes;
+    size_t          memory;
+};
+
+static int create_stripe(struct stripe* stripe, int n_entries, size_t record_size);
+static void free_stripe(struct stripe* stripe);
+static struct stripe* stripe_for(Cache cache, uint64_t hash);
+static char* record_of(Cache cache, struct stripe* stripe, int entry);
+static int find(Cache cache, struct stripe* stripe, uint64_t hash, const void* key);
+static void link_entry(struct stripe* stripe, int entry, uint64_t hash);
+static void unlink_entry(struct stripe* stripe, int entry);
+static int clock_victim(struct stripe* stripe);
+static int sketch_index(struct stripe* stripe, int row, uint64_t hash);
+static void sketch_add(struct stripe* stripe, uint64_t hash);
+static int sketch_estimate(struct stripe* stripe, uint64_t hash);
+static int next_power_of_two(int n);
+
+Cache
+cache_create(size_t capacity, size_t record_size, size_t key_size)
+{
+    if (capacity == 0 || record_size == 0 || key_size == 0 || key_size > record_size) {
+        return NULL;
+    }
+
+    Cache cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->record_size = record_size;
+    cache->key_size = key_size;
+
+    /* Small caches get fewer stripes so every stripe has a reasonable number of entries. */
+    cache->n_stripes = MAX_STRIPES;
+    while (cache->n_stripes > 1 && capacity / cache->n_stripes < 16) {
+        cache->n_stripes /= 2;
+    }
+
+    void* stripes;
+    if (posix_memalign(&stripes, CACHE_LINE_SIZE, cache->n_stripes * sizeof(struct stripe)) != 0) {
+        free(cache);
+        return NULL;
+    }
+    cache->stripes = memset(stripes, 0, cache->n_stripes * sizeof(struct stripe));
+    cache->memory = sizeof(*cache) + cache->n_stripes * sizeof(struct stripe);
+
+    for (int i = 0; i < cache->n_stripes; i++) {
+        int n_entries = capacity / cache->n_stripes + ((size_t)i < capacity % cache->n_stripes);
+        if (create_stripe(&cache->stripes[i], n_entries, record_size) != 0) {
+            cache->n_stripes = i + 1;
+            cache_free(&cache);
+            return NULL;
+        }
+        struct stripe* stripe = &cache->stripes[i];
+        cache->memory += stripe->n_heads * sizeof(*stripe->heads)
+            + n_entries * (sizeof(*stripe->entries) + record_size)
+            + SKETCH_DEPTH * stripe->sketch_width * sizeof(*stripe->sketch);
+    }
+
+    return cache;
+}
+
+void
+cache_free(Cache* cache)
+{
+    if (cache == NULL || *cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < (*cache)->n_stripes; i++) {
+        free_stripe(&(*cache)->stripes[i]);
+    }
+
+    free((*cache)->stripes);
+    free(*cache);
+    *cache = NULL;
+}
+
+int
+cache_get(Cache cache, uint64_t hash, const void* key, void* out)
+{
+    if (cache == NULL || key == NULL || out == NULL) {
+        return CACHE_ARG_INVALID;
+    }
+
+    struct stripe* stripe = stripe_for(cache, hash);
+
+    pthread_mutex_lock(&stripe->latch);
+    sketch_add(stripe, hash);
+
+    int entry = find(cache, stripe, hash, key);
+    if (entry == NO_ENTRY) {
+        stripe->stats.misses++;
+        pthread_mutex_unlock(&stripe->latch);
+        return CACHE_MISS;
+    }
+
+    stripe->entries[entry].referenced = 1;
+    memcpy(out, record_of(cache, stripe, entry), cache->record_size);
+    stripe->stats.hits++;
+    pthread_mutex_unlock(&stripe->latch);
+
+    return 0;
+}
+
+int
+cache_put(Cache cache, uint64_t hash, const void* record)
+{
+    if (cache == NULL || record == NULL) {
+        return CACHE_ARG_INVALID;
+    }
+
+    struct stripe* stripe = stripe_for(cache, hash);
+
+    pthread_mutex_lock(&stripe->latch);
+
+    int entry = find(cache, stripe, hash, record);
+    if (entry == NO_ENTRY && stripe->free != NO_ENTRY) {
+        entry = stripe->free;
+        stripe->free = stripe->entries[entry].next;
+        stripe->n_used++;
+        link_entry(stripe, entry, hash);
+    } else if (entry == NO_ENTRY) {
+        int victim = clock_victim(stripe);
+        if (sketch_estimate(stripe, hash) <= sketch_estimate(stripe, stripe->entries[victim].hash)) {
+            stripe->stats.rejections++;
+            pthread_mutex_unlock(&stripe->latch);
+            return CACHE_MISS;
+        }
+
+        unlink_entry(stripe, victim);
+        link_entry(stripe, victim, hash);
+        stripe->stats.evictions++;
+        entry = victim;
+    }
+
+    stripe->entries[entry].referenced = 1;
+    memcpy(record_of(cache, stripe, entry), record, cache->record_size);
+    pthread_mutex_unlock(&stripe->latch);
+
+    return 0;
+}
+
+void
+cache_invalidate(Cache cache, uint64_t hash, const void* key)
+{
+    if (cache == NULL || key == NULL) {
+        return;
+    }
+
+    struct stripe* stripe = stripe_for(cache, hash);
+
+    pthread_mutex_lock(&stripe->latch);
+    int entry = find(cache, stripe, hash, key);
+    if (entry != NO_ENTRY) {
+        unlink_entry(stripe, entry);
+        stripe->entries[entry].next = stripe->free;
+        stripe->free = entry;
+        stripe->n_used--;
+    }
+    pthread_mutex_unlock(&stripe->latch);
+}
+
+CacheStats
+cache_stats(Cache cache)
+{
+    CacheStats stats = {0};
+    if (cache == NULL) {
+        return stats;
+    }
+
+    stats.memory = cache->memory;
+
+    for (int i = 0; i < cache->n_stripes; i++) {
+        struct stripe* stripe = &cache->stripes[i];
+        pthread_mutex_lock(&stripe->latch);
+        stats.hits += stripe->stats.hits;
+        stats.misses += stripe->stats.misses;
+        stats.entries += stripe->n_used;
+        stats.evictions += stripe->stats.evictions;
+        stats.rejections += stripe->stats.rejections;
+        pthread_mutex_unlock(&stripe->latch);
+    }
+
+    return stats;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static int
+create_stripe(struct stripe* stripe, int n_entries, size_t record_size)
+{
+    pthread_mutex_init(&stripe->latch, NULL);
+    stripe->n_entries = n_entries;
+    stripe->n_heads = next_power_of_two(n_entries);
+    stripe->sketch_width = next_power_of_two(n_entries * SKETCH_WIDTH_FACTOR);
+
+    stripe->heads = malloc(stripe->n_heads * sizeof(*stripe->heads));
+    stripe->entries = malloc(n_entries * sizeof(*stripe->entries));
+    stripe->records = malloc(n_entries * record_size);
+    stripe->sketch = calloc(SKETCH_DEPTH * stripe->sketch_width, sizeof(*stripe->sketch));
+    if (stripe->heads == NULL || stripe->entries == NULL || stripe->records == NULL
+        || stripe->sketch == NULL) {
+        return CACHE_ARG_INVALID;
+    }
+
+    for (int i = 0; i < stripe->n_heads; i++) {
+        stripe->heads[i] = NO_ENTRY;
+    }
+
+    for (int i = 0; i < n_entries; i++) {
+        stripe->entries[i].next = i + 1 < n_entries ? i + 1 : NO_ENTRY;
+        stripe->entries[i].referenced = 0;
+    }
+    stripe->free = 0;
+
+    return 0;
+}
+
+static void
+free_stripe(struct stripe* stripe)
+{
+    pthread_mutex_destroy(&stripe->latch);
+    free(stripe->heads);
+    free(stripe->entries);
+    free(stripe->records);
+    free(stripe->sketch);
+}
+
+/*
+ * The table uses the low bits of the hash for buckets and the top bits for shards, the middle bits
+ * pick the stripe.
+ */
+static struct stripe*
+stripe_for(Cache cache, uint64_t hash)
+{
+    return &cache->stripes[(hash >> 24) & (cache->n_stripes - 1)];
+}
+
+static char*
+record_of(Cache cache, struct stripe* stripe, int entry)
+{
+    return stripe->records + (size_t)entry * cache->record_size;
+}
+
+static int
+find(Cache cache, struct stripe* stripe, uint64_t hash, const void* key)
+{
+    int entry = stripe->heads[hash & (stripe->n_heads - 1)];
+    while (entry != NO_ENTRY) {
+        if (stripe->entries[entry].hash == hash
+            && memcmp(record_of(cache, stripe, entry), key, cache->key_size) == 0) {
+            return entry;
+        }
+        entry = stripe->entries[entry].next;
+    }
+
+    return NO_ENTRY;
+}
+
+static void
+link_entry(struct stripe* stripe, int entry, uint64_t hash)
+{
+    int* head = &stripe->heads[hash & (stripe->n_heads - 1)];
+
+    stripe->entries[entry].hash = hash;
+    stripe->entries[entry].next = *head;
+    *head = entry;
+}
+
+static void
+unlink_entry(struct stripe* stripe, int entry)
+{
+    int* link = &stripe->heads[stripe->entries[entry].hash & (stripe->n_heads - 1)];
+    while (*link != entry) {
+        link = &stripe->entries[*link].next;
+    }
+
+    *link = stripe->entries[entry].next;
+}
+
+/*
+ * Sweeps the clock hand over the entries, giving referenced entries a second chance.
+ * Only called when the stripe is full, so every entry is in use.
+ */
+static int
+clock_victim(struct stripe* stripe)
+{
+    for (;;) {
+        int entry = stripe->hand;
+        stripe->hand = (stripe->hand + 1) % stripe->n_entries;
+
+        if (!stripe->entries[entry].referenced) {
+            return entry;
+        }
+        stripe->entries[entry].referenced = 0;
+    }
+}
+
+static int
+sketch_index(struct stripe* stripe, int row, uint64_t hash)
+{
+    uint64_t h = (hash ^ (hash >> 29)) * sketch_seeds[row];
+    return row * stripe->sketch_width + (int)((h >> 32) & (stripe->sketch_width - 1));
+}
+
+static void
+sketch_add(struct stripe* stripe, uint64_t hash)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t* count = &stripe->sketch[sketch_index(stripe, row, hash)];
+        if (*count < MAX_COUNT) {
+            (*count)++;
+        }
+    }
+
+    if (++stripe->n_accesses >= (size_t)SAMPLE_FACTOR * stripe->n_entries) {
+        for (int i = 0; i < SKETCH_DEPTH * stripe->sketch_width; i++) {
+            stripe->sketch[i] /= 2;
+        }
+        stripe->n_accesses /= 2;
+    }
+}
+
+static int
+sketch_estimate(struct stripe* stripe, uint64_t hash)
+{
+    int estimate = MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int count = stripe->sketch[sketch_index(stripe, row, hash)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+
+    return estimate;
+}
+
+static int
+next_power_of_two(int n)
+{
+    int power = 1;
+    while (power < n) {
+        power *= 2;
+    }
+
+    return power;
+}
@@ -0,0 +1,781 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "table.h"
+#include "trace.h"
+
+/*
+ * ezdbd serves one table over a unix domain socket.
+ *
+ * Everything runs on one epoll loop. Each time a connection is readable, every complete request in
+ * its buffer is parsed and handed to table_execute as a single batch, so a pipelining client gets
+ * one shard latch per shard and one probe per bucket for the whole batch, and one write() for all
+ * the responses.
+ *
+ * A scan is sent in chunks of at most PROTOCOL_SCAN_CHUNK_SIZE bytes of records, SCAN_BUCKETS
+ * buckets each time round the loop, with the shard latched only while they are copied out. It
+ * carries on when the client can take more output, and only while less than MAX_BUFFERED bytes are
+ * waiting, so a client that stops reading holds up nothing but itself. Requests sent after a scan
+ * wait for it to finish.
+ */
+
+#define MAX_EVENTS (64)
+#define READ_SIZE (64 * 1024)
+#define MAX_BUFFERED (16 * 1024 * 1024)
+#define SCAN_BUCKETS (64)
+
+struct buffer
+{
+    char*   data;
+    size_t  start;
+    size_t  len;
+    size_t  max_len;
+};
+
+/*
+ * A scan on its way out. chunk_at is where the open chunk's header goes, relative to the start of
+ * the output. Only the output before it is written while the chunk is open.
+ */
+struct scan_ctx
+{
+    int                 running;
+    TableScanCursor     cursor;
+    size_t              record_size;
+    uint32_t            id;
+    size_t              chunk_at;
+    size_t              chunk_len;
+    struct buffer*      out;
+};
+
+struct connection
+{
+    int             fd;
+    int             events;
+    struct buffer   in;
+    struct buffer   out;
+    struct scan_ctx scan;
+};
+
+struct server
+{
+    Table           table;
+    size_t          record_size;
+    size_t          key_size;
+    int             listen_fd;
+    int             epoll_fd;
+
+    /* Reused between batches so that steady state pipelining doesn't allocate. */
+    TableRequest*   requests;
+    ProtocolHeader* headers;
+    char*           records;
+    int             max_requests;
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_requested = 0;
+
+static void usage(char* name);
+static void stop(int signal);
+static void request_dump(int signal);
+static void dump_trace(char* path);
+static int listen_on(char* path);
+static int accept_connections(struct server* server);
+static void close_connection(struct server* server, struct connection* conn);
+static int read_requests(struct server* server, struct connection* conn);
+static int process_requests(struct server* server, struct connection* conn);
+static int run_batch(struct server* server, struct connection* conn, int n_requests);
+static int run_info(struct server* server, struct connection* conn, ProtocolHeader* header);
+static int start_scan(struct server* server, struct connection* conn, ProtocolHeader* header);
+static int continue_scan(struct server* server, struct connection* conn);
+static int open_chunk(struct scan_ctx* scan);
+static void close_chunk(struct scan_ctx* scan, ProtocolStatus status);
+static int add_request(struct server* server, int n_requests, ProtocolHeader* header, char* payload);
+static int payload_is_valid(struct server* server, ProtocolHeader* header);
+static int write_responses(struct server* server, struct connection* conn);
+static int watch(struct server* server, struct connection* conn, int events);
+static int append(struct buffer* buffer, const void* data, size_t len);
+static int reserve(struct buffer* buffer, size_t len);
+static int append_record(void* record, void* ctx);
+
+int
+main(int argc, char** argv)
+{
+    TableConfig config = table_default_config();
+    char* trace_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:k:p:s:c:f:m:t:")) != -1) {
+        switch (opt) {
+        case 'r':
+            config.record_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.key_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            config.page_size = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.n_shards = atoi(optarg);
+            break;
+        case 'c':
+            config.cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            config.path = optarg;
+            break;
+        case 'm':
+            config.memory_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char* path = argv[optind];
+
+    if (trace_path != NULL && !trace_enabled()) {
+        fprintf(stderr, "ezdbd: built without tracing, -t is ignored\n");
+        trace_path = NULL;
+    }
+
+    /* Responses carry a record in a message whose length is a u32. */
+    if (config.record_size > UINT32_MAX) {
+        fprintf(stderr, "ezdbd: record_size must fit in 32 bits\n");
+        return EXIT_FAILURE;
+    }
+
+    struct server server = {
+        .record_size = config.record_size,
+        .key_size = config.key_size,
+    };
+
+    server.table = table_create_with_config("ezdbd", config);
+    if (server.table == NULL) {
+        fprintf(stderr, "ezdbd: invalid table config\n");
+        return EXIT_FAILURE;
+    }
+
+    server.listen_fd = listen_on(path);
+    if (server.listen_fd < 0) {
+        perror("ezdbd: listen");
+        table_free(server.table);
+        return EXIT_FAILURE;
+    }
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (server.epoll_fd < 0
+        || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_event) != 0) {
+        perror("ezdbd: epoll");
+        if (server.epoll_fd >= 0) {
+            close(server.epoll_fd);
+        }
+        close(server.listen_fd);
+        unlink(path);
+        table_free(server.table);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = { .sa_handler = stop };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (trace_path != NULL) {
+        struct sigaction dump_action = { .sa_handler = request_dump };
+        sigaction(SIGUSR1, &dump_action, NULL);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_trace(trace_path);
+        }
+
+        int n_events = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+        if (n_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ezdbd: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n_events; i++) {
+            struct connection* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(&server);
+                continue;
+            }
+
+            int failed = events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN);
+            if (!failed && events[i].events & EPOLLIN) {
+                failed = read_requests(&server, conn) != 0;
+            }
+            if (!failed && conn->scan.running) {
+                failed = continue_scan(&server, conn) != 0;
+            }
+            if (!failed) {
+                failed = write_responses(&server, conn) != 0;
+            }
+            if (failed) {
+                close_connection(&server, conn);
+            }
+        }
+    }
+
+    if (trace_path != NULL) {
+        dump_trace(trace_path);
+    }
+
+    close(server.listen_fd);
+    close(server.epoll_fd);
+    unlink(path);
+    free(server.requests);
+    free(server.headers);
+    free(server.records);
+    table_free(server.table);
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(char* name)
+{
+    fprintf(stderr, "usage: %s [-r record_size] [-k key_size] [-p page_size] [-s shards] "
+        "[-c cached_records] [-f file] [-m memory_limit] [-t trace_file] socket\n", name);
+}
+
+static void
+stop(int signal)
+{
+    (void)signal;
+    running = 0;
+}
+
+static void
+request_dump(int signal)
+{
+    (void)signal;
+    dump_requested = 1;
+}
+
+/*
+ * Writes the operations traced so far to path as Chrome trace events and their latency histograms
+ * to stderr.
+ */
+static void
+dump_trace(char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || trace_write_chrome(fd) != 0) {
+        perror("ezdbd: trace");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    trace_write_histograms(STDERR_FILENO);
+}
+
+static int
+listen_on(char* path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+accept_connections(struct server* server)
+{
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        struct connection* conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->events = EPOLLIN;
+    }
+}
+
+static void
+close_connection(struct server* server, struct connection* conn)
+{
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+/*
+ * Reads until the socket is drained and then runs everything that arrived.
+ * Returns non-zero if the connection should be closed.
+ */
+static int
+read_requests(struct server* server, struct connection* conn)
+{
+    for (;;) {
+        if (reserve(&conn->in, READ_SIZE) != 0) {
+            return -1;
+        }
+
+        ssize_t n = read(conn->fd, conn->in.data + conn->in.start + conn->in.len, READ_SIZE);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        conn->in.len += n;
+
+        /* Don't let one connection hog the loop. */
+        if (n < READ_SIZE || conn->in.len >= MAX_BUFFERED) {
+            break;
+        }
+    }
+
+    return process_requests(server, conn);
+}
+
+/*
+ * Parses every complete request in the input buffer, batching them up until an info or scan, which
+ * aren't table requests and must be answered after the requests before them, or the end of the
+ * buffer. Parsing stops at a scan until it has been sent.
+ */
+static int
+process_requests(struct server* server, struct connection* conn)
+{
+    int n_requests = 0;
+    ProtocolHeader header;
+
+    while (conn->in.len >= PROTOCOL_HEADER_SIZE && !conn->scan.running) {
+        long size = protocol_read_header(conn->in.data + conn->in.start, conn->in.len, &header);
+
+        /* Checked before the payload arrives so a bad length can't make us buffer forever. */
+        if (!payload_is_valid(server, &header)) {
+            return -1;
+        }
+        if (size == PROTOCOL_INCOMPLETE) {
+            break;
+        }
+
+        char* payload = conn->in.data + conn->in.start + PROTOCOL_HEADER_SIZE;
+
+        if (header.code == PROTOCOL_OP_INFO || header.code == PROTOCOL_OP_SCAN) {
+            if (run_batch(server, conn, n_requests) != 0
+                || (header.code == PROTOCOL_OP_INFO ? run_info(server, conn, &header)
+                    : start_scan(server, conn, &header)) != 0) {
+                return -1;
+            }
+            n_requests = 0;
+        } else if (add_request(server, n_requests, &header, payload) == 0) {
+            n_requests++;
+        } else {
+            return -1;
+        }
+
+        /*
+         * The payloads stay in the input buffer until the batch has run, only the start moves.
+         */
+        conn->in.start += size;
+        conn->in.len -= size;
+    }
+
+    if (run_batch(server, conn, n_requests) != 0) {
+        return -1;
+    }
+
+    if (conn->in.len == 0) {
+        conn->in.start = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs the batched requests and queues their responses in order.
+ */
+static int
+run_batch(struct server* server, struct connection* conn, int n_requests)
+{
+    if (n_requests == 0) {
+        return 0;
+    }
+
+    table_execute(server->table, server->requests, n_requests);
+
+    for (int i = 0; i < n_requests; i++) {
+        TableRequest* request = &server->requests[i];
+        ProtocolHeader response = { .length = 0, .id = server->headers[i].id };
+        char buf[PROTOCOL_HEADER_SIZE];
+
+        response.code = protocol_status(request->result);
+        if (request->op == TABLE_OP_LOOKUP && request->result == 0) {
+            response.length = server->record_size;
+        }
+        protocol_write_header(buf, response);
+        if (append(&conn->out, buf, PROTOCOL_HEADER_SIZE) != 0
+            || append(&conn->out, request->record, response.length) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+run_info(struct server* server, struct connection* conn, ProtocolHeader* header)
+{
+    ProtocolHeader response = { .length = 8, .code = PROTOCOL_OK, .id = header->id };
+    char buf[PROTOCOL_HEADER_SIZE + 8];
+
+    protocol_write_header(buf, response);
+    protocol_write_u32(buf + PROTOCOL_HEADER_SIZE, server->record_size);
+    protocol_write_u32(buf + PROTOCOL_HEADER_SIZE + 4, server->key_size);
+
+    return append(&conn->out, buf, sizeof(buf));
+}
+
+/*
+ * Starts sending every record in chunks, followed by an empty message carrying the scan's status,
+ * see continue_scan.
+ */
+static int
+start_scan(struct server* server, struct connection* conn, ProtocolHeader* header)
+{
+    struct scan_ctx* scan = &conn->scan;
+    memset(scan, 0, sizeof(*scan));
+    scan->record_size = server->record_size;
+    scan->id = header->id;
+    scan->out = &conn->out;
+    if (open_chunk(scan) != 0) {
+        return -1;
+    }
+    scan->running = 1;
+
+    return 0;
+}
+
+/*
+ * Sends the records of the next SCAN_BUCKETS buckets unless the client already has MAX_BUFFERED
+ * bytes of output waiting. Once the scan is over the requests that came after it are run.
+ * Returns non-zero if the connection should be closed.
+ */
+static int
+continue_scan(struct server* server, struct connection* conn)
+{
+    struct scan_ctx* scan = &conn->scan;
+    if (conn->out.len >= MAX_BUFFERED) {
+        return 0;
+    }
+
+    int result = table_scan_from(server->table, &scan->cursor, SCAN_BUCKETS, append_record, scan);
+    if (result > 0) {
+        return -1;
+    }
+    if (result == 0 && !scan->cursor.done) {
+        return 0;
+    }
+
+    /* The open chunk becomes the last message if it is empty, otherwise one more is sent. */
+    if (scan->chunk_len > 0) {
+        close_chunk(scan, PROTOCOL_OK);
+        if (open_chunk(scan) != 0) {
+            return -1;
+        }
+    }
+    close_chunk(scan, protocol_status(result));
+    scan->running = 0;
+
+    return process_requests(server, conn);
+}
+
+/*
+ * Starts a chunk with a placeholder header, filled in when it is closed.
+ */
+static int
+open_chunk(struct scan_ctx* scan)
+{
+    struct buffer* out = scan->out;
+    if (reserve(out, PROTOCOL_HEADER_SIZE) != 0) {
+        return -1;
+    }
+
+    scan->chunk_at = out->len;
+    scan->chunk_len = 0;
+    out->len += PROTOCOL_HEADER_SIZE;
+
+    return 0;
+}
+
+static void
+close_chunk(struct scan_ctx* scan, ProtocolStatus status)
+{
+    struct buffer* out = scan->out;
+    ProtocolHeader response = { .length = scan->chunk_len, .code = status, .id = scan->id };
+    protocol_write_header(out->data + out->start + scan->chunk_at, response);
+}
+
+static int
+add_request(struct server* server, int n_requests, ProtocolHeader* header, char* payload)
+{
+    if (n_requests == server->max_requests) {
+        int max_requests = server->max_requests == 0 ? 64 : server->max_requests * 2;
+        TableRequest* requests = realloc(server->requests, max_requests * sizeof(*requests));
+        if (requests == NULL) {
+            return -1;
+        }
+        server->requests = requests;
+
+        ProtocolHeader* headers = realloc(server->headers, max_requests * sizeof(*headers));
+        if (headers == NULL) {
+            return -1;
+        }
+        server->headers = headers;
+
+        char* records = realloc(server->records, max_requests * server->record_size);
+        if (records == NULL) {
+            return -1;
+        }
+        server->records = records;
+        server->max_requests = max_requests;
+
+        /* Lookups that were already added point into the old records. */
+        for (int i = 0; i < n_requests; i++) {
+            if (server->requests[i].op == TABLE_OP_LOOKUP) {
+                server->requests[i].record = server->records + i * server->record_size;
+            }
+        }
+    }
+
+    TableRequest* request = &server->requests[n_requests];
+    memset(request, 0, sizeof(*request));
+    server->headers[n_requests] = *header;
+
+    switch (header->code) {
+    case PROTOCOL_OP_INSERT:
+        request->op = TABLE_OP_INSERT;
+        request->record = payload;
+        break;
+    case PROTOCOL_OP_UPDATE:
+        request->op = TABLE_OP_UPDATE;
+        request->record = payload;
+        break;
+    case PROTOCOL_OP_UPSERT:
+        request->op = TABLE_OP_UPSERT;
+        request->record = payload;
+        break;
+    case PROTOCOL_OP_LOOKUP:
+        request->op = TABLE_OP_LOOKUP;
+        request->key = payload;
+        request->record = server->records + n_requests * server->record_size;
+        break;
+    case PROTOCOL_OP_DELETE:
+        request->op = TABLE_OP_DELETE;
+        request->key = payload;
+        break;
+    }
+
+    return 0;
+}
+
+static int
+payload_is_valid(struct server* server, ProtocolHeader* header)
+{
+    switch (header->code) {
+    case PROTOCOL_OP_INFO:
+    case PROTOCOL_OP_SCAN:
+        return header->length == 0;
+    case PROTOCOL_OP_INSERT:
+    case PROTOCOL_OP_UPDATE:
+    case PROTOCOL_OP_UPSERT:
+        return header->length == server->record_size;
+    case PROTOCOL_OP_LOOKUP:
+    case PROTOCOL_OP_DELETE:
+        return header->length == server->key_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes as much pending output as the socket takes, and only asks epoll about writability while
+ * there is output left or a scan to carry on with. A client that stops reading, or is being sent
+ * a scan, stops being read from.
+ */
+static int
+write_responses(struct server* server, struct connection* conn)
+{
+    /* An open chunk's header is only filled in when it is closed. */
+    size_t len = conn->scan.running ? conn->scan.chunk_at : conn->out.len;
+
+    while (len > 0) {
+        ssize_t n = write(conn->fd, conn->out.data + conn->out.start, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        conn->out.start += n;
+        conn->out.len -= n;
+        len -= n;
+        if (conn->scan.running) {
+            conn->scan.chunk_at -= n;
+        }
+    }
+
+    if (conn->out.len == 0) {
+        conn->out.start = 0;
+    }
+
+    int events = conn->out.len > 0 || conn->scan.running ? EPOLLOUT : 0;
+    if (conn->out.len < MAX_BUFFERED && !conn->scan.running) {
+        events |= EPOLLIN;
+    }
+
+    return watch(server, conn, events);
+}
+
+static int
+watch(struct server* server, struct connection* conn, int events)
+{
+    if (events == conn->events) {
+        return 0;
+    }
+
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0) {
+        return -1;
+    }
+    conn->events = events;
+
+    return 0;
+}
+
+static int
+append(struct buffer* buffer, const void* data, size_t len)
+{
+    if (reserve(buffer, len) != 0) {
+        return -1;
+    }
+
+    memcpy(buffer->data + buffer->start + buffer->len, data, len);
+    buffer->len += len;
+
+    return 0;
+}
+
+/*
+ * Makes room for len more bytes after the buffer's contents, first by sliding the contents back to
+ * the start of the buffer and then by growing it.
+ */
+static int
+reserve(struct buffer* buffer, size_t len)
+{
+    if (buffer->start + buffer->len + len <= buffer->max_len) {
+        return 0;
+    }
+
+    if (buffer->start > 0 && buffer->len + len <= buffer->max_len) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->len);
+        buffer->start = 0;
+        return 0;
+    }
+
+    size_t max_len = buffer->max_len == 0 ? READ_SIZE : buffer->max_len;
+    while (max_len < buffer->start + buffer->len + len) {
+        max_len *= 2;
+    }
+
+    char* data = realloc(buffer->data, max_len);
+    if (data == NULL) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->max_len = max_len;
+
+    return 0;
+}
+
+/*
+ * Adds the record to the open chunk, closing it first if the record would take it past
+ * PROTOCOL_SCAN_CHUNK_SIZE.
+ */
+static int
+append_record(void* record, void* ctx)
+{
+    struct scan_ctx* scan = ctx;
+
+    if (scan->chunk_len > 0 && scan->chunk_len + scan->record_size > PROTOCOL_SCAN_CHUNK_SIZE) {
+        close_chunk(scan, PROTOCOL_OK);
+        if (open_chunk(scan) != 0) {
+            return 1;
+        }
+    }
+
+    if (append(scan->out, record, scan->record_size) != 0) {
+        return 1;
+    }
+    scan->chunk_len += scan->record_size;
+
+    return 0;
+}
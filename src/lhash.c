@@ -0,0 +1,1104 @@
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "lhash.h"
+#include "page.h"
+#include "trace.h"
+
+/*
+ * A bucket is a primary page followed by its overflow pages, kept in an array rather than a linked
+ * list so a probe walks contiguous memory.
+ * The directory holds 2^level + split buckets. A hash is first taken modulo 2^level, and if that
+ * lands on a bucket that has already been split this round, modulo 2^(level + 1).
+ * When deletes take the load below MIN_LOAD_FACTOR the last split is undone, the last bucket is
+ * merged back into the one it was split from. The gap between the two factors keeps a table near
+ * either of them from splitting and merging the same bucket over and over.
+ */
+
+#define MAX_LOAD_FACTOR (0.8)
+#define MIN_LOAD_FACTOR (0.3)
+#define MIN_BUCKETS (4)
+
+struct bucket
+{
+    Page*   pages;
+    int     n_pages;
+    int     max_pages;
+};
+
+struct lhash
+{
+    size_t          page_size;
+    int             n_fields;
+    size_t          field_sizes[PAGE_MAX_FIELDS];
+    size_t          record_size;
+    size_t          key_size;
+    int             page_capacity;
+    HashFn          hash;
+    uint64_t        seed;
+
+    int             level;
+    size_t          split;
+    size_t          n_buckets;
+    size_t          max_buckets;
+    struct bucket*  buckets;
+
+    size_t          n_records;
+    size_t          n_pages;
+    char*           scratch;
+    int*            matches;
+
+    int             has_store;
+    LHashStore      store;
+    Budget          budget;
+
+    LHashWriteFn    on_write;
+    void*           on_write_ctx;
+};
+
+static size_t address(LHash lhash, uint64_t hash);
+static uint64_t reverse_bits(uint64_t x);
+static int find(LHash lhash, struct bucket* bucket, void* key, int* page_id, Page* page);
+static Page pin(LHash lhash, Page page);
+static void unpin(LHash lhash, Page page, int dirty);
+static void before_write(LHash lhash, Page page);
+static int append(LHash lhash, struct bucket* bucket, void* record);
+static int add_record(LHash lhash, struct bucket* bucket, void* record);
+static int add_page(LHash lhash, struct bucket* bucket, Page* page);
+static void release_page(LHash lhash, Page* page);
+static void free_bucket(LHash lhash, struct bucket* bucket);
+static void free_chain(LHash lhash, struct bucket* bucket);
+static int grow_directory(LHash lhash, size_t min_buckets);
+static void set_level(LHash lhash);
+static void shrink_directory(LHash lhash);
+static void shrink_chain(LHash lhash, struct bucket* bucket);
+static int should_split(LHash lhash);
+static int split(LHash lhash);
+static int should_merge(LHash lhash);
+static int merge(LHash lhash);
+
+LHash
+lhash_create(size_t page_size, size_t record_size, size_t key_size, HashFn hash, uint64_t seed)
+{
+    return lhash_create_with_fields(page_size, 1, &record_size, key_size, hash, seed);
+}
+
+LHash
+lhash_create_with_fields(size_t page_size, int n_fields, const size_t* field_sizes,
+    size_t key_size, HashFn hash, uint64_t seed)
+{
+    return lhash_create_with_store(page_size, n_fields, field_sizes, key_size, hash, seed, NULL,
+        NULL);
+}
+
+LHash
+lhash_create_with_store(size_t page_size, int n_fields, const size_t* field_sizes,
+    size_t key_size, HashFn hash, uint64_t seed, const LHashStore* store, Budget budget)
+{
+    if (hash == NULL || field_sizes == NULL || !(0 < n_fields && n_fields <= PAGE_MAX_FIELDS)) {
+        return NULL;
+    }
+
+    if (store != NULL && ((store->pin == NULL) != (store->unpin == NULL)
+            || (store->pin != NULL && store->move != NULL))) {
+        return NULL;
+    }
+
+    size_t record_size = 0;
+    for (int i = 0; i < n_fields; i++) {
+        record_size += field_sizes[i];
+    }
+
+    if (key_size == 0 || key_size > record_size || page_capacity(page_size, record_size) == 0) {
+        return NULL;
+    }
+
+    LHash lhash = budget_calloc(budget, 1, sizeof(*lhash));
+    if (lhash == NULL) {
+        return NULL;
+    }
+
+    lhash->page_size = page_size;
+    lhash->n_fields = n_fields;
+    memcpy(lhash->field_sizes, field_sizes, n_fields * sizeof(*field_sizes));
+    lhash->record_size = record_size;
+    lhash->key_size = key_size;
+    lhash->page_capacity = page_capacity(page_size, record_size);
+    lhash->hash = hash;
+    lhash->seed = seed;
+    lhash->budget = budget;
+    if (store != NULL) {
+        lhash->has_store = 1;
+        lhash->store = *store;
+    }
+    lhash->n_buckets = 1;
+    lhash->max_buckets = MIN_BUCKETS;
+    lhash->buckets = budget_calloc(budget, lhash->max_buckets, sizeof(*lhash->buckets));
+    lhash->scratch = budget_alloc(budget, record_size);
+    lhash->matches = budget_alloc(budget, lhash->page_capacity * sizeof(*lhash->matches));
+    if (lhash->buckets == NULL || lhash->scratch == NULL || lhash->matches == NULL) {
+        lhash_free(&lhash);
+        return NULL;
+    }
+
+    return lhash;
+}
+
+int
+lhash_restore(LHash lhash, size_t n_buckets, size_t n_records, const LHashPageRef* pages,
+    size_t n_pages)
+{
+    if (lhash == NULL || !lhash->has_store || lhash->n_pages > 0 || n_buckets == 0
+        || (pages == NULL && n_pages > 0)) {
+        return LHASH_ARG_INVALID;
+    }
+
+    if (grow_directory(lhash, n_buckets) != 0) {
+        return LHASH_NO_MEMORY;
+    }
+    lhash->n_buckets = n_buckets;
+
+    /* Size every chain first so the pages can be put in place whatever order they come in. */
+    int result = 0;
+    for (size_t i = 0; i < n_pages && result == 0; i++) {
+        if (pages[i].bucket >= n_buckets || pages[i].position < 0 || pages[i].page == NULL) {
+            result = LHASH_ARG_INVALID;
+        } else if (pages[i].position >= lhash->buckets[pages[i].bucket].max_pages) {
+            lhash->buckets[pages[i].bucket].max_pages = pages[i].position + 1;
+        }
+    }
+
+    for (size_t i = 0; i < n_buckets && result == 0; i++) {
+        struct bucket* bucket = &lhash->buckets[i];
+        if (bucket->max_pages > 0) {
+            bucket->pages = budget_calloc(lhash->budget, bucket->max_pages,
+                sizeof(*bucket->pages));
+            if (bucket->pages == NULL) {
+                result = LHASH_NO_MEMORY;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n_pages && result == 0; i++) {
+        struct bucket* bucket = &lhash->buckets[pages[i].bucket];
+        if (bucket->pages[pages[i].position] != NULL) {
+            result = LHASH_ARG_INVALID;
+        } else {
+            bucket->pages[pages[i].position] = pages[i].page;
+            bucket->n_pages++;
+        }
+    }
+
+    for (size_t i = 0; i < n_buckets && result == 0; i++) {
+        if (lhash->buckets[i].n_pages != lhash->buckets[i].max_pages) {
+            result = LHASH_ARG_INVALID;
+        }
+    }
+
+    if (result != 0) {
+        /* The pages belong to the store, only the chains are undone. */
+        for (size_t i = 0; i < n_buckets; i++) {
+            free_chain(lhash, &lhash->buckets[i]);
+        }
+        lhash->n_buckets = 1;
+        return result;
+    }
+
+    set_level(lhash);
+    lhash->n_records = n_records;
+    lhash->n_pages = n_pages;
+
+    return 0;
+}
+
+int
+lhash_reserve(LHash lhash, size_t n_records)
+{
+    if (lhash == NULL || lhash->n_records > 0) {
+        return LHASH_ARG_INVALID;
+    }
+
+    size_t n_buckets = (size_t)(n_records / (MAX_LOAD_FACTOR * lhash->page_capacity)) + 1;
+    if (n_buckets <= lhash->n_buckets) {
+        return 0;
+    }
+
+    /* Nothing is stored, so no record has to move to the buckets that now exist. */
+    if (grow_directory(lhash, n_buckets) != 0) {
+        return LHASH_NO_MEMORY;
+    }
+    lhash->n_buckets = n_buckets;
+    set_level(lhash);
+
+    return 0;
+}
+
+void
+lhash_watch_writes(LHash lhash, LHashWriteFn fn, void* ctx)
+{
+    if (lhash == NULL || lhash->store.pin != NULL) {
+        return;
+    }
+
+    lhash->on_write = fn;
+    lhash->on_write_ctx = ctx;
+}
+
+void
+lhash_free(LHash* lhash)
+{
+    if (lhash == NULL || *lhash == NULL) {
+        return;
+    }
+
+    /* Pages from a store outlive the linear hash, only the chains are freed. */
+    if ((*lhash)->buckets != NULL) {
+        for (size_t i = 0; i < (*lhash)->n_buckets; i++) {
+            if ((*lhash)->has_store) {
+                free_chain(*lhash, &(*lhash)->buckets[i]);
+            } else {
+                free_bucket(*lhash, &(*lhash)->buckets[i]);
+            }
+        }
+    }
+
+    Budget budget = (*lhash)->budget;
+    budget_dealloc(budget, (*lhash)->buckets, (*lhash)->max_buckets * sizeof(struct bucket));
+    budget_dealloc(budget, (*lhash)->scratch, (*lhash)->record_size);
+    budget_dealloc(budget, (*lhash)->matches, (*lhash)->page_capacity * sizeof(int));
+    budget_dealloc(budget, *lhash, sizeof(**lhash));
+    *lhash = NULL;
+}
+
+int
+lhash_insert(LHash lhash, uint64_t hash, void* record)
+{
+    if (lhash == NULL || record == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int record_id = find(lhash, bucket, record, NULL, NULL);
+    if (record_id != LHASH_KEY_NOT_FOUND) {
+        return record_id >= 0 ? LHASH_KEY_EXISTS : record_id;
+    }
+
+    return add_record(lhash, bucket, record);
+}
+
+int
+lhash_lookup(LHash lhash, uint64_t hash, void* key, void* out)
+{
+    if (lhash == NULL || key == NULL || out == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    TRACE_START(start);
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int page_id;
+    Page page;
+    int record_id = find(lhash, bucket, key, &page_id, &page);
+    if (record_id < 0) {
+        TRACE(TRACE_LOOKUP, start, 0, bucket->n_pages);
+        return record_id;
+    }
+
+    page_copy_record(page, record_id, out);
+    unpin(lhash, bucket->pages[page_id], 0);
+    TRACE(TRACE_LOOKUP, start, (uintptr_t)bucket->pages[page_id], page_id + 1);
+
+    return 0;
+}
+
+int
+lhash_update(LHash lhash, uint64_t hash, void* record)
+{
+    if (lhash == NULL || record == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int page_id;
+    Page page;
+    int record_id = find(lhash, bucket, record, &page_id, &page);
+    if (record_id < 0) {
+        return record_id;
+    }
+
+    before_write(lhash, page);
+    page_update_record_id(page, record_id, record);
+    unpin(lhash, bucket->pages[page_id], 1);
+
+    return 0;
+}
+
+int
+lhash_upsert(LHash lhash, uint64_t hash, void* record)
+{
+    if (lhash == NULL || record == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int page_id;
+    Page page;
+    int record_id = find(lhash, bucket, record, &page_id, &page);
+    if (record_id == LHASH_KEY_NOT_FOUND) {
+        return add_record(lhash, bucket, record);
+    }
+    if (record_id < 0) {
+        return record_id;
+    }
+
+    before_write(lhash, page);
+    page_update_record_id(page, record_id, record);
+    unpin(lhash, bucket->pages[page_id], 1);
+
+    return 0;
+}
+
+int
+lhash_rmw(LHash lhash, uint64_t hash, void* key, LHashRmwFn fn, void* ctx)
+{
+    if (lhash == NULL || key == NULL || fn == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int page_id;
+    Page page;
+    int record_id = find(lhash, bucket, key, &page_id, &page);
+    if (record_id < 0 && record_id != LHASH_KEY_NOT_FOUND) {
+        return record_id;
+    }
+
+    int exists = record_id >= 0;
+    if (exists) {
+        page_copy_record(page, record_id, lhash->scratch);
+    } else {
+        memset(lhash->scratch, 0, lhash->record_size);
+        memcpy(lhash->scratch, key, lhash->key_size);
+    }
+
+    int result = fn(lhash->scratch, exists, ctx);
+    if (result == 0 && memcmp(lhash->scratch, key, lhash->key_size) != 0) {
+        result = LHASH_ARG_INVALID;
+    }
+    if (result != 0) {
+        if (exists) {
+            unpin(lhash, bucket->pages[page_id], 0);
+        }
+        return result;
+    }
+
+    /* The slot found above is still the record's, fn couldn't have touched the table. */
+    if (!exists) {
+        return add_record(lhash, bucket, lhash->scratch);
+    }
+    before_write(lhash, page);
+    page_update_record_id(page, record_id, lhash->scratch);
+    unpin(lhash, bucket->pages[page_id], 1);
+
+    return 0;
+}
+
+int
+lhash_delete(LHash lhash, uint64_t hash, void* key)
+{
+    if (lhash == NULL || key == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    struct bucket* bucket = &lhash->buckets[address(lhash, hash)];
+    int page_id;
+    Page page;
+    int record_id = find(lhash, bucket, key, &page_id, &page);
+    if (record_id < 0) {
+        return record_id;
+    }
+
+    /*
+     * Fill the hole with the last record of the chain so that only the last page is ever partly
+     * full.
+     */
+    int last_page_id = bucket->n_pages - 1;
+    Page last = last_page_id == page_id ? page : pin(lhash, bucket->pages[last_page_id]);
+    if (last == NULL) {
+        unpin(lhash, bucket->pages[page_id], 0);
+        return LHASH_IO_ERROR;
+    }
+    int last_id = page_n_records(last) - 1;
+    before_write(lhash, last);
+    if (last != page) {
+        before_write(lhash, page);
+        page_copy_record(last, last_id, lhash->scratch);
+        page_delete_record_id(page, record_id);
+        page_add_record(page, lhash->scratch);
+        unpin(lhash, bucket->pages[page_id], 1);
+        record_id = last_id;
+    }
+    page_delete_record_id(last, record_id);
+    int emptied = page_n_records(last) == 0;
+    unpin(lhash, bucket->pages[last_page_id], 1);
+    lhash->n_records--;
+
+    /* The primary page stays even when empty, an empty overflow page is given back. */
+    if (emptied && bucket->n_pages > 1) {
+        release_page(lhash, &bucket->pages[--bucket->n_pages]);
+        lhash->n_pages--;
+    }
+
+    /* A failed merge leaves the table valid, just less loaded than we would like. */
+    if (should_merge(lhash)) {
+        merge(lhash);
+    }
+
+    return 0;
+}
+
+int
+lhash_compact(LHash lhash)
+{
+    if (lhash == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    /* Deletes merge at most one bucket each, a purge can leave the directory behind. */
+    int result = 0;
+    while (should_merge(lhash) && result == 0) {
+        result = merge(lhash);
+    }
+
+    for (size_t i = 0; i < lhash->n_buckets; i++) {
+        struct bucket* bucket = &lhash->buckets[i];
+        shrink_chain(lhash, bucket);
+
+        if (lhash->has_store && lhash->store.move != NULL) {
+            for (int p = 0; p < bucket->n_pages; p++) {
+                before_write(lhash, bucket->pages[p]);
+                Page page = lhash->store.move(lhash->store.ctx, bucket->pages[p]);
+                if (page != NULL) {
+                    bucket->pages[p] = page;
+                }
+            }
+        }
+    }
+    shrink_directory(lhash);
+
+    return result;
+}
+
+int
+lhash_scan(LHash lhash, LHashScanFn fn, void* ctx)
+{
+    if (lhash == NULL || fn == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    for (size_t i = 0; i < lhash->n_buckets; i++) {
+        struct bucket* bucket = &lhash->buckets[i];
+        for (int p = 0; p < bucket->n_pages; p++) {
+            Page page = pin(lhash, bucket->pages[p]);
+            if (page == NULL) {
+                return LHASH_IO_ERROR;
+            }
+
+            int stop = 0;
+            for (int r = 0; r < page_n_records(page) && !stop; r++) {
+                page_copy_record(page, r, lhash->scratch);
+                stop = fn(lhash->scratch, ctx);
+            }
+            unpin(lhash, bucket->pages[p], 0);
+            if (stop) {
+                return stop;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+lhash_scan_from(LHash lhash, uint64_t* cursor, size_t n_buckets, LHashScanFn fn, void* ctx)
+{
+    if (lhash == NULL || cursor == NULL || fn == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    /*
+     * A bucket holds the hashes whose low bits are its id, so reversed they are a run of the
+     * order the cursor moves in: splits only cut runs in two and merges join them back, nothing
+     * moves from ahead of the cursor to behind it. A merged bucket may reach back behind the
+     * cursor, the records from there were already visited and are skipped.
+     */
+    for (size_t n = 0; n < n_buckets && *cursor != LHASH_SCAN_END; n++) {
+        uint64_t from = *cursor;
+        size_t id = address(lhash, reverse_bits(from));
+        struct bucket* bucket = &lhash->buckets[id];
+
+        for (int p = 0; p < bucket->n_pages; p++) {
+            Page page = pin(lhash, bucket->pages[p]);
+            if (page == NULL) {
+                return LHASH_IO_ERROR;
+            }
+
+            int stop = 0;
+            for (int r = 0; r < page_n_records(page) && !stop; r++) {
+                page_copy_record(page, r, lhash->scratch);
+                uint64_t hash = lhash->hash(lhash->scratch, lhash->key_size, lhash->seed);
+                if (reverse_bits(hash) >= from) {
+                    stop = fn(lhash->scratch, ctx);
+                }
+            }
+            unpin(lhash, bucket->pages[p], 0);
+            if (stop) {
+                return stop;
+            }
+        }
+
+        /* Buckets before the split pointer and after the first 2^level use one more bit. */
+        int bits = lhash->level + (id < lhash->split || id >= (1ull << lhash->level));
+        if (bits == 0) {
+            *cursor = LHASH_SCAN_END;
+        } else {
+            uint64_t step = 1ull << (64 - bits);
+            uint64_t next = (from & ~(step - 1)) + step;
+            *cursor = next == 0 ? LHASH_SCAN_END : next;
+        }
+    }
+
+    return 0;
+}
+
+int
+lhash_filter(LHash lhash, size_t offset, size_t width, const void* value, LHashScanFn fn,
+    void* ctx)
+{
+    if (lhash == NULL || value == NULL || fn == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    for (size_t i = 0; i < lhash->n_buckets; i++) {
+        struct bucket* bucket = &lhash->buckets[i];
+
+        /*
+         * Filtering a page is quick enough that waiting for the next page to arrive from memory
+         * dominates, so ask for the next bucket's first page early. A pinned store's handles
+         * aren't memory.
+         */
+        if (i + 1 < lhash->n_buckets && lhash->buckets[i + 1].n_pages > 0
+            && lhash->store.pin == NULL) {
+            __builtin_prefetch(lhash->buckets[i + 1].pages[0]);
+        }
+
+        for (int p = 0; p < bucket->n_pages; p++) {
+            Page page = pin(lhash, bucket->pages[p]);
+            if (page == NULL) {
+                return LHASH_IO_ERROR;
+            }
+
+            int n_matches = page_match_field(page, offset, width, value, lhash->matches);
+            int stop = n_matches < 0 ? LHASH_ARG_INVALID : 0;
+            for (int m = 0; m < n_matches && !stop; m++) {
+                page_copy_record(page, lhash->matches[m], lhash->scratch);
+                stop = fn(lhash->scratch, ctx);
+            }
+            unpin(lhash, bucket->pages[p], 0);
+            if (stop) {
+                return stop;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+lhash_pages(LHash lhash, size_t first, size_t last, LHashPageFn fn, void* ctx)
+{
+    if (lhash == NULL || fn == NULL) {
+        return LHASH_ARG_INVALID;
+    }
+
+    for (size_t i = first; i < last && i < lhash->n_buckets; i++) {
+        struct bucket* bucket = &lhash->buckets[i];
+        for (int p = 0; p < bucket->n_pages; p++) {
+            Page page = pin(lhash, bucket->pages[p]);
+            if (page == NULL) {
+                return LHASH_IO_ERROR;
+            }
+            fn(page, ctx);
+            unpin(lhash, bucket->pages[p], 0);
+        }
+    }
+
+    return 0;
+}
+
+size_t
+lhash_count(LHash lhash)
+{
+    return lhash == NULL ? 0 : lhash->n_records;
+}
+
+size_t
+lhash_bucket_of(LHash lhash, uint64_t hash)
+{
+    return lhash == NULL ? 0 : address(lhash, hash);
+}
+
+size_t
+lhash_n_buckets(LHash lhash)
+{
+    return lhash == NULL ? 0 : lhash->n_buckets;
+}
+
+size_t
+lhash_n_pages(LHash lhash)
+{
+    return lhash == NULL ? 0 : lhash->n_pages;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static size_t
+address(LHash lhash, uint64_t hash)
+{
+    size_t bucket = hash & ((1ull << lhash->level) - 1);
+    if (bucket < lhash->split) {
+        bucket = hash & ((1ull << (lhash->level + 1)) - 1);
+    }
+
+    return bucket;
+}
+
+/*
+ * Returns x with the order of its bits reversed.
+ */
+static uint64_t
+reverse_bits(uint64_t x)
+{
+    x = (x >> 1 & 0x5555555555555555ull) | (x & 0x5555555555555555ull) << 1;
+    x = (x >> 2 & 0x3333333333333333ull) | (x & 0x3333333333333333ull) << 2;
+    x = (x >> 4 & 0x0f0f0f0f0f0f0f0full) | (x & 0x0f0f0f0f0f0f0f0full) << 4;
+    return __builtin_bswap64(x);
+}
+
+/*
+ * Returns the record id of key in the bucket and sets page_id to the page it is on.
+ * If page isn't NULL the page is left pinned and set to it, the caller unpins it.
+ * Returns LHASH_KEY_NOT_FOUND if the key isn't in the bucket.
+ * Returns LHASH_IO_ERROR if a page couldn't be pinned.
+ */
+static int
+find(LHash lhash, struct bucket* bucket, void* key, int* page_id, Page* page)
+{
+    for (int p = 0; p < bucket->n_pages; p++) {
+        Page pinned = pin(lhash, bucket->pages[p]);
+        if (pinned == NULL) {
+            return LHASH_IO_ERROR;
+        }
+
+        int record_id = page_find_key(pinned, key, lhash->key_size);
+        if (record_id >= 0 && page != NULL) {
+            *page = pinned;
+        } else {
+            unpin(lhash, bucket->pages[p], 0);
+        }
+        if (record_id >= 0) {
+            if (page_id != NULL) {
+                *page_id = p;
+            }
+            return record_id;
+        }
+    }
+
+    return LHASH_KEY_NOT_FOUND;
+}
+
+/*
+ * Returns the memory of a page in a chain, which is the page itself unless the store pins pages.
+ * Returns NULL if the store couldn't pin it.
+ */
+static Page
+pin(LHash lhash, Page page)
+{
+    return lhash->store.pin == NULL ? page : lhash->store.pin(lhash->store.ctx, page);
+}
+
+static void
+unpin(LHash lhash, Page page, int dirty)
+{
+    if (lhash->store.unpin != NULL) {
+        lhash->store.unpin(lhash->store.ctx, page, dirty);
+    }
+}
+
+static void
+before_write(LHash lhash, Page page)
+{
+    if (lhash->on_write != NULL) {
+        lhash->on_write(page, lhash->on_write_ctx);
+    }
+}
+
+static int
+append(LHash lhash, struct bucket* bucket, void* record)
+{
+    /* A full last page isn't written to, so it isn't reported. */
+    if (bucket->n_pages > 0) {
+        Page last = pin(lhash, bucket->pages[bucket->n_pages - 1]);
+        if (last == NULL) {
+            return LHASH_IO_ERROR;
+        }
+
+        int added = 0;
+        if (page_n_records(last) < lhash->page_capacity) {
+            before_write(lhash, last);
+            added = page_add_record(last, record) != PAGE_HAS_NO_SPACE;
+        }
+        unpin(lhash, bucket->pages[bucket->n_pages - 1], added);
+        if (added) {
+            return 0;
+        }
+    }
+
+    Page page;
+    int result = add_page(lhash, bucket, &page);
+    if (result != 0) {
+        return result;
+    }
+    page_add_record(page, record);
+    unpin(lhash, bucket->pages[bucket->n_pages - 1], 1);
+
+    return 0;
+}
+
+/*
+ * Appends a record that isn't in the bucket yet and splits if the table has become too loaded.
+ */
+static int
+add_record(LHash lhash, struct bucket* bucket, void* record)
+{
+    int result = append(lhash, bucket, record);
+    if (result != 0) {
+        return result;
+    }
+    lhash->n_records++;
+
+    /* A failed split leaves the table valid, just more loaded than we would like. */
+    if (should_split(lhash)) {
+        split(lhash);
+    }
+
+    return 0;
+}
+
+/*
+ * Adds an empty page to the end of the chain and sets page to it, pinned.
+ */
+static int
+add_page(LHash lhash, struct bucket* bucket, Page* page)
+{
+    if (bucket->n_pages == bucket->max_pages) {
+        int max_pages = bucket->max_pages == 0 ? 1 : bucket->max_pages * 2;
+        Page* pages = budget_realloc(lhash->budget, bucket->pages,
+            bucket->max_pages * sizeof(*pages), max_pages * sizeof(*pages));
+        if (pages == NULL) {
+            return LHASH_NO_MEMORY;
+        }
+        bucket->pages = pages;
+        bucket->max_pages = max_pages;
+    }
+
+    void* handle;
+    if (lhash->has_store) {
+        handle = lhash->store.alloc(lhash->store.ctx, bucket - lhash->buckets, bucket->n_pages);
+        void* memory = handle != NULL ? pin(lhash, handle) : NULL;
+        *page = page_init(memory, lhash->page_size, lhash->n_fields, lhash->field_sizes);
+        if (*page == NULL && memory != NULL) {
+            unpin(lhash, handle, 0);
+        }
+        if (*page == NULL && handle != NULL) {
+            lhash->store.release(lhash->store.ctx, handle);
+            return memory == NULL ? LHASH_IO_ERROR : LHASH_NO_MEMORY;
+        }
+    } else {
+        handle = budget_alloc(lhash->budget, lhash->page_size);
+        *page = page_init(handle, lhash->page_size, lhash->n_fields, lhash->field_sizes);
+        if (*page == NULL) {
+            budget_dealloc(lhash->budget, handle, lhash->page_size);
+        }
+    }
+    if (*page == NULL) {
+        return LHASH_NO_MEMORY;
+    }
+
+    bucket->pages[bucket->n_pages++] = handle;
+    lhash->n_pages++;
+
+    return 0;
+}
+
+static void
+release_page(LHash lhash, Page* page)
+{
+    before_write(lhash, *page);
+    if (lhash->has_store) {
+        lhash->store.release(lhash->store.ctx, *page);
+        *page = NULL;
+    } else {
+        budget_dealloc(lhash->budget, *page, lhash->page_size);
+        *page = NULL;
+    }
+}
+
+static void
+free_bucket(LHash lhash, struct bucket* bucket)
+{
+    for (int p = 0; p < bucket->n_pages; p++) {
+        release_page(lhash, &bucket->pages[p]);
+    }
+    lhash->n_pages -= bucket->n_pages;
+
+    free_chain(lhash, bucket);
+}
+
+/*
+ * Frees the bucket's array of pages, leaving the pages themselves.
+ */
+static void
+free_chain(LHash lhash, struct bucket* bucket)
+{
+    budget_dealloc(lhash->budget, bucket->pages, bucket->max_pages * sizeof(*bucket->pages));
+    memset(bucket, 0, sizeof(*bucket));
+}
+
+static int
+should_split(LHash lhash)
+{
+    return lhash->n_records > MAX_LOAD_FACTOR * lhash->n_buckets * lhash->page_capacity;
+}
+
+static int
+should_merge(LHash lhash)
+{
+    return lhash->n_buckets > 1
+        && lhash->n_records < MIN_LOAD_FACTOR * lhash->n_buckets * lhash->page_capacity;
+}
+
+/*
+ * Splits the bucket under the split pointer into itself and a new bucket at the end of the
+ * directory, then advances the split pointer.
+ */
+static int
+split(LHash lhash)
+{
+    TRACE_START(start);
+    if (grow_directory(lhash, lhash->n_buckets + 1) != 0) {
+        return LHASH_NO_MEMORY;
+    }
+
+    /*
+     * The old chain is rebuilt from scratch so both halves end up packed, the records are moved
+     * through the old pages which are then freed.
+     */
+    struct bucket old = lhash->buckets[lhash->split];
+    struct bucket* low = &lhash->buckets[lhash->split];
+    struct bucket* high = &lhash->buckets[lhash->n_buckets];
+    size_t high_id = lhash->n_buckets;
+    uint64_t mask = (1ull << (lhash->level + 1)) - 1;
+
+    memset(low, 0, sizeof(*low));
+    memset(high, 0, sizeof(*high));
+
+    for (int p = 0; p < old.n_pages; p++) {
+        Page page = pin(lhash, old.pages[p]);
+        int result = page == NULL ? LHASH_IO_ERROR : 0;
+        for (int r = 0; result == 0 && r < page_n_records(page); r++) {
+            page_copy_record(page, r, lhash->scratch);
+            uint64_t hash = lhash->hash(lhash->scratch, lhash->key_size, lhash->seed);
+            struct bucket* to = (hash & mask) == high_id ? high : low;
+            result = append(lhash, to, lhash->scratch);
+        }
+        if (page != NULL) {
+            unpin(lhash, old.pages[p], 0);
+        }
+        if (result != 0) {
+            /* Put everything back the way it was. */
+            free_bucket(lhash, low);
+            free_bucket(lhash, high);
+            *low = old;
+            return result;
+        }
+    }
+    TRACE(TRACE_SPLIT, start, lhash->split, old.n_pages);
+    free_bucket(lhash, &old);
+
+    lhash->n_buckets++;
+    lhash->split++;
+    if (lhash->split == (1ull << lhash->level)) {
+        lhash->level++;
+        lhash->split = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Undoes the last split: steps the split pointer back and appends the records of the last bucket
+ * to the bucket it was split from, then frees the last bucket.
+ * Only the last page of a chain is ever partly full, so appending keeps the merged chain packed.
+ */
+static int
+merge(LHash lhash)
+{
+    int level = lhash->level;
+    size_t split = lhash->split;
+    if (split == 0) {
+        level--;
+        split = 1ull << level;
+    }
+    split--;
+
+    struct bucket* low = &lhash->buckets[split];
+    struct bucket* high = &lhash->buckets[lhash->n_buckets - 1];
+    int n_pages = low->n_pages;
+    int n_last = 0;
+    if (n_pages > 0) {
+        Page last = pin(lhash, low->pages[n_pages - 1]);
+        if (last == NULL) {
+            return LHASH_IO_ERROR;
+        }
+        n_last = page_n_records(last);
+        unpin(lhash, low->pages[n_pages - 1], 0);
+    }
+
+    for (int p = 0; p < high->n_pages; p++) {
+        Page page = pin(lhash, high->pages[p]);
+        int result = page == NULL ? LHASH_IO_ERROR : 0;
+        for (int r = 0; result == 0 && r < page_n_records(page); r++) {
+            page_copy_record(page, r, lhash->scratch);
+            result = append(lhash, low, lhash->scratch);
+        }
+        if (page != NULL) {
+            unpin(lhash, high->pages[p], 0);
+        }
+        if (result != 0) {
+            /* Take the appended records back off the low chain. */
+            while (low->n_pages > n_pages) {
+                release_page(lhash, &low->pages[--low->n_pages]);
+                lhash->n_pages--;
+            }
+            Page last = n_pages > 0 ? pin(lhash, low->pages[n_pages - 1]) : NULL;
+            if (last != NULL) {
+                while (page_n_records(last) > n_last) {
+                    page_delete_record_id(last, page_n_records(last) - 1);
+                }
+                unpin(lhash, low->pages[n_pages - 1], 1);
+            }
+            return result;
+        }
+    }
+    free_bucket(lhash, high);
+
+    lhash->n_buckets--;
+    lhash->level = level;
+    lhash->split = split;
+    shrink_directory(lhash);
+
+    return 0;
+}
+
+/*
+ * Makes room in the directory for at least min_buckets buckets, new buckets are empty.
+ */
+static int
+grow_directory(LHash lhash, size_t min_buckets)
+{
+    size_t max_buckets = lhash->max_buckets;
+    while (max_buckets < min_buckets) {
+        max_buckets *= 2;
+    }
+
+    if (max_buckets == lhash->max_buckets) {
+        return 0;
+    }
+
+    struct bucket* buckets = budget_realloc(lhash->budget, lhash->buckets,
+        lhash->max_buckets * sizeof(*buckets), max_buckets * sizeof(*buckets));
+    if (buckets == NULL) {
+        return LHASH_NO_MEMORY;
+    }
+    memset(buckets + lhash->max_buckets, 0,
+        (max_buckets - lhash->max_buckets) * sizeof(*buckets));
+    lhash->buckets = buckets;
+    lhash->max_buckets = max_buckets;
+
+    return 0;
+}
+
+/*
+ * Sets the level and split pointer for the number of buckets in the directory, which holds
+ * 2^level + split buckets with split < 2^level.
+ */
+static void
+set_level(LHash lhash)
+{
+    lhash->level = 0;
+    while ((2ull << lhash->level) <= lhash->n_buckets) {
+        lhash->level++;
+    }
+    lhash->split = lhash->n_buckets - (1ull << lhash->level);
+}
+
+/*
+ * Halves the directory while it is at most a quarter full, so it doesn't flip between sizes when
+ * buckets are split and merged around a power of two.
+ */
+static void
+shrink_directory(LHash lhash)
+{
+    size_t max_buckets = lhash->max_buckets;
+    while (max_buckets > MIN_BUCKETS && lhash->n_buckets <= max_buckets / 4) {
+        max_buckets /= 2;
+    }
+
+    if (max_buckets == lhash->max_buckets) {
+        return;
+    }
+
+    /* Buckets past the end are empty, a failed shrink just keeps them. */
+    struct bucket* buckets = budget_realloc(lhash->budget, lhash->buckets,
+        lhash->max_buckets * sizeof(*buckets), max_buckets * sizeof(*buckets));
+    if (buckets != NULL) {
+        lhash->buckets = buckets;
+        lhash->max_buckets = max_buckets;
+    }
+}
+
+/*
+ * Fits the bucket's array of pages to the pages it holds, it is left as it was if that fails.
+ */
+static void
+shrink_chain(LHash lhash, struct bucket* bucket)
+{
+    if (bucket->n_pages == bucket->max_pages) {
+        return;
+    }
+
+    if (bucket->n_pages == 0) {
+        free_chain(lhash, bucket);
+        return;
+    }
+
+    Page* pages = budget_realloc(lhash->budget, bucket->pages,
+        bucket->max_pages * sizeof(*pages), bucket->n_pages * sizeof(*pages));
+    if (pages != NULL) {
+        bucket->pages = pages;
+        bucket->max_pages = bucket->n_pages;
+    }
+}
@@ -0,0 +1,609 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapfile.h"
+#include "trace.h"
+
+/*
+ * The file is a header followed by extents. An extent is one directory slot, holding a
+ * slot_entry for each of the page slots that follow it, and then those page slots.
+ *
+ * A large range of address space is reserved when the file is opened and the file is mapped over
+ * the start of it. Growing the file maps the new extents over the reservation right after the
+ * old end, so the mapping never has to move.
+ *
+ * Shrinking goes the other way: pages are moved out of the extents past the ones their count
+ * needs, and free extents at the end are cut off the file and handed back to the reservation.
+ */
+
+#define MAGIC (0x3150414d42445a45ull)
+#define VERSION (1)
+#define MIN_PAGE_SIZE (512)
+#define MAP_RESERVE (1ull << 38)
+#define FREE_SLOT (0)
+
+struct file_header
+{
+    uint64_t    magic;
+    uint32_t    version;
+    uint32_t    page_size;
+    uint64_t    n_extents;
+    char        meta[MAPFILE_META_SIZE];
+};
+
+/*
+ * owner is the owner id plus one, so a zeroed directory is all free slots.
+ */
+struct slot_entry
+{
+    uint16_t    owner;
+    uint16_t    position;
+    uint32_t    bucket;
+};
+
+struct mapfile
+{
+    pthread_mutex_t     latch;
+    int                 fd;
+    char*               base;
+    size_t              reserved;
+    size_t              len;
+    struct file_header* header;
+
+    size_t              page_size;
+    size_t              header_size;
+    size_t              slots_per_extent;
+    size_t              extent_size;
+
+    size_t*             free_slots;
+    size_t              n_free;
+    size_t              max_free;
+    size_t              n_used;
+    size_t              n_touched;
+};
+
+static MapFile map(int fd, size_t len, size_t page_size);
+static void set_geometry(MapFile file, size_t page_size);
+static size_t n_slots(MapFile file);
+static char* slot_page(MapFile file, size_t slot);
+static struct slot_entry* slot_entry(MapFile file, size_t slot);
+static size_t slot_of(MapFile file, void* page);
+static int push_free(MapFile file, size_t slot);
+static int grow(MapFile file);
+static size_t slots_needed(MapFile file);
+static int is_free_extent(MapFile file, size_t extent);
+static void touch(MapFile file, size_t slot);
+
+MapFile
+mapfile_create(const char* path, size_t page_size)
+{
+    if (path == NULL || page_size < MIN_PAGE_SIZE || page_size % MIN_PAGE_SIZE != 0) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct mapfile geometry;
+    set_geometry(&geometry, page_size);
+    if (ftruncate(fd, geometry.header_size) != 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    MapFile file = map(fd, geometry.header_size, page_size);
+    if (file == NULL) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    file->header->magic = MAGIC;
+    file->header->version = VERSION;
+    file->header->page_size = page_size;
+    file->header->n_extents = 0;
+
+    return file;
+}
+
+MapFile
+mapfile_open(const char* path)
+{
+    if (path == NULL) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct file_header header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0
+        || header.magic != MAGIC || header.version != VERSION
+        || header.page_size < MIN_PAGE_SIZE || header.page_size % MIN_PAGE_SIZE != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct mapfile geometry;
+    set_geometry(&geometry, header.page_size);
+    size_t len = geometry.header_size + header.n_extents * geometry.extent_size;
+    if ((size_t)st.st_size < len) {
+        close(fd);
+        return NULL;
+    }
+
+    MapFile file = map(fd, len, header.page_size);
+    if (file == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    /* The free list is given room for every slot, so releasing a page never has to allocate. */
+    file->max_free = n_slots(file);
+    file->free_slots = malloc(file->max_free * sizeof(*file->free_slots));
+    if (file->free_slots == NULL && file->max_free > 0) {
+        mapfile_close(&file);
+        return NULL;
+    }
+
+    /* Only the directory slots are read, the pages stay on disk until they are used. */
+    for (size_t slot = n_slots(file); slot-- > 0;) {
+        if (slot_entry(file, slot)->owner == FREE_SLOT) {
+            push_free(file, slot);
+        } else {
+            file->n_used++;
+        }
+    }
+
+    return file;
+}
+
+int
+mapfile_close(MapFile* file)
+{
+    if (file == NULL || *file == NULL) {
+        return MAPFILE_ARG_INVALID;
+    }
+
+    int result = mapfile_sync(*file);
+
+    munmap((*file)->base, (*file)->reserved);
+    close((*file)->fd);
+    pthread_mutex_destroy(&(*file)->latch);
+    free((*file)->free_slots);
+    free(*file);
+    *file = NULL;
+
+    return result;
+}
+
+void*
+mapfile_meta(MapFile file)
+{
+    return file == NULL ? NULL : file->header->meta;
+}
+
+size_t
+mapfile_page_size(MapFile file)
+{
+    return file == NULL ? 0 : file->page_size;
+}
+
+void*
+mapfile_alloc(MapFile file, int owner, size_t bucket, int position)
+{
+    if (file == NULL || !(0 <= owner && owner < UINT16_MAX) || bucket > UINT32_MAX
+        || !(0 <= position && position <= UINT16_MAX)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    if (file->n_free == 0 && grow(file) != 0) {
+        pthread_mutex_unlock(&file->latch);
+        return NULL;
+    }
+
+    size_t slot = file->free_slots[--file->n_free];
+    struct slot_entry* entry = slot_entry(file, slot);
+    entry->owner = owner + 1;
+    entry->position = position;
+    entry->bucket = bucket;
+    file->n_used++;
+
+    /* Lower slots are handed out first, so past the highest one so far they haven't been used. */
+    int first_use = slot >= file->n_touched;
+    if (first_use) {
+        file->n_touched = slot + 1;
+    }
+    pthread_mutex_unlock(&file->latch);
+
+    if (first_use) {
+        touch(file, slot);
+    }
+
+    return slot_page(file, slot);
+}
+
+void
+mapfile_release(MapFile file, void* page)
+{
+    if (file == NULL || page == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t slot = slot_of(file, page);
+
+    /* The free list has room for every slot, pushing can't fail here. */
+    memset(slot_entry(file, slot), 0, sizeof(struct slot_entry));
+    push_free(file, slot);
+    file->n_used--;
+    pthread_mutex_unlock(&file->latch);
+}
+
+void*
+mapfile_relocate(MapFile file, void* page)
+{
+    if (file == NULL || page == NULL) {
+        return page;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t slot = slot_of(file, page);
+    size_t needed = slots_needed(file);
+    if (slot < needed) {
+        pthread_mutex_unlock(&file->latch);
+        return page;
+    }
+
+    /*
+     * While a page sits past the slots needed there is a free slot before them. Free slots past
+     * them stay on the free list, so other owners keep allocating from them rather than growing
+     * the file while it is being compacted.
+     */
+    size_t i = file->n_free;
+    while (i > 0 && file->free_slots[i - 1] >= needed) {
+        i--;
+    }
+    if (i == 0) {
+        pthread_mutex_unlock(&file->latch);
+        return page;
+    }
+    size_t to = file->free_slots[i - 1];
+    file->free_slots[i - 1] = file->free_slots[--file->n_free];
+
+    memcpy(slot_page(file, to), page, file->page_size);
+    *slot_entry(file, to) = *slot_entry(file, slot);
+    memset(slot_entry(file, slot), 0, sizeof(struct slot_entry));
+    pthread_mutex_unlock(&file->latch);
+
+    return slot_page(file, to);
+}
+
+int
+mapfile_shrink(MapFile file)
+{
+    if (file == NULL) {
+        return MAPFILE_ARG_INVALID;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t n_extents = file->header->n_extents;
+    while (n_extents > 0 && is_free_extent(file, n_extents - 1)) {
+        n_extents--;
+    }
+
+    int result = 0;
+    if (n_extents < file->header->n_extents) {
+        size_t len = file->header_size + n_extents * file->extent_size;
+
+        /* The system page the new end falls in stays mapped, grow maps it again anyway. */
+        size_t from = (len + getpagesize() - 1) / getpagesize() * getpagesize();
+        if (from < file->len && mmap(file->base + from, file->len - from, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            pthread_mutex_unlock(&file->latch);
+            return MAPFILE_IO_ERROR;
+        }
+
+        file->header->n_extents = n_extents;
+        file->len = len;
+        if (file->n_touched > n_slots(file)) {
+            file->n_touched = n_slots(file);
+        }
+
+        /* The file is left longer than it needs to be, the header still says how long it is. */
+        if (ftruncate(file->fd, len) != 0) {
+            result = MAPFILE_IO_ERROR;
+        }
+    }
+
+    /* The free list has room for every slot, pushing can't fail here. */
+    file->n_free = 0;
+    for (size_t slot = n_slots(file); slot-- > 0;) {
+        if (slot_entry(file, slot)->owner == FREE_SLOT) {
+            push_free(file, slot);
+        }
+    }
+    pthread_mutex_unlock(&file->latch);
+
+    return result;
+}
+
+size_t
+mapfile_size(MapFile file)
+{
+    if (file == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t len = file->len;
+    pthread_mutex_unlock(&file->latch);
+
+    return len;
+}
+
+void
+mapfile_pages(MapFile file, MapFilePageFn fn, void* ctx)
+{
+    if (file == NULL || fn == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t n = n_slots(file);
+    pthread_mutex_unlock(&file->latch);
+
+    for (size_t slot = 0; slot < n; slot++) {
+        struct slot_entry* entry = slot_entry(file, slot);
+        if (entry->owner != FREE_SLOT) {
+            fn(slot_page(file, slot), entry->owner - 1, entry->bucket, entry->position, ctx);
+        }
+    }
+}
+
+size_t
+mapfile_n_pages(MapFile file)
+{
+    if (file == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    size_t n_used = file->n_used;
+    pthread_mutex_unlock(&file->latch);
+
+    return n_used;
+}
+
+int
+mapfile_sync(MapFile file)
+{
+    if (file == NULL) {
+        return MAPFILE_ARG_INVALID;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    TRACE_START(start);
+    /* msync only writes pages back, the length set by growing or shrinking needs fdatasync. */
+    int result = msync(file->base, file->len, MS_SYNC) == 0 && fdatasync(file->fd) == 0 ? 0
+        : MAPFILE_IO_ERROR;
+    TRACE(TRACE_FLUSH, start, 0, 0);
+    pthread_mutex_unlock(&file->latch);
+
+    return result;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+/*
+ * Reserves address space for the file to grow into and maps the first len bytes of it.
+ */
+static MapFile
+map(int fd, size_t len, size_t page_size)
+{
+    MapFile file = calloc(1, sizeof(*file));
+    if (file == NULL) {
+        return NULL;
+    }
+
+    set_geometry(file, page_size);
+    file->fd = fd;
+    file->len = len;
+    file->reserved = len < MAP_RESERVE ? MAP_RESERVE : 2 * len;
+
+    void* base = mmap(NULL, file->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    if (base == MAP_FAILED) {
+        free(file);
+        return NULL;
+    }
+
+    if (mmap(base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, file->reserved);
+        free(file);
+        return NULL;
+    }
+
+    file->base = base;
+    file->header = base;
+    pthread_mutex_init(&file->latch, NULL);
+    madvise(base, len, MADV_RANDOM);
+
+    return file;
+}
+
+static void
+set_geometry(MapFile file, size_t page_size)
+{
+    file->page_size = page_size;
+    file->header_size = (sizeof(struct file_header) + page_size - 1) / page_size * page_size;
+    file->slots_per_extent = page_size / sizeof(struct slot_entry);
+    file->extent_size = (file->slots_per_extent + 1) * page_size;
+}
+
+static size_t
+n_slots(MapFile file)
+{
+    return file->header->n_extents * file->slots_per_extent;
+}
+
+static char*
+slot_page(MapFile file, size_t slot)
+{
+    size_t extent = slot / file->slots_per_extent;
+    size_t index = slot % file->slots_per_extent;
+
+    return file->base + file->header_size + extent * file->extent_size
+        + (index + 1) * file->page_size;
+}
+
+static struct slot_entry*
+slot_entry(MapFile file, size_t slot)
+{
+    size_t extent = slot / file->slots_per_extent;
+    size_t index = slot % file->slots_per_extent;
+    char* directory = file->base + file->header_size + extent * file->extent_size;
+
+    return (struct slot_entry*)directory + index;
+}
+
+static size_t
+slot_of(MapFile file, void* page)
+{
+    size_t offset = (char*)page - file->base - file->header_size;
+    size_t extent = offset / file->extent_size;
+    size_t index = offset % file->extent_size / file->page_size - 1;
+
+    return extent * file->slots_per_extent + index;
+}
+
+static int
+push_free(MapFile file, size_t slot)
+{
+    if (file->n_free == file->max_free) {
+        size_t max_free = file->max_free == 0 ? file->slots_per_extent : file->max_free * 2;
+        size_t* free_slots = realloc(file->free_slots, max_free * sizeof(*free_slots));
+        if (free_slots == NULL) {
+            return MAPFILE_IO_ERROR;
+        }
+        file->free_slots = free_slots;
+        file->max_free = max_free;
+    }
+
+    file->free_slots[file->n_free++] = slot;
+
+    return 0;
+}
+
+/*
+ * Doubles the number of extents with ftruncate, and maps the new ones over the reservation.
+ * mremap can't grow a mapping in place into address space that is already reserved, and letting
+ * it move the mapping would leave every page pointer dangling.
+ */
+static int
+grow(MapFile file)
+{
+    size_t n_extents = file->header->n_extents == 0 ? 1 : file->header->n_extents * 2;
+    size_t len = file->header_size + n_extents * file->extent_size;
+    if (len > file->reserved) {
+        n_extents = (file->reserved - file->header_size) / file->extent_size;
+        len = file->header_size + n_extents * file->extent_size;
+        if (n_extents <= file->header->n_extents) {
+            return MAPFILE_IO_ERROR;
+        }
+    }
+
+    /* Make sure the free list can take every slot before anything changes. */
+    size_t n_new = (n_extents - file->header->n_extents) * file->slots_per_extent;
+    size_t max_free = file->max_free;
+    while (max_free < n_slots(file) + n_new) {
+        max_free = max_free == 0 ? file->slots_per_extent : max_free * 2;
+    }
+    size_t* free_slots = realloc(file->free_slots, max_free * sizeof(*free_slots));
+    if (free_slots == NULL) {
+        return MAPFILE_IO_ERROR;
+    }
+    file->free_slots = free_slots;
+    file->max_free = max_free;
+
+    if (ftruncate(file->fd, len) != 0) {
+        return MAPFILE_IO_ERROR;
+    }
+
+    /*
+     * Mappings start on a system page, so the last partly mapped system page is mapped again. It
+     * maps the same bytes of the same file to the same address, nothing using it can tell.
+     */
+    size_t from = file->len / getpagesize() * getpagesize();
+    if (mmap(file->base + from, len - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+        file->fd, from) == MAP_FAILED) {
+        /* The file is left longer than it needs to be, the header still says how long it is. */
+        return MAPFILE_IO_ERROR;
+    }
+    madvise(file->base + from, len - from, MADV_RANDOM);
+
+    size_t first = n_slots(file);
+    file->header->n_extents = n_extents;
+    file->len = len;
+
+    /* Pushed backwards so the lowest slots are handed out first. */
+    for (size_t slot = n_slots(file); slot-- > first;) {
+        push_free(file, slot);
+    }
+
+    return 0;
+}
+
+/*
+ * Faults in the system pages of a slot that hasn't been used since the file was mapped, so the
+ * fault is traced on its own rather than inside whatever first writes the page.
+ * Each byte written is the one already there, and only the slot's own bytes are touched.
+ */
+static void
+touch(MapFile file, size_t slot)
+{
+    TRACE_START(start);
+    volatile char* page = slot_page(file, slot);
+    size_t system_page = getpagesize();
+    for (size_t i = 0; i < file->page_size; i += system_page - (uintptr_t)(page + i) % system_page) {
+        page[i] = page[i];
+    }
+    TRACE(TRACE_FAULT, start, slot, 0);
+}
+
+/*
+ * Returns the number of slots in the fewest whole extents that can hold every page in use.
+ */
+static size_t
+slots_needed(MapFile file)
+{
+    return (file->n_used + file->slots_per_extent - 1) / file->slots_per_extent
+        * file->slots_per_extent;
+}
+
+static int
+is_free_extent(MapFile file, size_t extent)
+{
+    for (size_t i = 0; i < file->slots_per_extent; i++) {
+        if (slot_entry(file, extent * file->slots_per_extent + i)->owner != FREE_SLOT) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -1,6 +1,9 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include "budget.h"
 #include "page.h"
+#include "trace.h"
 
 /*
  * For a packed page, size is assumed to be constant.
@@ -15,29 +18,65 @@ struct page
     char    data[1];
 };
 
-static int header_size();
+static size_t header_size();
 static int has_space(Page page);
 static void* get_offset(Page page, int record_id);
 static int find_record(Page page, void* record);
+static void delete_record(Page page, int record_id);
 
 Page
 page_create(size_t size, size_t record_size)
 {
-    if (size <= header_size() || size < MIN_PAGE_SIZE) {
+    return page_create_with_fields(size, 1, &record_size);
+}
+
+Page
+page_create_with_fields(size_t size, int n_fields, const size_t* field_sizes)
+{
+    if (size <= header_size() || size < MIN_PAGE_SIZE || size > MAX_PAGE_SIZE) {
         return NULL;
     }
 
-    Page page = malloc(size);
+    void* memory = budget_alloc(NULL, size);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    Page page = page_init(memory, size, n_fields, field_sizes);
     if (page == NULL) {
+        budget_dealloc(NULL, memory, size);
         return NULL;
     }
-    
+
+    return page;
+}
+
+Page
+page_init(void* memory, size_t size, int n_fields, const size_t* field_sizes)
+{
+    if (memory == NULL || size <= header_size() || size < MIN_PAGE_SIZE
+        || size > MAX_PAGE_SIZE) {
+        return NULL;
+    }
+
+    if (field_sizes == NULL || !(0 < n_fields && n_fields <= PAGE_MAX_FIELDS)) {
+        return NULL;
+    }
+
+    size_t record_size = 0;
+    for (int i = 0; i < n_fields; i++) {
+        if (field_sizes[i] == 0) {
+            return NULL;
+        }
+        record_size += field_sizes[i];
+    }
+
+    Page page = memory;
     page->size = size;
     page->record_size = record_size;
     page->n_records = 0;
-    
+
     if (!has_space(page)) {
-        page_free(&page);
         return NULL;
     }
 
@@ -51,7 +90,7 @@ page_free(Page* page)
         return;
     }
     
-    free(*page);
+    budget_dealloc(NULL, *page, (*page)->size);
     *page = NULL;
 }
 
@@ -66,7 +105,9 @@ page_add_record(Page page, void* record)
         return PAGE_HAS_NO_SPACE;
     }
 
+    TRACE_START(start);
     memcpy(get_offset(page, page->n_records), record, page->record_size);
+    TRACE(TRACE_PAGE_ADD, start, (uintptr_t)page, 0);
 
     return page->n_records++;
 }
@@ -78,20 +119,28 @@ page_delete_record(Page page, void* record)
         return PAGE_ARG_INVALID;
     }
 
+    TRACE_START(start);
     int record_id = find_record(page, record);
     if (record_id == PAGE_RECORD_NOT_FOUND) {
         return PAGE_RECORD_NOT_FOUND;
     }
-    
-    /*
-     * Instead of moving all the records above down one, just swap the last record with the deleted
-     * record.
-     * The last record is then zero'd out to delete the record.
-     */
-    memmove(get_offset(page, record_id), get_offset(page, page->n_records - 1), page->record_size);
-    memset(get_offset(page, page->n_records - 1), 0, page->record_size);
-    page->n_records--;
-    
+    delete_record(page, record_id);
+    TRACE(TRACE_PAGE_DELETE, start, (uintptr_t)page, record_id + 1);
+
+    return record_id;
+}
+
+int
+page_delete_record_id(Page page, int record_id)
+{
+    if (page == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
+    TRACE_START(start);
+    delete_record(page, record_id);
+    TRACE(TRACE_PAGE_DELETE, start, (uintptr_t)page, 0);
+
     return record_id;
 }
 
@@ -107,6 +156,16 @@ page_update_record(Page page, void* old, void* new)
         return PAGE_RECORD_NOT_FOUND;
     }
     
+    return page_update_record_id(page, record_id, new);
+}
+
+int
+page_update_record_id(Page page, int record_id, void* new)
+{
+    if (page == NULL || new == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
     memcpy(get_offset(page, record_id), new, page->record_size);
 
     return 0;
@@ -129,12 +188,117 @@ page_read_record(Page page, int record_id)
     return record;
 }
 
+int
+page_copy_record(Page page, int record_id, void* out)
+{
+    if (page == NULL || out == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
+    memcpy(out, get_offset(page, record_id), page->record_size);
+
+    return 0;
+}
+
+int
+page_copy_field(Page page, int record_id, size_t offset, size_t width, void* out)
+{
+    if (page == NULL || out == NULL || !(0 <= record_id && record_id < page->n_records)
+        || width == 0 || offset + width > page->record_size) {
+        return PAGE_ARG_INVALID;
+    }
+
+    memcpy(out, (char*)get_offset(page, record_id) + offset, width);
+
+    return 0;
+}
+
+int
+page_match_field(Page page, size_t offset, size_t width, const void* value, int* record_ids)
+{
+    if (page == NULL || value == NULL || record_ids == NULL || width == 0
+        || offset + width > page->record_size) {
+        return PAGE_ARG_INVALID;
+    }
+
+    const char* field = page->data + offset;
+    int n_matches = 0;
+
+    /*
+     * The common widths compare as integers. Every id is written and the count only advances on a
+     * match, so the loop has no branches to mispredict.
+     */
+    if (width == sizeof(uint32_t)) {
+        uint32_t v;
+        memcpy(&v, value, sizeof(v));
+        for (int record_id = 0; record_id < page->n_records; record_id++) {
+            uint32_t x;
+            memcpy(&x, field + record_id * page->record_size, sizeof(x));
+            record_ids[n_matches] = record_id;
+            n_matches += x == v;
+        }
+    } else if (width == sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, value, sizeof(v));
+        for (int record_id = 0; record_id < page->n_records; record_id++) {
+            uint64_t x;
+            memcpy(&x, field + record_id * page->record_size, sizeof(x));
+            record_ids[n_matches] = record_id;
+            n_matches += x == v;
+        }
+    } else {
+        for (int record_id = 0; record_id < page->n_records; record_id++) {
+            record_ids[n_matches] = record_id;
+            n_matches += memcmp(field + record_id * page->record_size, value, width) == 0;
+        }
+    }
+
+    return n_matches;
+}
+
+int
+page_find_key(Page page, void* key, size_t key_size)
+{
+    if (page == NULL || key == NULL || key_size == 0 || key_size > page->record_size) {
+        return PAGE_ARG_INVALID;
+    }
+
+    for (int record_id = 0; record_id < page->n_records; record_id++) {
+        if (memcmp(get_offset(page, record_id), key, key_size) == 0) {
+            return record_id;
+        }
+    }
+
+    return PAGE_RECORD_NOT_FOUND;
+}
+
+int
+page_n_records(Page page)
+{
+    if (page == NULL) {
+        return 0;
+    }
+
+    return page->n_records;
+}
+
+int
+page_capacity(size_t size, size_t record_size)
+{
+    if (size <= header_size() || record_size == 0) {
+        return 0;
+    }
+
+    /* has_space() keeps the header and records strictly smaller than the page. */
+    return (size - header_size() - 1) / record_size;
+}
+
 
 /*
  * PRIVATE FUNCTIONS
  */
 
-static int
+static size_t
 header_size()
 {
     return sizeof(struct page);
@@ -163,3 +327,16 @@ find_record(Page page, void* record)
     
     return PAGE_RECORD_NOT_FOUND;
 }
+
+static void
+delete_record(Page page, int record_id)
+{
+    /*
+     * Instead of moving all the records above down one, just swap the last record with the deleted
+     * record.
+     * The last record is then zero'd out to delete the record.
+     */
+    memmove(get_offset(page, record_id), get_offset(page, page->n_records - 1), page->record_size);
+    memset(get_offset(page, page->n_records - 1), 0, page->record_size);
+    page->n_records--;
+}
@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pagefile.h"
+#include "trace.h"
+
+/*
+ * Frames are found by page number through a chained hash, the same layout as the record cache.
+ * Eviction is CLOCK over the unpinned frames.
+ * The file latch isn't held across I/O. A frame being read or written is marked busy and linked
+ * under the page it is being read for, so a second pin of that page waits for the read rather than
+ * reading it into another frame, and the page a busy frame is writing back can't be read until
+ * the write is done.
+ */
+
+#define MIN_ALIGNMENT (512)
+#define CACHE_LINE_SIZE (64)
+#define NO_FRAME (-1)
+
+struct frame
+{
+    uint64_t    page_no;
+    uint64_t    evicted;
+    int         next;
+    int         pins;
+    char        used;
+    char        dirty;
+    char        referenced;
+    char        busy;
+    char        writing;
+};
+
+struct pagefile
+{
+    pthread_mutex_t latch;
+    pthread_cond_t  io_done;
+    int             fd;
+    int             direct;
+    size_t          page_size;
+    size_t          alignment;
+    uint64_t        n_pages;
+
+    int             n_frames;
+    int             n_busy;
+    int             n_heads;
+    int             hand;
+    int*            heads;
+    struct frame*   frames;
+    char*           data;
+
+    PageFileStats   stats;
+};
+
+static size_t block_size(int fd);
+static char* data_of(PageFile file, int frame);
+static int find(PageFile file, uint64_t page_no);
+static void link_frame(PageFile file, int frame, uint64_t page_no);
+static void unlink_frame(PageFile file, int frame);
+static int is_being_written(PageFile file, uint64_t page_no);
+static int victim(PageFile file);
+static int load(PageFile file, int frame, uint64_t page_no);
+static int read_page(PageFile file, char* data, uint64_t page_no);
+static int write_page(PageFile file, char* data, uint64_t page_no);
+static int write_back(PageFile file);
+static int retry_buffered(PageFile file);
+static int drop_direct(PageFile file);
+
+PageFile
+pagefile_open(const char* path, size_t page_size, int n_frames, int direct)
+{
+    if (path == NULL || page_size == 0 || n_frames <= 0) {
+        return NULL;
+    }
+
+    PageFile file = calloc(1, sizeof(*file));
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->fd = -1;
+    if (direct) {
+        file->fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+        file->direct = file->fd >= 0;
+    }
+    if (file->fd < 0) {
+        file->fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+    if (file->fd < 0) {
+        free(file);
+        return NULL;
+    }
+
+    /* Direct I/O must be block aligned, pages that don't line up with the blocks can't use it. */
+    file->alignment = block_size(file->fd);
+    if (file->direct && page_size % file->alignment != 0) {
+        drop_direct(file);
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        close(file->fd);
+        free(file);
+        return NULL;
+    }
+
+    pthread_mutex_init(&file->latch, NULL);
+    pthread_cond_init(&file->io_done, NULL);
+    file->page_size = page_size;
+    file->n_pages = (st.st_size + page_size - 1) / page_size;
+    file->n_frames = n_frames;
+    file->n_heads = 1;
+    while (file->n_heads < n_frames) {
+        file->n_heads *= 2;
+    }
+
+    void* data = NULL;
+    file->heads = malloc(file->n_heads * sizeof(*file->heads));
+    file->frames = calloc(n_frames, sizeof(*file->frames));
+    if (posix_memalign(&data, file->alignment, (size_t)n_frames * page_size) != 0) {
+        data = NULL;
+    }
+    file->data = data;
+    if (file->heads == NULL || file->frames == NULL || file->data == NULL) {
+        pagefile_close(&file);
+        return NULL;
+    }
+
+    for (int i = 0; i < file->n_heads; i++) {
+        file->heads[i] = NO_FRAME;
+    }
+
+    return file;
+}
+
+int
+pagefile_close(PageFile* file)
+{
+    if (file == NULL || *file == NULL) {
+        return PAGEFILE_ARG_INVALID;
+    }
+
+    int result = 0;
+    if ((*file)->frames != NULL && (*file)->data != NULL) {
+        result = pagefile_flush(*file);
+    }
+
+    close((*file)->fd);
+    pthread_mutex_destroy(&(*file)->latch);
+    pthread_cond_destroy(&(*file)->io_done);
+    free((*file)->heads);
+    free((*file)->frames);
+    free((*file)->data);
+    free(*file);
+    *file = NULL;
+
+    return result;
+}
+
+int
+pagefile_pin(PageFile file, uint64_t page_no, void** frame)
+{
+    if (file == NULL || frame == NULL) {
+        return PAGEFILE_ARG_INVALID;
+    }
+
+    pthread_mutex_lock(&file->latch);
+
+    /* Frames that are busy now will be free to pin or evict once their I/O is done. */
+    int i;
+    for (;;) {
+        i = find(file, page_no);
+        if (i != NO_FRAME && !file->frames[i].busy) {
+            file->frames[i].pins++;
+            break;
+        }
+
+        if (i == NO_FRAME && !is_being_written(file, page_no)) {
+            i = victim(file);
+            if (i != NO_FRAME) {
+                int result = load(file, i, page_no);
+                if (result != 0) {
+                    pthread_mutex_unlock(&file->latch);
+                    return result;
+                }
+                break;
+            }
+            if (file->n_busy == 0) {
+                pthread_mutex_unlock(&file->latch);
+                return PAGEFILE_NO_FRAME;
+            }
+        }
+        pthread_cond_wait(&file->io_done, &file->latch);
+    }
+
+    file->frames[i].referenced = 1;
+    *frame = data_of(file, i);
+    pthread_mutex_unlock(&file->latch);
+
+    return 0;
+}
+
+int
+pagefile_unpin(PageFile file, uint64_t page_no, int dirty)
+{
+    if (file == NULL) {
+        return PAGEFILE_ARG_INVALID;
+    }
+
+    pthread_mutex_lock(&file->latch);
+
+    int i = find(file, page_no);
+    if (i == NO_FRAME || file->frames[i].pins == 0) {
+        pthread_mutex_unlock(&file->latch);
+        return PAGEFILE_ARG_INVALID;
+    }
+
+    file->frames[i].pins--;
+    file->frames[i].dirty |= dirty != 0;
+    pthread_mutex_unlock(&file->latch);
+
+    return 0;
+}
+
+int
+pagefile_flush(PageFile file)
+{
+    if (file == NULL) {
+        return PAGEFILE_ARG_INVALID;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    int result = write_back(file);
+    pthread_mutex_unlock(&file->latch);
+
+    TRACE_START(start);
+    if (result == 0 && fdatasync(file->fd) != 0) {
+        result = PAGEFILE_IO_ERROR;
+    }
+    TRACE(TRACE_FLUSH, start, 0, 0);
+
+    return result;
+}
+
+uint64_t
+pagefile_n_pages(PageFile file)
+{
+    if (file == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    uint64_t n_pages = file->n_pages;
+    pthread_mutex_unlock(&file->latch);
+
+    return n_pages;
+}
+
+int
+pagefile_is_direct(PageFile file)
+{
+    if (file == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    int direct = file->direct;
+    pthread_mutex_unlock(&file->latch);
+
+    return direct;
+}
+
+size_t
+pagefile_alignment(PageFile file)
+{
+    return file == NULL ? 0 : file->alignment;
+}
+
+PageFileStats
+pagefile_stats(PageFile file)
+{
+    PageFileStats stats = {0};
+    if (file == NULL) {
+        return stats;
+    }
+
+    pthread_mutex_lock(&file->latch);
+    stats = file->stats;
+    pthread_mutex_unlock(&file->latch);
+
+    return stats;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+/*
+ * Returns the file system's preferred I/O size, which is a multiple of the logical block size that
+ * O_DIRECT requires, as a power of two no smaller than MIN_ALIGNMENT.
+ */
+static size_t
+block_size(int fd)
+{
+    struct stat st;
+    size_t size = MIN_ALIGNMENT;
+    if (fstat(fd, &st) == 0) {
+        while (size < (size_t)st.st_blksize) {
+            size *= 2;
+        }
+    }
+
+    return size < CACHE_LINE_SIZE ? CACHE_LINE_SIZE : size;
+}
+
+static char*
+data_of(PageFile file, int frame)
+{
+    return file->data + (size_t)frame * file->page_size;
+}
+
+static int
+find(PageFile file, uint64_t page_no)
+{
+    int frame = file->heads[page_no & (file->n_heads - 1)];
+    while (frame != NO_FRAME && file->frames[frame].page_no != page_no) {
+        frame = file->frames[frame].next;
+    }
+
+    return frame;
+}
+
+static void
+link_frame(PageFile file, int frame, uint64_t page_no)
+{
+    int* head = &file->heads[page_no & (file->n_heads - 1)];
+
+    file->frames[frame].next = *head;
+    *head = frame;
+}
+
+static void
+unlink_frame(PageFile file, int frame)
+{
+    int* link = &file->heads[file->frames[frame].page_no & (file->n_heads - 1)];
+    while (*link != frame) {
+        link = &file->frames[*link].next;
+    }
+
+    *link = file->frames[frame].next;
+}
+
+/*
+ * Returns non-zero if a busy frame is writing back the page, which must not be read until it is
+ * on disk.
+ */
+static int
+is_being_written(PageFile file, uint64_t page_no)
+{
+    for (int i = 0; i < file->n_frames; i++) {
+        if (file->frames[i].busy && file->frames[i].writing && file->frames[i].evicted == page_no) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a free frame, or the first unpinned frame the clock hand finds without its reference bit.
+ * Returns NO_FRAME if every frame is pinned or busy.
+ */
+static int
+victim(PageFile file)
+{
+    for (int i = 0; i < 2 * file->n_frames; i++) {
+        int frame = file->hand;
+        file->hand = (file->hand + 1) % file->n_frames;
+
+        if (!file->frames[frame].used) {
+            return frame;
+        }
+        if (file->frames[frame].pins > 0 || file->frames[frame].busy) {
+            continue;
+        }
+        if (!file->frames[frame].referenced) {
+            return frame;
+        }
+        file->frames[frame].referenced = 0;
+    }
+
+    return NO_FRAME;
+}
+
+/*
+ * Evicts whatever is in the frame and reads page_no into it, pinned once. Called and returns with
+ * the latch held, but drops it for the I/O.
+ * If the evicted page couldn't be written back it is left in the frame.
+ */
+static int
+load(PageFile file, int frame, uint64_t page_no)
+{
+    struct frame* f = &file->frames[frame];
+    uint64_t evicted = f->page_no;
+    int evicting = f->used;
+    int write = f->used && f->dirty;
+    if (evicting) {
+        unlink_frame(file, frame);
+    }
+
+    f->page_no = page_no;
+    f->evicted = evicted;
+    f->writing = write;
+    f->used = 1;
+    f->dirty = 0;
+    f->busy = 1;
+    f->pins = 1;
+    file->n_busy++;
+    link_frame(file, frame, page_no);
+    pthread_mutex_unlock(&file->latch);
+
+    char* data = data_of(file, frame);
+    int written = write ? write_page(file, data, evicted) : 0;
+    int result = written == 0 ? read_page(file, data, page_no) : written;
+
+    pthread_mutex_lock(&file->latch);
+    unlink_frame(file, frame);
+    if (written != 0) {
+        f->page_no = evicted;
+        f->dirty = 1;
+        link_frame(file, frame, evicted);
+    } else if (result != 0) {
+        f->used = 0;
+    } else {
+        link_frame(file, frame, page_no);
+    }
+    file->stats.evictions += evicting && written == 0;
+    file->stats.writes += write && written == 0;
+    file->stats.reads += result == 0;
+    if (result == 0 && page_no >= file->n_pages) {
+        file->n_pages = page_no + 1;
+    }
+    if (result != 0) {
+        f->pins = 0;
+    }
+    f->busy = 0;
+    f->writing = 0;
+    file->n_busy--;
+    pthread_cond_broadcast(&file->io_done);
+
+    return result;
+}
+
+static int
+read_page(PageFile file, char* data, uint64_t page_no)
+{
+    TRACE_START(start);
+    off_t offset = (off_t)page_no * file->page_size;
+    size_t done = 0;
+    int retried = 0;
+
+    while (done < file->page_size) {
+        ssize_t n = pread(file->fd, data + done, file->page_size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL && !retried && retry_buffered(file) == 0) {
+            retried = 1;
+            continue;
+        }
+        if (n < 0) {
+            return PAGEFILE_IO_ERROR;
+        }
+        if (n == 0) {
+            /* Past the end of the file. */
+            memset(data + done, 0, file->page_size - done);
+            break;
+        }
+        done += n;
+    }
+    TRACE(TRACE_FAULT, start, page_no, 0);
+
+    return 0;
+}
+
+static int
+write_page(PageFile file, char* data, uint64_t page_no)
+{
+    TRACE_START(start);
+    off_t offset = (off_t)page_no * file->page_size;
+    size_t done = 0;
+    int retried = 0;
+
+    while (done < file->page_size) {
+        ssize_t n = pwrite(file->fd, data + done, file->page_size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL && !retried && retry_buffered(file) == 0) {
+            retried = 1;
+            continue;
+        }
+        if (n <= 0) {
+            return PAGEFILE_IO_ERROR;
+        }
+        done += n;
+    }
+    TRACE(TRACE_FLUSH, start, page_no, 0);
+
+    return 0;
+}
+
+/*
+ * Writes back every dirty frame, called with the latch held. Each frame is marked busy while it is
+ * written so it isn't evicted or loaded over, the latch is dropped for the write.
+ */
+static int
+write_back(PageFile file)
+{
+    int result = 0;
+    for (int i = 0; i < file->n_frames; i++) {
+        struct frame* f = &file->frames[i];
+        while (f->busy) {
+            pthread_cond_wait(&file->io_done, &file->latch);
+        }
+        if (!f->used || !f->dirty) {
+            continue;
+        }
+
+        f->busy = 1;
+        f->dirty = 0;
+        file->n_busy++;
+        uint64_t page_no = f->page_no;
+        pthread_mutex_unlock(&file->latch);
+        int written = write_page(file, data_of(file, i), page_no);
+        pthread_mutex_lock(&file->latch);
+
+        if (written != 0) {
+            f->dirty = 1;
+            result = PAGEFILE_IO_ERROR;
+        } else {
+            file->stats.writes++;
+        }
+        f->busy = 0;
+        file->n_busy--;
+        pthread_cond_broadcast(&file->io_done);
+    }
+
+    return result;
+}
+
+/*
+ * Called without the latch when a read or write was refused as invalid, which may be O_DIRECT
+ * being refused. Returns zero if the file now uses buffered I/O and the call is worth retrying
+ * once, another thread may have fallen back already.
+ */
+static int
+retry_buffered(PageFile file)
+{
+    pthread_mutex_lock(&file->latch);
+    int result = file->direct ? drop_direct(file) : 0;
+    pthread_mutex_unlock(&file->latch);
+
+    return result;
+}
+
+/*
+ * Some file systems accept O_DIRECT at open and only refuse it on the first read or write,
+ * those files carry on with buffered I/O.
+ */
+static int
+drop_direct(PageFile file)
+{
+    int flags = fcntl(file->fd, F_GETFL);
+    if (flags < 0 || fcntl(file->fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+        return PAGEFILE_IO_ERROR;
+    }
+    file->direct = 0;
+
+    return 0;
+}
@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "page.h"
+#include "trace.h"
+
+/*
+ * For a pax page, records are split into their fields and each field is stored in its own
+ * minipage, so the n'th record is the n'th value of every minipage.
+ * A scan over one field only touches that field's minipage, rows are put back together when a
+ * whole record is read.
+ * Like the packed page, deleting a record moves the last record into its place.
+ */
+
+#define MINIPAGE_ALIGNMENT (8)
+#define MATCH_BLOCK (64)
+
+struct page
+{
+    size_t      size;
+    size_t      record_size;
+    int         n_records;
+    int         capacity;
+    int         n_fields;
+    uint16_t    field_sizes[PAGE_MAX_FIELDS];
+    uint16_t    field_starts[PAGE_MAX_FIELDS];
+    uint32_t    minipages[PAGE_MAX_FIELDS];
+    _Alignas(MINIPAGE_ALIGNMENT) char data[1];
+};
+
+static size_t header_size();
+static int has_space(Page page);
+static size_t align_up(size_t size);
+static size_t minipages_size(Page page, int capacity);
+static char* get_value(Page page, int field, int record_id);
+static int field_of(Page page, size_t offset, size_t width);
+static void write_record(Page page, int record_id, const void* record);
+static void read_record(Page page, int record_id, void* out);
+static int compare_bytes(Page page, int record_id, const void* bytes, size_t len);
+static int find_record(Page page, void* record);
+static void delete_record(Page page, int record_id);
+
+Page
+page_create(size_t size, size_t record_size)
+{
+    return page_create_with_fields(size, 1, &record_size);
+}
+
+Page
+page_create_with_fields(size_t size, int n_fields, const size_t* field_sizes)
+{
+    if (size <= header_size() || size < MIN_PAGE_SIZE || size > MAX_PAGE_SIZE) {
+        return NULL;
+    }
+
+    void* memory = budget_alloc(NULL, size);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    Page page = page_init(memory, size, n_fields, field_sizes);
+    if (page == NULL) {
+        budget_dealloc(NULL, memory, size);
+        return NULL;
+    }
+
+    return page;
+}
+
+Page
+page_init(void* memory, size_t size, int n_fields, const size_t* field_sizes)
+{
+    if (memory == NULL || size <= header_size() || size < MIN_PAGE_SIZE
+        || size > MAX_PAGE_SIZE) {
+        return NULL;
+    }
+
+    if (field_sizes == NULL || !(0 < n_fields && n_fields <= PAGE_MAX_FIELDS)) {
+        return NULL;
+    }
+
+    Page page = memory;
+    page->size = size;
+    page->record_size = 0;
+    page->n_records = 0;
+    page->n_fields = n_fields;
+    for (int i = 0; i < n_fields; i++) {
+        if (field_sizes[i] == 0 || page->record_size + field_sizes[i] > UINT16_MAX) {
+            return NULL;
+        }
+        page->field_sizes[i] = field_sizes[i];
+        page->field_starts[i] = page->record_size;
+        page->record_size += field_sizes[i];
+    }
+
+    /*
+     * Start from the capacity of a packed page and back off until the padding between minipages
+     * fits too, which is never more than a few records.
+     */
+    page->capacity = page_capacity(size, page->record_size);
+    while (page->capacity > 0 && header_size() + minipages_size(page, page->capacity) >= size) {
+        page->capacity--;
+    }
+
+    if (!has_space(page)) {
+        return NULL;
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < n_fields; i++) {
+        page->minipages[i] = offset;
+        offset += align_up((size_t)page->capacity * page->field_sizes[i]);
+    }
+
+    return page;
+}
+
+void
+page_free(Page* page)
+{
+    if (page == NULL || *page == NULL) {
+        return;
+    }
+
+    budget_dealloc(NULL, *page, (*page)->size);
+    *page = NULL;
+}
+
+int
+page_add_record(Page page, void* record)
+{
+    if (page == NULL || record == NULL) {
+        return PAGE_ARG_INVALID;
+    }
+
+    if (!has_space(page)) {
+        return PAGE_HAS_NO_SPACE;
+    }
+
+    TRACE_START(start);
+    write_record(page, page->n_records, record);
+    TRACE(TRACE_PAGE_ADD, start, (uintptr_t)page, 0);
+
+    return page->n_records++;
+}
+
+int
+page_delete_record(Page page, void* record)
+{
+    if (page == NULL || record == NULL) {
+        return PAGE_ARG_INVALID;
+    }
+
+    TRACE_START(start);
+    int record_id = find_record(page, record);
+    if (record_id == PAGE_RECORD_NOT_FOUND) {
+        return PAGE_RECORD_NOT_FOUND;
+    }
+    delete_record(page, record_id);
+    TRACE(TRACE_PAGE_DELETE, start, (uintptr_t)page, record_id + 1);
+
+    return record_id;
+}
+
+int
+page_delete_record_id(Page page, int record_id)
+{
+    if (page == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
+    TRACE_START(start);
+    delete_record(page, record_id);
+    TRACE(TRACE_PAGE_DELETE, start, (uintptr_t)page, 0);
+
+    return record_id;
+}
+
+int
+page_update_record(Page page, void* old, void* new)
+{
+    if (page == NULL || old == NULL || new == NULL) {
+        return PAGE_ARG_INVALID;
+    }
+
+    int record_id = find_record(page, old);
+    if (record_id == PAGE_RECORD_NOT_FOUND) {
+        return PAGE_RECORD_NOT_FOUND;
+    }
+
+    return page_update_record_id(page, record_id, new);
+}
+
+int
+page_update_record_id(Page page, int record_id, void* new)
+{
+    if (page == NULL || new == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
+    write_record(page, record_id, new);
+
+    return 0;
+}
+
+void*
+page_read_record(Page page, int record_id)
+{
+    if (page == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return NULL;
+    }
+
+    void* record = malloc(page->record_size);
+    if (record == NULL) {
+        return NULL;
+    }
+
+    read_record(page, record_id, record);
+
+    return record;
+}
+
+int
+page_copy_record(Page page, int record_id, void* out)
+{
+    if (page == NULL || out == NULL || !(0 <= record_id && record_id < page->n_records)) {
+        return PAGE_ARG_INVALID;
+    }
+
+    read_record(page, record_id, out);
+
+    return 0;
+}
+
+int
+page_copy_field(Page page, int record_id, size_t offset, size_t width, void* out)
+{
+    if (page == NULL || out == NULL || !(0 <= record_id && record_id < page->n_records)
+        || width == 0 || offset + width > page->record_size) {
+        return PAGE_ARG_INVALID;
+    }
+
+    /* Fields are copied piece by piece, so the bytes may span fields here. */
+    char* to = out;
+    for (int field = 0; field < page->n_fields && width > 0; field++) {
+        size_t start = page->field_starts[field];
+        size_t end = start + page->field_sizes[field];
+        if (offset >= end) {
+            continue;
+        }
+
+        size_t n = end - offset < width ? end - offset : width;
+        memcpy(to, get_value(page, field, record_id) + (offset - start), n);
+        to += n;
+        offset += n;
+        width -= n;
+    }
+
+    return 0;
+}
+
+int
+page_match_field(Page page, size_t offset, size_t width, const void* value, int* record_ids)
+{
+    if (page == NULL || value == NULL || record_ids == NULL || width == 0) {
+        return PAGE_ARG_INVALID;
+    }
+
+    int field = field_of(page, offset, width);
+    if (field < 0) {
+        return PAGE_ARG_INVALID;
+    }
+
+    size_t stride = page->field_sizes[field];
+    const char* values = get_value(page, field, 0) + (offset - page->field_starts[field]);
+    int n_records = page->n_records;
+    int n_matches = 0;
+    int record_id = 0;
+
+    /*
+     * A whole 4 or 8 byte field is a contiguous aligned array. It is compared MATCH_BLOCK values
+     * at a time into flags, which the compiler vectorises, then the flags are turned into ids,
+     * writing every id and only advancing the count on a match so there are no branches.
+     * 8 byte values are compared as two 4 byte halves since x86-64 only compares 8 byte vectors
+     * from SSE4.1 on.
+     */
+    if (width == stride && (width == sizeof(uint32_t) || width == sizeof(uint64_t))) {
+        const uint32_t* words = (const uint32_t*)values;
+        uint32_t v[2] = {0};
+        uint8_t hits[MATCH_BLOCK];
+        memcpy(v, value, width);
+
+        for (; record_id + MATCH_BLOCK <= n_records; record_id += MATCH_BLOCK) {
+            if (width == sizeof(uint32_t)) {
+                const uint32_t* block = words + record_id;
+                for (int i = 0; i < MATCH_BLOCK; i++) {
+                    hits[i] = block[i] == v[0];
+                }
+            } else {
+                const uint32_t* block = words + 2 * record_id;
+                for (int i = 0; i < MATCH_BLOCK; i++) {
+                    hits[i] = (block[2 * i] == v[0]) & (block[2 * i + 1] == v[1]);
+                }
+            }
+            for (int i = 0; i < MATCH_BLOCK; i++) {
+                record_ids[n_matches] = record_id + i;
+                n_matches += hits[i];
+            }
+        }
+    }
+
+    /* What is left over, and fields of other widths, a record at a time. */
+    for (; record_id < n_records; record_id++) {
+        record_ids[n_matches] = record_id;
+        n_matches += memcmp(values + record_id * stride, value, width) == 0;
+    }
+
+    return n_matches;
+}
+
+int
+page_find_key(Page page, void* key, size_t key_size)
+{
+    if (page == NULL || key == NULL || key_size == 0 || key_size > page->record_size) {
+        return PAGE_ARG_INVALID;
+    }
+
+    for (int record_id = 0; record_id < page->n_records; record_id++) {
+        if (compare_bytes(page, record_id, key, key_size) == 0) {
+            return record_id;
+        }
+    }
+
+    return PAGE_RECORD_NOT_FOUND;
+}
+
+int
+page_n_records(Page page)
+{
+    if (page == NULL) {
+        return 0;
+    }
+
+    return page->n_records;
+}
+
+int
+page_capacity(size_t size, size_t record_size)
+{
+    if (size <= header_size() || record_size == 0) {
+        return 0;
+    }
+
+    return (size - header_size() - 1) / record_size;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static size_t
+header_size()
+{
+    return sizeof(struct page);
+}
+
+static int
+has_space(Page page)
+{
+    return page->n_records < page->capacity;
+}
+
+static size_t
+align_up(size_t size)
+{
+    return (size + MINIPAGE_ALIGNMENT - 1) & ~(size_t)(MINIPAGE_ALIGNMENT - 1);
+}
+
+/*
+ * Returns the bytes taken by the minipages of a page holding capacity records.
+ */
+static size_t
+minipages_size(Page page, int capacity)
+{
+    size_t size = 0;
+    for (int i = 0; i < page->n_fields; i++) {
+        size += align_up((size_t)capacity * page->field_sizes[i]);
+    }
+
+    return size;
+}
+
+static char*
+get_value(Page page, int field, int record_id)
+{
+    return page->data + page->minipages[field] + (size_t)record_id * page->field_sizes[field];
+}
+
+/*
+ * Returns the field holding all width bytes at offset, or PAGE_ARG_INVALID if there isn't one.
+ */
+static int
+field_of(Page page, size_t offset, size_t width)
+{
+    for (int field = 0; field < page->n_fields; field++) {
+        size_t start = page->field_starts[field];
+        if (start <= offset && offset + width <= start + page->field_sizes[field]) {
+            return field;
+        }
+    }
+
+    return PAGE_ARG_INVALID;
+}
+
+static void
+write_record(Page page, int record_id, const void* record)
+{
+    for (int field = 0; field < page->n_fields; field++) {
+        memcpy(get_value(page, field, record_id), (const char*)record + page->field_starts[field],
+            page->field_sizes[field]);
+    }
+}
+
+static void
+read_record(Page page, int record_id, void* out)
+{
+    for (int field = 0; field < page->n_fields; field++) {
+        memcpy((char*)out + page->field_starts[field], get_value(page, field, record_id),
+            page->field_sizes[field]);
+    }
+}
+
+/*
+ * Compares the first len bytes of the record with bytes, field by field.
+ */
+static int
+compare_bytes(Page page, int record_id, const void* bytes, size_t len)
+{
+    for (int field = 0; field < page->n_fields && page->field_starts[field] < len; field++) {
+        size_t n = len - page->field_starts[field];
+        if (n > page->field_sizes[field]) {
+            n = page->field_sizes[field];
+        }
+
+        int cmp = memcmp(get_value(page, field, record_id),
+            (const char*)bytes + page->field_starts[field], n);
+        if (cmp != 0) {
+            return cmp;
+        }
+    }
+
+    return 0;
+}
+
+static int
+find_record(Page page, void* record)
+{
+    for (int record_id = 0; record_id < page->n_records; record_id++) {
+        if (compare_bytes(page, record_id, record, page->record_size) == 0) {
+            return record_id;
+        }
+    }
+
+    return PAGE_RECORD_NOT_FOUND;
+}
+
+/*
+ * Deletes the record by moving the last record into its place.
+ */
+static void
+delete_record(Page page, int record_id)
+{
+    int last = page->n_records - 1;
+    for (int field = 0; field < page->n_fields; field++) {
+        memmove(get_value(page, field, record_id), get_value(page, field, last),
+            page->field_sizes[field]);
+        memset(get_value(page, field, last), 0, page->field_sizes[field]);
+    }
+    page->n_records--;
+}
@@ -0,0 +1,63 @@
+#include <string.h>
+#include "protocol.h"
+
+void
+protocol_write_header(void* buf, ProtocolHeader header)
+{
+    uint8_t* p = buf;
+
+    protocol_write_u32(p, header.length);
+    p[4] = header.code;
+    memset(p + 5, 0, 3);
+    protocol_write_u32(p + 8, header.id);
+}
+
+long
+protocol_read_header(const void* buf, size_t len, ProtocolHeader* header)
+{
+    const uint8_t* p = buf;
+
+    if (len < PROTOCOL_HEADER_SIZE) {
+        return PROTOCOL_INCOMPLETE;
+    }
+
+    header->length = protocol_read_u32(p);
+    header->code = p[4];
+    header->id = protocol_read_u32(p + 8);
+
+    if (len - PROTOCOL_HEADER_SIZE < header->length) {
+        return PROTOCOL_INCOMPLETE;
+    }
+
+    return PROTOCOL_HEADER_SIZE + (long)header->length;
+}
+
+void
+protocol_write_u32(void* buf, uint32_t v)
+{
+    uint8_t* p = buf;
+
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+uint32_t
+protocol_read_u32(const void* buf)
+{
+    const uint8_t* p = buf;
+
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+ProtocolStatus
+protocol_status(int table_result)
+{
+    if (table_result > 0 || table_result < -PROTOCOL_NO_MEMORY) {
+        return PROTOCOL_ARG_INVALID;
+    }
+
+    return -table_result;
+}
+
@@ -0,0 +1,953 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+#include "hash.h"
+#include "page.h"
+#include "query.h"
+
+/*
+ * A partition entry is the key's hash followed by the record or group it belongs to. Partitions
+ * are numbered by the top bits of the hash and hashed within by the bottom bits, so the two don't
+ * depend on each other.
+ * Partitions are sized so a partition's hash table fits in a core's L2 cache.
+ */
+
+#define PARTITION_BYTES (256 * 1024)
+#define MAX_PARTITION_BITS (12)
+#define MIN_GROUP_SLOTS (64)
+
+typedef void (*TaskFn)(void* arg, int worker);
+
+struct worker
+{
+    QueryPool   pool;
+    int         id;
+    pthread_t   thread;
+};
+
+struct query_pool
+{
+    pthread_mutex_t run_latch;
+    pthread_mutex_t latch;
+    pthread_cond_t  ready;
+    pthread_cond_t  done;
+    TaskFn          task;
+    void*           arg;
+    uint64_t        generation;
+    int             n_running;
+    int             stopping;
+    int             n_workers;
+    struct worker*  workers;
+};
+
+/*
+ * A growable array of partition entries, one per worker per partition so workers never share one.
+ */
+struct run
+{
+    char*   entries;
+    size_t  n;
+    size_t  max;
+};
+
+/*
+ * One input of a join and the partitions its records were scattered into.
+ */
+struct side
+{
+    Table           table;
+    size_t          offset;
+    size_t          entry_size;
+    size_t          n_morsels;
+    struct run*     runs;
+};
+
+struct join
+{
+    QueryPool       pool;
+    size_t          width;
+    int             bits;
+    size_t          n_partitions;
+    struct side     sides[2];
+    int             build;
+    size_t          next;
+    QueryJoinFn     fn;
+    void*           ctx;
+    int             result;
+};
+
+/*
+ * A worker's hash table over the build side of one partition at a time, kept between partitions.
+ * Chains hold an entry's number plus one, so zero ends them.
+ */
+struct probe_table
+{
+    uint32_t*   heads;
+    size_t      max_heads;
+    uint32_t*   chain;
+    size_t      max_chain;
+    char**      entries;
+    size_t      max_entries;
+};
+
+/*
+ * An open addressing table of groups. Each slot is the key's hash with the low bit set, so an
+ * empty slot is zero, then the aggregates and then the key.
+ */
+struct groups
+{
+    char*   slots;
+    size_t  n;
+    size_t  max;
+};
+
+struct group_by
+{
+    QueryPool       pool;
+    Table           table;
+    size_t          offset;
+    size_t          width;
+    QueryAggregate  aggregates[QUERY_MAX_AGGREGATES];
+    int             n_aggregates;
+    size_t          slot_size;
+    int             bits;
+    size_t          n_partitions;
+    size_t          n_morsels;
+    struct groups*  groups;
+    size_t          next;
+    QueryGroupFn    fn;
+    void*           ctx;
+    int             result;
+};
+
+/*
+ * What a worker needs while it scatters the pages of a morsel.
+ */
+struct scatter
+{
+    void*   query;
+    int     side;
+    int     worker;
+    char*   record;
+    int64_t values[QUERY_MAX_AGGREGATES];
+};
+
+static void* worker_main(void* arg);
+static void run_task(QueryPool pool, TaskFn task, void* arg);
+static void stop_workers(QueryPool pool, int n_workers);
+static void free_pool(QueryPool pool, int max_workers);
+static int partition_bits(size_t n_bytes);
+static size_t partition_of(uint64_t hash, int bits);
+static char* run_append(struct run* run, size_t entry_size);
+static void free_runs(struct run* runs, size_t n_runs, size_t entry_size);
+static void fail(int* result, int error);
+static void lock_tables(Table a, Table b);
+static void unlock_tables(Table a, Table b);
+static void join_scatter(void* arg, int worker);
+static void join_scatter_page(Page page, void* ctx);
+static void join_partitions(void* arg, int worker);
+static void join_partition(struct join* join, size_t partition, struct probe_table* table);
+static int reserve_probe_table(struct probe_table* table, size_t n_heads, size_t n_entries);
+static void free_probe_table(struct probe_table* table);
+static void group_scatter(void* arg, int worker);
+static void group_scatter_page(Page page, void* ctx);
+static void group_partitions(void* arg, int worker);
+static char* group_find(struct group_by* gb, struct groups* groups, uint64_t hash,
+    const void* key);
+static void group_combine(struct group_by* gb, char* slot, const int64_t* values);
+static void free_groups(struct group_by* gb, struct groups* groups);
+static int64_t read_int(Page page, int record_id, size_t offset, size_t width);
+static int is_valid_aggregate(const QueryAggregate* aggregate, size_t record_size);
+
+QueryPool
+query_pool_create(int n_threads)
+{
+    if (n_threads <= 0) {
+        return NULL;
+    }
+
+    QueryPool pool = budget_calloc(NULL, 1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->workers = budget_calloc(NULL, n_threads, sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        budget_dealloc(NULL, pool, sizeof(*pool));
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->run_latch, NULL);
+    pthread_mutex_init(&pool->latch, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->n_workers = n_threads;
+
+    for (int i = 0; i < n_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            stop_workers(pool, i);
+            free_pool(pool, n_threads);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void
+query_pool_free(QueryPool* pool)
+{
+    if (pool == NULL || *pool == NULL) {
+        return;
+    }
+
+    stop_workers(*pool, (*pool)->n_workers);
+    free_pool(*pool, (*pool)->n_workers);
+    *pool = NULL;
+}
+
+int
+query_pool_size(QueryPool pool)
+{
+    return pool == NULL ? 0 : pool->n_workers;
+}
+
+int
+query_join(QueryPool pool, Table left, size_t left_offset, Table right, size_t right_offset,
+    size_t width, QueryJoinFn fn, void* ctx)
+{
+    if (pool == NULL || left == NULL || right == NULL || fn == NULL || width == 0
+        || left_offset + width > table_record_size(left)
+        || right_offset + width > table_record_size(right)) {
+        return QUERY_ARG_INVALID;
+    }
+
+    struct join join = {
+        .pool = pool,
+        .width = width,
+        .sides = {
+            {.table = left, .offset = left_offset,
+                .entry_size = sizeof(uint64_t) + table_record_size(left)},
+            {.table = right, .offset = right_offset,
+                .entry_size = sizeof(uint64_t) + table_record_size(right)},
+        },
+        .fn = fn,
+        .ctx = ctx,
+    };
+
+    /* Counted before latching, the sizes only steer how finely the tables are partitioned. */
+    size_t n_left = table_count(left);
+    size_t n_right = table_count(right);
+    join.build = n_left <= n_right ? 0 : 1;
+    struct side* build = &join.sides[join.build];
+    join.bits = partition_bits((join.build == 0 ? n_left : n_right) * build->entry_size);
+    join.n_partitions = (size_t)1 << join.bits;
+
+    size_t n_runs = join.n_partitions * pool->n_workers;
+    for (int s = 0; s < 2; s++) {
+        join.sides[s].runs = budget_calloc(NULL, n_runs, sizeof(struct run));
+        if (join.sides[s].runs == NULL) {
+            budget_dealloc(NULL, join.sides[0].runs, n_runs * sizeof(struct run));
+            return QUERY_NO_MEMORY;
+        }
+    }
+
+    lock_tables(left, right);
+    join.sides[0].n_morsels = table_n_morsels(left);
+    join.sides[1].n_morsels = table_n_morsels(right);
+
+    run_task(pool, join_scatter, &join);
+    if (join.result == 0) {
+        join.next = 0;
+        run_task(pool, join_partitions, &join);
+    }
+    unlock_tables(left, right);
+
+    for (int s = 0; s < 2; s++) {
+        free_runs(join.sides[s].runs, n_runs, join.sides[s].entry_size);
+    }
+
+    return join.result;
+}
+
+int
+query_group_by(QueryPool pool, Table table, size_t offset, size_t width,
+    const QueryAggregate* aggregates, int n_aggregates, QueryGroupFn fn, void* ctx)
+{
+    if (pool == NULL || table == NULL || fn == NULL || width == 0
+        || offset + width > table_record_size(table)
+        || (aggregates == NULL && n_aggregates > 0)
+        || !(0 <= n_aggregates && n_aggregates <= QUERY_MAX_AGGREGATES)) {
+        return QUERY_ARG_INVALID;
+    }
+
+    for (int i = 0; i < n_aggregates; i++) {
+        if (!is_valid_aggregate(&aggregates[i], table_record_size(table))) {
+            return QUERY_ARG_INVALID;
+        }
+    }
+
+    struct group_by gb = {
+        .pool = pool,
+        .table = table,
+        .offset = offset,
+        .width = width,
+        .n_aggregates = n_aggregates,
+        .fn = fn,
+        .ctx = ctx,
+    };
+    memcpy(gb.aggregates, aggregates, n_aggregates * sizeof(*aggregates));
+
+    /* The key is padded so the hash and aggregates of the next slot stay aligned. */
+    gb.slot_size = sizeof(uint64_t) + n_aggregates * sizeof(int64_t)
+        + (width + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+
+    /* There can't be more groups than records, and often far fewer, groups are allocated lazily. */
+    gb.bits = partition_bits(table_count(table) * gb.slot_size);
+    gb.n_partitions = (size_t)1 << gb.bits;
+
+    size_t n_groups = gb.n_partitions * pool->n_workers;
+    gb.groups = budget_calloc(NULL, n_groups, sizeof(struct groups));
+    if (gb.groups == NULL) {
+        return QUERY_NO_MEMORY;
+    }
+
+    table_latch(table);
+    gb.n_morsels = table_n_morsels(table);
+    run_task(pool, group_scatter, &gb);
+    if (gb.result == 0) {
+        gb.next = 0;
+        run_task(pool, group_partitions, &gb);
+    }
+    table_unlatch(table);
+
+    for (size_t i = 0; i < n_groups; i++) {
+        free_groups(&gb, &gb.groups[i]);
+    }
+    budget_dealloc(NULL, gb.groups, n_groups * sizeof(struct groups));
+
+    return gb.result;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static void*
+worker_main(void* arg)
+{
+    struct worker* worker = arg;
+    QueryPool pool = worker->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->latch);
+    for (;;) {
+        while (pool->generation == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->latch);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->generation;
+        TaskFn task = pool->task;
+        void* task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->latch);
+
+        task(task_arg, worker->id);
+
+        pthread_mutex_lock(&pool->latch);
+        if (--pool->n_running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->latch);
+
+    return NULL;
+}
+
+/*
+ * Runs task on every worker and waits for all of them to return. Queries sharing a pool take
+ * turns.
+ */
+static void
+run_task(QueryPool pool, TaskFn task, void* arg)
+{
+    pthread_mutex_lock(&pool->run_latch);
+    pthread_mutex_lock(&pool->latch);
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_running = pool->n_workers;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->ready);
+    while (pool->n_running > 0) {
+        pthread_cond_wait(&pool->done, &pool->latch);
+    }
+    pthread_mutex_unlock(&pool->latch);
+    pthread_mutex_unlock(&pool->run_latch);
+}
+
+static void
+stop_workers(QueryPool pool, int n_workers)
+{
+    pthread_mutex_lock(&pool->latch);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->latch);
+
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+}
+
+/*
+ * Frees a pool whose workers have stopped, its workers array having room for max_workers.
+ */
+static void
+free_pool(QueryPool pool, int max_workers)
+{
+    pthread_mutex_destroy(&pool->run_latch);
+    pthread_mutex_destroy(&pool->latch);
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->done);
+    budget_dealloc(NULL, pool->workers, max_workers * sizeof(struct worker));
+    budget_dealloc(NULL, pool, sizeof(*pool));
+}
+
+/*
+ * Returns how many top bits of the hash pick a partition so that n_bytes of entries make
+ * partitions of about PARTITION_BYTES.
+ */
+static int
+partition_bits(size_t n_bytes)
+{
+    int bits = 0;
+    while (bits < MAX_PARTITION_BITS && (n_bytes >> bits) > PARTITION_BYTES) {
+        bits++;
+    }
+
+    return bits;
+}
+
+static size_t
+partition_of(uint64_t hash, int bits)
+{
+    return bits == 0 ? 0 : hash >> (64 - bits);
+}
+
+/*
+ * Returns room for one more entry at the end of the run.
+ * Returns NULL if the run could not grow.
+ */
+static char*
+run_append(struct run* run, size_t entry_size)
+{
+    if (run->n == run->max) {
+        size_t max = run->max == 0 ? 64 : run->max * 2;
+        char* entries = budget_realloc(NULL, run->entries, run->max * entry_size,
+            max * entry_size);
+        if (entries == NULL) {
+            return NULL;
+        }
+        run->entries = entries;
+        run->max = max;
+    }
+
+    return run->entries + run->n++ * entry_size;
+}
+
+static void
+free_runs(struct run* runs, size_t n_runs, size_t entry_size)
+{
+    for (size_t i = 0; i < n_runs; i++) {
+        budget_dealloc(NULL, runs[i].entries, runs[i].max * entry_size);
+    }
+    budget_dealloc(NULL, runs, n_runs * sizeof(*runs));
+}
+
+/*
+ * Records why the query stopped, the first reason wins.
+ */
+static void
+fail(int* result, int error)
+{
+    int none = 0;
+    __atomic_compare_exchange_n(result, &none, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Latches both tables in address order, so two joins of the same tables can't deadlock.
+ */
+static void
+lock_tables(Table a, Table b)
+{
+    if (a == b) {
+        table_latch(a);
+    } else if (a < b) {
+        table_latch(a);
+        table_latch(b);
+    } else {
+        table_latch(b);
+        table_latch(a);
+    }
+}
+
+static void
+unlock_tables(Table a, Table b)
+{
+    table_unlatch(a);
+    if (a != b) {
+        table_unlatch(b);
+    }
+}
+
+/*
+ * Scatters the records of both tables into their partitions, a morsel at a time.
+ */
+static void
+join_scatter(void* arg, int worker)
+{
+    struct join* join = arg;
+    size_t record_size = table_record_size(join->sides[0].table);
+    if (table_record_size(join->sides[1].table) > record_size) {
+        record_size = table_record_size(join->sides[1].table);
+    }
+
+    struct scatter scatter = {.query = join, .worker = worker};
+    scatter.record = budget_alloc(NULL, record_size);
+    if (scatter.record == NULL) {
+        fail(&join->result, QUERY_NO_MEMORY);
+        return;
+    }
+
+    size_t n_morsels = join->sides[0].n_morsels + join->sides[1].n_morsels;
+    for (;;) {
+        size_t morsel = __atomic_fetch_add(&join->next, 1, __ATOMIC_RELAXED);
+        if (morsel >= n_morsels || __atomic_load_n(&join->result, __ATOMIC_RELAXED) != 0) {
+            break;
+        }
+
+        scatter.side = morsel < join->sides[0].n_morsels ? 0 : 1;
+        if (scatter.side == 1) {
+            morsel -= join->sides[0].n_morsels;
+        }
+        if (table_morsel(join->sides[scatter.side].table, morsel, join_scatter_page, &scatter)
+            != 0) {
+            fail(&join->result, QUERY_IO_ERROR);
+        }
+    }
+
+    budget_dealloc(NULL, scatter.record, record_size);
+}
+
+static void
+join_scatter_page(Page page, void* ctx)
+{
+    struct scatter* scatter = ctx;
+    struct join* join = scatter->query;
+    struct side* side = &join->sides[scatter->side];
+    size_t record_size = side->entry_size - sizeof(uint64_t);
+
+    for (int r = 0; r < page_n_records(page); r++) {
+        page_copy_record(page, r, scatter->record);
+        uint64_t hash = hash_fast(scatter->record + side->offset, join->width, 0);
+        size_t partition = partition_of(hash, join->bits);
+
+        struct run* run = &side->runs[scatter->worker * join->n_partitions + partition];
+        char* entry = run_append(run, side->entry_size);
+        if (entry == NULL) {
+            fail(&join->result, QUERY_NO_MEMORY);
+            return;
+        }
+        memcpy(entry, &hash, sizeof(hash));
+        memcpy(entry + sizeof(hash), scatter->record, record_size);
+    }
+}
+
+/*
+ * Joins the partitions one at a time, the hash table of each is reused for the next.
+ */
+static void
+join_partitions(void* arg, int worker)
+{
+    (void)worker;
+    struct join* join = arg;
+    struct probe_table table = {0};
+
+    for (;;) {
+        size_t partition = __atomic_fetch_add(&join->next, 1, __ATOMIC_RELAXED);
+        if (partition >= join->n_partitions
+            || __atomic_load_n(&join->result, __ATOMIC_RELAXED) != 0) {
+            break;
+        }
+        join_partition(join, partition, &table);
+    }
+
+    free_probe_table(&table);
+}
+
+/*
+ * Builds a hash table over the build side's entries of the partition, from every worker's run,
+ * and probes it with the other side's.
+ */
+static void
+join_partition(struct join* join, size_t partition, struct probe_table* table)
+{
+    struct side* build = &join->sides[join->build];
+    struct side* probe = &join->sides[1 - join->build];
+    int n_workers = join->pool->n_workers;
+
+    size_t n_build = 0;
+    for (int w = 0; w < n_workers; w++) {
+        n_build += build->runs[w * join->n_partitions + partition].n;
+    }
+    if (n_build == 0) {
+        return;
+    }
+
+    size_t n_heads = MIN_GROUP_SLOTS;
+    while (n_heads < n_build * 2) {
+        n_heads *= 2;
+    }
+    if (reserve_probe_table(table, n_heads, n_build) != 0) {
+        fail(&join->result, QUERY_NO_MEMORY);
+        return;
+    }
+
+    memset(table->heads, 0, n_heads * sizeof(*table->heads));
+    uint32_t id = 0;
+    for (int w = 0; w < n_workers; w++) {
+        struct run* run = &build->runs[w * join->n_partitions + partition];
+        for (size_t i = 0; i < run->n; i++) {
+            char* entry = run->entries + i * build->entry_size;
+            uint64_t hash;
+            memcpy(&hash, entry, sizeof(hash));
+            table->entries[id] = entry;
+            table->chain[id] = table->heads[hash & (n_heads - 1)];
+            table->heads[hash & (n_heads - 1)] = ++id;
+        }
+    }
+
+    for (int w = 0; w < n_workers; w++) {
+        struct run* run = &probe->runs[w * join->n_partitions + partition];
+        for (size_t i = 0; i < run->n; i++) {
+            char* entry = run->entries + i * probe->entry_size;
+            uint64_t hash;
+            memcpy(&hash, entry, sizeof(hash));
+            const char* key = entry + sizeof(hash) + probe->offset;
+
+            for (uint32_t m = table->heads[hash & (n_heads - 1)]; m != 0; m = table->chain[m - 1]) {
+                char* match = table->entries[m - 1];
+                uint64_t match_hash;
+                memcpy(&match_hash, match, sizeof(match_hash));
+                if (match_hash != hash
+                    || memcmp(match + sizeof(hash) + build->offset, key, join->width) != 0) {
+                    continue;
+                }
+
+                const char* left = join->build == 0 ? match : entry;
+                const char* right = join->build == 0 ? entry : match;
+                int stop = join->fn(left + sizeof(hash), right + sizeof(hash), join->ctx);
+                if (stop) {
+                    fail(&join->result, stop);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Makes room in the table for n_heads chains and n_entries entries.
+ */
+static int
+reserve_probe_table(struct probe_table* table, size_t n_heads, size_t n_entries)
+{
+    if (n_heads > table->max_heads) {
+        uint32_t* heads = budget_realloc(NULL, table->heads,
+            table->max_heads * sizeof(*heads), n_heads * sizeof(*heads));
+        if (heads == NULL) {
+            return QUERY_NO_MEMORY;
+        }
+        table->heads = heads;
+        table->max_heads = n_heads;
+    }
+
+    if (n_entries > table->max_chain) {
+        uint32_t* chain = budget_realloc(NULL, table->chain,
+            table->max_chain * sizeof(*chain), n_entries * sizeof(*chain));
+        if (chain == NULL) {
+            return QUERY_NO_MEMORY;
+        }
+        table->chain = chain;
+        table->max_chain = n_entries;
+    }
+
+    if (n_entries > table->max_entries) {
+        char** entries = budget_realloc(NULL, table->entries,
+            table->max_entries * sizeof(*entries), n_entries * sizeof(*entries));
+        if (entries == NULL) {
+            return QUERY_NO_MEMORY;
+        }
+        table->entries = entries;
+        table->max_entries = n_entries;
+    }
+
+    return 0;
+}
+
+static void
+free_probe_table(struct probe_table* table)
+{
+    budget_dealloc(NULL, table->heads, table->max_heads * sizeof(*table->heads));
+    budget_dealloc(NULL, table->chain, table->max_chain * sizeof(*table->chain));
+    budget_dealloc(NULL, table->entries, table->max_entries * sizeof(*table->entries));
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Aggregates the table's records into each worker's own groups, a morsel at a time.
+ */
+static void
+group_scatter(void* arg, int worker)
+{
+    struct group_by* gb = arg;
+    struct scatter scatter = {.query = gb, .worker = worker};
+    scatter.record = budget_alloc(NULL, gb->width);
+    if (scatter.record == NULL) {
+        fail(&gb->result, QUERY_NO_MEMORY);
+        return;
+    }
+
+    for (;;) {
+        size_t morsel = __atomic_fetch_add(&gb->next, 1, __ATOMIC_RELAXED);
+        if (morsel >= gb->n_morsels || __atomic_load_n(&gb->result, __ATOMIC_RELAXED) != 0) {
+            break;
+        }
+        if (table_morsel(gb->table, morsel, group_scatter_page, &scatter) != 0) {
+            fail(&gb->result, QUERY_IO_ERROR);
+        }
+    }
+
+    budget_dealloc(NULL, scatter.record, gb->width);
+}
+
+static void
+group_scatter_page(Page page, void* ctx)
+{
+    struct scatter* scatter = ctx;
+    struct group_by* gb = scatter->query;
+
+    for (int r = 0; r < page_n_records(page); r++) {
+        page_copy_field(page, r, gb->offset, gb->width, scatter->record);
+        uint64_t hash = hash_fast(scatter->record, gb->width, 0);
+        size_t partition = partition_of(hash, gb->bits);
+
+        struct groups* groups = &gb->groups[scatter->worker * gb->n_partitions + partition];
+        char* slot = group_find(gb, groups, hash, scatter->record);
+        if (slot == NULL) {
+            fail(&gb->result, QUERY_NO_MEMORY);
+            return;
+        }
+
+        /* A single record is a group of one, combined into the slot like any other. */
+        for (int a = 0; a < gb->n_aggregates; a++) {
+            QueryAggregate* aggregate = &gb->aggregates[a];
+            scatter->values[a] = aggregate->op == QUERY_COUNT ? 1
+                : read_int(page, r, aggregate->offset, aggregate->width);
+        }
+        group_combine(gb, slot, scatter->values);
+    }
+}
+
+/*
+ * Merges each partition's groups from every worker and hands them to fn.
+ */
+static void
+group_partitions(void* arg, int worker)
+{
+    (void)worker;
+    struct group_by* gb = arg;
+    int n_workers = gb->pool->n_workers;
+
+    for (;;) {
+        size_t partition = __atomic_fetch_add(&gb->next, 1, __ATOMIC_RELAXED);
+        if (partition >= gb->n_partitions
+            || __atomic_load_n(&gb->result, __ATOMIC_RELAXED) != 0) {
+            break;
+        }
+
+        /* The first worker's groups take in everyone else's. */
+        struct groups* merged = &gb->groups[partition];
+        for (int w = 1; w < n_workers; w++) {
+            struct groups* groups = &gb->groups[w * gb->n_partitions + partition];
+            for (size_t i = 0; i < groups->max; i++) {
+                char* slot = groups->slots + i * gb->slot_size;
+                uint64_t hash;
+                memcpy(&hash, slot, sizeof(hash));
+                if (hash == 0) {
+                    continue;
+                }
+
+                const int64_t* values = (int64_t*)(slot + sizeof(hash));
+                char* into = group_find(gb, merged, hash,
+                    slot + sizeof(hash) + gb->n_aggregates * sizeof(int64_t));
+                if (into == NULL) {
+                    fail(&gb->result, QUERY_NO_MEMORY);
+                    return;
+                }
+                group_combine(gb, into, values);
+            }
+            free_groups(gb, groups);
+        }
+
+        for (size_t i = 0; i < merged->max; i++) {
+            char* slot = merged->slots + i * gb->slot_size;
+            uint64_t hash;
+            memcpy(&hash, slot, sizeof(hash));
+            if (hash == 0) {
+                continue;
+            }
+
+            int stop = gb->fn(slot + sizeof(hash) + gb->n_aggregates * sizeof(int64_t),
+                (int64_t*)(slot + sizeof(hash)), gb->ctx);
+            if (stop) {
+                fail(&gb->result, stop);
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Returns the slot of the group with the given key, adding it with every aggregate at its
+ * identity if it is new. The table doubles when it is half full.
+ * Returns NULL if the table could not grow.
+ */
+static char*
+group_find(struct group_by* gb, struct groups* groups, uint64_t hash, const void* key)
+{
+    if (groups->n * 2 >= groups->max) {
+        struct groups grown = {.max = groups->max == 0 ? MIN_GROUP_SLOTS : groups->max * 2};
+        grown.slots = budget_calloc(NULL, grown.max, gb->slot_size);
+        if (grown.slots == NULL) {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < groups->max; i++) {
+            char* slot = groups->slots + i * gb->slot_size;
+            uint64_t stored;
+            memcpy(&stored, slot, sizeof(stored));
+            if (stored == 0) {
+                continue;
+            }
+
+            size_t j = (stored >> 1) & (grown.max - 1);
+            while (*(uint64_t*)(grown.slots + j * gb->slot_size) != 0) {
+                j = (j + 1) & (grown.max - 1);
+            }
+            memcpy(grown.slots + j * gb->slot_size, slot, gb->slot_size);
+        }
+        grown.n = groups->n;
+        free_groups(gb, groups);
+        *groups = grown;
+    }
+
+    /* The low bit of a stored hash is always set, so slots are picked by the bits above it. */
+    uint64_t stored = hash | 1;
+    size_t key_offset = sizeof(stored) + gb->n_aggregates * sizeof(int64_t);
+    size_t i = (stored >> 1) & (groups->max - 1);
+    for (;;) {
+        char* slot = groups->slots + i * gb->slot_size;
+        uint64_t found;
+        memcpy(&found, slot, sizeof(found));
+        if (found == 0) {
+            memcpy(slot, &stored, sizeof(stored));
+            int64_t* values = (int64_t*)(slot + sizeof(stored));
+            for (int a = 0; a < gb->n_aggregates; a++) {
+                values[a] = gb->aggregates[a].op == QUERY_MIN ? INT64_MAX
+                    : gb->aggregates[a].op == QUERY_MAX ? INT64_MIN : 0;
+            }
+            memcpy(slot + key_offset, key, gb->width);
+            groups->n++;
+            return slot;
+        }
+        if (found == stored && memcmp(slot + key_offset, key, gb->width) == 0) {
+            return slot;
+        }
+        i = (i + 1) & (groups->max - 1);
+    }
+}
+
+/*
+ * Folds a group's partial aggregates into the slot.
+ */
+static void
+group_combine(struct group_by* gb, char* slot, const int64_t* values)
+{
+    int64_t* into = (int64_t*)(slot + sizeof(uint64_t));
+    for (int a = 0; a < gb->n_aggregates; a++) {
+        switch (gb->aggregates[a].op) {
+        case QUERY_COUNT:
+        case QUERY_SUM:
+            into[a] += values[a];
+            break;
+        case QUERY_MIN:
+            into[a] = values[a] < into[a] ? values[a] : into[a];
+            break;
+        case QUERY_MAX:
+            into[a] = values[a] > into[a] ? values[a] : into[a];
+            break;
+        }
+    }
+}
+
+static void
+free_groups(struct group_by* gb, struct groups* groups)
+{
+    budget_dealloc(NULL, groups->slots, groups->max * gb->slot_size);
+    memset(groups, 0, sizeof(*groups));
+}
+
+static int64_t
+read_int(Page page, int record_id, size_t offset, size_t width)
+{
+    int8_t v8;
+    int16_t v16;
+    int32_t v32;
+    int64_t v64 = 0;
+
+    switch (width) {
+    case 1:
+        page_copy_field(page, record_id, offset, width, &v8);
+        return v8;
+    case 2:
+        page_copy_field(page, record_id, offset, width, &v16);
+        return v16;
+    case 4:
+        page_copy_field(page, record_id, offset, width, &v32);
+        return v32;
+    }
+
+    page_copy_field(page, record_id, offset, width, &v64);
+    return v64;
+}
+
+static int
+is_valid_aggregate(const QueryAggregate* aggregate, size_t record_size)
+{
+    switch (aggregate->op) {
+    case QUERY_COUNT:
+        return 1;
+    case QUERY_SUM:
+    case QUERY_MIN:
+    case QUERY_MAX:
+        return (aggregate->width == 1 || aggregate->width == 2 || aggregate->width == 4
+            || aggregate->width == 8) && aggregate->offset + aggregate->width <= record_size;
+    }
+
+    return 0;
+}
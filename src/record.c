@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include "budget.h"
 #include "record.h"
 
 struct record
@@ -15,15 +16,15 @@ record_create(void* record, size_t size)
         return NULL;
     }
 
-    Record rec = malloc(sizeof(*rec));
+    Record rec = budget_alloc(NULL, sizeof(*rec));
     if (rec == NULL) {
         return NULL;
     }
     
     rec->size = size;
-    rec->record = malloc(rec->size);
+    rec->record = budget_alloc(NULL, rec->size);
     if (rec->record == NULL) {
-        free(rec);
+        budget_dealloc(NULL, rec, sizeof(*rec));
         return NULL;
     }
     memcpy(rec->record, record, size);
@@ -38,8 +39,8 @@ record_free(Record* record)
         return ;
     }
 
-    free((*record)->record);
-    free(*record);
+    budget_dealloc(NULL, (*record)->record, (*record)->size);
+    budget_dealloc(NULL, *record, sizeof(**record));
     *record = NULL;
 }
 
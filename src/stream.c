@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stream.h"
+
+/*
+ * The caller works on one buffer while the thread works on the other, and they trade buffers
+ * through handed. A writer's caller hands over a full buffer, the thread writes it out and clears
+ * handed, which frees it for the caller once the other one fills up. A reader's thread hands over
+ * a buffer it has read, the caller clears handed when it takes it, which frees the buffer it has
+ * just finished with for the thread.
+ * A reader hands over a buffer early when a read comes back short, so a pipe or socket that has
+ * gone quiet doesn't keep the bytes already read from the caller.
+ */
+
+struct stream
+{
+    int             fd;
+    int             writing;
+    size_t          buffer_size;
+    Budget          budget;
+    char*           buffers[2];
+
+    char*           current;
+    size_t          start;
+    size_t          length;
+    int             result;
+
+    pthread_t       thread;
+    pthread_mutex_t latch;
+    pthread_cond_t  changed;
+    char*           handed;
+    size_t          handed_length;
+    int             handed_result;
+    int             stopping;
+    int             error;
+};
+
+static Stream create_stream(int fd, size_t buffer_size, Budget budget, int writing);
+static void free_stream(Stream stream);
+static int hand_over(Stream stream);
+static void take_over(Stream stream);
+static void* write_main(void* arg);
+static void* read_main(void* arg);
+static int write_fully(int fd, const char* data, size_t size);
+static int read_some(int fd, char* data, size_t size, size_t* length);
+
+Stream
+stream_writer(int fd, size_t buffer_size, Budget budget)
+{
+    return create_stream(fd, buffer_size, budget, 1);
+}
+
+Stream
+stream_reader(int fd, size_t buffer_size, Budget budget)
+{
+    return create_stream(fd, buffer_size, budget, 0);
+}
+
+int
+stream_write(Stream stream, const void* data, size_t size)
+{
+    if (stream == NULL || !stream->writing || (data == NULL && size > 0)) {
+        return STREAM_ARG_INVALID;
+    }
+
+    const char* from = data;
+    while (size > 0) {
+        if (stream->length == stream->buffer_size && hand_over(stream) != 0) {
+            return STREAM_IO_ERROR;
+        }
+
+        size_t n = stream->buffer_size - stream->length;
+        n = n < size ? n : size;
+        memcpy(stream->current + stream->length, from, n);
+        stream->length += n;
+        from += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int
+stream_read(Stream stream, void* data, size_t size)
+{
+    if (stream == NULL || stream->writing || (data == NULL && size > 0)) {
+        return STREAM_ARG_INVALID;
+    }
+
+    char* to = data;
+    while (size > 0) {
+        if (stream->start == stream->length) {
+            /* The buffer that came with an error or the end of fd was the last one. */
+            if (stream->result != 0) {
+                return stream->result;
+            }
+            take_over(stream);
+            continue;
+        }
+
+        size_t n = stream->length - stream->start;
+        n = n < size ? n : size;
+        memcpy(to, stream->current + stream->start, n);
+        stream->start += n;
+        to += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int
+stream_close(Stream* stream)
+{
+    if (stream == NULL || *stream == NULL) {
+        return 0;
+    }
+
+    Stream s = *stream;
+    int result = 0;
+    if (s->writing && s->length > 0 && hand_over(s) != 0) {
+        result = STREAM_IO_ERROR;
+    }
+
+    pthread_mutex_lock(&s->latch);
+    s->stopping = 1;
+    pthread_cond_signal(&s->changed);
+    pthread_mutex_unlock(&s->latch);
+
+    /* A reader may be blocked on a pipe or socket that will never say more. */
+    if (!s->writing) {
+        pthread_cancel(s->thread);
+    }
+    pthread_join(s->thread, NULL);
+
+    if (s->writing && s->error != 0) {
+        result = STREAM_IO_ERROR;
+    }
+    free_stream(s);
+    *stream = NULL;
+
+    return result;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static Stream
+create_stream(int fd, size_t buffer_size, Budget budget, int writing)
+{
+    if (fd < 0 || buffer_size == 0) {
+        return NULL;
+    }
+
+    Stream stream = budget_calloc(budget, 1, sizeof(*stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->fd = fd;
+    stream->writing = writing;
+    stream->buffer_size = buffer_size;
+    stream->budget = budget;
+    stream->buffers[0] = budget_alloc(budget, buffer_size);
+    stream->buffers[1] = budget_alloc(budget, buffer_size);
+    pthread_mutex_init(&stream->latch, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    if (stream->buffers[0] == NULL || stream->buffers[1] == NULL
+        || pthread_create(&stream->thread, NULL, writing ? write_main : read_main, stream) != 0) {
+        free_stream(stream);
+        return NULL;
+    }
+
+    /* A writer's caller starts on the first buffer, a reader's waits for the thread to fill it. */
+    stream->current = writing ? stream->buffers[0] : NULL;
+
+    return stream;
+}
+
+static void
+free_stream(Stream stream)
+{
+    budget_dealloc(stream->budget, stream->buffers[0], stream->buffer_size);
+    budget_dealloc(stream->budget, stream->buffers[1], stream->buffer_size);
+    pthread_mutex_destroy(&stream->latch);
+    pthread_cond_destroy(&stream->changed);
+    budget_dealloc(stream->budget, stream, sizeof(*stream));
+}
+
+/*
+ * Gives the writer's thread the current buffer once it is done with the other, and carries on in
+ * the other one.
+ * Returns STREAM_IO_ERROR if an earlier write failed, the buffer is then kept.
+ */
+static int
+hand_over(Stream stream)
+{
+    pthread_mutex_lock(&stream->latch);
+    while (stream->handed != NULL) {
+        pthread_cond_wait(&stream->changed, &stream->latch);
+    }
+    int error = stream->error;
+    if (error == 0) {
+        stream->handed = stream->current;
+        stream->handed_length = stream->length;
+        pthread_cond_signal(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->latch);
+
+    if (error != 0) {
+        return STREAM_IO_ERROR;
+    }
+
+    stream->current = stream->current == stream->buffers[0] ? stream->buffers[1]
+        : stream->buffers[0];
+    stream->length = 0;
+
+    return 0;
+}
+
+/*
+ * Takes the next buffer the reader's thread has read, giving it back the current one.
+ */
+static void
+take_over(Stream stream)
+{
+    pthread_mutex_lock(&stream->latch);
+    while (stream->handed == NULL) {
+        pthread_cond_wait(&stream->changed, &stream->latch);
+    }
+    stream->current = stream->handed;
+    stream->start = 0;
+    stream->length = stream->handed_length;
+    stream->result = stream->handed_result;
+    stream->handed = NULL;
+    pthread_cond_signal(&stream->changed);
+    pthread_mutex_unlock(&stream->latch);
+}
+
+static void*
+write_main(void* arg)
+{
+    Stream stream = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&stream->latch);
+        while (stream->handed == NULL && !stream->stopping) {
+            pthread_cond_wait(&stream->changed, &stream->latch);
+        }
+        char* data = stream->handed;
+        size_t length = stream->handed_length;
+        pthread_mutex_unlock(&stream->latch);
+
+        if (data == NULL) {
+            return NULL;
+        }
+
+        int result = write_fully(stream->fd, data, length);
+
+        pthread_mutex_lock(&stream->latch);
+        if (result != 0) {
+            stream->error = result;
+        }
+        stream->handed = NULL;
+        pthread_cond_signal(&stream->changed);
+        pthread_mutex_unlock(&stream->latch);
+    }
+}
+
+/*
+ * Only cancelled while it is reading fd, never while it holds the latch.
+ */
+static void*
+read_main(void* arg)
+{
+    Stream stream = arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&stream->latch);
+        while (stream->handed != NULL && !stream->stopping) {
+            pthread_cond_wait(&stream->changed, &stream->latch);
+        }
+        int stopping = stream->stopping;
+        pthread_mutex_unlock(&stream->latch);
+
+        if (stopping) {
+            return NULL;
+        }
+
+        size_t length = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int result = read_some(stream->fd, stream->buffers[i], stream->buffer_size, &length);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&stream->latch);
+        stream->handed = stream->buffers[i];
+        stream->handed_length = length;
+        stream->handed_result = result;
+        pthread_cond_signal(&stream->changed);
+        pthread_mutex_unlock(&stream->latch);
+
+        if (result != 0) {
+            return NULL;
+        }
+    }
+}
+
+static int
+write_fully(int fd, const char* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return STREAM_IO_ERROR;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads until data is full or a read comes back short, setting length to the bytes read.
+ * Returns zero if fd may have more to read.
+ * Returns STREAM_END if fd has ended.
+ * Returns STREAM_IO_ERROR if fd could not be read.
+ */
+static int
+read_some(int fd, char* data, size_t size, size_t* length)
+{
+    while (*length < size) {
+        ssize_t n = read(fd, data + *length, size - *length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return STREAM_IO_ERROR;
+        }
+        if (n == 0) {
+            return STREAM_END;
+        }
+        *length += n;
+        if ((size_t)n < size - (*length - n)) {
+            break;
+        }
+    }
+
+    return 0;
+}
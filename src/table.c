@@ -1,35 +1,411 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 #include "table.h"
+#include "lhash.h"
+#include "mapfile.h"
+#include "pagefile.h"
+#include "stream.h"
+
+/*
+ * A table is split into shards that share nothing: each has its own linear hash, latch and
+ * request queue, and sits on its own cache lines, so operations on different shards never write
+ * to the same memory.
+ */
+
+#define CACHE_LINE_SIZE (64)
+
+/* About 256 KB of pages on a full table with 4 KB pages, sized to fit in a core's L2. */
+#define MORSEL_BUCKETS (64)
+
+/* What a shard charges the table's budget at a time, a few pages of the default size. */
+#define SHARD_BUDGET_BATCH (16 * 1024)
+
+/* Batches up to this size are sorted on the stack, 4 KB of it. */
+#define STACK_BATCH_ENTRIES (128)
+
+/*
+ * What a table backed by a file keeps in the file's meta bytes: its config and the size of each
+ * shard's directory as of the last flush.
+ */
+struct table_meta
+{
+    uint64_t    record_size;
+    uint64_t    key_size;
+    uint32_t    n_fields;
+    uint32_t    field_sizes[PAGE_MAX_FIELDS];
+    uint32_t    n_shards;
+    uint32_t    hash;
+    uint64_t    seed;
+    struct
+    {
+        uint64_t    n_buckets;
+        uint64_t    n_records;
+    } shards[TABLE_MAX_SHARDS];
+};
+
+_Static_assert(sizeof(struct table_meta) <= MAPFILE_META_SIZE, "table meta must fit in a file");
+
+/*
+ * An export is a header holding the table's config and its shards' sizes as the export started,
+ * then blocks of up to a page of records and an end block holding how many were exported.
+ * A block holds its records one after another, as they are or delta encoded, and a CRC32C of
+ * itself.
+ */
+#define EXPORT_MAGIC "EZDBEXP"
+#define EXPORT_VERSION (1)
+#define EXPORT_BUFFER_SIZE (1 << 20)
+
+/*
+ * Delta encoding is a run of control bytes each followed by its literals: 0 to 127 for 1 to 128
+ * literal bytes, 128 to 255 for 1 to 128 bytes that are the same as the byte a record before them,
+ * or zero in the first record. A run of one repeated byte is never shorter than its literal.
+ */
+#define DELTA_MAX_RUN (128)
+#define DELTA_MIN_REPEAT (2)
+
+struct export_header
+{
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            crc;
+    uint64_t            page_size;
+    struct table_meta   meta;
+};
+
+enum export_encoding
+{
+    EXPORT_RAW,
+    EXPORT_DELTA,
+    EXPORT_END
+};
+
+struct export_block
+{
+    uint32_t    n_records;
+    uint32_t    encoding;
+    uint32_t    size;
+    uint32_t    crc;
+};
+
+/*
+ * Records on their way to or from an export, and the encoded form of a block of them.
+ * An import reads a block at a time into records, an export copies a whole bucket into it, which
+ * can take more than a page.
+ */
+struct export_ctx
+{
+    Table       table;
+    Stream      stream;
+    int         compress;
+    size_t      buffer_size;
+    size_t      records_size;
+    size_t      n_copied;
+    char*       records;
+    char*       encoded;
+    uint64_t    n_records;
+    int         result;
+};
+
+struct shard
+{
+    struct table*   table;
+    pthread_mutex_t latch;
+    LHash           lhash;
+    Budget          budget;
+    uint64_t*       free_pages;
+    size_t          n_free_pages;
+    size_t          max_free_pages;
+
+    pthread_mutex_t queue_latch;
+    pthread_cond_t  queue_ready;
+    TableRequest*   head;
+    TableRequest*   tail;
+    int             stopping;
+    pthread_t       worker;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * A request's place in a batch being sorted for table_execute.
+ */
+struct batch_entry
+{
+    uint64_t    hash;
+    size_t      bucket;
+    int         shard;
+    int         index;
+};
+
+/*
+ * Each shard's pages as they are found in a table's file.
+ */
+struct restore_ctx
+{
+    Table           table;
+    size_t          n_pages[TABLE_MAX_SHARDS];
+    LHashPageRef*   pages[TABLE_MAX_SHARDS];
+    int             invalid;
+};
+
+/*
+ * Where a page listed by a backup is: still only in the table, copied aside before a write, or
+ * already in the backup file. It only changes under the page's shard latch.
+ */
+enum backup_state
+{
+    BACKUP_PENDING,
+    BACKUP_COPIED,
+    BACKUP_DONE
+};
+
+struct backup_page
+{
+    Page    page;
+    void*   copy;
+    size_t  bucket;
+    int     position;
+    int     state;
+};
+
+/*
+ * A shard's pages as they were when the backup started, sorted by address so a writer finds the
+ * page it is about to change with a binary search.
+ */
+struct backup_shard
+{
+    struct backup*      backup;
+    struct backup_page* pages;
+    size_t              n_pages;
+    size_t              n_buckets;
+    size_t              n_records;
+};
+
+/*
+ * A page being listed for a backup and its place in the shard's directory.
+ */
+struct backup_list
+{
+    struct backup_shard*    shard;
+    size_t                  bucket;
+    int                     position;
+};
+
+struct backup
+{
+    Table               table;
+    MapFile             file;
+    char*               path;
+    size_t              rate_limit;
+    pthread_t           thread;
+    pthread_mutex_t     latch;
+    pthread_cond_t      stop;
+    int                 stopping;
+    int                 result;
+    struct backup_shard shards[];
+};
 
 struct table
 {
-    char* name;
-    
+    char*           name;
+    HashFn          hash;
+    uint64_t        seed;
+    size_t          record_size;
+    size_t          key_size;
+    int             n_shards;
+    int             n_initialised;
+    int             workers_running;
+    struct shard*   shards;
+    Cache           cache;
+    MapFile         file;
+    PageFile        page_file;
+    uint64_t        n_file_pages;
+    Budget          budget;
+    TableConfig     config;
+    struct backup*  backup;
 };
 
 static int is_valid_name(char* name);
+static int is_valid_config(TableConfig* config);
+static Table create_table(char* name, TableConfig* config, MapFile file);
+static int create_shards(Table table, TableConfig* config);
+static MapFile open_file(TableConfig* config);
+static void write_config(struct table_meta* meta, TableConfig* config);
+static TableConfig read_config(struct table_meta* meta);
+static int restore_shards(Table table);
+static void count_page(void* page, int owner, size_t bucket, int position, void* ctx);
+static void collect_page(void* page, int owner, size_t bucket, int position, void* ctx);
+static void* alloc_page(void* ctx, size_t bucket, int position);
+static void release_page(void* ctx, void* page);
+static void* move_page(void* ctx, void* page);
+static int open_page_file(Table table, TableConfig* config);
+static void* alloc_file_page(void* ctx, size_t bucket, int position);
+static void release_file_page(void* ctx, void* page);
+static void* pin_file_page(void* ctx, void* page);
+static void unpin_file_page(void* ctx, void* page, int dirty);
+static struct shard* shard_for(Table table, uint64_t hash);
+static void* request_key(TableRequest* request);
+static int run_request(struct shard* shard, TableRequest* request, uint64_t hash);
+static int run_single(Table table, TableRequest* request);
+static int lookup_cached(Table table, TableRequest* request, uint64_t hash);
+static int compare_batch_entries(const void* a, const void* b);
+static void* worker_main(void* arg);
+static void stop_workers(Table table, int n_workers);
+static int list_pages(struct backup* backup, int shard_id);
+static void list_page(Page page, void* ctx);
+static int compare_backup_pages(const void* a, const void* b);
+static void copy_on_write(Page page, void* ctx);
+static void* backup_main(void* arg);
+static int backup_page(struct backup* backup, int shard_id, struct backup_page* entry);
+static int wait_for_rate(struct backup* backup, size_t written, struct timespec* start);
+static void fail_backup(struct backup* backup, int error);
+static void unwatch_writes(Table table);
+static void free_backup(struct backup* backup);
+static int open_export(struct export_ctx* export, Table table, int fd, int writing);
+static int alloc_export_page(struct export_ctx* export, size_t page_size);
+static int close_export(struct export_ctx* export);
+static void export_shard(struct export_ctx* export, struct shard* shard);
+static int copy_record(void* record, void* ctx);
+static void export_records(struct export_ctx* export);
+static int write_block(struct export_ctx* export, uint32_t encoding, uint32_t n_records,
+    const char* payload, size_t size);
+static int read_header(struct export_ctx* export, struct export_header* header);
+static int import_block(struct export_ctx* export);
+static uint32_t block_crc(struct export_block* block, const char* payload);
+static size_t encode_delta(const unsigned char* in, size_t size, size_t record_size,
+    unsigned char* out);
+static int decode_delta(const unsigned char* in, size_t size, size_t record_size,
+    unsigned char* out, size_t out_size);
+static int stream_error(int stream_error);
+static int to_table_error(int lhash_error);
+
+TableConfig
+table_default_config(void)
+{
+    TableConfig config = {
+        .record_size = 128,
+        .key_size = 8,
+        .page_size = 4096,
+        .n_shards = 1,
+        .hash = HASH_FAST,
+        .seed = 0,
+    };
+
+    return config;
+}
 
 Table
 table_create(char* name)
 {
-    if (!is_valid_name(name)) {
+    return table_create_with_config(name, table_default_config());
+}
+
+Table
+table_create_with_hash(char* name, HashType type, uint64_t seed)
+{
+    TableConfig config = table_default_config();
+    config.hash = type;
+    config.seed = seed;
+
+    return table_create_with_config(name, config);
+}
+
+Table
+table_create_with_config(char* name, TableConfig config)
+{
+    if (!is_valid_name(name) || !is_valid_config(&config)) {
         return NULL;
     }
 
-    Table table = malloc(sizeof(*table));
-    if (table == NULL) {
+    MapFile file = NULL;
+    if (config.path != NULL && !config.direct_io) {
+        file = open_file(&config);
+        if (file == NULL) {
+            return NULL;
+        }
+    }
+
+    return create_table(name, &config, file);
+}
+
+Table
+table_open(char* name, char* path)
+{
+    if (!is_valid_name(name) || path == NULL) {
         return NULL;
     }
-    
-    table->name = strdup(name);
-    if (table->name == NULL) {
-        table_free(table);
+
+    MapFile file = mapfile_open(path);
+    if (file == NULL) {
         return NULL;
     }
 
-    return table;
+    TableConfig config = read_config(mapfile_meta(file));
+    config.page_size = mapfile_page_size(file);
+    config.path = path;
+    if (!is_valid_config(&config)) {
+        mapfile_close(&file);
+        return NULL;
+    }
+
+    return create_table(name, &config, file);
+}
+
+int
+table_flush(Table table)
+{
+    if (table == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    if (table->page_file != NULL) {
+        return pagefile_flush(table->page_file) == 0 ? 0 : TABLE_IO_ERROR;
+    }
+
+    if (table->file == NULL) {
+        return 0;
+    }
+
+    struct table_meta* meta = mapfile_meta(table->file);
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        meta->shards[i].n_buckets = lhash_n_buckets(table->shards[i].lhash);
+        meta->shards[i].n_records = lhash_count(table->shards[i].lhash);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    return mapfile_sync(table->file) == 0 ? 0 : TABLE_IO_ERROR;
+}
+
+int
+table_compact(Table table)
+{
+    if (table == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    /* One shard at a time, so the others keep serving requests. */
+    int result = 0;
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        if (lhash_compact(table->shards[i].lhash) != 0) {
+            result = TABLE_NO_MEMORY;
+        }
+        budget_trim(table->shards[i].budget);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    if (table->file != NULL && mapfile_shrink(table->file) != 0) {
+        result = TABLE_IO_ERROR;
+    }
+
+    return result;
 }
 
 void
@@ -39,21 +415,1781 @@ table_free(Table table)
         return;
     }
 
+    table_stop_workers(table);
+
+    if (table->backup != NULL) {
+        pthread_mutex_lock(&table->backup->latch);
+        table->backup->stopping = 1;
+        pthread_cond_signal(&table->backup->stop);
+        pthread_mutex_unlock(&table->backup->latch);
+        table_backup_wait(table);
+    }
+
+    table_flush(table);
+
+    for (int i = 0; i < table->n_initialised; i++) {
+        lhash_free(&table->shards[i].lhash);
+        budget_dealloc(table->shards[i].budget, table->shards[i].free_pages,
+            table->shards[i].max_free_pages * sizeof(*table->shards[i].free_pages));
+        budget_free(&table->shards[i].budget);
+        pthread_mutex_destroy(&table->shards[i].latch);
+        pthread_mutex_destroy(&table->shards[i].queue_latch);
+        pthread_cond_destroy(&table->shards[i].queue_ready);
+    }
+
+    cache_free(&table->cache);
+    mapfile_close(&table->file);
+    pagefile_close(&table->page_file);
+    free(table->shards);
     free(table->name);
+    budget_free(&table->budget);
     free(table);
 }
 
-/*
- * PRIVATE FUNCTIONS
- */
+uint64_t
+table_hash(Table table, const void* key, size_t len)
+{
+    return table->hash(key, len, table->seed);
+}
 
-static int
-is_valid_name(char* name)
+int
+table_insert(Table table, void* record)
 {
-    if (name == NULL) {
+    if (table == NULL || record == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_INSERT, .record = record};
+    return run_single(table, &request);
+}
+
+int
+table_lookup(Table table, void* key, void* out)
+{
+    if (table == NULL || key == NULL || out == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_LOOKUP, .key = key, .record = out};
+    return run_single(table, &request);
+}
+
+int
+table_update(Table table, void* record)
+{
+    if (table == NULL || record == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_UPDATE, .record = record};
+    return run_single(table, &request);
+}
+
+int
+table_delete(Table table, void* key)
+{
+    if (table == NULL || key == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_DELETE, .key = key};
+    return run_single(table, &request);
+}
+
+int
+table_upsert(Table table, void* record)
+{
+    if (table == NULL || record == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_UPSERT, .record = record};
+    return run_single(table, &request);
+}
+
+int
+table_rmw(Table table, void* key, TableRmwFn fn, void* ctx)
+{
+    if (table == NULL || key == NULL || fn == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    TableRequest request = {.op = TABLE_OP_RMW, .key = key, .rmw = fn, .rmw_ctx = ctx};
+    return run_single(table, &request);
+}
+
+int
+table_execute(Table table, TableRequest* requests, int n_requests)
+{
+    if (table == NULL || requests == NULL || n_requests < 0) {
+        return TABLE_ARG_INVALID;
+    }
+
+    /* Only batches too big for the stack pay for charging the table's budget. */
+    struct batch_entry stack_entries[STACK_BATCH_ENTRIES];
+    struct batch_entry* entries = stack_entries;
+    size_t entries_size = n_requests * sizeof(struct batch_entry);
+    if (n_requests > STACK_BATCH_ENTRIES) {
+        entries = budget_alloc(table->budget, entries_size);
+        if (entries == NULL) {
+            return TABLE_NO_MEMORY;
+        }
+    }
+
+    for (int i = 0; i < n_requests; i++) {
+        void* key = request_key(&requests[i]);
+        entries[i].hash = key == NULL ? 0 : table_hash(table, key, table->key_size);
+        entries[i].shard = shard_for(table, entries[i].hash) - table->shards;
+        entries[i].index = i;
+        entries[i].bucket = 0;
+    }
+
+    /* Group by shard first, buckets can only be worked out while the shard is latched. */
+    qsort(entries, n_requests, sizeof(*entries), compare_batch_entries);
+
+    int end;
+    for (int start = 0; start < n_requests; start = end) {
+        struct shard* shard = &table->shards[entries[start].shard];
+        end = start;
+        while (end < n_requests && entries[end].shard == entries[start].shard) {
+            end++;
+        }
+
+        pthread_mutex_lock(&shard->latch);
+        for (int i = start; i < end; i++) {
+            entries[i].bucket = lhash_bucket_of(shard->lhash, entries[i].hash);
+        }
+        qsort(entries + start, end - start, sizeof(*entries), compare_batch_entries);
+
+        for (int i = start; i < end; i++) {
+            TableRequest* request = &requests[entries[i].index];
+            if (request_key(request) == NULL) {
+                request->result = TABLE_ARG_INVALID;
+            } else if (lookup_cached(table, request, entries[i].hash) == 0) {
+                request->result = 0;
+            } else {
+                request->result = run_request(shard, request, entries[i].hash);
+            }
+        }
+        pthread_mutex_unlock(&shard->latch);
+    }
+    if (entries != stack_entries) {
+        budget_dealloc(table->budget, entries, entries_size);
+    }
+
+    for (int i = 0; i < n_requests; i++) {
+        if (requests[i].done != NULL) {
+            requests[i].done(&requests[i], requests[i].ctx);
+        }
+    }
+
+    return 0;
+}
+
+int
+table_filter(Table table, size_t offset, size_t width, const void* value, TableScanFn fn,
+    void* ctx)
+{
+    if (table == NULL || value == NULL || fn == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    int stop = 0;
+    for (int i = 0; i < table->n_shards && !stop; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        stop = lhash_filter(table->shards[i].lhash, offset, width, value, fn, ctx);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    return stop;
+}
+
+int
+table_scan(Table table, TableScanFn fn, void* ctx)
+{
+    if (table == NULL || fn == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    int stop = 0;
+    for (int i = 0; i < table->n_shards && !stop; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        stop = lhash_scan(table->shards[i].lhash, fn, ctx);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    return stop;
+}
+
+int
+table_scan_from(Table table, TableScanCursor* cursor, size_t n_buckets, TableScanFn fn,
+    void* ctx)
+{
+    if (table == NULL || cursor == NULL || fn == NULL || cursor->shard < 0) {
+        return TABLE_ARG_INVALID;
+    }
+    if (cursor->done || cursor->shard >= table->n_shards) {
+        cursor->done = 1;
         return 0;
     }
 
-    size_t len = strlen(name);
-    return 0 < len && len < NAME_MAX;
+    struct shard* shard = &table->shards[cursor->shard];
+    pthread_mutex_lock(&shard->latch);
+    int result = lhash_scan_from(shard->lhash, &cursor->position, n_buckets, fn, ctx);
+    pthread_mutex_unlock(&shard->latch);
+
+    if (result == 0 && cursor->position == LHASH_SCAN_END) {
+        cursor->shard++;
+        cursor->position = 0;
+        cursor->done = cursor->shard == table->n_shards;
+    }
+
+    return to_table_error(result);
+}
+
+size_t
+table_count(Table table)
+{
+    if (table == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        count += lhash_count(table->shards[i].lhash);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    return count;
+}
+
+size_t
+table_record_size(Table table)
+{
+    return table == NULL ? 0 : table->record_size;
+}
+
+void
+table_latch(Table table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    /* Always in shard order, so two threads latching the whole table can't deadlock. */
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+    }
+}
+
+void
+table_unlatch(Table table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    for (int i = table->n_shards; i-- > 0;) {
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+}
+
+size_t
+table_n_morsels(Table table)
+{
+    if (table == NULL) {
+        return 0;
+    }
+
+    size_t n_morsels = 0;
+    for (int i = 0; i < table->n_shards; i++) {
+        n_morsels += (lhash_n_buckets(table->shards[i].lhash) + MORSEL_BUCKETS - 1)
+            / MORSEL_BUCKETS;
+    }
+
+    return n_morsels;
+}
+
+int
+table_morsel(Table table, size_t morsel, TablePageFn fn, void* ctx)
+{
+    if (table == NULL || fn == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    for (int i = 0; i < table->n_shards; i++) {
+        LHash lhash = table->shards[i].lhash;
+        size_t n_morsels = (lhash_n_buckets(lhash) + MORSEL_BUCKETS - 1) / MORSEL_BUCKETS;
+        if (morsel < n_morsels) {
+            return to_table_error(lhash_pages(lhash, morsel * MORSEL_BUCKETS,
+                (morsel + 1) * MORSEL_BUCKETS, fn, ctx));
+        }
+        morsel -= n_morsels;
+    }
+
+    return 0;
+}
+
+int
+table_backup(Table table, const char* path, size_t rate_limit)
+{
+    if (table == NULL || path == NULL || table->backup != NULL || table->page_file != NULL
+        || table->config.page_size % 512 != 0) {
+        return TABLE_ARG_INVALID;
+    }
+
+    size_t size = sizeof(struct backup) + table->n_shards * sizeof(struct backup_shard);
+    struct backup* backup = budget_calloc(table->budget, 1, size);
+    if (backup == NULL) {
+        return TABLE_NO_MEMORY;
+    }
+
+    backup->table = table;
+    backup->rate_limit = rate_limit;
+    pthread_mutex_init(&backup->latch, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&backup->stop, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int i = 0; i < table->n_shards; i++) {
+        backup->shards[i].backup = backup;
+    }
+
+    backup->path = strdup(path);
+    if (backup->path == NULL) {
+        free_backup(backup);
+        return TABLE_NO_MEMORY;
+    }
+
+    backup->file = mapfile_create(path, table->config.page_size);
+    if (backup->file == NULL) {
+        free_backup(backup);
+        return errno == EEXIST ? TABLE_ARG_INVALID : TABLE_IO_ERROR;
+    }
+
+    /*
+     * Every shard is latched at once so the backup is of one moment across the table, but only
+     * while the pages are listed, not copied.
+     */
+    int result = 0;
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+    }
+    for (int i = 0; i < table->n_shards && result == 0; i++) {
+        result = list_pages(backup, i);
+    }
+    if (result == 0) {
+        for (int i = 0; i < table->n_shards; i++) {
+            lhash_watch_writes(table->shards[i].lhash, copy_on_write, &backup->shards[i]);
+        }
+        if (pthread_create(&backup->thread, NULL, backup_main, backup) != 0) {
+            for (int i = 0; i < table->n_shards; i++) {
+                lhash_watch_writes(table->shards[i].lhash, NULL, NULL);
+            }
+            result = TABLE_NO_MEMORY;
+        }
+    }
+    for (int i = table->n_shards; i-- > 0;) {
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    if (result != 0) {
+        mapfile_close(&backup->file);
+        unlink(backup->path);
+        free_backup(backup);
+        return result;
+    }
+    table->backup = backup;
+
+    return 0;
+}
+
+int
+table_backup_wait(Table table)
+{
+    if (table == NULL || table->backup == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    pthread_join(table->backup->thread, NULL);
+    int result = table->backup->result;
+    free_backup(table->backup);
+    table->backup = NULL;
+
+    return result;
+}
+
+int
+table_export(Table table, int fd, int flags)
+{
+    if (table == NULL || fd < 0 || (flags & ~TABLE_EXPORT_COMPRESS) != 0) {
+        return TABLE_ARG_INVALID;
+    }
+
+    struct export_ctx export;
+    int result = open_export(&export, table, fd, 1);
+    if (result != 0) {
+        return result;
+    }
+    export.compress = (flags & TABLE_EXPORT_COMPRESS) != 0;
+    export.result = alloc_export_page(&export, table->config.page_size);
+    if (export.result != 0) {
+        return close_export(&export);
+    }
+
+    /* The sizes are only a hint for sizing the directories on import, they may change meanwhile. */
+    struct export_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, sizeof(header.magic));
+    header.version = EXPORT_VERSION;
+    header.page_size = table->config.page_size;
+    write_config(&header.meta, &table->config);
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        header.meta.shards[i].n_buckets = lhash_n_buckets(table->shards[i].lhash);
+        header.meta.shards[i].n_records = lhash_count(table->shards[i].lhash);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+    header.crc = crc32c(0, &header, sizeof(header));
+    export.result = stream_error(stream_write(export.stream, &header, sizeof(header)));
+
+    for (int i = 0; i < table->n_shards && export.result == 0; i++) {
+        export_shard(&export, &table->shards[i]);
+    }
+
+    if (export.result == 0) {
+        export.result = write_block(&export, EXPORT_END, 0, (char*)&export.n_records,
+            sizeof(export.n_records));
+    }
+
+    return close_export(&export);
+}
+
+int
+table_import(Table table, int fd)
+{
+    if (table == NULL || fd < 0) {
+        return TABLE_ARG_INVALID;
+    }
+
+    struct export_ctx export;
+    int result = open_export(&export, table, fd, 0);
+    if (result != 0) {
+        return result;
+    }
+
+    /* The records must be laid out the same, everything that follows the fields may differ. */
+    struct export_header header;
+    struct table_meta expected = {0};
+    write_config(&expected, &table->config);
+    result = read_header(&export, &header);
+    if (result == 0 && memcmp(&expected, &header.meta, offsetof(struct table_meta, n_shards)) != 0) {
+        result = TABLE_ARG_INVALID;
+    }
+    if (result == 0) {
+        result = alloc_export_page(&export, header.page_size);
+    }
+    if (result != 0) {
+        export.result = result;
+        return close_export(&export);
+    }
+
+    uint64_t n_exported = 0;
+    for (uint32_t i = 0; i < header.meta.n_shards; i++) {
+        n_exported += header.meta.shards[i].n_records;
+    }
+
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+    }
+    for (int i = 0; i < table->n_shards && result == 0; i++) {
+        if (lhash_count(table->shards[i].lhash) > 0) {
+            result = TABLE_ARG_INVALID;
+        }
+    }
+    for (int i = 0; i < table->n_shards && result == 0; i++) {
+        result = to_table_error(lhash_reserve(table->shards[i].lhash,
+            n_exported / table->n_shards));
+    }
+    while (result == 0 && (result = import_block(&export)) > 0) {
+        result = 0;
+    }
+    for (int i = table->n_shards; i-- > 0;) {
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+
+    export.result = result;
+    return close_export(&export);
+}
+
+int
+table_n_shards(Table table)
+{
+    return table == NULL ? 0 : table->n_shards;
+}
+
+int
+table_shard_of(Table table, void* key)
+{
+    if (table == NULL || key == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    return shard_for(table, table_hash(table, key, table->key_size)) - table->shards;
+}
+
+CacheStats
+table_cache_stats(Table table)
+{
+    CacheStats stats = {0};
+    if (table == NULL || table->cache == NULL) {
+        return stats;
+    }
+
+    return cache_stats(table->cache);
+}
+
+size_t
+table_memory_used(Table table)
+{
+    if (table == NULL) {
+        return 0;
+    }
+
+    return budget_used(table->budget);
+}
+
+void
+table_set_memory_limit(Table table, size_t limit)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    budget_set_limit(table->budget, limit);
+}
+
+int
+table_start_workers(Table table, int pin)
+{
+    if (table == NULL || table->workers_running) {
+        return TABLE_ARG_INVALID;
+    }
+
+    cpu_set_t allowed;
+    int n_cpus = 0;
+    int cpus[CPU_SETSIZE];
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[n_cpus++] = cpu;
+            }
+        }
+    }
+
+    for (int i = 0; i < table->n_shards; i++) {
+        struct shard* shard = &table->shards[i];
+        shard->stopping = 0;
+        if (pthread_create(&shard->worker, NULL, worker_main, shard) != 0) {
+            stop_workers(table, i);
+            return TABLE_NO_MEMORY;
+        }
+
+        if (n_cpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % n_cpus], &set);
+            pthread_setaffinity_np(shard->worker, sizeof(set), &set);
+        }
+    }
+    table->workers_running = 1;
+
+    return 0;
+}
+
+void
+table_stop_workers(Table table)
+{
+    if (table == NULL || !table->workers_running) {
+        return;
+    }
+
+    stop_workers(table, table->n_shards);
+    table->workers_running = 0;
+}
+
+int
+table_submit(Table table, TableRequest* request)
+{
+    if (table == NULL || !table->workers_running || request == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    void* key = request_key(request);
+    if (key == NULL) {
+        return TABLE_ARG_INVALID;
+    }
+
+    struct shard* shard = shard_for(table, table_hash(table, key, table->key_size));
+
+    request->next = NULL;
+    pthread_mutex_lock(&shard->queue_latch);
+    if (shard->tail == NULL) {
+        shard->head = request;
+        pthread_cond_signal(&shard->queue_ready);
+    } else {
+        shard->tail->next = request;
+    }
+    shard->tail = request;
+    pthread_mutex_unlock(&shard->queue_latch);
+
+    return 0;
+}
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+static int
+is_valid_name(char* name)
+{
+    if (name == NULL) {
+        return 0;
+    }
+
+    size_t len = strlen(name);
+    return 0 < len && len < NAME_MAX;
+}
+
+static int
+is_valid_config(TableConfig* config)
+{
+    if (!(0 <= config->n_fields && config->n_fields <= PAGE_MAX_FIELDS)) {
+        return 0;
+    }
+
+    if (config->n_fields > 0) {
+        size_t record_size = 0;
+        for (int i = 0; i < config->n_fields; i++) {
+            if (config->field_sizes[i] == 0) {
+                return 0;
+            }
+            record_size += config->field_sizes[i];
+        }
+
+        if (record_size != config->record_size) {
+            return 0;
+        }
+    }
+
+    if (config->direct_io && (config->path == NULL || config->n_frames > INT_MAX
+            || (config->n_frames > 0
+                && config->n_frames < (size_t)config->n_shards * TABLE_MIN_SHARD_FRAMES))) {
+        return 0;
+    }
+
+    return hash_get(config->hash) != NULL
+        && 0 < config->key_size && config->key_size <= config->record_size
+        && 0 < config->n_shards && config->n_shards <= TABLE_MAX_SHARDS
+        && config->page_size <= MAX_PAGE_SIZE;
+}
+
+/*
+ * Creates the table, taking ownership of file if the table is backed by one.
+ */
+static Table
+create_table(char* name, TableConfig* config, MapFile file)
+{
+    Table table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        mapfile_close(&file);
+        return NULL;
+    }
+
+    table->hash = hash_get(config->hash);
+    table->seed = config->seed;
+    table->record_size = config->record_size;
+    table->key_size = config->key_size;
+    table->file = file;
+    table->config = *config;
+    table->config.path = NULL;
+    table->name = strdup(name);
+    table->budget = budget_create(NULL, config->memory_limit);
+    if (table->name == NULL || table->budget == NULL
+        || budget_reserve(table->budget, sizeof(*table) + strlen(name) + 1
+            + config->n_shards * sizeof(struct shard)) != 0
+        || (config->direct_io && open_page_file(table, config) != 0)
+        || create_shards(table, config) != 0
+        || (file != NULL && restore_shards(table) != 0)) {
+        /* Closed first so a half built table isn't flushed over the file's contents. */
+        mapfile_close(&table->file);
+        table_free(table);
+        return NULL;
+    }
+
+    if (config->cache_size > 0) {
+        table->cache = cache_create(config->cache_size, config->record_size, config->key_size);
+        if (table->cache == NULL
+            || budget_reserve(table->budget, cache_stats(table->cache).memory) != 0) {
+            mapfile_close(&table->file);
+            table_free(table);
+            return NULL;
+        }
+    }
+
+    return table;
+}
+
+static int
+create_shards(Table table, TableConfig* config)
+{
+    void* shards;
+    if (posix_memalign(&shards, CACHE_LINE_SIZE, config->n_shards * sizeof(struct shard)) != 0) {
+        return TABLE_NO_MEMORY;
+    }
+    table->shards = memset(shards, 0, config->n_shards * sizeof(struct shard));
+    table->n_shards = config->n_shards;
+
+    for (int i = 0; i < table->n_shards; i++) {
+        struct shard* shard = &table->shards[i];
+        shard->table = table;
+        pthread_mutex_init(&shard->latch, NULL);
+        pthread_mutex_init(&shard->queue_latch, NULL);
+        pthread_cond_init(&shard->queue_ready, NULL);
+        table->n_initialised++;
+
+        shard->budget = budget_create_batched(table->budget, 0, SHARD_BUDGET_BATCH);
+        if (shard->budget == NULL) {
+            return TABLE_NO_MEMORY;
+        }
+
+        int n_fields = config->n_fields > 0 ? config->n_fields : 1;
+        const size_t* field_sizes = config->n_fields > 0 ? config->field_sizes
+            : &config->record_size;
+        LHashStore store = {
+            .alloc = alloc_page,
+            .release = release_page,
+            .move = move_page,
+            .ctx = shard,
+        };
+        if (table->page_file != NULL) {
+            store = (LHashStore){
+                .alloc = alloc_file_page,
+                .release = release_file_page,
+                .pin = pin_file_page,
+                .unpin = unpin_file_page,
+                .ctx = shard,
+            };
+        }
+        int has_store = table->file != NULL || table->page_file != NULL;
+        shard->lhash = lhash_create_with_store(config->page_size, n_fields, field_sizes,
+            config->key_size, table->hash, table->seed, has_store ? &store : NULL,
+            shard->budget);
+        if (shard->lhash == NULL) {
+            return TABLE_NO_MEMORY;
+        }
+
+        /* An empty shard holds nothing ahead, its first inserts draw the first batch. */
+        budget_trim(shard->budget);
+    }
+
+    return 0;
+}
+
+/*
+ * Opens the table's file if it exists and holds a table with the same config, or creates it.
+ */
+static MapFile
+open_file(TableConfig* config)
+{
+    MapFile file = mapfile_create(config->path, config->page_size);
+    if (file != NULL) {
+        struct table_meta* meta = mapfile_meta(file);
+        write_config(meta, config);
+        for (int i = 0; i < config->n_shards; i++) {
+            meta->shards[i].n_buckets = 1;
+            meta->shards[i].n_records = 0;
+        }
+        return file;
+    }
+
+    file = mapfile_open(config->path);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    struct table_meta expected = {0};
+    write_config(&expected, config);
+    if (mapfile_page_size(file) != config->page_size
+        || memcmp(&expected, mapfile_meta(file), offsetof(struct table_meta, shards)) != 0) {
+        mapfile_close(&file);
+        return NULL;
+    }
+
+    return file;
+}
+
+static void
+write_config(struct table_meta* meta, TableConfig* config)
+{
+    meta->record_size = config->record_size;
+    meta->key_size = config->key_size;
+    meta->n_fields = config->n_fields;
+    for (int i = 0; i < PAGE_MAX_FIELDS; i++) {
+        meta->field_sizes[i] = i < config->n_fields ? config->field_sizes[i] : 0;
+    }
+    meta->n_shards = config->n_shards;
+    meta->hash = config->hash;
+    meta->seed = config->seed;
+}
+
+static TableConfig
+read_config(struct table_meta* meta)
+{
+    TableConfig config = table_default_config();
+    config.record_size = meta->record_size;
+    config.key_size = meta->key_size;
+    config.n_fields = meta->n_fields <= PAGE_MAX_FIELDS ? meta->n_fields : PAGE_MAX_FIELDS + 1;
+    for (int i = 0; i < PAGE_MAX_FIELDS; i++) {
+        config.field_sizes[i] = meta->field_sizes[i];
+    }
+    config.n_shards = meta->n_shards;
+    config.hash = meta->hash;
+    config.seed = meta->seed;
+
+    return config;
+}
+
+/*
+ * Puts each shard's directory back together from the file's page directory, without reading the
+ * pages.
+ */
+static int
+restore_shards(Table table)
+{
+    struct table_meta* meta = mapfile_meta(table->file);
+    struct restore_ctx* ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        return TABLE_NO_MEMORY;
+    }
+    ctx->table = table;
+
+    /* Count first so each shard's pages fit in one allocation. */
+    mapfile_pages(table->file, count_page, ctx);
+    int result = ctx->invalid ? TABLE_ARG_INVALID : 0;
+    for (int i = 0; i < table->n_shards && result == 0; i++) {
+        ctx->pages[i] = malloc(ctx->n_pages[i] * sizeof(*ctx->pages[i]));
+        if (ctx->pages[i] == NULL && ctx->n_pages[i] > 0) {
+            result = TABLE_NO_MEMORY;
+        }
+        ctx->n_pages[i] = 0;
+    }
+
+    if (result == 0) {
+        mapfile_pages(table->file, collect_page, ctx);
+    }
+
+    for (int i = 0; i < table->n_shards && result == 0; i++) {
+        result = to_table_error(lhash_restore(table->shards[i].lhash, meta->shards[i].n_buckets,
+            meta->shards[i].n_records, ctx->pages[i], ctx->n_pages[i]));
+    }
+
+    for (int i = 0; i < table->n_shards; i++) {
+        free(ctx->pages[i]);
+    }
+    free(ctx);
+
+    return result;
+}
+
+static void
+count_page(void* page, int owner, size_t bucket, int position, void* ctx)
+{
+    (void)page;
+    (void)bucket;
+    (void)position;
+    struct restore_ctx* restore = ctx;
+    if (owner >= restore->table->n_shards) {
+        restore->invalid = 1;
+        return;
+    }
+
+    restore->n_pages[owner]++;
+}
+
+static void
+collect_page(void* page, int owner, size_t bucket, int position, void* ctx)
+{
+    struct restore_ctx* restore = ctx;
+    restore->pages[owner][restore->n_pages[owner]++] = (LHashPageRef){
+        .bucket = bucket,
+        .position = position,
+        .page = page,
+    };
+}
+
+static void*
+alloc_page(void* ctx, size_t bucket, int position)
+{
+    struct shard* shard = ctx;
+    return mapfile_alloc(shard->table->file, shard - shard->table->shards, bucket, position);
+}
+
+static void
+release_page(void* ctx, void* page)
+{
+    struct shard* shard = ctx;
+    mapfile_release(shard->table->file, page);
+}
+
+static void*
+move_page(void* ctx, void* page)
+{
+    struct shard* shard = ctx;
+    return mapfile_relocate(shard->table->file, page);
+}
+
+/*
+ * Creates the page file of a table with direct_io set and charges its frames to the table.
+ * The file is unlinked once open, so it goes away with the table.
+ */
+static int
+open_page_file(Table table, TableConfig* config)
+{
+    size_t n_frames = config->n_frames > 0 ? config->n_frames : TABLE_DEFAULT_FRAMES;
+    if (access(config->path, F_OK) == 0) {
+        return TABLE_ARG_INVALID;
+    }
+    if (budget_reserve(table->budget, n_frames * config->page_size) != 0) {
+        return TABLE_NO_MEMORY;
+    }
+
+    table->page_file = pagefile_open(config->path, config->page_size, n_frames, 1);
+    if (table->page_file == NULL) {
+        return TABLE_IO_ERROR;
+    }
+    unlink(config->path);
+
+    return 0;
+}
+
+/*
+ * Pages of a page file are handed to the linear hash as their page number plus one, so no page is
+ * NULL. A shard reuses the pages it gave back before taking a new one off the end of the file.
+ */
+static void*
+alloc_file_page(void* ctx, size_t bucket, int position)
+{
+    (void)bucket;
+    (void)position;
+    struct shard* shard = ctx;
+    uint64_t page_no = shard->n_free_pages > 0 ? shard->free_pages[--shard->n_free_pages]
+        : __atomic_fetch_add(&shard->table->n_file_pages, 1, __ATOMIC_RELAXED);
+
+    return (void*)(uintptr_t)(page_no + 1);
+}
+
+/*
+ * Keeps the page for the shard's next alloc. If there is no room to keep it the page is just left
+ * unused in the file.
+ */
+static void
+release_file_page(void* ctx, void* page)
+{
+    struct shard* shard = ctx;
+    if (shard->n_free_pages == shard->max_free_pages) {
+        size_t max_free_pages = shard->max_free_pages == 0 ? 16 : 2 * shard->max_free_pages;
+        uint64_t* free_pages = budget_realloc(shard->budget, shard->free_pages,
+            shard->max_free_pages * sizeof(*free_pages), max_free_pages * sizeof(*free_pages));
+        if (free_pages == NULL) {
+            return;
+        }
+        shard->free_pages = free_pages;
+        shard->max_free_pages = max_free_pages;
+    }
+
+    shard->free_pages[shard->n_free_pages++] = (uintptr_t)page - 1;
+}
+
+static void*
+pin_file_page(void* ctx, void* page)
+{
+    struct shard* shard = ctx;
+    void* frame;
+    if (pagefile_pin(shard->table->page_file, (uintptr_t)page - 1, &frame) != 0) {
+        return NULL;
+    }
+
+    return frame;
+}
+
+static void
+unpin_file_page(void* ctx, void* page, int dirty)
+{
+    struct shard* shard = ctx;
+    pagefile_unpin(shard->table->page_file, (uintptr_t)page - 1, dirty);
+}
+
+/*
+ * Picks the shard from the top 32 bits of the hash, the linear hash uses the bottom bits.
+ */
+static struct shard*
+shard_for(Table table, uint64_t hash)
+{
+    return &table->shards[((hash >> 32) * table->n_shards) >> 32];
+}
+
+static void*
+request_key(TableRequest* request)
+{
+    if (request->op == TABLE_OP_INSERT || request->op == TABLE_OP_UPDATE
+        || request->op == TABLE_OP_UPSERT) {
+        return request->record;
+    }
+
+    return request->key;
+}
+
+/*
+ * Runs the request with its shard latched.
+ * The cache is filled and invalidated here too, under the latch, so a lookup can't put back a
+ * record that an update or delete on the same shard has just replaced.
+ */
+static int
+run_request(struct shard* shard, TableRequest* request, uint64_t hash)
+{
+    Cache cache = shard->table->cache;
+    int result;
+
+    switch (request->op) {
+    case TABLE_OP_INSERT:
+        return to_table_error(lhash_insert(shard->lhash, hash, request->record));
+    case TABLE_OP_LOOKUP:
+        if (request->record == NULL) {
+            return TABLE_ARG_INVALID;
+        }
+        result = lhash_lookup(shard->lhash, hash, request->key, request->record);
+        if (result == 0 && cache != NULL) {
+            cache_put(cache, hash, request->record);
+        }
+        return to_table_error(result);
+    case TABLE_OP_UPDATE:
+        result = lhash_update(shard->lhash, hash, request->record);
+        if (result == 0 && cache != NULL) {
+            cache_invalidate(cache, hash, request->record);
+        }
+        return to_table_error(result);
+    case TABLE_OP_DELETE:
+        result = lhash_delete(shard->lhash, hash, request->key);
+        if (result == 0 && cache != NULL) {
+            cache_invalidate(cache, hash, request->key);
+        }
+        return to_table_error(result);
+    case TABLE_OP_UPSERT:
+        result = lhash_upsert(shard->lhash, hash, request->record);
+        if (result == 0 && cache != NULL) {
+            cache_invalidate(cache, hash, request->record);
+        }
+        return to_table_error(result);
+    case TABLE_OP_RMW:
+        if (request->rmw == NULL) {
+            return TABLE_ARG_INVALID;
+        }
+        result = lhash_rmw(shard->lhash, hash, request->key, request->rmw, request->rmw_ctx);
+        if (result == 0 && cache != NULL) {
+            cache_invalidate(cache, hash, request->key);
+        }
+        return to_table_error(result);
+    }
+
+    return TABLE_ARG_INVALID;
+}
+
+/*
+ * Runs a single request on the calling thread, hot lookups are answered without the shard latch.
+ */
+static int
+run_single(Table table, TableRequest* request)
+{
+    uint64_t hash = table_hash(table, request_key(request), table->key_size);
+    if (lookup_cached(table, request, hash) == 0) {
+        return 0;
+    }
+
+    struct shard* shard = shard_for(table, hash);
+
+    pthread_mutex_lock(&shard->latch);
+    int result = run_request(shard, request, hash);
+    pthread_mutex_unlock(&shard->latch);
+
+    return result;
+}
+
+/*
+ * Answers a lookup from the cache.
+ * Returns zero on a hit, CACHE_MISS if the request isn't a lookup or its key isn't cached.
+ */
+static int
+lookup_cached(Table table, TableRequest* request, uint64_t hash)
+{
+    if (table->cache == NULL || request->op != TABLE_OP_LOOKUP || request->record == NULL) {
+        return CACHE_MISS;
+    }
+
+    return cache_get(table->cache, hash, request->key, request->record);
+}
+
+/*
+ * Orders a batch by shard, then bucket, then position in the batch.
+ */
+static int
+compare_batch_entries(const void* a, const void* b)
+{
+    const struct batch_entry* x = a;
+    const struct batch_entry* y = b;
+
+    if (x->shard != y->shard) {
+        return x->shard < y->shard ? -1 : 1;
+    }
+    if (x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Drains the whole queue at once so the shard latch is taken once per batch instead of once per
+ * request.
+ */
+static void*
+worker_main(void* arg)
+{
+    struct shard* shard = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&shard->queue_latch);
+        while (shard->head == NULL && !shard->stopping) {
+            pthread_cond_wait(&shard->queue_ready, &shard->queue_latch);
+        }
+        TableRequest* batch = shard->head;
+        shard->head = NULL;
+        shard->tail = NULL;
+        pthread_mutex_unlock(&shard->queue_latch);
+
+        if (batch == NULL) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&shard->latch);
+        for (TableRequest* request = batch; request != NULL; request = request->next) {
+            void* key = request_key(request);
+            uint64_t hash = table_hash(shard->table, key, shard->table->key_size);
+            if (lookup_cached(shard->table, request, hash) == 0) {
+                request->result = 0;
+            } else {
+                request->result = run_request(shard, request, hash);
+            }
+        }
+        pthread_mutex_unlock(&shard->latch);
+
+        while (batch != NULL) {
+            TableRequest* next = batch->next;
+            if (batch->done != NULL) {
+                batch->done(batch, batch->ctx);
+            }
+            batch = next;
+        }
+    }
+}
+
+static void
+stop_workers(Table table, int n_workers)
+{
+    for (int i = 0; i < n_workers; i++) {
+        struct shard* shard = &table->shards[i];
+        pthread_mutex_lock(&shard->queue_latch);
+        shard->stopping = 1;
+        pthread_cond_signal(&shard->queue_ready);
+        pthread_mutex_unlock(&shard->queue_latch);
+    }
+
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(table->shards[i].worker, NULL);
+    }
+}
+
+/*
+ * Lists the shard's pages and where they are in its directory, the shard must be latched.
+ */
+static int
+list_pages(struct backup* backup, int shard_id)
+{
+    struct backup_shard* shard = &backup->shards[shard_id];
+    LHash lhash = backup->table->shards[shard_id].lhash;
+
+    shard->n_buckets = lhash_n_buckets(lhash);
+    shard->n_records = lhash_count(lhash);
+    size_t n_pages = lhash_n_pages(lhash);
+    shard->pages = budget_alloc(backup->table->budget, n_pages * sizeof(*shard->pages));
+    if (shard->pages == NULL && n_pages > 0) {
+        return TABLE_NO_MEMORY;
+    }
+
+    struct backup_list list = {.shard = shard};
+    for (size_t i = 0; i < shard->n_buckets; i++) {
+        list.bucket = i;
+        list.position = 0;
+        lhash_pages(lhash, i, i + 1, list_page, &list);
+    }
+    qsort(shard->pages, shard->n_pages, sizeof(*shard->pages), compare_backup_pages);
+
+    return 0;
+}
+
+static void
+list_page(Page page, void* ctx)
+{
+    struct backup_list* list = ctx;
+    list->shard->pages[list->shard->n_pages++] = (struct backup_page){
+        .page = page,
+        .bucket = list->bucket,
+        .position = list->position++,
+        .state = BACKUP_PENDING,
+    };
+}
+
+static int
+compare_backup_pages(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t)((const struct backup_page*)a)->page;
+    uintptr_t y = (uintptr_t)((const struct backup_page*)b)->page;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Called under the shard latch before a write to page, copies it aside if the backup still needs
+ * it as it was.
+ */
+static void
+copy_on_write(Page page, void* ctx)
+{
+    struct backup_shard* shard = ctx;
+    struct backup_page key = {.page = page};
+    struct backup_page* entry = bsearch(&key, shard->pages, shard->n_pages, sizeof(key),
+        compare_backup_pages);
+    if (entry == NULL || entry->state != BACKUP_PENDING) {
+        return;
+    }
+
+    Table table = shard->backup->table;
+    entry->copy = budget_alloc(table->budget, table->config.page_size);
+    if (entry->copy == NULL) {
+        fail_backup(shard->backup, TABLE_NO_MEMORY);
+        return;
+    }
+    memcpy(entry->copy, page, table->config.page_size);
+    entry->state = BACKUP_COPIED;
+}
+
+/*
+ * Writes every listed page to the backup file, then the table's config and directory sizes, and
+ * syncs it. The file is removed if the backup failed or was stopped.
+ */
+static void*
+backup_main(void* arg)
+{
+    struct backup* backup = arg;
+    Table table = backup->table;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t written = 0;
+    int stopped = 0;
+    for (int i = 0; i < table->n_shards && !stopped; i++) {
+        struct backup_shard* shard = &backup->shards[i];
+        for (size_t p = 0; p < shard->n_pages && !stopped; p++) {
+            stopped = wait_for_rate(backup, written, &start)
+                || backup_page(backup, i, &shard->pages[p]) != 0
+                || __atomic_load_n(&backup->result, __ATOMIC_RELAXED) != 0;
+            written += table->config.page_size;
+        }
+    }
+
+    /* Writers stop copying pages now, whatever is still copied aside isn't needed. */
+    unwatch_writes(table);
+    for (int i = 0; i < table->n_shards; i++) {
+        for (size_t p = 0; p < backup->shards[i].n_pages; p++) {
+            budget_dealloc(table->budget, backup->shards[i].pages[p].copy,
+                table->config.page_size);
+            backup->shards[i].pages[p].copy = NULL;
+        }
+    }
+
+    if (!stopped) {
+        struct table_meta* meta = mapfile_meta(backup->file);
+        write_config(meta, &table->config);
+        for (int i = 0; i < table->n_shards; i++) {
+            meta->shards[i].n_buckets = backup->shards[i].n_buckets;
+            meta->shards[i].n_records = backup->shards[i].n_records;
+        }
+    }
+
+    if (mapfile_close(&backup->file) != 0) {
+        fail_backup(backup, TABLE_IO_ERROR);
+    }
+    if (stopped || backup->result != 0) {
+        unlink(backup->path);
+        fail_backup(backup, TABLE_ARG_INVALID);
+    }
+
+    return NULL;
+}
+
+/*
+ * Writes the page as it was when the backup started into the backup file.
+ * The shard is only latched to copy a page that wasn't copied aside.
+ */
+static int
+backup_page(struct backup* backup, int shard_id, struct backup_page* entry)
+{
+    Table table = backup->table;
+    struct shard* shard = &table->shards[shard_id];
+
+    void* slot = mapfile_alloc(backup->file, shard_id, entry->bucket, entry->position);
+    if (slot == NULL) {
+        fail_backup(backup, TABLE_IO_ERROR);
+        return TABLE_IO_ERROR;
+    }
+
+    pthread_mutex_lock(&shard->latch);
+    void* copy = entry->copy;
+    if (entry->state == BACKUP_PENDING) {
+        memcpy(slot, entry->page, table->config.page_size);
+    }
+    entry->copy = NULL;
+    entry->state = BACKUP_DONE;
+    pthread_mutex_unlock(&shard->latch);
+
+    if (copy != NULL) {
+        memcpy(slot, copy, table->config.page_size);
+        budget_dealloc(table->budget, copy, table->config.page_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Sleeps until written bytes since start are within the rate limit.
+ * Returns non-zero if the backup was stopped.
+ */
+static int
+wait_for_rate(struct backup* backup, size_t written, struct timespec* start)
+{
+    pthread_mutex_lock(&backup->latch);
+    if (backup->rate_limit > 0) {
+        uint64_t ns = (uint64_t)((double)written / backup->rate_limit * 1e9)
+            + start->tv_nsec;
+        struct timespec until = {
+            .tv_sec = start->tv_sec + ns / 1000000000,
+            .tv_nsec = ns % 1000000000,
+        };
+        while (!backup->stopping
+            && pthread_cond_timedwait(&backup->stop, &backup->latch, &until) != ETIMEDOUT) {
+        }
+    }
+    int stopping = backup->stopping;
+    pthread_mutex_unlock(&backup->latch);
+
+    return stopping;
+}
+
+/*
+ * Records the first error the backup ran into, later ones are ignored.
+ */
+static void
+fail_backup(struct backup* backup, int error)
+{
+    int expected = 0;
+    __atomic_compare_exchange_n(&backup->result, &expected, error, 0, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED);
+}
+
+static void
+unwatch_writes(Table table)
+{
+    for (int i = 0; i < table->n_shards; i++) {
+        pthread_mutex_lock(&table->shards[i].latch);
+        lhash_watch_writes(table->shards[i].lhash, NULL, NULL);
+        pthread_mutex_unlock(&table->shards[i].latch);
+    }
+}
+
+static void
+free_backup(struct backup* backup)
+{
+    Table table = backup->table;
+    for (int i = 0; i < table->n_shards; i++) {
+        struct backup_shard* shard = &backup->shards[i];
+        for (size_t p = 0; p < shard->n_pages; p++) {
+            budget_dealloc(table->budget, shard->pages[p].copy, table->config.page_size);
+        }
+        budget_dealloc(table->budget, shard->pages, shard->n_pages * sizeof(*shard->pages));
+    }
+
+    pthread_mutex_destroy(&backup->latch);
+    pthread_cond_destroy(&backup->stop);
+    free(backup->path);
+    budget_dealloc(table->budget, backup,
+        sizeof(*backup) + table->n_shards * sizeof(struct backup_shard));
+}
+
+/*
+ * Sets up an export or import of table to or from fd.
+ */
+static int
+open_export(struct export_ctx* export, Table table, int fd, int writing)
+{
+    memset(export, 0, sizeof(*export));
+    export->table = table;
+    export->stream = writing ? stream_writer(fd, EXPORT_BUFFER_SIZE, table->budget)
+        : stream_reader(fd, EXPORT_BUFFER_SIZE, table->budget);
+
+    return export->stream == NULL ? TABLE_NO_MEMORY : 0;
+}
+
+/*
+ * Makes room for the records of a page of page_size and their encoding.
+ */
+static int
+alloc_export_page(struct export_ctx* export, size_t page_size)
+{
+    Table table = export->table;
+    int n_records = page_capacity(page_size, table->record_size);
+    if (n_records <= 0) {
+        return TABLE_CORRUPT;
+    }
+
+    export->buffer_size = n_records * table->record_size;
+    export->records_size = export->buffer_size;
+    export->records = budget_alloc(table->budget, export->buffer_size);
+    export->encoded = budget_alloc(table->budget, export->buffer_size);
+
+    return export->records == NULL || export->encoded == NULL ? TABLE_NO_MEMORY : 0;
+}
+
+/*
+ * Closes the stream and frees the buffers.
+ * Returns the first error the export or import ran into.
+ */
+static int
+close_export(struct export_ctx* export)
+{
+    Table table = export->table;
+    int result = stream_close(&export->stream) != 0 ? TABLE_IO_ERROR : 0;
+    budget_dealloc(table->budget, export->records, export->records_size);
+    budget_dealloc(table->budget, export->encoded, export->buffer_size);
+
+    return export->result != 0 ? export->result : result;
+}
+
+/*
+ * Exports the shard a bucket at a time. The shard is only latched while a bucket is copied out, not
+ * while it is written, and a cursor in hash order keeps the export's place while buckets are split
+ * and merged in between, see lhash_scan_from. Buckets aren't held still meanwhile, so inserts keep
+ * splitting them rather than growing the chain that is copied out next.
+ */
+static void
+export_shard(struct export_ctx* export, struct shard* shard)
+{
+    uint64_t cursor = 0;
+    while (export->result == 0 && cursor != LHASH_SCAN_END) {
+        pthread_mutex_lock(&shard->latch);
+        export->n_copied = 0;
+        int result = lhash_scan_from(shard->lhash, &cursor, 1, copy_record, export);
+        pthread_mutex_unlock(&shard->latch);
+
+        if (result < 0) {
+            export->result = to_table_error(result);
+        }
+        export_records(export);
+    }
+}
+
+/*
+ * Appends the record to those copied out of its bucket, growing the buffer if the bucket has more
+ * than a page of them. The record's shard is latched.
+ * Returns non-zero if the buffer couldn't grow.
+ */
+static int
+copy_record(void* record, void* ctx)
+{
+    struct export_ctx* export = ctx;
+    size_t record_size = export->table->record_size;
+    size_t size = export->n_copied + record_size;
+    if (size > export->records_size) {
+        size_t records_size = 2 * export->records_size > size ? 2 * export->records_size : size;
+        char* records = budget_realloc(export->table->budget, export->records,
+            export->records_size, records_size);
+        if (records == NULL) {
+            export->result = TABLE_NO_MEMORY;
+            return 1;
+        }
+        export->records = records;
+        export->records_size = records_size;
+    }
+
+    memcpy(export->records + export->n_copied, record, record_size);
+    export->n_copied += record_size;
+
+    return 0;
+}
+
+/*
+ * Writes the records copied out of a bucket to the export in blocks of up to a page of them, each
+ * delta encoded if it is compressed and that makes the block smaller.
+ */
+static void
+export_records(struct export_ctx* export)
+{
+    size_t record_size = export->table->record_size;
+    for (size_t at = 0; at < export->n_copied && export->result == 0;) {
+        size_t size = export->n_copied - at;
+        size = size < export->buffer_size ? size : export->buffer_size;
+        uint32_t n_records = size / record_size;
+        char* records = export->records + at;
+
+        size_t encoded = export->compress ? encode_delta((unsigned char*)records, size,
+            record_size, (unsigned char*)export->encoded) : 0;
+        if (encoded > 0) {
+            export->result = write_block(export, EXPORT_DELTA, n_records, export->encoded, encoded);
+        } else {
+            export->result = write_block(export, EXPORT_RAW, n_records, records, size);
+        }
+        export->n_records += n_records;
+        at += size;
+    }
+}
+
+static int
+write_block(struct export_ctx* export, uint32_t encoding, uint32_t n_records,
+    const char* payload, size_t size)
+{
+    struct export_block block = {
+        .n_records = n_records,
+        .encoding = encoding,
+        .size = size,
+    };
+    block.crc = block_crc(&block, payload);
+
+    int result = stream_write(export->stream, &block, sizeof(block));
+    if (result == 0) {
+        result = stream_write(export->stream, payload, size);
+    }
+
+    return stream_error(result);
+}
+
+/*
+ * Reads the export's header and checks it is one.
+ */
+static int
+read_header(struct export_ctx* export, struct export_header* header)
+{
+    int result = stream_error(stream_read(export->stream, header, sizeof(*header)));
+    if (result != 0) {
+        return result;
+    }
+
+    uint32_t crc = header->crc;
+    header->crc = 0;
+    if (memcmp(header->magic, EXPORT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != EXPORT_VERSION || crc32c(0, header, sizeof(*header)) != crc
+        || header->meta.n_shards > TABLE_MAX_SHARDS || header->page_size > MAX_PAGE_SIZE) {
+        return TABLE_CORRUPT;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the next block of the export and adds its records to the table, whose shards are latched.
+ * Returns a positive number if there are more blocks, zero after the end block or an error.
+ */
+static int
+import_block(struct export_ctx* export)
+{
+    Table table = export->table;
+    struct export_block block;
+    int result = stream_error(stream_read(export->stream, &block, sizeof(block)));
+    if (result != 0) {
+        return result;
+    }
+
+    size_t size = (size_t)block.n_records * table->record_size;
+    int valid;
+    switch (block.encoding) {
+    case EXPORT_RAW:
+        valid = block.n_records > 0 && size <= export->buffer_size && block.size == size;
+        break;
+    case EXPORT_DELTA:
+        valid = block.n_records > 0 && size <= export->buffer_size && block.size < size;
+        break;
+    case EXPORT_END:
+        valid = block.n_records == 0 && block.size == sizeof(uint64_t);
+        break;
+    default:
+        valid = 0;
+    }
+    if (!valid) {
+        return TABLE_CORRUPT;
+    }
+
+    char* payload = block.encoding == EXPORT_RAW ? export->records : export->encoded;
+    result = stream_error(stream_read(export->stream, payload, block.size));
+    if (result == 0 && block_crc(&block, payload) != block.crc) {
+        result = TABLE_CORRUPT;
+    }
+    if (result == 0 && block.encoding == EXPORT_DELTA) {
+        result = decode_delta((unsigned char*)payload, block.size, table->record_size,
+            (unsigned char*)export->records, size);
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    if (block.encoding == EXPORT_END) {
+        uint64_t n_records;
+        memcpy(&n_records, payload, sizeof(n_records));
+        return n_records == export->n_records ? 0 : TABLE_CORRUPT;
+    }
+
+    /* An export never holds a key twice, so a key already in its bucket means a corrupt one. */
+    for (uint32_t i = 0; i < block.n_records && result == 0; i++) {
+        char* record = export->records + i * table->record_size;
+        uint64_t hash = table_hash(table, record, table->key_size);
+        result = lhash_insert(shard_for(table, hash)->lhash, hash, record);
+        result = result == LHASH_KEY_EXISTS ? TABLE_CORRUPT : to_table_error(result);
+    }
+    export->n_records += block.n_records;
+
+    return result == 0 ? 1 : result;
+}
+
+static uint32_t
+block_crc(struct export_block* block, const char* payload)
+{
+    return crc32c(crc32c(0, block, offsetof(struct export_block, crc)), payload, block->size);
+}
+
+/*
+ * Delta encodes size bytes of records into out, which has room for size bytes.
+ * Returns the size of the encoding, or zero if it wouldn't be smaller than the records.
+ */
+static size_t
+encode_delta(const unsigned char* in, size_t size, size_t record_size, unsigned char* out)
+{
+    size_t n = 0;
+    size_t literals = 0;
+
+    for (size_t at = 0;;) {
+        size_t repeat = 0;
+        while (at + repeat < size && repeat < DELTA_MAX_RUN
+            && in[at + repeat] == (at + repeat >= record_size ? in[at + repeat - record_size] : 0)) {
+            repeat++;
+        }
+
+        if (at < size && repeat < DELTA_MIN_REPEAT) {
+            literals++;
+            at++;
+            continue;
+        }
+
+        while (literals > 0) {
+            size_t run = literals < DELTA_MAX_RUN ? literals : DELTA_MAX_RUN;
+            if (n + 1 + run >= size) {
+                return 0;
+            }
+            out[n++] = run - 1;
+            memcpy(out + n, in + at - literals, run);
+            n += run;
+            literals -= run;
+        }
+
+        if (at == size) {
+            return n;
+        }
+        if (n + 1 >= size) {
+            return 0;
+        }
+        out[n++] = DELTA_MAX_RUN - 1 + repeat;
+        at += repeat;
+    }
+}
+
+/*
+ * Decodes size bytes of delta encoding into the out_size bytes of records at out.
+ * Returns TABLE_CORRUPT if the encoding doesn't decode to exactly out_size bytes.
+ */
+static int
+decode_delta(const unsigned char* in, size_t size, size_t record_size, unsigned char* out,
+    size_t out_size)
+{
+    size_t at = 0;
+    for (size_t i = 0; i < size;) {
+        int literal = in[i] < DELTA_MAX_RUN;
+        size_t run = literal ? in[i] + 1 : in[i] - (DELTA_MAX_RUN - 1);
+        i++;
+        if (at + run > out_size || (literal && i + run > size)) {
+            return TABLE_CORRUPT;
+        }
+
+        if (literal) {
+            memcpy(out + at, in + i, run);
+            i += run;
+        } else {
+            for (size_t j = at; j < at + run; j++) {
+                out[j] = j >= record_size ? out[j - record_size] : 0;
+            }
+        }
+        at += run;
+    }
+
+    return at == out_size ? 0 : TABLE_CORRUPT;
+}
+
+static int
+stream_error(int stream_error)
+{
+    switch (stream_error) {
+    case STREAM_ARG_INVALID:
+        return TABLE_ARG_INVALID;
+    case STREAM_END:
+        return TABLE_CORRUPT;
+    case STREAM_IO_ERROR:
+        return TABLE_IO_ERROR;
+    }
+
+    return stream_error;
+}
+
+static int
+to_table_error(int lhash_error)
+{
+    switch (lhash_error) {
+    case LHASH_ARG_INVALID:
+        return TABLE_ARG_INVALID;
+    case LHASH_KEY_EXISTS:
+        return TABLE_KEY_EXISTS;
+    case LHASH_KEY_NOT_FOUND:
+        return TABLE_KEY_NOT_FOUND;
+    case LHASH_NO_MEMORY:
+        return TABLE_NO_MEMORY;
+    case LHASH_IO_ERROR:
+        return TABLE_IO_ERROR;
+    }
+
+    return lhash_error;
 }
@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+/*
+ * Rings are never freed. A thread that exits gives its ring back and the next thread to trace
+ * takes it over, so a server that starts and stops threads doesn't grow a ring per thread.
+ * A ring's head counts every operation written to it and is only stored by its thread, after the
+ * operation. A reader copies the ring and then reads the head again: slots the thread may have
+ * been writing in the meantime are left out, the others are whole.
+ * Latencies go into buckets of eight per power of two, like an HDR histogram with one significant
+ * digit in base eight.
+ */
+
+#define SUB_BUCKETS (8)
+#define N_BUCKETS (62 * SUB_BUCKETS)
+
+struct ring
+{
+    struct ring*    next;
+    int             in_use;
+    int             thread;
+    uint64_t        head;
+    TraceEvent      events[TRACE_RING_SIZE];
+};
+
+struct histogram
+{
+    uint64_t    count;
+    uint64_t    max;
+    uint64_t    buckets[N_BUCKETS];
+};
+
+static const char* op_names[TRACE_N_OPS] = {
+    "page_add",
+    "page_delete",
+    "lookup",
+    "split",
+    "fault",
+    "flush",
+};
+
+static struct ring* rings = NULL;
+static int n_rings = 0;
+static uint64_t cleared_at = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct ring* thread_ring = NULL;
+
+static struct ring* take_ring(void);
+static void create_ring_key(void);
+static void give_back_ring(void* ring);
+static size_t copy_ring(struct ring* ring, TraceEvent* out);
+static size_t bucket_of(uint64_t duration);
+static uint64_t bucket_limit(size_t bucket);
+static uint64_t percentile(struct histogram* histogram, double fraction);
+
+int
+trace_enabled(void)
+{
+#ifdef EZDB_TRACING
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+uint64_t
+trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+trace_record(TraceOp op, uint64_t start, uint64_t id, uint32_t probes)
+{
+    uint64_t end = trace_now();
+    if (thread_ring == NULL && (thread_ring = take_ring()) == NULL) {
+        return;
+    }
+
+    uint64_t head = thread_ring->head;
+    thread_ring->events[head % TRACE_RING_SIZE] = (TraceEvent){
+        .start = start,
+        .duration = end - start,
+        .id = id,
+        .probes = probes,
+        .op = op,
+    };
+    __atomic_store_n(&thread_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_clear(void)
+{
+    __atomic_store_n(&cleared_at, trace_now(), __ATOMIC_RELAXED);
+}
+
+const char*
+trace_op_name(TraceOp op)
+{
+    return 0 <= op && op < TRACE_N_OPS ? op_names[op] : "unknown";
+}
+
+int
+trace_write_chrome(int fd)
+{
+    TraceEvent* events = malloc(TRACE_RING_SIZE * sizeof(*events));
+    if (events == NULL) {
+        return TRACE_NO_MEMORY;
+    }
+
+    int dup_fd = dup(fd);
+    FILE* out = dup_fd < 0 ? NULL : fdopen(dup_fd, "w");
+    if (out == NULL) {
+        if (dup_fd >= 0) {
+            close(dup_fd);
+        }
+        free(events);
+        return TRACE_IO_ERROR;
+    }
+
+    int pid = getpid();
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+        ring = ring->next) {
+        size_t n_events = copy_ring(ring, events);
+        for (size_t i = 0; i < n_events; i++) {
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%llu,\"probes\":%u}}",
+                first ? "" : ",", trace_op_name(events[i].op), events[i].start / 1e3,
+                events[i].duration / 1e3, pid, ring->thread, (unsigned long long)events[i].id,
+                events[i].probes);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    int failed = ferror(out);
+    failed |= fclose(out) != 0;
+    free(events);
+
+    return failed ? TRACE_IO_ERROR : 0;
+}
+
+int
+trace_write_histograms(int fd)
+{
+    TraceEvent* events = malloc(TRACE_RING_SIZE * sizeof(*events));
+    struct histogram* histograms = calloc(TRACE_N_OPS, sizeof(*histograms));
+    if (events == NULL || histograms == NULL) {
+        free(events);
+        free(histograms);
+        return TRACE_NO_MEMORY;
+    }
+
+    for (struct ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+        ring = ring->next) {
+        size_t n_events = copy_ring(ring, events);
+        for (size_t i = 0; i < n_events; i++) {
+            struct histogram* histogram = &histograms[events[i].op];
+            histogram->count++;
+            histogram->buckets[bucket_of(events[i].duration)]++;
+            if (events[i].duration > histogram->max) {
+                histogram->max = events[i].duration;
+            }
+        }
+    }
+    free(events);
+
+    int failed = dprintf(fd, "%-12s %10s %10s %10s %10s %10s %10s  (ns)\n", "op", "count", "p50",
+        "p90", "p99", "p99.9", "max") < 0;
+    for (int op = 0; op < TRACE_N_OPS && !failed; op++) {
+        struct histogram* histogram = &histograms[op];
+        failed = dprintf(fd, "%-12s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+            trace_op_name(op), (unsigned long long)histogram->count,
+            (unsigned long long)percentile(histogram, 0.5),
+            (unsigned long long)percentile(histogram, 0.9),
+            (unsigned long long)percentile(histogram, 0.99),
+            (unsigned long long)percentile(histogram, 0.999),
+            (unsigned long long)histogram->max) < 0;
+    }
+
+    /* One row per power of two, the sub buckets are only there for the percentiles. */
+    for (int op = 0; op < TRACE_N_OPS && !failed; op++) {
+        struct histogram* histogram = &histograms[op];
+        if (histogram->count == 0) {
+            continue;
+        }
+
+        failed = dprintf(fd, "\n%s\n", trace_op_name(op)) < 0;
+        uint64_t below = 0;
+        for (size_t bucket = 0; bucket < N_BUCKETS && below < histogram->count && !failed;) {
+            uint64_t count = 0;
+            size_t end = bucket < SUB_BUCKETS ? SUB_BUCKETS : bucket + SUB_BUCKETS;
+            for (; bucket < end; bucket++) {
+                count += histogram->buckets[bucket];
+            }
+            below += count;
+            if (count > 0) {
+                failed = dprintf(fd, "  <= %-12llu %10llu %6.2f%%\n",
+                    (unsigned long long)bucket_limit(end - 1), (unsigned long long)count,
+                    100.0 * below / histogram->count) < 0;
+            }
+        }
+    }
+    free(histograms);
+
+    return failed ? TRACE_IO_ERROR : 0;
+}
+
+
+/*
+ * PRIVATE FUNCTIONS
+ */
+
+/*
+ * Returns a ring given back by a thread that has exited, or a new one.
+ */
+static struct ring*
+take_ring(void)
+{
+    pthread_once(&ring_key_once, create_ring_key);
+
+    struct ring* ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE,
+                __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->in_use = 1;
+        ring->thread = __atomic_add_fetch(&n_rings, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0, __ATOMIC_RELEASE,
+                __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+
+    return ring;
+}
+
+static void
+create_ring_key(void)
+{
+    pthread_key_create(&ring_key, give_back_ring);
+}
+
+static void
+give_back_ring(void* ring)
+{
+    __atomic_store_n(&((struct ring*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the operations of the ring that are whole and weren't cleared into out, oldest first.
+ * Returns how many were copied.
+ */
+static size_t
+copy_ring(struct ring* ring, TraceEvent* out)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < head; i++) {
+        out[i - first] = ring->events[i % TRACE_RING_SIZE];
+    }
+
+    /* The thread may have overwritten, or be writing, the slots of the oldest operations. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t whole = now + 1 > TRACE_RING_SIZE ? now + 1 - TRACE_RING_SIZE : 0;
+    uint64_t cleared = __atomic_load_n(&cleared_at, __ATOMIC_RELAXED);
+
+    size_t n_events = 0;
+    for (uint64_t i = first < whole ? whole : first; i < head; i++) {
+        if (out[i - first].start >= cleared) {
+            out[n_events++] = out[i - first];
+        }
+    }
+
+    return n_events;
+}
+
+static size_t
+bucket_of(uint64_t duration)
+{
+    if (duration < SUB_BUCKETS) {
+        return duration;
+    }
+
+    int msb = 63 - __builtin_clzll(duration);
+    return (msb - 2) * SUB_BUCKETS + ((duration >> (msb - 3)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the largest duration that falls in the bucket.
+ */
+static uint64_t
+bucket_limit(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t sub = SUB_BUCKETS + bucket % SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t
+percentile(struct histogram* histogram, double fraction)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    uint64_t below = 0;
+    for (size_t bucket = 0; bucket < N_BUCKETS; bucket++) {
+        below += histogram->buckets[bucket];
+        if (below > rank) {
+            uint64_t limit = bucket_limit(bucket);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,294 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "budget.h"
+
+#define N_THREADS (4)
+
+static void*
+charge_and_release(void* arg)
+{
+    Budget budget = arg;
+    for (int i = 0; i < 100000; i++) {
+        ck_assert(budget_reserve(budget, i % 50 + 1) == 0);
+        if (i % 3 == 2) {
+            budget_release(budget, i % 50 + 1);
+            budget_release(budget, (i - 1) % 50 + 1);
+            budget_release(budget, (i - 2) % 50 + 1);
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST (should_create_budget)
+{
+    Budget budget = budget_create(NULL, 100);
+
+    ck_assert(budget != NULL);
+    ck_assert(budget_limit(budget) == 100);
+    ck_assert(budget_used(budget) == 0);
+
+    budget_free(&budget);
+    ck_assert(budget == NULL);
+}
+END_TEST
+
+START_TEST (should_not_fail_when_freeing_null)
+{
+    Budget budget = NULL;
+
+    budget_free(NULL);
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_refuse_charge_over_limit)
+{
+    Budget budget = budget_create(NULL, 100);
+
+    ck_assert(budget_reserve(budget, 60) == 0);
+    ck_assert(budget_reserve(budget, 60) == BUDGET_EXCEEDED);
+    ck_assert(budget_used(budget) == 60);
+    ck_assert(budget_reserve(budget, 40) == 0);
+
+    budget_release(budget, 50);
+    ck_assert(budget_used(budget) == 50);
+
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_charge_every_budget_above)
+{
+    size_t global_used = budget_used(budget_global());
+    Budget parent = budget_create(NULL, 0);
+    Budget child = budget_create(parent, 0);
+
+    ck_assert(budget_reserve(child, 30) == 0);
+    ck_assert(budget_used(child) == 30);
+    ck_assert(budget_used(parent) == 30);
+    ck_assert(budget_used(budget_global()) == global_used + 30);
+
+    budget_free(&child);
+    ck_assert(budget_used(parent) == 0);
+    ck_assert(budget_used(budget_global()) == global_used);
+
+    budget_free(&parent);
+}
+END_TEST
+
+START_TEST (should_roll_back_charge_refused_above)
+{
+    Budget parent = budget_create(NULL, 100);
+    Budget child = budget_create(parent, 0);
+    Budget sibling = budget_create(parent, 0);
+
+    ck_assert(budget_reserve(sibling, 80) == 0);
+    ck_assert(budget_reserve(child, 30) == BUDGET_EXCEEDED);
+    ck_assert(budget_used(child) == 0);
+    ck_assert(budget_used(parent) == 80);
+
+    budget_free(&sibling);
+    ck_assert(budget_reserve(child, 30) == 0);
+
+    budget_free(&child);
+    budget_free(&parent);
+}
+END_TEST
+
+START_TEST (should_apply_global_limit)
+{
+    Budget budget = budget_create(NULL, 0);
+    budget_set_limit(budget_global(), budget_used(budget_global()) + 100);
+
+    ck_assert(budget_alloc(budget, 200) == NULL);
+    ck_assert(budget_used(budget) == 0);
+
+    void* memory = budget_alloc(budget, 50);
+    ck_assert(memory != NULL);
+
+    budget_dealloc(budget, memory, 50);
+    budget_set_limit(budget_global(), 0);
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_charge_allocations)
+{
+    Budget budget = budget_create(NULL, 100);
+
+    char* memory = budget_calloc(budget, 4, 10);
+    ck_assert(memory != NULL && memory[39] == 0);
+    ck_assert(budget_used(budget) == 40);
+
+    char* grown = budget_realloc(budget, memory, 40, 80);
+    ck_assert(grown != NULL);
+    ck_assert(budget_used(budget) == 80);
+
+    ck_assert(budget_realloc(budget, grown, 80, 120) == NULL);
+    ck_assert(budget_used(budget) == 80);
+
+    char* shrunk = budget_realloc(budget, grown, 80, 20);
+    ck_assert(shrunk != NULL);
+    ck_assert(budget_used(budget) == 20);
+
+    budget_dealloc(budget, shrunk, 20);
+    ck_assert(budget_used(budget) == 0);
+
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_keep_charges_over_lowered_limit)
+{
+    Budget budget = budget_create(NULL, 0);
+
+    ck_assert(budget_reserve(budget, 100) == 0);
+    budget_set_limit(budget, 50);
+    ck_assert(budget_used(budget) == 100);
+    ck_assert(budget_reserve(budget, 1) == BUDGET_EXCEEDED);
+
+    budget_release(budget, 60);
+    ck_assert(budget_reserve(budget, 1) == 0);
+
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_free_memory_reallocated_to_nothing)
+{
+    Budget budget = budget_create(NULL, 0);
+
+    void* memory = budget_alloc(budget, 40);
+    ck_assert(budget_realloc(budget, memory, 40, 0) == NULL);
+    ck_assert(budget_used(budget) == 0);
+
+    budget_free(&budget);
+}
+END_TEST
+
+START_TEST (should_charge_parent_in_batches)
+{
+    Budget parent = budget_create(NULL, 0);
+    Budget child = budget_create_batched(parent, 0, 100);
+    ck_assert(budget_create_batched(parent, 0, 0) == NULL);
+
+    ck_assert(budget_reserve(child, 10) == 0);
+    ck_assert(budget_used(child) == 10);
+    ck_assert(budget_used(parent) == 100);
+    ck_assert(budget_reserve(child, 80) == 0);
+    ck_assert(budget_used(parent) == 100);
+    ck_assert(budget_reserve(child, 160) == 0);
+    ck_assert(budget_used(parent) == 300);
+
+    /* Up to two batches past what is charged are kept, past that all but one go back. */
+    budget_release(child, 40);
+    ck_assert(budget_used(parent) == 300);
+    budget_release(child, 200);
+    ck_assert(budget_used(child) == 10);
+    ck_assert(budget_used(parent) == 110);
+
+    budget_trim(child);
+    ck_assert(budget_used(parent) == 10);
+    budget_free(&child);
+    ck_assert(budget_used(parent) == 0);
+
+    budget_free(&parent);
+}
+END_TEST
+
+START_TEST (should_draw_what_is_missing_near_limit_above)
+{
+    Budget parent = budget_create(NULL, 150);
+    Budget child = budget_create_batched(parent, 0, 100);
+
+    ck_assert(budget_reserve(child, 120) == 0);
+    ck_assert(budget_used(parent) == 120);
+    ck_assert(budget_reserve(child, 40) == BUDGET_EXCEEDED);
+    ck_assert(budget_used(child) == 120);
+    ck_assert(budget_reserve(child, 30) == 0);
+    ck_assert(budget_used(parent) == 150);
+
+    budget_free(&child);
+    budget_free(&parent);
+}
+END_TEST
+
+START_TEST (should_keep_batched_charges_in_step_across_threads)
+{
+    Budget parent = budget_create(NULL, 0);
+    Budget children[N_THREADS];
+    pthread_t threads[N_THREADS];
+
+    /* Two threads on each child, so charges race give-backs on the same budget. */
+    for (int i = 0; i < N_THREADS; i++) {
+        children[i] = budget_create_batched(parent, 0, 1000);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_create(&threads[i], NULL, charge_and_release, children[i / 2]);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    size_t held = 0;
+    for (int i = 0; i < N_THREADS; i++) {
+        budget_trim(children[i]);
+        held += budget_used(children[i]);
+    }
+    ck_assert(budget_used(parent) == held);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        budget_free(&children[i]);
+    }
+    ck_assert(budget_used(parent) == 0);
+    budget_free(&parent);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Budget");
+
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_create_budget);
+    tcase_add_test(tc_core, should_not_fail_when_freeing_null);
+    suite_add_tcase(s, tc_core);
+
+    TCase* tc_limits = tcase_create("Limits");
+    tcase_add_test(tc_limits, should_refuse_charge_over_limit);
+    tcase_add_test(tc_limits, should_charge_every_budget_above);
+    tcase_add_test(tc_limits, should_roll_back_charge_refused_above);
+    tcase_add_test(tc_limits, should_apply_global_limit);
+    tcase_add_test(tc_limits, should_charge_allocations);
+    tcase_add_test(tc_limits, should_keep_charges_over_lowered_limit);
+    tcase_add_test(tc_limits, should_free_memory_reallocated_to_nothing);
+    suite_add_tcase(s, tc_limits);
+
+    TCase* tc_batched = tcase_create("Batched");
+    tcase_add_test(tc_batched, should_charge_parent_in_batches);
+    tcase_add_test(tc_batched, should_draw_what_is_missing_near_limit_above);
+    tcase_add_test(tc_batched, should_keep_batched_charges_in_step_across_threads);
+    suite_add_tcase(s, tc_batched);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = page_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "cache.h"
+#include "hash.h"
+
+static void
+make_record(char* record, uint64_t key, char value)
+{
+    memset(record, value, 16);
+    memcpy(record, &key, sizeof(key));
+}
+
+static uint64_t
+hash_of(uint64_t key)
+{
+    return hash_fast(&key, sizeof(key), 0);
+}
+
+START_TEST (should_create_cache)
+{
+    Cache cache = cache_create(64, 16, 8);
+    
+    ck_assert(cache != NULL);
+    
+    cache_free(&cache);
+    ck_assert(cache == NULL);
+}
+END_TEST
+
+START_TEST (should_not_create_cache_with_invalid_sizes)
+{
+    ck_assert(cache_create(0, 16, 8) == NULL);
+    ck_assert(cache_create(64, 0, 8) == NULL);
+    ck_assert(cache_create(64, 16, 0) == NULL);
+    ck_assert(cache_create(64, 16, 17) == NULL);
+}
+END_TEST
+
+START_TEST (should_not_fail_when_freeing_null)
+{
+    Cache cache = NULL;
+    
+    cache_free(NULL);
+    cache_free(&cache);
+}
+END_TEST
+
+START_TEST (should_get_cached_record)
+{
+    Cache cache = cache_create(64, 16, 8);
+    char record[16];
+    char out[16];
+    make_record(record, 7, 'a');
+    
+    ck_assert(cache_get(cache, hash_of(7), record, out) == CACHE_MISS);
+    ck_assert(cache_put(cache, hash_of(7), record) == 0);
+    ck_assert(cache_get(cache, hash_of(7), record, out) == 0);
+    ck_assert(memcmp(record, out, 16) == 0);
+    
+    CacheStats stats = cache_stats(cache);
+    ck_assert(stats.hits == 1);
+    ck_assert(stats.misses == 1);
+    ck_assert(stats.entries == 1);
+    
+    cache_free(&cache);
+}
+END_TEST
+
+START_TEST (should_replace_record_with_same_key)
+{
+    Cache cache = cache_create(64, 16, 8);
+    char record[16];
+    char out[16];
+    
+    make_record(record, 7, 'a');
+    cache_put(cache, hash_of(7), record);
+    make_record(record, 7, 'b');
+    ck_assert(cache_put(cache, hash_of(7), record) == 0);
+    
+    ck_assert(cache_get(cache, hash_of(7), record, out) == 0);
+    ck_assert(out[15] == 'b');
+    ck_assert(cache_stats(cache).entries == 1);
+    
+    cache_free(&cache);
+}
+END_TEST
+
+START_TEST (should_invalidate_record)
+{
+    Cache cache = cache_create(64, 16, 8);
+    char record[16];
+    char out[16];
+    make_record(record, 7, 'a');
+    
+    cache_put(cache, hash_of(7), record);
+    cache_invalidate(cache, hash_of(7), record);
+    
+    ck_assert(cache_get(cache, hash_of(7), record, out) == CACHE_MISS);
+    ck_assert(cache_stats(cache).entries == 0);
+    
+    /* The freed entry is reused. */
+    ck_assert(cache_put(cache, hash_of(7), record) == 0);
+    ck_assert(cache_get(cache, hash_of(7), record, out) == 0);
+    
+    cache_free(&cache);
+}
+END_TEST
+
+START_TEST (should_never_exceed_capacity)
+{
+    Cache cache = cache_create(64, 16, 8);
+    char record[16];
+    char out[16];
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key, 'a');
+        cache_get(cache, hash_of(key), record, out);
+        cache_put(cache, hash_of(key), record);
+    }
+    
+    ck_assert(cache_stats(cache).entries <= 64);
+    
+    cache_free(&cache);
+}
+END_TEST
+
+START_TEST (should_keep_hot_records_over_one_off_keys)
+{
+    Cache cache = cache_create(64, 16, 8);
+    char record[16];
+    char out[16];
+    
+    /* A few keys are read over and over, as in a zipfian workload. */
+    for (int round = 0; round < 4; round++) {
+        for (uint64_t key = 0; key < 32; key++) {
+            make_record(record, key, 'a');
+            if (cache_get(cache, hash_of(key), record, out) != 0) {
+                cache_put(cache, hash_of(key), record);
+            }
+        }
+    }
+    
+    /* A scan over keys that are read once shouldn't push them out. */
+    for (uint64_t key = 1000; key < 2000; key++) {
+        make_record(record, key, 'a');
+        if (cache_get(cache, hash_of(key), record, out) != 0) {
+            cache_put(cache, hash_of(key), record);
+        }
+    }
+    
+    int hits = 0;
+    for (uint64_t key = 0; key < 32; key++) {
+        make_record(record, key, 'a');
+        hits += cache_get(cache, hash_of(key), record, out) == 0;
+    }
+    
+    ck_assert(hits >= 24);
+    ck_assert(cache_stats(cache).rejections > 0);
+    
+    cache_free(&cache);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Cache");
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_create_cache);
+    tcase_add_test(tc_core, should_not_create_cache_with_invalid_sizes);
+    tcase_add_test(tc_core, should_not_fail_when_freeing_null);
+    suite_add_tcase(s, tc_core);
+    
+    TCase* tc_records = tcase_create("Records");
+    tcase_add_test(tc_records, should_get_cached_record);
+    tcase_add_test(tc_records, should_replace_record_with_same_key);
+    tcase_add_test(tc_records, should_invalidate_record);
+    tcase_add_test(tc_records, should_never_exceed_capacity);
+    tcase_add_test(tc_records, should_keep_hot_records_over_one_off_keys);
+    suite_add_tcase(s, tc_records);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "hash.h"
+
+START_TEST (should_compute_known_crc32c)
+{
+    ck_assert(crc32c(0, "123456789", 9) == 0xe3069283);
+}
+END_TEST
+
+START_TEST (should_continue_crc32c_across_calls)
+{
+    uint32_t crc = crc32c(0, "12345", 5);
+    
+    ck_assert(crc32c(crc, "6789", 4) == 0xe3069283);
+}
+END_TEST
+
+START_TEST (should_hash_equal_keys_equally)
+{
+    char* key1 = strdup("hello,my,name,jeff");
+    char* key2 = strdup("hello,my,name,jeff");
+    
+    ck_assert(hash_fast(key1, 18, 0) == hash_fast(key2, 18, 0));
+    ck_assert(hash_crc32c(key1, 18, 0) == hash_crc32c(key2, 18, 0));
+    
+    free(key1);
+    free(key2);
+}
+END_TEST
+
+START_TEST (should_hash_different_keys_differently)
+{
+    ck_assert(hash_fast("hello,my,name,jeff", 18, 0) != hash_fast("hello,my,name,john", 18, 0));
+    ck_assert(hash_crc32c("hello,my,name,jeff", 18, 0) != hash_crc32c("hello,my,name,john", 18, 0));
+}
+END_TEST
+
+START_TEST (should_hash_every_length)
+{
+    char data[256];
+    for (int i = 0; i < 256; i++) {
+        data[i] = i;
+    }
+
+    /* Each length takes a different path through hash_fast, none should collide. */
+    for (size_t len = 1; len < sizeof(data); len++) {
+        ck_assert(hash_fast(data, len, 0) != hash_fast(data, len - 1, 0));
+        ck_assert(hash_crc32c(data, len, 0) != hash_crc32c(data, len - 1, 0));
+    }
+}
+END_TEST
+
+START_TEST (should_change_hash_with_seed)
+{
+    ck_assert(hash_fast("hello", 5, 1) != hash_fast("hello", 5, 2));
+    ck_assert(hash_crc32c("hello", 5, 1) != hash_crc32c("hello", 5, 2));
+}
+END_TEST
+
+START_TEST (should_not_collide_on_crc_collisions_with_a_seed)
+{
+    /* A message followed by its crc always has the same crc, so these keys collide under a plain crc. */
+    uint8_t key1[12] = "messageA";
+    uint8_t key2[12] = "messageB";
+    uint32_t crc1 = crc32c(0, key1, 8);
+    uint32_t crc2 = crc32c(0, key2, 8);
+    memcpy(key1 + 8, &crc1, sizeof(crc1));
+    memcpy(key2 + 8, &crc2, sizeof(crc2));
+    ck_assert(crc32c(0, key1, sizeof(key1)) == crc32c(0, key2, sizeof(key2)));
+
+    int n_collisions = 0;
+    for (uint64_t seed = 1; seed <= 64; seed++) {
+        n_collisions += hash_crc32c(key1, sizeof(key1), seed) == hash_crc32c(key2, sizeof(key2), seed);
+    }
+    ck_assert_int_eq(n_collisions, 0);
+}
+END_TEST
+
+START_TEST (should_get_hash_by_type)
+{
+    ck_assert(hash_get(HASH_FAST) == hash_fast);
+    ck_assert(hash_get(HASH_CRC32C) == hash_crc32c);
+    ck_assert(hash_get(-1) == NULL);
+}
+END_TEST
+
+START_TEST (should_spread_sequential_keys_over_buckets)
+{
+    int buckets[64] = {0};
+    
+    for (uint32_t key = 0; key < 64 * 1024; key++) {
+        buckets[hash_fast(&key, sizeof(key), 0) & 63]++;
+    }
+
+    for (int i = 0; i < 64; i++) {
+        ck_assert(900 < buckets[i] && buckets[i] < 1150);
+    }
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Hash");
+    
+    TCase* tc_crc = tcase_create("CRC32C");
+    tcase_add_test(tc_crc, should_compute_known_crc32c);
+    tcase_add_test(tc_crc, should_continue_crc32c_across_calls);
+    suite_add_tcase(s, tc_crc);
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_hash_equal_keys_equally);
+    tcase_add_test(tc_core, should_hash_different_keys_differently);
+    tcase_add_test(tc_core, should_hash_every_length);
+    tcase_add_test(tc_core, should_change_hash_with_seed);
+    tcase_add_test(tc_core, should_not_collide_on_crc_collisions_with_a_seed);
+    tcase_add_test(tc_core, should_get_hash_by_type);
+    tcase_add_test(tc_core, should_spread_sequential_keys_over_buckets);
+    suite_add_tcase(s, tc_core);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
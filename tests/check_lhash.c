@@ -0,0 +1,622 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "lhash.h"
+
+#define RECORD_SIZE (32)
+#define KEY_SIZE (8)
+
+static void
+make_record(char* record, uint64_t key)
+{
+    memset(record, 0, RECORD_SIZE);
+    memcpy(record, &key, KEY_SIZE);
+    memcpy(record + KEY_SIZE, "value", 5);
+}
+
+static uint64_t
+hash_of(void* key)
+{
+    return hash_fast(key, KEY_SIZE, 0);
+}
+
+static int
+count_records(void* record, void* ctx)
+{
+    (*(int*)ctx)++;
+    return 0;
+}
+
+static int
+mark_record(void* record, void* ctx)
+{
+    uint64_t key;
+    memcpy(&key, record, sizeof(key));
+    ((int*)ctx)[key]++;
+    return 0;
+}
+
+static int
+increment(void* record, int exists, void* ctx)
+{
+    uint64_t count;
+    memcpy(&count, (char*)record + KEY_SIZE, sizeof(count));
+    ck_assert(exists == (count > 0));
+    count++;
+    memcpy((char*)record + KEY_SIZE, &count, sizeof(count));
+    
+    return 0;
+}
+
+static void
+count_write(Page page, void* ctx)
+{
+    ck_assert(page != NULL);
+    (*(int*)ctx)++;
+}
+
+START_TEST (should_create_lhash)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    
+    ck_assert(lhash != NULL);
+    ck_assert(lhash_n_buckets(lhash) == 1);
+    ck_assert(lhash_count(lhash) == 0);
+    
+    lhash_free(&lhash);
+    ck_assert(lhash == NULL);
+}
+END_TEST
+
+START_TEST (should_not_create_lhash_with_invalid_key_size)
+{
+    ck_assert(lhash_create(1024, RECORD_SIZE, 0, hash_fast, 0) == NULL);
+    ck_assert(lhash_create(1024, RECORD_SIZE, RECORD_SIZE + 1, hash_fast, 0) == NULL);
+}
+END_TEST
+
+START_TEST (should_not_create_lhash_without_hash)
+{
+    ck_assert(lhash_create(1024, RECORD_SIZE, KEY_SIZE, NULL, 0) == NULL);
+}
+END_TEST
+
+START_TEST (should_insert_and_lookup_record)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    make_record(record, 42);
+    
+    ck_assert(lhash_insert(lhash, hash_of(record), record) == 0);
+    ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == 0);
+    ck_assert(memcmp(record, out, RECORD_SIZE) == 0);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_not_insert_duplicate_key)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    make_record(record, 42);
+    
+    lhash_insert(lhash, hash_of(record), record);
+    ck_assert(lhash_insert(lhash, hash_of(record), record) == LHASH_KEY_EXISTS);
+    ck_assert(lhash_count(lhash) == 1);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_not_lookup_missing_key)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    make_record(record, 42);
+    
+    ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == LHASH_KEY_NOT_FOUND);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_split_as_records_are_added)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_insert(lhash, hash_of(record), record) == 0);
+    }
+    
+    ck_assert(lhash_count(lhash) == 10000);
+    ck_assert(lhash_n_buckets(lhash) > 300);
+    
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == 0);
+        ck_assert(memcmp(record, out, RECORD_SIZE) == 0);
+    }
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_delete_records)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        lhash_insert(lhash, hash_of(record), record);
+    }
+    
+    for (uint64_t key = 0; key < 1000; key += 2) {
+        make_record(record, key);
+        ck_assert(lhash_delete(lhash, hash_of(record), record) == 0);
+        ck_assert(lhash_delete(lhash, hash_of(record), record) == LHASH_KEY_NOT_FOUND);
+    }
+    
+    ck_assert(lhash_count(lhash) == 500);
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        int expected = key % 2 == 0 ? LHASH_KEY_NOT_FOUND : 0;
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == expected);
+    }
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_scan_every_record)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    int count = 0;
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        lhash_insert(lhash, hash_of(record), record);
+    }
+    
+    ck_assert(lhash_scan(lhash, count_records, &count) == 0);
+    ck_assert(count == 1000);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_scan_from_cursor_while_buckets_split_and_merge)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    int* seen = calloc(20000, sizeof(*seen));
+    uint64_t cursor = 0;
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        lhash_insert(lhash, hash_of(record), record);
+    }
+    
+    /* Grow the table well past its size at the start of the scan, then shrink it back below. */
+    uint64_t next = 1000;
+    int n_steps = 0;
+    while (cursor != LHASH_SCAN_END) {
+        ck_assert(lhash_scan_from(lhash, &cursor, 2, mark_record, seen) == 0);
+        for (int i = 0; i < 100; i++) {
+            if (n_steps < 100) {
+                make_record(record, next++);
+                lhash_insert(lhash, hash_of(record), record);
+            } else if (next > 1000) {
+                make_record(record, --next);
+                lhash_delete(lhash, hash_of(record), record);
+            }
+        }
+        n_steps++;
+    }
+    
+    ck_assert(n_steps > 200);
+    for (uint64_t key = 0; key < 20000; key++) {
+        ck_assert(key < 1000 ? seen[key] == 1 : seen[key] <= 1);
+    }
+    ck_assert(lhash_scan_from(lhash, &cursor, 2, mark_record, seen) == 0);
+    ck_assert(cursor == LHASH_SCAN_END);
+    
+    free(seen);
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_merge_buckets_as_records_are_deleted)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        lhash_insert(lhash, hash_of(record), record);
+    }
+    size_t n_buckets = lhash_n_buckets(lhash);
+    size_t n_pages = lhash_n_pages(lhash);
+    
+    for (uint64_t key = 100; key < 10000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_delete(lhash, hash_of(record), record) == 0);
+    }
+    
+    ck_assert(lhash_n_buckets(lhash) < n_buckets / 10);
+    ck_assert(lhash_n_pages(lhash) < n_pages / 10);
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        int expected = key < 100 ? 0 : LHASH_KEY_NOT_FOUND;
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == expected);
+    }
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_compact_after_deletes)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    int count = 0;
+    
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        lhash_insert(lhash, hash_of(record), record);
+    }
+    for (uint64_t key = 0; key < 5000; key += 5) {
+        make_record(record, key);
+        lhash_delete(lhash, hash_of(record), record);
+    }
+    
+    ck_assert(lhash_compact(lhash) == 0);
+    ck_assert(lhash_compact(NULL) == LHASH_ARG_INVALID);
+    ck_assert(lhash_scan(lhash, count_records, &count) == 0);
+    ck_assert(count == 4000);
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        int expected = key % 5 == 0 ? LHASH_KEY_NOT_FOUND : 0;
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == expected);
+    }
+    
+    /* The table grows again after shrinking. */
+    for (uint64_t key = 0; key < 5000; key += 5) {
+        make_record(record, key);
+        ck_assert(lhash_insert(lhash, hash_of(record), record) == 0);
+    }
+    ck_assert(lhash_count(lhash) == 5000);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_upsert_records)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_upsert(lhash, hash_of(record), record) == 0);
+    }
+    for (uint64_t key = 0; key < 1000; key += 2) {
+        make_record(record, key);
+        record[RECORD_SIZE - 1] = 'x';
+        ck_assert(lhash_upsert(lhash, hash_of(record), record) == 0);
+    }
+    
+    ck_assert(lhash_count(lhash) == 1000);
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == 0);
+        ck_assert(out[RECORD_SIZE - 1] == (key % 2 == 0 ? 'x' : 0));
+    }
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+static int
+change_key(void* record, int exists, void* ctx)
+{
+    ((char*)record)[0]++;
+    return 0;
+}
+
+static int
+refuse(void* record, int exists, void* ctx)
+{
+    return 7;
+}
+
+START_TEST (should_read_modify_write_records)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char out[RECORD_SIZE];
+    uint64_t count;
+    
+    for (int round = 0; round < 5; round++) {
+        for (uint64_t key = 0; key < 1000; key++) {
+            ck_assert(lhash_rmw(lhash, hash_of(&key), &key, increment, NULL) == 0);
+        }
+    }
+    
+    ck_assert(lhash_count(lhash) == 1000);
+    for (uint64_t key = 0; key < 1000; key++) {
+        ck_assert(lhash_lookup(lhash, hash_of(&key), &key, out) == 0);
+        memcpy(&count, out + KEY_SIZE, sizeof(count));
+        ck_assert(count == 5);
+    }
+    
+    uint64_t key = 1000;
+    ck_assert(lhash_rmw(lhash, hash_of(&key), &key, refuse, NULL) == 7);
+    ck_assert(lhash_rmw(lhash, hash_of(&key), &key, change_key, NULL) == LHASH_ARG_INVALID);
+    ck_assert(lhash_rmw(lhash, hash_of(&key), &key, NULL, NULL) == LHASH_ARG_INVALID);
+    ck_assert(lhash_count(lhash) == 1000);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_report_writes_to_existing_pages)
+{
+    LHash lhash = lhash_create(512, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    int writes = 0;
+    
+    lhash_watch_writes(lhash, count_write, &writes);
+    
+    /* The first record goes on a new page, which isn't reported. */
+    make_record(record, 1);
+    lhash_insert(lhash, hash_of(record), record);
+    ck_assert(writes == 0);
+    
+    make_record(record, 2);
+    lhash_insert(lhash, hash_of(record), record);
+    ck_assert(writes == 1);
+    
+    lhash_lookup(lhash, hash_of(record), record, out);
+    ck_assert(writes == 1);
+    
+    lhash_update(lhash, hash_of(record), record);
+    lhash_delete(lhash, hash_of(record), record);
+    ck_assert(writes == 3);
+    
+    lhash_watch_writes(lhash, NULL, NULL);
+    lhash_insert(lhash, hash_of(record), record);
+    ck_assert(writes == 3);
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+START_TEST (should_load_reserved_records_without_splitting)
+{
+    LHash lhash = lhash_create(1024, RECORD_SIZE, KEY_SIZE, hash_fast, 0);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    ck_assert(lhash_reserve(lhash, 10000) == 0);
+    size_t n_buckets = lhash_n_buckets(lhash);
+    ck_assert(n_buckets > 300);
+    
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_insert(lhash, hash_of(record), record) == 0);
+    }
+    
+    ck_assert(lhash_count(lhash) == 10000);
+    ck_assert(lhash_n_buckets(lhash) == n_buckets);
+    ck_assert(lhash_reserve(lhash, 20000) == LHASH_ARG_INVALID);
+    
+    for (uint64_t key = 0; key < 10000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == 0);
+        ck_assert(memcmp(record, out, RECORD_SIZE) == 0);
+    }
+    
+    lhash_free(&lhash);
+}
+END_TEST
+
+/*
+ * A store that hands the linear hash a fresh copy of a page on every pin and copies it back on a
+ * dirty unpin, so a page used after it is unpinned or changed without being marked dirty shows.
+ */
+#define PAGING_PAGES (1024)
+
+struct paging_store
+{
+    char*   pages[PAGING_PAGES];
+    char*   pinned[PAGING_PAGES];
+    int     n_pinned;
+    int     failing;
+};
+
+static void*
+paging_alloc(void* ctx, size_t bucket, int position)
+{
+    struct paging_store* store = ctx;
+    for (int i = 0; i < PAGING_PAGES; i++) {
+        if (store->pages[i] == NULL) {
+            store->pages[i] = calloc(1, 512);
+            return (void*)(uintptr_t)(i + 1);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+paging_release(void* ctx, void* page)
+{
+    struct paging_store* store = ctx;
+    int i = (uintptr_t)page - 1;
+    ck_assert(store->pinned[i] == NULL);
+    free(store->pages[i]);
+    store->pages[i] = NULL;
+}
+
+static void*
+paging_pin(void* ctx, void* page)
+{
+    struct paging_store* store = ctx;
+    int i = (uintptr_t)page - 1;
+    ck_assert(store->pages[i] != NULL && store->pinned[i] == NULL);
+    if (store->failing) {
+        return NULL;
+    }
+
+    store->pinned[i] = malloc(512);
+    memcpy(store->pinned[i], store->pages[i], 512);
+    store->n_pinned++;
+
+    return store->pinned[i];
+}
+
+static void
+paging_unpin(void* ctx, void* page, int dirty)
+{
+    struct paging_store* store = ctx;
+    int i = (uintptr_t)page - 1;
+    ck_assert(store->pinned[i] != NULL);
+    if (dirty) {
+        memcpy(store->pages[i], store->pinned[i], 512);
+    }
+    free(store->pinned[i]);
+    store->pinned[i] = NULL;
+    store->n_pinned--;
+}
+
+static void
+count_page(Page page, void* ctx)
+{
+    *(int*)ctx += page_n_records(page);
+}
+
+START_TEST (should_pin_pages_of_a_paging_store)
+{
+    struct paging_store paging = {0};
+    LHashStore store = {
+        .alloc = paging_alloc,
+        .release = paging_release,
+        .pin = paging_pin,
+        .unpin = paging_unpin,
+        .ctx = &paging,
+    };
+    size_t record_size = RECORD_SIZE;
+    LHash lhash = lhash_create_with_store(512, 1, &record_size, KEY_SIZE, hash_fast, 0, &store,
+        NULL);
+    char record[RECORD_SIZE];
+    char out[RECORD_SIZE];
+    
+    ck_assert(lhash != NULL);
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_insert(lhash, hash_of(record), record) == 0);
+        ck_assert(paging.n_pinned == 0);
+    }
+    for (uint64_t key = 0; key < 2000; key += 2) {
+        make_record(record, key);
+        ck_assert(lhash_delete(lhash, hash_of(record), record) == 0);
+    }
+    for (uint64_t key = 1; key < 2000; key += 2) {
+        make_record(record, key);
+        ck_assert(lhash_rmw(lhash, hash_of(record), record, increment, NULL) == 0);
+    }
+    ck_assert(paging.n_pinned == 0);
+    
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        ck_assert(lhash_lookup(lhash, hash_of(record), record, out)
+            == (key % 2 ? 0 : LHASH_KEY_NOT_FOUND));
+    }
+    make_record(record, 1);
+    lhash_lookup(lhash, hash_of(record), record, out);
+    ck_assert(out[KEY_SIZE] == 'v' + 1);
+    
+    int count = 0;
+    ck_assert(lhash_scan(lhash, count_records, &count) == 0);
+    ck_assert(count == 1000);
+    count = 0;
+    ck_assert(lhash_pages(lhash, 0, lhash_n_buckets(lhash), count_page, &count) == 0);
+    ck_assert(count == 1000);
+    ck_assert(lhash_compact(lhash) == 0);
+    ck_assert(paging.n_pinned == 0);
+    
+    paging.failing = 1;
+    ck_assert(lhash_lookup(lhash, hash_of(record), record, out) == LHASH_IO_ERROR);
+    ck_assert(lhash_insert(lhash, hash_of(record), record) == LHASH_IO_ERROR);
+    ck_assert(lhash_scan(lhash, count_records, &count) == LHASH_IO_ERROR);
+    
+    /* A store can't both page and move its pages. */
+    store.move = paging_pin;
+    ck_assert(lhash_create_with_store(512, 1, &record_size, KEY_SIZE, hash_fast, 0, &store, NULL)
+        == NULL);
+    
+    lhash_free(&lhash);
+    for (int i = 0; i < PAGING_PAGES; i++) {
+        free(paging.pages[i]);
+    }
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("LHash");
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_create_lhash);
+    tcase_add_test(tc_core, should_not_create_lhash_with_invalid_key_size);
+    tcase_add_test(tc_core, should_not_create_lhash_without_hash);
+    suite_add_tcase(s, tc_core);
+    
+    TCase* tc_records = tcase_create("Records");
+    tcase_add_test(tc_records, should_insert_and_lookup_record);
+    tcase_add_test(tc_records, should_not_insert_duplicate_key);
+    tcase_add_test(tc_records, should_not_lookup_missing_key);
+    tcase_add_test(tc_records, should_split_as_records_are_added);
+    tcase_add_test(tc_records, should_delete_records);
+    tcase_add_test(tc_records, should_scan_every_record);
+    tcase_add_test(tc_records, should_scan_from_cursor_while_buckets_split_and_merge);
+    tcase_add_test(tc_records, should_merge_buckets_as_records_are_deleted);
+    tcase_add_test(tc_records, should_compact_after_deletes);
+    tcase_add_test(tc_records, should_upsert_records);
+    tcase_add_test(tc_records, should_read_modify_write_records);
+    tcase_add_test(tc_records, should_report_writes_to_existing_pages);
+    tcase_add_test(tc_records, should_load_reserved_records_without_splitting);
+    tcase_add_test(tc_records, should_pin_pages_of_a_paging_store);
+    suite_add_tcase(s, tc_records);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
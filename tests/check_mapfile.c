@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+#include "mapfile.h"
+
+static char path[] = "/tmp/check_mapfile_XXXXXX";
+
+static void
+setup(void)
+{
+    strcpy(path, "/tmp/check_mapfile_XXXXXX");
+    close(mkstemp(path));
+    unlink(path);
+}
+
+static void
+teardown(void)
+{
+    unlink(path);
+}
+
+static void
+count_pages(void* page, int owner, size_t bucket, int position, void* ctx)
+{
+    (*(int*)ctx)++;
+}
+
+static void
+check_page(void* page, int owner, size_t bucket, int position, void* ctx)
+{
+    ck_assert(owner == 3);
+    ck_assert(*(uint64_t*)page == bucket * 100 + position);
+}
+
+START_TEST (should_create_and_open_file)
+{
+    MapFile file = mapfile_create(path, 512);
+    
+    ck_assert(file != NULL);
+    ck_assert(mapfile_page_size(file) == 512);
+    ck_assert(mapfile_n_pages(file) == 0);
+    memcpy(mapfile_meta(file), "meta", 5);
+    ck_assert(mapfile_close(&file) == 0);
+    ck_assert(file == NULL);
+    
+    file = mapfile_open(path);
+    ck_assert(file != NULL);
+    ck_assert(mapfile_page_size(file) == 512);
+    ck_assert(strcmp(mapfile_meta(file), "meta") == 0);
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_not_create_file_with_invalid_arguments)
+{
+    ck_assert(mapfile_create(NULL, 512) == NULL);
+    ck_assert(mapfile_create(path, 100) == NULL);
+    ck_assert(mapfile_create(path, 1000) == NULL);
+    ck_assert(mapfile_close(NULL) == MAPFILE_ARG_INVALID);
+    
+    /* Existing files aren't overwritten. */
+    MapFile file = mapfile_create(path, 512);
+    ck_assert(mapfile_create(path, 512) == NULL);
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_not_open_file_that_isnt_mapped_file)
+{
+    ck_assert(mapfile_open("/nonexistent") == NULL);
+    
+    FILE* f = fopen(path, "w");
+    for (int i = 0; i < 10000; i++) {
+        fputc('x', f);
+    }
+    fclose(f);
+    ck_assert(mapfile_open(path) == NULL);
+}
+END_TEST
+
+START_TEST (should_keep_pages_in_place_as_file_grows)
+{
+    MapFile file = mapfile_create(path, 512);
+    uint64_t* pages[1000];
+    
+    for (int i = 0; i < 1000; i++) {
+        pages[i] = mapfile_alloc(file, 3, i / 10, i % 10);
+        ck_assert(pages[i] != NULL);
+        ck_assert((uintptr_t)pages[i] % 512 == 0);
+        *pages[i] = (i / 10) * 100 + i % 10;
+    }
+    
+    ck_assert(mapfile_n_pages(file) == 1000);
+    for (int i = 0; i < 1000; i++) {
+        ck_assert(*pages[i] == (i / 10) * 100 + i % 10);
+    }
+    
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_find_pages_after_reopening)
+{
+    MapFile file = mapfile_create(path, 512);
+    for (int i = 0; i < 300; i++) {
+        uint64_t* page = mapfile_alloc(file, 3, i / 10, i % 10);
+        *page = (i / 10) * 100 + i % 10;
+    }
+    mapfile_close(&file);
+    
+    file = mapfile_open(path);
+    int count = 0;
+    ck_assert(mapfile_n_pages(file) == 300);
+    mapfile_pages(file, count_pages, &count);
+    mapfile_pages(file, check_page, NULL);
+    ck_assert(count == 300);
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_reuse_released_pages)
+{
+    MapFile file = mapfile_create(path, 512);
+    
+    char* first = mapfile_alloc(file, 0, 0, 0);
+    char* second = mapfile_alloc(file, 0, 0, 1);
+    mapfile_release(file, first);
+    ck_assert(mapfile_n_pages(file) == 1);
+    ck_assert(mapfile_alloc(file, 0, 1, 0) == first);
+    mapfile_release(file, second);
+    size_t offset = second - (char*)mapfile_meta(file);
+    mapfile_close(&file);
+    
+    /* Released slots stay free across a reopen. */
+    file = mapfile_open(path);
+    ck_assert(mapfile_n_pages(file) == 1);
+    ck_assert((char*)mapfile_alloc(file, 0, 0, 1) - (char*)mapfile_meta(file) == offset);
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_not_alloc_for_invalid_owner)
+{
+    MapFile file = mapfile_create(path, 512);
+    
+    ck_assert(mapfile_alloc(file, -1, 0, 0) == NULL);
+    ck_assert(mapfile_alloc(file, UINT16_MAX, 0, 0) == NULL);
+    ck_assert(mapfile_alloc(file, 0, 0, UINT16_MAX + 1) == NULL);
+    
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_shrink_file_after_relocating_pages)
+{
+    MapFile file = mapfile_create(path, 512);
+    uint64_t* pages[300];
+    for (int i = 0; i < 300; i++) {
+        pages[i] = mapfile_alloc(file, 3, i / 10, i % 10);
+        *pages[i] = (i / 10) * 100 + i % 10;
+    }
+    
+    /* Extents are added in doubling runs, the empty ones at the end can go straight away. */
+    size_t size = mapfile_size(file);
+    ck_assert(mapfile_shrink(file) == 0);
+    ck_assert(mapfile_size(file) < size);
+    size = mapfile_size(file);
+    
+    /* Nothing more can be cut off while the last pages are in use. */
+    for (int i = 10; i < 290; i++) {
+        mapfile_release(file, pages[i]);
+    }
+    ck_assert(mapfile_shrink(file) == 0);
+    ck_assert(mapfile_size(file) == size);
+    
+    for (int i = 290; i < 300; i++) {
+        pages[i] = mapfile_relocate(file, pages[i]);
+        ck_assert(*pages[i] == (i / 10) * 100 + i % 10);
+    }
+    ck_assert(mapfile_relocate(file, pages[0]) == pages[0]);
+    ck_assert(mapfile_shrink(file) == 0);
+    ck_assert(mapfile_size(file) < size / 4);
+    ck_assert(mapfile_n_pages(file) == 20);
+    
+    /* The file grows again over the space it gave back. */
+    for (int i = 0; i < 300; i++) {
+        ck_assert(mapfile_alloc(file, 4, 0, 0) != NULL);
+    }
+    mapfile_close(&file);
+    
+    file = mapfile_open(path);
+    int count = 0;
+    mapfile_pages(file, count_pages, &count);
+    ck_assert(count == 320);
+    mapfile_close(&file);
+}
+END_TEST
+
+START_TEST (should_keep_free_slots_while_relocating_pages)
+{
+    MapFile file = mapfile_create(path, 512);
+    uint64_t* pages[300];
+    for (int i = 0; i < 300; i++) {
+        pages[i] = mapfile_alloc(file, 3, 0, 0);
+    }
+    for (int i = 10; i < 290; i++) {
+        mapfile_release(file, pages[i]);
+    }
+    for (int i = 290; i < 300; i++) {
+        pages[i] = mapfile_relocate(file, pages[i]);
+    }
+    
+    /* The slots still free past the ones needed are used before the file grows. */
+    size_t size = mapfile_size(file);
+    for (int i = 0; i < 270; i++) {
+        ck_assert(mapfile_alloc(file, 4, 0, 0) != NULL);
+    }
+    ck_assert(mapfile_size(file) == size);
+    ck_assert(mapfile_n_pages(file) == 290);
+    
+    mapfile_close(&file);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("MapFile");
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, should_create_and_open_file);
+    tcase_add_test(tc_core, should_not_create_file_with_invalid_arguments);
+    tcase_add_test(tc_core, should_not_open_file_that_isnt_mapped_file);
+    suite_add_tcase(s, tc_core);
+    
+    TCase* tc_pages = tcase_create("Pages");
+    tcase_add_checked_fixture(tc_pages, setup, teardown);
+    tcase_add_test(tc_pages, should_keep_pages_in_place_as_file_grows);
+    tcase_add_test(tc_pages, should_find_pages_after_reopening);
+    tcase_add_test(tc_pages, should_reuse_released_pages);
+    tcase_add_test(tc_pages, should_not_alloc_for_invalid_owner);
+    tcase_add_test(tc_pages, should_shrink_file_after_relocating_pages);
+    tcase_add_test(tc_pages, should_keep_free_slots_while_relocating_pages);
+    suite_add_tcase(s, tc_pages);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
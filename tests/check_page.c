@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <check.h>
@@ -38,6 +39,13 @@ START_TEST (should_not_create_page_smaller_than_header)
 }
 END_TEST
 
+START_TEST (should_not_create_page_larger_than_max)
+{
+    Page page = page_create(MAX_PAGE_SIZE + 1, 4);
+    ck_assert(page == NULL);
+}
+END_TEST
+
 START_TEST (should_not_be_able_to_create_pages_that_cant_hold_records)
 {
     Page page = page_create(1024, 2048);
@@ -321,6 +329,209 @@ START_TEST (should_not_be_able_to_read_from_null_page)
 }
 END_TEST
 
+START_TEST (should_delete_record_by_id)
+{
+    Page page = page_create(1024, 18);
+    
+    char* record1 = strdup("hello,my,name,jeff");
+    char* record2 = strdup("hello,my,name,john");
+    char out[18];
+    
+    page_add_record(page, record1);
+    page_add_record(page, record2);
+    ck_assert(page_delete_record_id(page, 0) == 0);
+    ck_assert(page_n_records(page) == 1);
+    ck_assert(page_copy_record(page, 0, out) == 0);
+    ck_assert(memcmp(out, record2, 18) == 0);
+    ck_assert(page_delete_record_id(page, 1) == PAGE_ARG_INVALID);
+    
+    free(record1);
+    free(record2);
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_not_copy_invalid_record)
+{
+    Page page = page_create(1024, 18);
+    char out[18];
+    
+    ck_assert(page_copy_record(page, 0, out) == PAGE_ARG_INVALID);
+    ck_assert(page_copy_record(NULL, 0, out) == PAGE_ARG_INVALID);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_find_record_by_key)
+{
+    Page page = page_create(1024, 18);
+    
+    char* record1 = strdup("hello,my,name,jeff");
+    char* record2 = strdup("howdy,my,name,john");
+    
+    page_add_record(page, record1);
+    page_add_record(page, record2);
+    ck_assert(page_find_key(page, "howdy", 5) == 1);
+    ck_assert(page_find_key(page, "hello", 5) == 0);
+    ck_assert(page_find_key(page, "hiya!", 5) == PAGE_RECORD_NOT_FOUND);
+    ck_assert(page_find_key(page, "hello", 0) == PAGE_ARG_INVALID);
+    
+    free(record1);
+    free(record2);
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_update_record_by_id)
+{
+    Page page = page_create(1024, 18);
+    
+    char* old = strdup("hello,my,name,jeff");
+    char* new = strdup("hello,my,name,john");
+    char out[18];
+    
+    int record_id = page_add_record(page, old);
+    ck_assert(page_update_record_id(page, record_id, new) == 0);
+    page_copy_record(page, record_id, out);
+    ck_assert(memcmp(out, new, 18) == 0);
+    ck_assert(page_update_record_id(page, record_id + 1, new) == PAGE_ARG_INVALID);
+    
+    free(old);
+    free(new);
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_fill_page_to_capacity)
+{
+    Page page = page_create(1024, 18);
+    char record[18] = {0};
+    int capacity = page_capacity(1024, 18);
+    
+    for (int i = 0; i < capacity; i++) {
+        ck_assert(page_add_record(page, record) == i);
+    }
+    ck_assert(page_add_record(page, record) == PAGE_HAS_NO_SPACE);
+    ck_assert(page_n_records(page) == capacity);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_create_page_with_fields)
+{
+    size_t fields[] = {8, 4, 6};
+    Page page = page_create_with_fields(1024, 3, fields);
+    char record[18];
+    char out[18];
+    memcpy(record, "hello,myname,jeff!", 18);
+    
+    ck_assert(page != NULL);
+    ck_assert(page_add_record(page, record) == 0);
+    ck_assert(page_copy_record(page, 0, out) == 0);
+    ck_assert(memcmp(out, record, 18) == 0);
+    ck_assert(page_find_key(page, "hello,myna", 10) == 0);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_not_create_page_with_invalid_fields)
+{
+    size_t fields[] = {8, 0};
+    
+    ck_assert(page_create_with_fields(1024, 2, fields) == NULL);
+    ck_assert(page_create_with_fields(1024, 0, fields) == NULL);
+    ck_assert(page_create_with_fields(1024, PAGE_MAX_FIELDS + 1, fields) == NULL);
+    ck_assert(page_create_with_fields(1024, 1, NULL) == NULL);
+}
+END_TEST
+
+START_TEST (should_copy_field)
+{
+    size_t fields[] = {8, 4, 6};
+    Page page = page_create_with_fields(1024, 3, fields);
+    char out[4];
+    
+    page_add_record(page, "hello,myname,jeff!");
+    ck_assert(page_copy_field(page, 0, 8, 4, out) == 0);
+    ck_assert(memcmp(out, "name", 4) == 0);
+    ck_assert(page_copy_field(page, 0, 16, 4, out) == PAGE_ARG_INVALID);
+    ck_assert(page_copy_field(page, 1, 8, 4, out) == PAGE_ARG_INVALID);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_match_field)
+{
+    size_t fields[] = {8, 4, 6};
+    Page page = page_create_with_fields(1024, 3, fields);
+    int ids[64];
+    
+    page_add_record(page, "hello,myname,jeff!");
+    page_add_record(page, "howdy,mygame,john!");
+    page_add_record(page, "hiya,youname,jane!");
+    
+    ck_assert(page_match_field(page, 8, 4, "name", ids) == 2);
+    ck_assert(ids[0] == 0 && ids[1] == 2);
+    ck_assert(page_match_field(page, 12, 6, ",mary!", ids) == 0);
+    ck_assert(page_match_field(page, 0, 8, "howdy,my", ids) == 1);
+    ck_assert(ids[0] == 1);
+    ck_assert(page_match_field(page, 16, 4, "name", ids) == PAGE_ARG_INVALID);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_match_field_after_delete)
+{
+    size_t fields[] = {4, 4};
+    Page page = page_create_with_fields(2048, 2, fields);
+    int ids[128];
+    
+    for (uint32_t i = 0; i < 100; i++) {
+        uint32_t record[2] = {i, i % 3};
+        page_add_record(page, record);
+    }
+    uint32_t first[2] = {0, 0};
+    page_delete_record(page, first);
+    
+    uint32_t zero = 0;
+    ck_assert(page_match_field(page, 4, 4, &zero, ids) == 33);
+    
+    page_free(&page);
+}
+END_TEST
+
+START_TEST (should_match_wide_field_over_many_records)
+{
+    size_t fields[] = {4, 8};
+    Page page = page_create_with_fields(4096, 2, fields);
+    int ids[256];
+    
+    for (uint32_t i = 0; i < 200; i++) {
+        char record[12];
+        uint64_t value = (uint64_t)(i % 5) << 32 | 7;
+        memcpy(record, &i, sizeof(i));
+        memcpy(record + 4, &value, sizeof(value));
+        ck_assert(page_add_record(page, record) >= 0);
+    }
+    
+    /* Matches on either half alone must not count. */
+    uint64_t value = (uint64_t)3 << 32 | 7;
+    ck_assert(page_match_field(page, 4, 8, &value, ids) == 40);
+    for (int m = 0; m < 40; m++) {
+        ck_assert(ids[m] == 5 * m + 3);
+    }
+    value = 3;
+    ck_assert(page_match_field(page, 4, 8, &value, ids) == 0);
+    
+    page_free(&page);
+}
+END_TEST
+
 Suite* page_suite(void)
 {
     Suite* s = suite_create("Page");
@@ -330,6 +541,7 @@ Suite* page_suite(void)
     tcase_add_test(tc_core, should_set_page_to_null_after_free);
     tcase_add_test(tc_core, should_not_throw_error_when_freeing_null_page);
     tcase_add_test(tc_core, should_not_create_page_smaller_than_header);
+    tcase_add_test(tc_core, should_not_create_page_larger_than_max);
     tcase_add_test(tc_core, should_not_be_able_to_create_pages_that_cant_hold_records);
     suite_add_tcase(s, tc_core);
     
@@ -364,6 +576,23 @@ Suite* page_suite(void)
     tcase_add_test(tc_read, should_not_be_able_to_read_from_null_page);
     suite_add_tcase(s, tc_read);
     
+    TCase* tc_keys = tcase_create("Keys");
+    tcase_add_test(tc_keys, should_delete_record_by_id);
+    tcase_add_test(tc_keys, should_not_copy_invalid_record);
+    tcase_add_test(tc_keys, should_find_record_by_key);
+    tcase_add_test(tc_keys, should_update_record_by_id);
+    tcase_add_test(tc_keys, should_fill_page_to_capacity);
+    suite_add_tcase(s, tc_keys);
+    
+    TCase* tc_fields = tcase_create("Fields");
+    tcase_add_test(tc_fields, should_create_page_with_fields);
+    tcase_add_test(tc_fields, should_not_create_page_with_invalid_fields);
+    tcase_add_test(tc_fields, should_copy_field);
+    tcase_add_test(tc_fields, should_match_field);
+    tcase_add_test(tc_fields, should_match_field_after_delete);
+    tcase_add_test(tc_fields, should_match_wide_field_over_many_records);
+    suite_add_tcase(s, tc_fields);
+    
     return s;
 }
 
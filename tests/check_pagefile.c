@@ -0,0 +1,357 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <check.h>
+#include "pagefile.h"
+
+#define TMPFS_MAGIC (0x01021994)
+
+static char path[] = "/tmp/check_pagefile_XXXXXX";
+
+static void
+setup(void)
+{
+    strcpy(path, "/tmp/check_pagefile_XXXXXX");
+    close(mkstemp(path));
+}
+
+static void
+teardown(void)
+{
+    unlink(path);
+}
+
+static int
+is_tmpfs(const char* dir)
+{
+    struct statfs st;
+    return statfs(dir, &st) == 0 && st.f_type == TMPFS_MAGIC;
+}
+
+/*
+ * Returns how many of the file's first n_pages pages of 4096 bytes are in the kernel's page cache.
+ */
+static int
+n_cached_pages(const char* file_path, int n_pages)
+{
+    int fd = open(file_path, O_RDONLY);
+    ck_assert(fd >= 0);
+    void* map = mmap(NULL, n_pages * 4096, PROT_READ, MAP_SHARED, fd, 0);
+    ck_assert(map != MAP_FAILED);
+    unsigned char resident[n_pages * 4096 / getpagesize()];
+    ck_assert(mincore(map, n_pages * 4096, resident) == 0);
+
+    int n_cached = 0;
+    for (size_t i = 0; i < sizeof(resident); i++) {
+        n_cached += resident[i] & 1;
+    }
+    munmap(map, n_pages * 4096);
+    close(fd);
+
+    return n_cached;
+}
+
+static void
+write_pages(PageFile file, int n_pages)
+{
+    for (int page_no = 0; page_no < n_pages; page_no++) {
+        void* frame;
+        ck_assert(pagefile_pin(file, page_no, &frame) == 0);
+        memset(frame, 'a' + page_no, 4096);
+        ck_assert(pagefile_unpin(file, page_no, 1) == 0);
+    }
+}
+
+static void
+check_pages(PageFile file, int n_pages)
+{
+    for (int page_no = 0; page_no < n_pages; page_no++) {
+        char* frame;
+        ck_assert(pagefile_pin(file, page_no, (void**)&frame) == 0);
+        ck_assert(frame[0] == 'a' + page_no && frame[4095] == 'a' + page_no);
+        ck_assert(pagefile_unpin(file, page_no, 0) == 0);
+    }
+}
+
+START_TEST (should_open_and_close_page_file)
+{
+    PageFile file = pagefile_open(path, 4096, 8, 1);
+    
+    ck_assert(file != NULL);
+    ck_assert(pagefile_n_pages(file) == 0);
+    ck_assert(pagefile_close(&file) == 0);
+    ck_assert(file == NULL);
+}
+END_TEST
+
+START_TEST (should_not_open_page_file_with_invalid_arguments)
+{
+    ck_assert(pagefile_open(NULL, 4096, 8, 1) == NULL);
+    ck_assert(pagefile_open(path, 0, 8, 1) == NULL);
+    ck_assert(pagefile_open(path, 4096, 0, 1) == NULL);
+    ck_assert(pagefile_open("/nonexistent/dir/file", 4096, 8, 1) == NULL);
+    ck_assert(pagefile_close(NULL) == PAGEFILE_ARG_INVALID);
+}
+END_TEST
+
+START_TEST (should_align_frames_to_blocks)
+{
+    PageFile file = pagefile_open(path, 4096, 8, 1);
+    void* frame;
+    
+    ck_assert(pagefile_pin(file, 0, &frame) == 0);
+    ck_assert((uintptr_t)frame % pagefile_alignment(file) == 0);
+    ck_assert(pagefile_alignment(file) >= 512);
+    pagefile_unpin(file, 0, 0);
+    
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_only_write_back_on_flush)
+{
+    PageFile file = pagefile_open(path, 4096, 8, 1);
+    
+    write_pages(file, 4);
+    ck_assert(pagefile_stats(file).writes == 0);
+    ck_assert(pagefile_n_pages(file) == 4);
+    
+    ck_assert(pagefile_flush(file) == 0);
+    ck_assert(pagefile_stats(file).writes == 4);
+    
+    /* Clean frames aren't written again. */
+    ck_assert(pagefile_flush(file) == 0);
+    ck_assert(pagefile_stats(file).writes == 4);
+    pagefile_close(&file);
+    
+    file = pagefile_open(path, 4096, 8, 1);
+    ck_assert(pagefile_n_pages(file) == 4);
+    check_pages(file, 4);
+    ck_assert(pagefile_stats(file).reads == 4);
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_write_back_evicted_pages)
+{
+    PageFile file = pagefile_open(path, 4096, 4, 1);
+    
+    write_pages(file, 16);
+    ck_assert(pagefile_stats(file).evictions == 12);
+    ck_assert(pagefile_stats(file).writes == 12);
+    check_pages(file, 16);
+    pagefile_close(&file);
+    
+    file = pagefile_open(path, 4096, 4, 1);
+    check_pages(file, 16);
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_not_evict_pinned_pages)
+{
+    PageFile file = pagefile_open(path, 4096, 2, 1);
+    void* frame;
+    
+    ck_assert(pagefile_pin(file, 0, &frame) == 0);
+    ck_assert(pagefile_pin(file, 1, &frame) == 0);
+    ck_assert(pagefile_pin(file, 2, &frame) == PAGEFILE_NO_FRAME);
+    
+    ck_assert(pagefile_unpin(file, 1, 0) == 0);
+    ck_assert(pagefile_unpin(file, 1, 0) == PAGEFILE_ARG_INVALID);
+    ck_assert(pagefile_pin(file, 2, &frame) == 0);
+    
+    pagefile_unpin(file, 0, 0);
+    pagefile_unpin(file, 2, 0);
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_read_zeros_past_end_of_file)
+{
+    PageFile file = pagefile_open(path, 4096, 2, 1);
+    char* frame;
+    
+    ck_assert(pagefile_pin(file, 9, (void**)&frame) == 0);
+    for (int i = 0; i < 4096; i++) {
+        ck_assert(frame[i] == 0);
+    }
+    pagefile_unpin(file, 9, 0);
+    ck_assert(pagefile_n_pages(file) == 10);
+    
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_fall_back_to_buffered_io_for_unaligned_pages)
+{
+    PageFile file = pagefile_open(path, 1000, 2, 1);
+    char* frame;
+    
+    ck_assert(file != NULL);
+    ck_assert(!pagefile_is_direct(file));
+    
+    ck_assert(pagefile_pin(file, 3, (void**)&frame) == 0);
+    memset(frame, 'x', 1000);
+    pagefile_unpin(file, 3, 1);
+    pagefile_close(&file);
+    
+    file = pagefile_open(path, 1000, 2, 0);
+    ck_assert(pagefile_n_pages(file) == 4);
+    ck_assert(pagefile_pin(file, 3, (void**)&frame) == 0);
+    ck_assert(frame[999] == 'x');
+    pagefile_unpin(file, 3, 0);
+    pagefile_close(&file);
+}
+END_TEST
+
+START_TEST (should_bypass_page_cache_on_a_real_file_system)
+{
+    /* The test runs in the build directory, which is on disk, unlike /tmp on some systems. */
+    char local[] = "check_pagefile_XXXXXX";
+    close(mkstemp(local));
+    if (is_tmpfs(".")) {
+        unlink(local);
+        return;
+    }
+
+    PageFile file = pagefile_open(local, 4096, 4, 1);
+    ck_assert(file != NULL);
+    write_pages(file, 16);
+    ck_assert(pagefile_flush(file) == 0);
+    ck_assert(pagefile_is_direct(file));
+
+    /* Every page went straight to the disk, the kernel kept no copy of its own. */
+    ck_assert(n_cached_pages(local, 16) == 0);
+    check_pages(file, 16);
+    pagefile_close(&file);
+    unlink(local);
+}
+END_TEST
+
+START_TEST (should_keep_pages_on_tmpfs)
+{
+    char shm[] = "/dev/shm/check_pagefile_XXXXXX";
+    int fd = mkstemp(shm);
+    if (fd < 0 || !is_tmpfs("/dev/shm")) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(shm);
+        }
+        return;
+    }
+    close(fd);
+
+    /* Older tmpfs refuses O_DIRECT and newer tmpfs accepts it, either way the pages get through. */
+    PageFile file = pagefile_open(shm, 4096, 4, 1);
+    ck_assert(file != NULL);
+    write_pages(file, 16);
+    ck_assert(pagefile_flush(file) == 0);
+    check_pages(file, 16);
+    pagefile_close(&file);
+
+    file = pagefile_open(shm, 4096, 4, 0);
+    ck_assert(!pagefile_is_direct(file));
+    check_pages(file, 16);
+    pagefile_close(&file);
+    unlink(shm);
+}
+END_TEST
+
+struct pinner
+{
+    PageFile    file;
+    int         first;
+};
+
+static void*
+pin_pages(void* arg)
+{
+    struct pinner* pinner = arg;
+    for (int round = 0; round < 50; round++) {
+        for (int page_no = pinner->first; page_no < pinner->first + 8; page_no++) {
+            char* frame;
+            ck_assert(pagefile_pin(pinner->file, page_no, (void**)&frame) == 0);
+            if (round == 0) {
+                memset(frame, page_no, 4096);
+            }
+            ck_assert(frame[0] == (char)page_no && frame[4095] == (char)page_no);
+            ck_assert(pagefile_unpin(pinner->file, page_no, round == 0) == 0);
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST (should_pin_pages_from_many_threads)
+{
+    /* Fewer frames than pages, so threads evict each other's pages while they read their own. */
+    PageFile file = pagefile_open(path, 4096, 8, 1);
+    struct pinner pinners[4];
+    pthread_t threads[4];
+
+    for (int i = 0; i < 4; i++) {
+        pinners[i] = (struct pinner){.file = file, .first = 8 * i};
+        ck_assert(pthread_create(&threads[i], NULL, pin_pages, &pinners[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ck_assert(pagefile_stats(file).evictions > 0);
+    ck_assert(pagefile_n_pages(file) == 32);
+    pagefile_close(&file);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("PageFile");
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, should_open_and_close_page_file);
+    tcase_add_test(tc_core, should_not_open_page_file_with_invalid_arguments);
+    tcase_add_test(tc_core, should_align_frames_to_blocks);
+    suite_add_tcase(s, tc_core);
+    
+    TCase* tc_frames = tcase_create("Frames");
+    tcase_add_checked_fixture(tc_frames, setup, teardown);
+    tcase_add_test(tc_frames, should_only_write_back_on_flush);
+    tcase_add_test(tc_frames, should_write_back_evicted_pages);
+    tcase_add_test(tc_frames, should_not_evict_pinned_pages);
+    tcase_add_test(tc_frames, should_read_zeros_past_end_of_file);
+    tcase_add_test(tc_frames, should_fall_back_to_buffered_io_for_unaligned_pages);
+    suite_add_tcase(s, tc_frames);
+
+    TCase* tc_io = tcase_create("IO");
+    tcase_add_checked_fixture(tc_io, setup, teardown);
+    tcase_add_test(tc_io, should_bypass_page_cache_on_a_real_file_system);
+    tcase_add_test(tc_io, should_keep_pages_on_tmpfs);
+    tcase_add_test(tc_io, should_pin_pages_from_many_threads);
+    suite_add_tcase(s, tc_io);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "protocol.h"
+#include "table.h"
+
+START_TEST (should_round_trip_header)
+{
+    char buf[PROTOCOL_HEADER_SIZE + 4] = {0};
+    ProtocolHeader header = { .length = 4, .code = PROTOCOL_OP_LOOKUP, .id = 123456 };
+    ProtocolHeader read;
+    
+    protocol_write_header(buf, header);
+    
+    ck_assert(protocol_read_header(buf, sizeof(buf), &read) == PROTOCOL_HEADER_SIZE + 4);
+    ck_assert(read.length == 4);
+    ck_assert(read.code == PROTOCOL_OP_LOOKUP);
+    ck_assert(read.id == 123456);
+}
+END_TEST
+
+START_TEST (should_write_little_endian)
+{
+    unsigned char buf[PROTOCOL_HEADER_SIZE];
+    ProtocolHeader header = { .length = 0x01020304, .code = 7, .id = 0x0a0b0c0d };
+    
+    protocol_write_header(buf, header);
+    
+    ck_assert(buf[0] == 0x04 && buf[3] == 0x01);
+    ck_assert(buf[4] == 7);
+    ck_assert(buf[5] == 0 && buf[6] == 0 && buf[7] == 0);
+    ck_assert(buf[8] == 0x0d && buf[11] == 0x0a);
+}
+END_TEST
+
+START_TEST (should_need_whole_header)
+{
+    char buf[PROTOCOL_HEADER_SIZE] = {0};
+    ProtocolHeader read;
+    
+    ck_assert(protocol_read_header(buf, PROTOCOL_HEADER_SIZE - 1, &read) == PROTOCOL_INCOMPLETE);
+}
+END_TEST
+
+START_TEST (should_need_whole_payload)
+{
+    char buf[PROTOCOL_HEADER_SIZE + 8] = {0};
+    ProtocolHeader header = { .length = 8, .code = PROTOCOL_OP_DELETE, .id = 1 };
+    ProtocolHeader read;
+    
+    protocol_write_header(buf, header);
+    
+    ck_assert(protocol_read_header(buf, sizeof(buf) - 1, &read) == PROTOCOL_INCOMPLETE);
+    ck_assert(read.length == 8);
+}
+END_TEST
+
+START_TEST (should_map_table_results_to_statuses)
+{
+    ck_assert(protocol_status(0) == PROTOCOL_OK);
+    ck_assert(protocol_status(TABLE_ARG_INVALID) == PROTOCOL_ARG_INVALID);
+    ck_assert(protocol_status(TABLE_KEY_EXISTS) == PROTOCOL_KEY_EXISTS);
+    ck_assert(protocol_status(TABLE_KEY_NOT_FOUND) == PROTOCOL_KEY_NOT_FOUND);
+    ck_assert(protocol_status(TABLE_NO_MEMORY) == PROTOCOL_NO_MEMORY);
+    ck_assert(protocol_status(-100) == PROTOCOL_ARG_INVALID);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Protocol");
+    
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_round_trip_header);
+    tcase_add_test(tc_core, should_write_little_endian);
+    tcase_add_test(tc_core, should_need_whole_header);
+    tcase_add_test(tc_core, should_need_whole_payload);
+    tcase_add_test(tc_core, should_map_table_results_to_statuses);
+    suite_add_tcase(s, tc_core);
+    
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+    
+    s = page_suite();
+    sr = srunner_create(s);
+    
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "query.h"
+
+/*
+ * Orders are keyed by order id and hold a customer id at offset 8 and a signed amount at offset
+ * 16. Customers are keyed by customer id.
+ */
+
+#define N_THREADS (4)
+
+struct totals
+{
+    pthread_mutex_t latch;
+    long            pairs;
+    int64_t         sums[100];
+    int64_t         counts[100];
+    int64_t         mins[100];
+    int64_t         maxes[100];
+    int             n_groups;
+};
+
+static Table
+create_table(char* name)
+{
+    TableConfig config = table_default_config();
+    config.record_size = 32;
+    config.key_size = 8;
+    config.page_size = 512;
+    config.n_shards = 2;
+
+    return table_create_with_config(name, config);
+}
+
+static Table
+create_orders(uint64_t n_orders, uint64_t n_customers)
+{
+    Table orders = create_table("orders");
+    char record[32] = {0};
+
+    for (uint64_t id = 0; id < n_orders; id++) {
+        uint64_t customer = id % n_customers;
+        int32_t amount = (int32_t)(id % 7) - 3;
+        memcpy(record, &id, sizeof(id));
+        memcpy(record + 8, &customer, sizeof(customer));
+        memcpy(record + 16, &amount, sizeof(amount));
+        table_insert(orders, record);
+    }
+
+    return orders;
+}
+
+static Table
+create_customers(uint64_t n_customers)
+{
+    Table customers = create_table("customers");
+    char record[32] = {0};
+
+    for (uint64_t id = 0; id < n_customers; id++) {
+        memcpy(record, &id, sizeof(id));
+        memcpy(record + 8, "customer", 8);
+        table_insert(customers, record);
+    }
+
+    return customers;
+}
+
+static int
+check_pair(const void* left, const void* right, void* ctx)
+{
+    struct totals* totals = ctx;
+    uint64_t customer;
+    memcpy(&customer, (char*)left + 8, sizeof(customer));
+
+    ck_assert(memcmp(&customer, right, sizeof(customer)) == 0);
+    ck_assert(memcmp((char*)right + 8, "customer", 8) == 0);
+    __atomic_fetch_add(&totals->pairs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int
+count_pair(const void* left, const void* right, void* ctx)
+{
+    struct totals* totals = ctx;
+    ck_assert(memcmp((char*)left + 8, (char*)right + 8, 8) == 0);
+    __atomic_fetch_add(&totals->pairs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int
+stop_pair(const void* left, const void* right, void* ctx)
+{
+    return 5;
+}
+
+static int
+collect_group(const void* group, const int64_t* values, void* ctx)
+{
+    struct totals* totals = ctx;
+    uint64_t customer;
+    memcpy(&customer, group, sizeof(customer));
+    ck_assert(customer < 100);
+
+    pthread_mutex_lock(&totals->latch);
+    totals->counts[customer] = values[0];
+    totals->sums[customer] = values[1];
+    totals->mins[customer] = values[2];
+    totals->maxes[customer] = values[3];
+    totals->n_groups++;
+    pthread_mutex_unlock(&totals->latch);
+
+    return 0;
+}
+
+START_TEST (should_create_pool)
+{
+    QueryPool pool = query_pool_create(N_THREADS);
+
+    ck_assert(pool != NULL);
+    ck_assert(query_pool_size(pool) == N_THREADS);
+    ck_assert(query_pool_create(0) == NULL);
+
+    query_pool_free(&pool);
+    ck_assert(pool == NULL);
+    query_pool_free(&pool);
+}
+END_TEST
+
+START_TEST (should_join_tables)
+{
+    QueryPool pool = query_pool_create(N_THREADS);
+    Table orders = create_orders(50000, 20000);
+    Table customers = create_customers(20000);
+    struct totals totals = {0};
+
+    ck_assert(query_join(pool, orders, 8, customers, 0, 8, check_pair, &totals) == 0);
+    ck_assert(totals.pairs == 50000);
+
+    /* The smaller side is hashed whichever side it is on, pairs still come left then right. */
+    totals.pairs = 0;
+    Table few_orders = create_orders(10, 20000);
+    ck_assert(query_join(pool, few_orders, 8, customers, 0, 8, check_pair, &totals) == 0);
+    ck_assert(totals.pairs == 10);
+
+    table_free(few_orders);
+    table_free(orders);
+    table_free(customers);
+    query_pool_free(&pool);
+}
+END_TEST
+
+START_TEST (should_join_table_with_itself)
+{
+    QueryPool pool = query_pool_create(N_THREADS);
+    Table orders = create_orders(1000, 10);
+    struct totals totals = {0};
+
+    /* Every order pairs with the 100 orders of its customer, itself included. */
+    ck_assert(query_join(pool, orders, 8, orders, 8, 8, count_pair, &totals) == 0);
+    ck_assert(totals.pairs == 1000 * 100);
+    ck_assert(query_join(pool, orders, 8, orders, 8, 8, stop_pair, NULL) == 5);
+
+    table_free(orders);
+    query_pool_free(&pool);
+}
+END_TEST
+
+START_TEST (should_not_join_with_invalid_arguments)
+{
+    QueryPool pool = query_pool_create(1);
+    Table orders = create_orders(10, 10);
+
+    ck_assert(query_join(NULL, orders, 0, orders, 0, 8, check_pair, NULL) == QUERY_ARG_INVALID);
+    ck_assert(query_join(pool, orders, 0, NULL, 0, 8, check_pair, NULL) == QUERY_ARG_INVALID);
+    ck_assert(query_join(pool, orders, 0, orders, 0, 0, check_pair, NULL) == QUERY_ARG_INVALID);
+    ck_assert(query_join(pool, orders, 30, orders, 0, 8, check_pair, NULL) == QUERY_ARG_INVALID);
+    ck_assert(query_join(pool, orders, 0, orders, 0, 8, NULL, NULL) == QUERY_ARG_INVALID);
+
+    table_free(orders);
+    query_pool_free(&pool);
+}
+END_TEST
+
+START_TEST (should_group_and_aggregate)
+{
+    QueryPool pool = query_pool_create(N_THREADS);
+    Table orders = create_orders(70000, 100);
+    QueryAggregate aggregates[] = {
+        {.op = QUERY_COUNT},
+        {.op = QUERY_SUM, .offset = 16, .width = 4},
+        {.op = QUERY_MIN, .offset = 16, .width = 4},
+        {.op = QUERY_MAX, .offset = 16, .width = 4},
+    };
+    struct totals totals = {0};
+    pthread_mutex_init(&totals.latch, NULL);
+
+    ck_assert(query_group_by(pool, orders, 8, 8, aggregates, 4, collect_group, &totals) == 0);
+    ck_assert(totals.n_groups == 100);
+
+    /* 700 orders each, their amounts cycle through -3 to 3 and 700 is a multiple of 7. */
+    for (int customer = 0; customer < 100; customer++) {
+        ck_assert(totals.counts[customer] == 700);
+        ck_assert(totals.sums[customer] == 0);
+        ck_assert(totals.mins[customer] == -3);
+        ck_assert(totals.maxes[customer] == 3);
+    }
+
+    pthread_mutex_destroy(&totals.latch);
+    table_free(orders);
+    query_pool_free(&pool);
+}
+END_TEST
+
+START_TEST (should_not_group_with_invalid_arguments)
+{
+    QueryPool pool = query_pool_create(1);
+    Table orders = create_orders(10, 10);
+    QueryAggregate odd_width = {.op = QUERY_SUM, .offset = 16, .width = 3};
+    QueryAggregate past_end = {.op = QUERY_MAX, .offset = 28, .width = 8};
+
+    ck_assert(query_group_by(pool, orders, 8, 8, &odd_width, 1, collect_group, NULL)
+        == QUERY_ARG_INVALID);
+    ck_assert(query_group_by(pool, orders, 8, 8, &past_end, 1, collect_group, NULL)
+        == QUERY_ARG_INVALID);
+    ck_assert(query_group_by(pool, orders, 8, 0, NULL, 0, collect_group, NULL)
+        == QUERY_ARG_INVALID);
+    ck_assert(query_group_by(pool, orders, 8, 8, NULL, QUERY_MAX_AGGREGATES + 1, collect_group,
+        NULL) == QUERY_ARG_INVALID);
+
+    table_free(orders);
+    query_pool_free(&pool);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Query");
+
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_create_pool);
+    suite_add_tcase(s, tc_core);
+
+    TCase* tc_join = tcase_create("Join");
+    tcase_add_test(tc_join, should_join_tables);
+    tcase_add_test(tc_join, should_join_table_with_itself);
+    tcase_add_test(tc_join, should_not_join_with_invalid_arguments);
+    suite_add_tcase(s, tc_join);
+
+    TCase* tc_group = tcase_create("Group");
+    tcase_add_test(tc_group, should_group_and_aggregate);
+    tcase_add_test(tc_group, should_not_group_with_invalid_arguments);
+    suite_add_tcase(s, tc_group);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = page_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,130 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+#include "stream.h"
+
+#define N_BYTES (100000)
+
+START_TEST (should_write_and_read_back)
+{
+    FILE* file = tmpfile();
+    Stream writer = stream_writer(fileno(file), 1000, NULL);
+    char* data = malloc(N_BYTES);
+    char* out = malloc(N_BYTES);
+
+    /* Chunks that don't line up with the buffers. */
+    for (int i = 0; i < N_BYTES; i++) {
+        data[i] = i * 7;
+    }
+    for (int at = 0; at < N_BYTES; at += 7) {
+        int n = N_BYTES - at < 7 ? N_BYTES - at : 7;
+        ck_assert(stream_write(writer, data + at, n) == 0);
+    }
+    ck_assert(stream_close(&writer) == 0);
+    ck_assert(writer == NULL);
+    ck_assert(lseek(fileno(file), 0, SEEK_END) == N_BYTES);
+
+    lseek(fileno(file), 0, SEEK_SET);
+    Stream reader = stream_reader(fileno(file), 1000, NULL);
+    for (int at = 0; at < N_BYTES; at += 13) {
+        int n = N_BYTES - at < 13 ? N_BYTES - at : 13;
+        ck_assert(stream_read(reader, out + at, n) == 0);
+    }
+    ck_assert(memcmp(data, out, N_BYTES) == 0);
+    ck_assert(stream_read(reader, out, 1) == STREAM_END);
+    ck_assert(stream_close(&reader) == 0);
+
+    free(out);
+    free(data);
+    fclose(file);
+}
+END_TEST
+
+START_TEST (should_read_from_pipe_that_stays_open)
+{
+    int fds[2];
+    char out[5];
+    ck_assert(pipe(fds) == 0);
+    ck_assert(write(fds[1], "hello", 5) == 5);
+
+    /* The thread is left waiting on the pipe for the rest of its buffer. */
+    Stream reader = stream_reader(fds[0], 1000, NULL);
+    ck_assert(stream_read(reader, out, 5) == 0);
+    ck_assert(memcmp(out, "hello", 5) == 0);
+    ck_assert(stream_close(&reader) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+START_TEST (should_report_failed_writes)
+{
+    int fd = open("/dev/null", O_RDONLY);
+    char data[100] = {0};
+    Stream writer = stream_writer(fd, 16, NULL);
+
+    ck_assert(stream_write(writer, data, sizeof(data)) == 0
+        || stream_write(writer, data, sizeof(data)) == STREAM_IO_ERROR);
+    ck_assert(stream_close(&writer) == STREAM_IO_ERROR);
+
+    close(fd);
+}
+END_TEST
+
+START_TEST (should_not_use_streams_the_wrong_way)
+{
+    FILE* file = tmpfile();
+    char byte = 0;
+
+    ck_assert(stream_writer(-1, 1000, NULL) == NULL);
+    ck_assert(stream_writer(fileno(file), 0, NULL) == NULL);
+
+    Stream writer = stream_writer(fileno(file), 1000, NULL);
+    Stream reader = stream_reader(fileno(file), 1000, NULL);
+    ck_assert(stream_read(writer, &byte, 1) == STREAM_ARG_INVALID);
+    ck_assert(stream_write(reader, &byte, 1) == STREAM_ARG_INVALID);
+    ck_assert(stream_read(NULL, &byte, 1) == STREAM_ARG_INVALID);
+
+    ck_assert(stream_close(&writer) == 0);
+    ck_assert(stream_close(&reader) == 0);
+    ck_assert(stream_close(&reader) == 0);
+    ck_assert(stream_close(NULL) == 0);
+
+    fclose(file);
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Stream");
+
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_write_and_read_back);
+    tcase_add_test(tc_core, should_read_from_pipe_that_stays_open);
+    tcase_add_test(tc_core, should_report_failed_writes);
+    tcase_add_test(tc_core, should_not_use_streams_the_wrong_way);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = page_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
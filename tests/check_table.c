@@ -1,7 +1,48 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <check.h>
+#include "hash.h"
 #include "table.h"
 
+static TableConfig
+small_config(int n_shards)
+{
+    TableConfig config = table_default_config();
+    config.record_size = 32;
+    config.key_size = 8;
+    config.page_size = 512;
+    config.n_shards = n_shards;
+    
+    return config;
+}
+
+static void
+make_record(char* record, uint64_t key)
+{
+    memset(record, 0, 32);
+    memcpy(record, &key, sizeof(key));
+    memcpy(record + sizeof(key), "value", 5);
+}
+
+static int
+count_records(void* record, void* ctx)
+{
+    (*(int*)ctx)++;
+    return 0;
+}
+
+static void
+count_done(TableRequest* request, void* ctx)
+{
+    __atomic_add_fetch((int*)ctx, request->result == 0, __ATOMIC_SEQ_CST);
+}
+
 START_TEST (should_create_table)
 {
     Table table = table_create("test");
@@ -51,6 +92,25 @@ START_TEST (should_be_able_to_free_table)
 }
 END_TEST
 
+START_TEST (should_create_table_with_hash)
+{
+    Table table = table_create_with_hash("test", HASH_CRC32C, 42);
+    
+    ck_assert(table != NULL);
+    ck_assert(table_hash(table, "key", 3) == hash_crc32c("key", 3, 42));
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_create_table_with_invalid_hash)
+{
+    Table table = table_create_with_hash("test", -1, 0);
+    
+    ck_assert(table == NULL);
+}
+END_TEST
+
 START_TEST (should_not_fail_when_freeing_null)
 {
     table_free(NULL);
@@ -59,6 +119,1115 @@ START_TEST (should_not_fail_when_freeing_null)
 }
 END_TEST
 
+START_TEST (should_not_create_table_with_invalid_config)
+{
+    TableConfig config = small_config(0);
+    ck_assert(table_create_with_config("test", config) == NULL);
+    
+    config = small_config(TABLE_MAX_SHARDS + 1);
+    ck_assert(table_create_with_config("test", config) == NULL);
+    
+    config = small_config(1);
+    config.key_size = 0;
+    ck_assert(table_create_with_config("test", config) == NULL);
+}
+END_TEST
+
+START_TEST (should_insert_lookup_and_delete_records)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char record[32];
+    char out[32];
+    make_record(record, 7);
+    
+    ck_assert(table_insert(table, record) == 0);
+    ck_assert(table_insert(table, record) == TABLE_KEY_EXISTS);
+    ck_assert(table_lookup(table, record, out) == 0);
+    ck_assert(memcmp(record, out, 32) == 0);
+    ck_assert(table_delete(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == TABLE_KEY_NOT_FOUND);
+    ck_assert(table_delete(table, record) == TABLE_KEY_NOT_FOUND);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_accept_null_arguments)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char out[32];
+    
+    ck_assert(table_insert(NULL, out) == TABLE_ARG_INVALID);
+    ck_assert(table_insert(table, NULL) == TABLE_ARG_INVALID);
+    ck_assert(table_lookup(table, NULL, out) == TABLE_ARG_INVALID);
+    ck_assert(table_lookup(table, out, NULL) == TABLE_ARG_INVALID);
+    ck_assert(table_delete(table, NULL) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_spread_records_over_shards)
+{
+    Table table = table_create_with_config("test", small_config(8));
+    char record[32];
+    int per_shard[8] = {0};
+    
+    for (uint64_t key = 0; key < 8000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+        per_shard[table_shard_of(table, record)]++;
+    }
+    
+    ck_assert(table_n_shards(table) == 8);
+    ck_assert(table_count(table) == 8000);
+    for (int i = 0; i < 8; i++) {
+        ck_assert(800 < per_shard[i] && per_shard[i] < 1200);
+    }
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_scan_every_shard)
+{
+    Table table = table_create_with_config("test", small_config(4));
+    char record[32];
+    int count = 0;
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    ck_assert(table_scan(table, count_records, &count) == 0);
+    ck_assert(count == 1000);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_scan_every_shard_from_cursor)
+{
+    Table table = table_create_with_config("test", small_config(4));
+    char record[32];
+    TableScanCursor cursor = {0};
+    int count = 0;
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    int n_calls = 0;
+    while (!cursor.done) {
+        ck_assert(table_scan_from(table, &cursor, 4, count_records, &count) == 0);
+        n_calls++;
+    }
+    ck_assert(count == 1000);
+    ck_assert(n_calls > 4);
+    ck_assert(table_scan_from(NULL, &cursor, 4, count_records, &count) == TABLE_ARG_INVALID);
+    ck_assert(table_scan_from(table, NULL, 4, count_records, &count) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_run_requests_on_shard_workers)
+{
+    Table table = table_create_with_config("test", small_config(4));
+    static char records[1000][32];
+    TableRequest requests[1000];
+    int done = 0;
+    
+    ck_assert(table_submit(table, &requests[0]) == TABLE_ARG_INVALID);
+    ck_assert(table_start_workers(table, 1) == 0);
+    ck_assert(table_start_workers(table, 1) == TABLE_ARG_INVALID);
+    
+    for (int i = 0; i < 1000; i++) {
+        make_record(records[i], i);
+        requests[i] = (TableRequest){ .op = TABLE_OP_INSERT, .record = records[i],
+            .done = count_done, .ctx = &done };
+        ck_assert(table_submit(table, &requests[i]) == 0);
+    }
+    
+    /* Stopping waits for the queues to drain. */
+    table_stop_workers(table);
+    ck_assert(done == 1000);
+    ck_assert(table_count(table) == 1000);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_update_record)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    char record[32];
+    char out[32];
+    make_record(record, 7);
+    
+    ck_assert(table_update(table, record) == TABLE_KEY_NOT_FOUND);
+    table_insert(table, record);
+    record[31] = 'x';
+    ck_assert(table_update(table, record) == 0);
+    table_lookup(table, record, out);
+    ck_assert(out[31] == 'x');
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_execute_batch_in_order_per_key)
+{
+    Table table = table_create_with_config("test", small_config(4));
+    static char records[500][32];
+    static char out[500][32];
+    TableRequest requests[1500];
+    int done = 0;
+    
+    /* Insert, look up and delete every key in one batch, each key's requests must stay in order. */
+    for (int i = 0; i < 500; i++) {
+        make_record(records[i], i);
+        requests[i] = (TableRequest){ .op = TABLE_OP_INSERT, .record = records[i],
+            .done = count_done, .ctx = &done };
+        requests[500 + i] = (TableRequest){ .op = TABLE_OP_LOOKUP, .key = records[i],
+            .record = out[i] };
+        requests[1000 + i] = (TableRequest){ .op = i % 2 ? TABLE_OP_DELETE : TABLE_OP_LOOKUP,
+            .key = records[i], .record = out[i] };
+    }
+    
+    ck_assert(table_execute(table, requests, 1500) == 0);
+    ck_assert(done == 500);
+    for (int i = 0; i < 1500; i++) {
+        ck_assert(requests[i].result == 0);
+    }
+    for (int i = 0; i < 500; i++) {
+        ck_assert(memcmp(out[i], records[i], 32) == 0);
+    }
+    ck_assert(table_count(table) == 250);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_upsert_record)
+{
+    TableConfig config = small_config(2);
+    config.cache_size = 64;
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    
+    make_record(record, 7);
+    ck_assert(table_upsert(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    
+    /* The cached copy must not outlive the upsert. */
+    record[31] = 'x';
+    ck_assert(table_upsert(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    ck_assert(out[31] == 'x');
+    ck_assert(table_count(table) == 1);
+    
+    ck_assert(table_upsert(NULL, record) == TABLE_ARG_INVALID);
+    ck_assert(table_upsert(table, NULL) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+static int
+increment(void* record, int exists, void* ctx)
+{
+    uint64_t count;
+    memcpy(&count, (char*)record + 8, sizeof(count));
+    count += exists ? 1 : 100;
+    memcpy((char*)record + 8, &count, sizeof(count));
+    
+    if (ctx != NULL) {
+        *(uint64_t*)ctx = count;
+    }
+    
+    return 0;
+}
+
+START_TEST (should_read_modify_write_record)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    uint64_t key = 7;
+    uint64_t count = 0;
+    
+    ck_assert(table_rmw(table, &key, increment, &count) == 0);
+    ck_assert(count == 100);
+    ck_assert(table_rmw(table, &key, increment, &count) == 0);
+    ck_assert(count == 101);
+    ck_assert(table_count(table) == 1);
+    
+    ck_assert(table_rmw(table, &key, NULL, NULL) == TABLE_ARG_INVALID);
+    ck_assert(table_rmw(table, NULL, increment, NULL) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_execute_read_modify_writes_in_batch)
+{
+    Table table = table_create_with_config("test", small_config(4));
+    TableRequest requests[2000];
+    uint64_t keys[100];
+    char out[32];
+    
+    for (int i = 0; i < 100; i++) {
+        keys[i] = i;
+    }
+    for (int i = 0; i < 2000; i++) {
+        requests[i] = (TableRequest){ .op = TABLE_OP_RMW, .key = &keys[i % 100],
+            .rmw = increment };
+    }
+    
+    ck_assert(table_execute(table, requests, 2000) == 0);
+    for (int i = 0; i < 2000; i++) {
+        ck_assert(requests[i].result == 0);
+    }
+    
+    ck_assert(table_count(table) == 100);
+    for (int i = 0; i < 100; i++) {
+        uint64_t count;
+        ck_assert(table_lookup(table, &keys[i], out) == 0);
+        memcpy(&count, out + 8, sizeof(count));
+        ck_assert(count == 119);
+    }
+    
+    TableRequest missing = { .op = TABLE_OP_RMW, .key = &keys[0] };
+    ck_assert(table_execute(table, &missing, 1) == 0);
+    ck_assert(missing.result == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_fail_batch_requests_without_key)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    TableRequest request = { .op = TABLE_OP_DELETE };
+    
+    ck_assert(table_execute(table, &request, 1) == 0);
+    ck_assert(request.result == TABLE_ARG_INVALID);
+    ck_assert(table_execute(table, NULL, 1) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_filter_on_field)
+{
+    TableConfig config = small_config(4);
+    config.n_fields = 3;
+    config.field_sizes[0] = 8;
+    config.field_sizes[1] = 4;
+    config.field_sizes[2] = 20;
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    int count = 0;
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        uint32_t group = key % 10;
+        make_record(record, key);
+        memcpy(record + 8, &group, sizeof(group));
+        table_insert(table, record);
+    }
+    
+    uint32_t group = 3;
+    ck_assert(table_filter(table, 8, 4, &group, count_records, &count) == 0);
+    ck_assert(count == 100);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_create_table_with_fields_that_dont_add_up)
+{
+    TableConfig config = small_config(1);
+    config.n_fields = 2;
+    config.field_sizes[0] = 8;
+    config.field_sizes[1] = 8;
+    
+    ck_assert(table_create_with_config("test", config) == NULL);
+}
+END_TEST
+
+START_TEST (should_serve_lookups_from_cache)
+{
+    TableConfig config = small_config(2);
+    config.cache_size = 64;
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    make_record(record, 7);
+    
+    ck_assert(table_insert(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    ck_assert(memcmp(record, out, 32) == 0);
+    
+    CacheStats stats = table_cache_stats(table);
+    ck_assert(stats.hits == 1);
+    ck_assert(stats.misses == 1);
+    ck_assert(stats.entries == 1);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_invalidate_cache_on_update_and_delete)
+{
+    TableConfig config = small_config(2);
+    config.cache_size = 64;
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    make_record(record, 7);
+    
+    table_insert(table, record);
+    table_lookup(table, record, out);
+    
+    record[31] = 'x';
+    ck_assert(table_update(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    ck_assert(out[31] == 'x');
+    
+    ck_assert(table_delete(table, record) == 0);
+    ck_assert(table_lookup(table, record, out) == TABLE_KEY_NOT_FOUND);
+    
+    /* Batches see their own updates even when the old record was cached. */
+    make_record(record, 7);
+    table_insert(table, record);
+    table_lookup(table, record, out);
+    char new[32];
+    make_record(new, 7);
+    new[31] = 'y';
+    TableRequest requests[2] = {
+        { .op = TABLE_OP_UPDATE, .record = new },
+        { .op = TABLE_OP_LOOKUP, .key = record, .record = out },
+    };
+    ck_assert(table_execute(table, requests, 2) == 0);
+    ck_assert(requests[1].result == 0);
+    ck_assert(out[31] == 'y');
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_report_cache_stats_without_cache)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char record[32];
+    char out[32];
+    make_record(record, 7);
+    
+    table_insert(table, record);
+    table_lookup(table, record, out);
+    
+    CacheStats stats = table_cache_stats(table);
+    ck_assert(stats.hits == 0 && stats.misses == 0 && stats.entries == 0);
+    
+    table_free(table);
+}
+END_TEST
+
+static char*
+temp_path(void)
+{
+    static char path[32];
+    strcpy(path, "/tmp/check_table_XXXXXX");
+    close(mkstemp(path));
+    unlink(path);
+    
+    return path;
+}
+
+START_TEST (should_keep_records_in_file)
+{
+    TableConfig config = small_config(4);
+    config.path = temp_path();
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    
+    ck_assert(table != NULL);
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+    }
+    for (uint64_t key = 0; key < 2000; key += 2) {
+        make_record(record, key);
+        ck_assert(table_delete(table, record) == 0);
+    }
+    table_free(table);
+    
+    table = table_open("test", config.path);
+    ck_assert(table != NULL);
+    ck_assert(table_n_shards(table) == 4);
+    ck_assert(table_count(table) == 1000);
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(table, record, out) == (key % 2 ? 0 : TABLE_KEY_NOT_FOUND));
+    }
+    
+    int count = 0;
+    ck_assert(table_scan(table, count_records, &count) == 0);
+    ck_assert(count == 1000);
+    
+    /* The reopened table keeps growing in the same file. */
+    for (uint64_t key = 2000; key < 3000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+    }
+    ck_assert(table_flush(table) == 0);
+    table_free(table);
+    
+    table = table_create_with_config("test", config);
+    ck_assert(table != NULL);
+    ck_assert(table_count(table) == 2000);
+    table_free(table);
+    
+    unlink(config.path);
+}
+END_TEST
+
+START_TEST (should_shrink_file_after_purge)
+{
+    TableConfig config = small_config(4);
+    config.path = temp_path();
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    struct stat st;
+    
+    for (uint64_t key = 0; key < 20000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    ck_assert(table_flush(table) == 0);
+    stat(config.path, &st);
+    off_t size = st.st_size;
+    
+    for (uint64_t key = 500; key < 20000; key++) {
+        make_record(record, key);
+        ck_assert(table_delete(table, record) == 0);
+    }
+    ck_assert(table_compact(table) == 0);
+    stat(config.path, &st);
+    ck_assert(st.st_size < size / 4);
+    table_free(table);
+    
+    table = table_open("test", config.path);
+    ck_assert(table_count(table) == 500);
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(table, record, out) == (key < 500 ? 0 : TABLE_KEY_NOT_FOUND));
+    }
+    ck_assert(table_compact(NULL) == TABLE_ARG_INVALID);
+    table_free(table);
+    
+    unlink(config.path);
+}
+END_TEST
+
+START_TEST (should_not_open_file_with_different_config)
+{
+    TableConfig config = small_config(2);
+    config.path = temp_path();
+    table_free(table_create_with_config("test", config));
+    
+    config.n_shards = 4;
+    ck_assert(table_create_with_config("test", config) == NULL);
+    config.n_shards = 2;
+    config.seed = 1;
+    ck_assert(table_create_with_config("test", config) == NULL);
+    
+    ck_assert(table_open("test", "/nonexistent") == NULL);
+    ck_assert(table_open("test", NULL) == NULL);
+    
+    unlink(config.path);
+}
+END_TEST
+
+START_TEST (should_page_records_through_direct_io_frames)
+{
+    TableConfig config = small_config(2);
+    config.page_size = 4096;
+    config.path = temp_path();
+    config.direct_io = 1;
+    config.n_frames = 8;
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    
+    /* The file is scratch space, unlinked as soon as it is open. */
+    ck_assert(table != NULL);
+    ck_assert(access(config.path, F_OK) != 0);
+    
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+    }
+    for (uint64_t key = 0; key < 5000; key += 2) {
+        make_record(record, key);
+        ck_assert(table_delete(table, record) == 0);
+    }
+    ck_assert(table_flush(table) == 0);
+    
+    /* Far more pages than frames, only the frames and the directories are in memory. */
+    ck_assert(table_memory_used(table) < 8 * 4096 + 64 * 1024);
+    ck_assert(table_count(table) == 2500);
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(table, record, out) == (key % 2 ? 0 : TABLE_KEY_NOT_FOUND));
+    }
+    
+    int count = 0;
+    ck_assert(table_scan(table, count_records, &count) == 0);
+    ck_assert(count == 2500);
+    ck_assert(table_backup(table, temp_path(), 0) == TABLE_ARG_INVALID);
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_create_direct_io_table_with_invalid_config)
+{
+    TableConfig config = small_config(4);
+    config.direct_io = 1;
+    ck_assert(table_create_with_config("test", config) == NULL);
+    
+    config.path = temp_path();
+    config.n_frames = 4 * TABLE_MIN_SHARD_FRAMES - 1;
+    ck_assert(table_create_with_config("test", config) == NULL);
+    
+    /* An existing file is never taken over as scratch space. */
+    config.n_frames = 0;
+    close(creat(config.path, 0644));
+    ck_assert(table_create_with_config("test", config) == NULL);
+    unlink(config.path);
+    
+    config.memory_limit = TABLE_DEFAULT_FRAMES * config.page_size / 2;
+    ck_assert(table_create_with_config("test", config) == NULL);
+}
+END_TEST
+
+START_TEST (should_flush_table_without_file)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    
+    ck_assert(table_flush(table) == 0);
+    ck_assert(table_flush(NULL) == TABLE_ARG_INVALID);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_refuse_inserts_over_memory_limit)
+{
+    TableConfig config = small_config(1);
+    config.memory_limit = 16 * 1024;
+    Table table = table_create_with_config("test", config);
+    ck_assert(table != NULL);
+    
+    char record[32];
+    int result = 0;
+    uint64_t n_inserted = 0;
+    while (result == 0 && n_inserted < 10000) {
+        make_record(record, n_inserted);
+        result = table_insert(table, record);
+        n_inserted += result == 0;
+    }
+    ck_assert(result == TABLE_NO_MEMORY);
+    ck_assert(table_memory_used(table) <= config.memory_limit);
+    
+    /* Records already in the table stay readable, a small batch needs no memory to sort. */
+    char out[32];
+    make_record(record, 0);
+    ck_assert(table_lookup(table, record, out) == 0);
+    TableRequest lookup = { .op = TABLE_OP_LOOKUP, .key = record, .record = out };
+    ck_assert(table_execute(table, &lookup, 1) == 0);
+    ck_assert(lookup.result == 0);
+    
+    table_set_memory_limit(table, 0);
+    make_record(record, n_inserted);
+    ck_assert(table_insert(table, record) == 0);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_report_memory_used)
+{
+    size_t global_used = budget_used(budget_global());
+    TableConfig config = small_config(2);
+    config.cache_size = 64;
+    Table table = table_create_with_config("test", config);
+    
+    size_t empty = table_memory_used(table);
+    ck_assert(empty >= table_cache_stats(table).memory);
+    
+    char record[32];
+    for (uint64_t i = 0; i < 1000; i++) {
+        make_record(record, i);
+        table_insert(table, record);
+    }
+    ck_assert(table_memory_used(table) >= empty + 1000 * 32);
+    ck_assert(budget_used(budget_global()) >= global_used + table_memory_used(table));
+    
+    table_free(table);
+    ck_assert(budget_used(budget_global()) == global_used);
+    ck_assert(table_memory_used(NULL) == 0);
+}
+END_TEST
+
+START_TEST (should_give_back_memory_after_purge)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    char record[32];
+    size_t empty = table_memory_used(table);
+    
+    for (uint64_t key = 0; key < 20000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    size_t full = table_memory_used(table);
+    
+    for (uint64_t key = 0; key < 20000; key++) {
+        make_record(record, key);
+        table_delete(table, record);
+    }
+    ck_assert(table_compact(table) == 0);
+    ck_assert(table_memory_used(table) - empty < (full - empty) / 50);
+    
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_apply_global_memory_limit)
+{
+    budget_set_limit(budget_global(), budget_used(budget_global()) + 64 * 1024);
+    
+    Table a = table_create_with_config("a", small_config(1));
+    Table b = table_create_with_config("b", small_config(1));
+    ck_assert(a != NULL && b != NULL);
+    
+    char record[32];
+    int result = 0;
+    for (uint64_t i = 0; result == 0 && i < 10000; i++) {
+        make_record(record, i);
+        result = table_insert(a, record);
+    }
+    ck_assert(result == TABLE_NO_MEMORY);
+    
+    make_record(record, 0);
+    ck_assert(table_insert(b, record) == TABLE_NO_MEMORY);
+    
+    table_free(a);
+    ck_assert(table_insert(b, record) == 0);
+    
+    table_free(b);
+    budget_set_limit(budget_global(), 0);
+}
+END_TEST
+
+START_TEST (should_back_up_table_while_writing)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    char* path = temp_path();
+    char record[32];
+    char out[32];
+    struct timespec start, end;
+    
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    /* Slow enough that the writes below land while most pages are still to be written. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(table_backup(table, path, 128 * 1024) == 0);
+    ck_assert(table_backup(table, "/tmp/check_table_other", 0) == TABLE_ARG_INVALID);
+    for (uint64_t key = 0; key < 2000; key++) {
+        make_record(record, key);
+        memcpy(record + 16, "changed", 7);
+        ck_assert((key % 2 ? table_update(table, record) : table_delete(table, record)) == 0);
+    }
+    for (uint64_t key = 2000; key < 3000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+    }
+    ck_assert(table_backup_wait(table) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ck_assert(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9 > 0.3);
+    ck_assert(table_backup_wait(table) == TABLE_ARG_INVALID);
+    ck_assert(table_count(table) == 2000);
+    
+    Table backup = table_open("backup", path);
+    ck_assert(backup != NULL);
+    ck_assert(table_count(backup) == 2000);
+    for (uint64_t key = 0; key < 3000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(backup, record, out) == (key < 2000 ? 0 : TABLE_KEY_NOT_FOUND));
+        ck_assert(key >= 2000 || memcmp(record, out, sizeof(out)) == 0);
+    }
+    
+    table_free(backup);
+    table_free(table);
+    unlink(path);
+}
+END_TEST
+
+START_TEST (should_back_up_table_in_file_while_compacting)
+{
+    char path[32];
+    strcpy(path, temp_path());
+    TableConfig config = small_config(4);
+    config.path = temp_path();
+    Table table = table_create_with_config("test", config);
+    char record[32];
+    char out[32];
+    
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    /* Pages are given back and moved while the backup still needs them. */
+    ck_assert(table_backup(table, path, 256 * 1024) == 0);
+    for (uint64_t key = 100; key < 5000; key++) {
+        make_record(record, key);
+        ck_assert(table_delete(table, record) == 0);
+    }
+    ck_assert(table_compact(table) == 0);
+    ck_assert(table_backup_wait(table) == 0);
+    
+    Table backup = table_open("backup", path);
+    ck_assert(backup != NULL);
+    ck_assert(table_count(backup) == 5000);
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(backup, record, out) == 0);
+        ck_assert(memcmp(record, out, sizeof(out)) == 0);
+    }
+    
+    table_free(backup);
+    table_free(table);
+    unlink(path);
+    unlink(config.path);
+}
+END_TEST
+
+START_TEST (should_not_back_up_with_invalid_arguments)
+{
+    TableConfig config = small_config(1);
+    Table table = table_create_with_config("test", config);
+    config.page_size = 1000;
+    Table odd_pages = table_create_with_config("test", config);
+    char path[32];
+    strcpy(path, "/tmp/check_table_XXXXXX");
+    close(mkstemp(path));
+    
+    ck_assert(table_backup(NULL, path, 0) == TABLE_ARG_INVALID);
+    ck_assert(table_backup(table, NULL, 0) == TABLE_ARG_INVALID);
+    ck_assert(table_backup(table, path, 0) == TABLE_ARG_INVALID);
+    ck_assert(table_backup(odd_pages, "/tmp/check_table_odd", 0) == TABLE_ARG_INVALID);
+    ck_assert(table_backup_wait(table) == TABLE_ARG_INVALID);
+    ck_assert(table_backup_wait(NULL) == TABLE_ARG_INVALID);
+    
+    table_free(odd_pages);
+    table_free(table);
+    unlink(path);
+}
+END_TEST
+
+START_TEST (should_abandon_backup_when_table_is_freed)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char* path = temp_path();
+    char record[32];
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    ck_assert(table_backup(table, path, 1) == 0);
+    table_free(table);
+    ck_assert(access(path, F_OK) != 0);
+}
+END_TEST
+
+/*
+ * Returns a temporary file holding the table's export, rewound to be imported.
+ */
+static FILE*
+export_to_file(Table table, int flags)
+{
+    FILE* file = tmpfile();
+    ck_assert(table_export(table, fileno(file), flags) == 0);
+    lseek(fileno(file), 0, SEEK_SET);
+    
+    return file;
+}
+
+START_TEST (should_export_and_import_table)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    char record[32];
+    char out[32];
+    
+    for (uint64_t key = 0; key < 5000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    FILE* raw = export_to_file(table, 0);
+    FILE* compressed = export_to_file(table, TABLE_EXPORT_COMPRESS);
+    off_t raw_size = lseek(fileno(raw), 0, SEEK_END);
+    off_t compressed_size = lseek(fileno(compressed), 0, SEEK_END);
+    ck_assert(raw_size > 5000 * 32);
+    ck_assert(compressed_size < raw_size / 2);
+    lseek(fileno(raw), 0, SEEK_SET);
+    lseek(fileno(compressed), 0, SEEK_SET);
+    
+    /* The copies differ from the table in everything but the records. */
+    TableConfig config = small_config(3);
+    config.seed = 42;
+    config.page_size = 1024;
+    char path[32];
+    strcpy(path, temp_path());
+    config.path = path;
+    Table copies[2] = {
+        table_create_with_config("raw", small_config(1)),
+        table_create_with_config("compressed", config),
+    };
+    ck_assert(table_import(copies[0], fileno(raw)) == 0);
+    ck_assert(table_import(copies[1], fileno(compressed)) == 0);
+    
+    for (int i = 0; i < 2; i++) {
+        ck_assert(table_count(copies[i]) == 5000);
+        for (uint64_t key = 0; key < 5000; key++) {
+            make_record(record, key);
+            ck_assert(table_lookup(copies[i], record, out) == 0);
+            ck_assert(memcmp(record, out, 32) == 0);
+        }
+        table_free(copies[i]);
+    }
+    
+    fclose(raw);
+    fclose(compressed);
+    table_free(table);
+    unlink(path);
+}
+END_TEST
+
+START_TEST (should_not_import_corrupt_export)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char record[32];
+    
+    for (uint64_t key = 0; key < 1000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    FILE* file = export_to_file(table, TABLE_EXPORT_COMPRESS);
+    int fd = fileno(file);
+    off_t size = lseek(fd, 0, SEEK_END);
+    char byte;
+    ck_assert(pread(fd, &byte, 1, size / 2) == 1);
+    byte ^= 1;
+    ck_assert(pwrite(fd, &byte, 1, size / 2) == 1);
+    
+    Table copy = table_create_with_config("copy", small_config(1));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert(table_import(copy, fd) == TABLE_CORRUPT);
+    table_free(copy);
+    
+    /* Cut short of its end block. */
+    byte ^= 1;
+    ck_assert(pwrite(fd, &byte, 1, size / 2) == 1);
+    ck_assert(ftruncate(fd, size - 1) == 0);
+    copy = table_create_with_config("copy", small_config(1));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert(table_import(copy, fd) == TABLE_CORRUPT);
+    table_free(copy);
+    
+    FILE* empty = tmpfile();
+    copy = table_create_with_config("copy", small_config(1));
+    ck_assert(table_import(copy, fileno(empty)) == TABLE_CORRUPT);
+    ck_assert(table_count(copy) == 0);
+    table_free(copy);
+    
+    fclose(empty);
+    fclose(file);
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_import_export_with_key_twice)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char records[64];
+    make_record(records, 1);
+    make_record(records + 32, 2);
+    table_insert(table, records);
+    table_insert(table, records + 32);
+    FILE* file = export_to_file(table, 0);
+    int fd = fileno(file);
+    
+    /* One block of both records follows the header, give the second the first one's key. */
+    size_t block_size = 16 + sizeof(records);
+    size_t header_size = lseek(fd, 0, SEEK_END) - block_size - 16 - sizeof(uint64_t);
+    char block[16 + sizeof(records)];
+    ck_assert(pread(fd, block, block_size, header_size) == (ssize_t)block_size);
+    memcpy(block + 16 + 32, block + 16, 8);
+    uint32_t crc = crc32c(crc32c(0, block, 12), block + 16, sizeof(records));
+    memcpy(block + 12, &crc, sizeof(crc));
+    ck_assert(pwrite(fd, block, block_size, header_size) == (ssize_t)block_size);
+    
+    Table copy = table_create_with_config("copy", small_config(1));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert(table_import(copy, fd) == TABLE_CORRUPT);
+    ck_assert(table_count(copy) == 1);
+    
+    fclose(file);
+    table_free(copy);
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_import_into_other_tables)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    char record[32];
+    make_record(record, 1);
+    table_insert(table, record);
+    
+    FILE* file = export_to_file(table, 0);
+    TableConfig config = small_config(1);
+    config.record_size = 64;
+    Table wider = table_create_with_config("wider", config);
+    
+    ck_assert(table_import(wider, fileno(file)) == TABLE_ARG_INVALID);
+    lseek(fileno(file), 0, SEEK_SET);
+    ck_assert(table_import(table, fileno(file)) == TABLE_ARG_INVALID);
+    ck_assert(table_count(table) == 1);
+    
+    ck_assert(table_import(NULL, fileno(file)) == TABLE_ARG_INVALID);
+    ck_assert(table_import(table, -1) == TABLE_ARG_INVALID);
+    ck_assert(table_export(NULL, fileno(file), 0) == TABLE_ARG_INVALID);
+    ck_assert(table_export(table, -1, 0) == TABLE_ARG_INVALID);
+    ck_assert(table_export(table, fileno(file), 2) == TABLE_ARG_INVALID);
+    
+    fclose(file);
+    table_free(wider);
+    table_free(table);
+}
+END_TEST
+
+START_TEST (should_not_import_export_of_oversized_pages)
+{
+    Table table = table_create_with_config("test", small_config(1));
+    FILE* file = export_to_file(table, 0);
+    int fd = fileno(file);
+    
+    /* An empty export is its header and an end block of 16 bytes and a count. */
+    size_t header_size = lseek(fd, 0, SEEK_END) - 16 - sizeof(uint64_t);
+    char* header = malloc(header_size);
+    ck_assert(pread(fd, header, header_size, 0) == (ssize_t)header_size);
+    
+    /* The page size is at byte 16 and the CRC, of the header with it zeroed, at byte 12. */
+    uint64_t page_size = MAX_PAGE_SIZE + 512;
+    uint32_t crc = 0;
+    memcpy(header + 16, &page_size, sizeof(page_size));
+    memcpy(header + 12, &crc, sizeof(crc));
+    crc = crc32c(0, header, header_size);
+    memcpy(header + 12, &crc, sizeof(crc));
+    ck_assert(pwrite(fd, header, header_size, 0) == (ssize_t)header_size);
+    
+    Table copy = table_create_with_config("copy", small_config(1));
+    lseek(fd, 0, SEEK_SET);
+    ck_assert(table_import(copy, fd) == TABLE_CORRUPT);
+    
+    free(header);
+    fclose(file);
+    table_free(copy);
+    table_free(table);
+}
+END_TEST
+
+struct export_thread
+{
+    Table   table;
+    int     fd;
+    int     result;
+};
+
+static void*
+export_main(void* arg)
+{
+    struct export_thread* export = arg;
+    export->result = table_export(export->table, export->fd, 0);
+    close(export->fd);
+    
+    return NULL;
+}
+
+START_TEST (should_serve_requests_while_export_waits_on_fd)
+{
+    Table table = table_create_with_config("test", small_config(2));
+    char record[32];
+    for (uint64_t key = 0; key < 100000; key++) {
+        make_record(record, key);
+        table_insert(table, record);
+    }
+    
+    /* Nothing reads the pipe until the inserts are done, so the export fills it and waits. */
+    int fds[2];
+    ck_assert(pipe(fds) == 0);
+    struct export_thread export = {.table = table, .fd = fds[1]};
+    pthread_t thread;
+    pthread_create(&thread, NULL, export_main, &export);
+    nanosleep(&(struct timespec){.tv_nsec = 50 * 1000 * 1000}, NULL);
+    
+    for (uint64_t key = 100000; key < 110000; key++) {
+        make_record(record, key);
+        ck_assert(table_insert(table, record) == 0);
+    }
+    
+    FILE* file = tmpfile();
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        ck_assert(write(fileno(file), buffer, n) == n);
+    }
+    pthread_join(thread, NULL);
+    ck_assert(export.result == 0);
+    close(fds[0]);
+    
+    /* Every record there throughout is imported once, the ones added meanwhile at most once. */
+    Table copy = table_create_with_config("copy", small_config(1));
+    lseek(fileno(file), 0, SEEK_SET);
+    ck_assert(table_import(copy, fileno(file)) == 0);
+    ck_assert(table_count(copy) >= 100000 && table_count(copy) <= 110000);
+    char out[32];
+    for (uint64_t key = 0; key < 100000; key++) {
+        make_record(record, key);
+        ck_assert(table_lookup(copy, record, out) == 0);
+    }
+    
+    fclose(file);
+    table_free(copy);
+    table_free(table);
+}
+END_TEST
+
 Suite* page_suite(void)
 {
     Suite* s = suite_create("Table");
@@ -70,8 +1239,69 @@ Suite* page_suite(void)
     tcase_add_test(tc_core, should_not_be_able_to_create_table_with_name_larger_than_possible);
     tcase_add_test(tc_core, should_be_able_to_free_table);
     tcase_add_test(tc_core, should_not_fail_when_freeing_null);
+    tcase_add_test(tc_core, should_create_table_with_hash);
+    tcase_add_test(tc_core, should_not_create_table_with_invalid_hash);
+    tcase_add_test(tc_core, should_not_create_table_with_invalid_config);
     suite_add_tcase(s, tc_core);
     
+    TCase* tc_records = tcase_create("Records");
+    tcase_add_test(tc_records, should_insert_lookup_and_delete_records);
+    tcase_add_test(tc_records, should_not_accept_null_arguments);
+    tcase_add_test(tc_records, should_update_record);
+    tcase_add_test(tc_records, should_execute_batch_in_order_per_key);
+    tcase_add_test(tc_records, should_fail_batch_requests_without_key);
+    tcase_add_test(tc_records, should_upsert_record);
+    tcase_add_test(tc_records, should_read_modify_write_record);
+    tcase_add_test(tc_records, should_execute_read_modify_writes_in_batch);
+    tcase_add_test(tc_records, should_filter_on_field);
+    tcase_add_test(tc_records, should_not_create_table_with_fields_that_dont_add_up);
+    suite_add_tcase(s, tc_records);
+    
+    TCase* tc_shards = tcase_create("Shards");
+    tcase_add_test(tc_shards, should_spread_records_over_shards);
+    tcase_add_test(tc_shards, should_scan_every_shard);
+    tcase_add_test(tc_shards, should_scan_every_shard_from_cursor);
+    tcase_add_test(tc_shards, should_run_requests_on_shard_workers);
+    suite_add_tcase(s, tc_shards);
+    
+    TCase* tc_cache = tcase_create("Cache");
+    tcase_add_test(tc_cache, should_serve_lookups_from_cache);
+    tcase_add_test(tc_cache, should_invalidate_cache_on_update_and_delete);
+    tcase_add_test(tc_cache, should_not_report_cache_stats_without_cache);
+    suite_add_tcase(s, tc_cache);
+    
+    TCase* tc_file = tcase_create("File");
+    tcase_add_test(tc_file, should_keep_records_in_file);
+    tcase_add_test(tc_file, should_not_open_file_with_different_config);
+    tcase_add_test(tc_file, should_flush_table_without_file);
+    tcase_add_test(tc_file, should_shrink_file_after_purge);
+    tcase_add_test(tc_file, should_page_records_through_direct_io_frames);
+    tcase_add_test(tc_file, should_not_create_direct_io_table_with_invalid_config);
+    suite_add_tcase(s, tc_file);
+    
+    TCase* tc_memory = tcase_create("Memory");
+    tcase_add_test(tc_memory, should_refuse_inserts_over_memory_limit);
+    tcase_add_test(tc_memory, should_report_memory_used);
+    tcase_add_test(tc_memory, should_apply_global_memory_limit);
+    tcase_add_test(tc_memory, should_give_back_memory_after_purge);
+    suite_add_tcase(s, tc_memory);
+    
+    TCase* tc_backup = tcase_create("Backup");
+    tcase_add_test(tc_backup, should_back_up_table_while_writing);
+    tcase_add_test(tc_backup, should_back_up_table_in_file_while_compacting);
+    tcase_add_test(tc_backup, should_not_back_up_with_invalid_arguments);
+    tcase_add_test(tc_backup, should_abandon_backup_when_table_is_freed);
+    suite_add_tcase(s, tc_backup);
+    
+    TCase* tc_export = tcase_create("Export");
+    tcase_add_test(tc_export, should_export_and_import_table);
+    tcase_add_test(tc_export, should_not_import_corrupt_export);
+    tcase_add_test(tc_export, should_not_import_export_with_key_twice);
+    tcase_add_test(tc_export, should_not_import_into_other_tables);
+    tcase_add_test(tc_export, should_not_import_export_of_oversized_pages);
+    tcase_add_test(tc_export, should_serve_requests_while_export_waits_on_fd);
+    suite_add_tcase(s, tc_export);
+    
     return s;
 }
 
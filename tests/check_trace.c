@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <check.h>
+#include "table.h"
+#include "trace.h"
+
+#define N_THREADS (4)
+
+struct summary
+{
+    unsigned long long  count;
+    unsigned long long  p50;
+    unsigned long long  p999;
+    unsigned long long  max;
+};
+
+/*
+ * Clears the rings and waits long enough that operations back-dated by less than a millisecond
+ * still start after the clear.
+ */
+static void
+clear(void)
+{
+    trace_clear();
+    struct timespec pause = {.tv_nsec = 2000000};
+    nanosleep(&pause, NULL);
+}
+
+/*
+ * Returns what write_fn wrote to a temporary file.
+ */
+static char*
+dump(int (*write_fn)(int fd))
+{
+    FILE* file = tmpfile();
+    ck_assert(write_fn(fileno(file)) == 0);
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* text = calloc(1, size + 1);
+    ck_assert(fread(text, 1, size, file) == (size_t)size);
+    fclose(file);
+
+    return text;
+}
+
+static struct summary
+summarize(TraceOp op)
+{
+    struct summary summary = {0};
+    char* text = dump(trace_write_histograms);
+    char name[32];
+    unsigned long long p90, p99;
+
+    for (char* line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        if (sscanf(line, "%31s %llu %llu %llu %llu %llu %llu", name, &summary.count,
+                &summary.p50, &p90, &p99, &summary.p999, &summary.max) == 7
+            && strcmp(name, trace_op_name(op)) == 0) {
+            break;
+        }
+        memset(&summary, 0, sizeof(summary));
+    }
+    free(text);
+
+    return summary;
+}
+
+/*
+ * Returns the number of threads in the Chrome trace.
+ */
+static int
+count_threads(void)
+{
+    char* text = dump(trace_write_chrome);
+    int tids[64];
+    int n_tids = 0;
+
+    for (char* at = strstr(text, "\"tid\":"); at != NULL; at = strstr(at + 1, "\"tid\":")) {
+        int tid = atoi(at + 6);
+        int seen = 0;
+        for (int i = 0; i < n_tids; i++) {
+            seen |= tids[i] == tid;
+        }
+        if (!seen && n_tids < 64) {
+            tids[n_tids++] = tid;
+        }
+    }
+    free(text);
+
+    return n_tids;
+}
+
+/*
+ * Records 100 lookups, then waits for the other threads so none gives its ring back early.
+ */
+static void*
+record_lookups(void* arg)
+{
+    for (int i = 0; i < 100; i++) {
+        trace_record(TRACE_LOOKUP, trace_now() - 100, i, 1);
+    }
+
+    if (arg != NULL) {
+        pthread_barrier_wait(arg);
+    }
+
+    return NULL;
+}
+
+START_TEST (should_write_chrome_trace)
+{
+    clear();
+    trace_record(TRACE_SPLIT, trace_now() - 1000, 42, 3);
+
+    char* text = dump(trace_write_chrome);
+    ck_assert(strncmp(text, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39) == 0);
+    ck_assert(strstr(text, "\"name\":\"split\",\"ph\":\"X\"") != NULL);
+    ck_assert(strstr(text, "\"args\":{\"id\":42,\"probes\":3}") != NULL);
+    ck_assert(strstr(text, "]}") != NULL);
+    free(text);
+}
+END_TEST
+
+START_TEST (should_write_latency_percentiles)
+{
+    clear();
+    for (int i = 0; i < 999; i++) {
+        trace_record(TRACE_FAULT, trace_now() - 10000, i, 0);
+    }
+    trace_record(TRACE_FAULT, trace_now() - 1000000, 999, 0);
+
+    struct summary summary = summarize(TRACE_FAULT);
+    ck_assert(summary.count == 1000);
+    ck_assert(10000 <= summary.p50 && summary.p50 < 10000 * 9 / 8 + 1000);
+    ck_assert(summary.max >= 1000000);
+    ck_assert(summary.p999 >= 1000000 * 7 / 8);
+    ck_assert(summarize(TRACE_FLUSH).count == 0);
+}
+END_TEST
+
+START_TEST (should_keep_the_last_operations_of_a_thread)
+{
+    clear();
+    for (int i = 0; i < TRACE_RING_SIZE + 10; i++) {
+        trace_record(TRACE_PAGE_ADD, trace_now(), i, 0);
+    }
+
+    ck_assert(summarize(TRACE_PAGE_ADD).count == TRACE_RING_SIZE - 1);
+
+    trace_clear();
+    ck_assert(summarize(TRACE_PAGE_ADD).count == 0);
+}
+END_TEST
+
+START_TEST (should_give_each_thread_a_ring)
+{
+    pthread_t threads[N_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, N_THREADS);
+    clear();
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_create(&threads[i], NULL, record_lookups, &barrier);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    ck_assert(summarize(TRACE_LOOKUP).count == N_THREADS * 100);
+    int n_threads = count_threads();
+    ck_assert(n_threads >= N_THREADS);
+
+    /* A new thread takes over the ring of one that has exited. */
+    pthread_create(&threads[0], NULL, record_lookups, NULL);
+    pthread_join(threads[0], NULL);
+    ck_assert(summarize(TRACE_LOOKUP).count == (N_THREADS + 1) * 100);
+    ck_assert(count_threads() == n_threads);
+}
+END_TEST
+
+START_TEST (should_trace_table_operations_only_when_built_in)
+{
+    TableConfig config = table_default_config();
+    config.record_size = 32;
+    config.page_size = 512;
+    Table table = table_create_with_config("test", config);
+    char record[32] = {0};
+    clear();
+
+    for (uint64_t key = 0; key < 1000; key++) {
+        memcpy(record, &key, sizeof(key));
+        table_insert(table, record);
+        table_lookup(table, record, record);
+    }
+
+    struct summary lookups = summarize(TRACE_LOOKUP);
+    if (trace_enabled()) {
+        ck_assert(lookups.count == 1000);
+        ck_assert(summarize(TRACE_PAGE_ADD).count >= 1000);
+        ck_assert(summarize(TRACE_SPLIT).count > 0);
+    } else {
+        ck_assert(lookups.count == 0);
+        ck_assert(summarize(TRACE_PAGE_ADD).count == 0);
+    }
+
+    table_free(table);
+}
+END_TEST
+
+/*
+ * Returns how many faults inserting and looking up 1000 records traced in a table with config.
+ */
+static unsigned long long
+count_faults(TableConfig config)
+{
+    char path[] = "/tmp/check_trace_XXXXXX";
+    close(mkstemp(path));
+    unlink(path);
+    config.record_size = 32;
+    config.page_size = 512;
+    config.path = path;
+    Table table = table_create_with_config("test", config);
+    char record[32] = {0};
+    ck_assert(table != NULL);
+    clear();
+
+    for (uint64_t key = 0; key < 1000; key++) {
+        memcpy(record, &key, sizeof(key));
+        table_insert(table, record);
+        table_lookup(table, record, record);
+    }
+
+    unsigned long long faults = summarize(TRACE_FAULT).count;
+    table_free(table);
+    unlink(path);
+
+    return faults;
+}
+
+START_TEST (should_trace_faults_only_when_built_in)
+{
+    /* A page file reads pages back into its few frames, a mapped file touches each new slot. */
+    TableConfig config = table_default_config();
+    config.direct_io = 1;
+    config.n_frames = TABLE_MIN_SHARD_FRAMES;
+    unsigned long long page_file_faults = count_faults(config);
+    config.direct_io = 0;
+    unsigned long long mapped_faults = count_faults(config);
+
+    if (trace_enabled()) {
+        ck_assert(page_file_faults > 1000);
+        ck_assert(mapped_faults > 0);
+    } else {
+        ck_assert(page_file_faults == 0);
+        ck_assert(mapped_faults == 0);
+    }
+}
+END_TEST
+
+Suite* page_suite(void)
+{
+    Suite* s = suite_create("Trace");
+
+    TCase* tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, should_write_chrome_trace);
+    tcase_add_test(tc_core, should_write_latency_percentiles);
+    tcase_add_test(tc_core, should_keep_the_last_operations_of_a_thread);
+    tcase_add_test(tc_core, should_give_each_thread_a_ring);
+    tcase_add_test(tc_core, should_trace_table_operations_only_when_built_in);
+    tcase_add_test(tc_core, should_trace_faults_only_when_built_in);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = page_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}